@@ -1080,6 +1080,8 @@ static struct conference_bridge *join_conference_bridge(const char *name, struct
 		ast_bridge_set_internal_sample_rate(conference_bridge->bridge, conference_bridge->b_profile.internal_sample_rate);
 		/* Set the internal mixing interval on the bridge from the bridge profile */
 		ast_bridge_set_mixing_interval(conference_bridge->bridge, conference_bridge->b_profile.mix_interval);
+		/* Set the number of loudest talkers to mix from the bridge profile */
+		ast_bridge_set_max_talkers(conference_bridge->bridge, conference_bridge->b_profile.max_talkers);
 
 		if (ast_test_flag(&conference_bridge->b_profile, BRIDGE_OPT_VIDEO_SRC_FOLLOW_TALKER)) {
 			ast_bridge_set_talker_src_video_mode(conference_bridge->bridge);
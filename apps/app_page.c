@@ -44,6 +44,11 @@ ASTERISK_FILE_VERSION(__FILE__, "$Revision: 366881 $")
 #include "asterisk/utils.h"
 #include "asterisk/devicestate.h"
 #include "asterisk/dial.h"
+#include "asterisk/astobj2.h"
+#include "asterisk/lock.h"
+#include "asterisk/framehook.h"
+#include "asterisk/translate.h"
+#include "asterisk/rtp_engine.h"
 
 /*** DOCUMENTATION
 	<application name="Page" language="en_US">
@@ -90,6 +95,15 @@ ASTERISK_FILE_VERSION(__FILE__, "$Revision: 366881 $")
 					<option name="n">
 						<para>Do not play simultaneous announcement to caller (implies <literal>A(x)</literal>)</para>
 					</option>
+					<option name="f">
+						<para>Send to <literal>MulticastRTP</literal> destinations from a single shared stream
+						instead of dialing a channel for each of them. The caller's audio is encoded once per
+						codec and sent to every destination using that codec from one thread. Destinations
+						take the form <literal>MulticastRTP/type/address:port[/control[/codec]]</literal>, the
+						codec defaulting to <literal>ulaw</literal>. Only the remaining destinations, the ones
+						that need signalling, are dialed. Announcements are not played to fan-out
+						destinations.</para>
+					</option>
 				</optionlist>
 			</parameter>
 			<parameter name="timeout">
@@ -119,6 +133,7 @@ enum page_opt_flags {
 	PAGE_IGNORE_FORWARDS = (1 << 4),
 	PAGE_ANNOUNCE = (1 << 5),
 	PAGE_NOCALLERANNOUNCE = (1 << 6),
+	PAGE_FANOUT = (1 << 7),
 };
 
 enum {
@@ -134,8 +149,320 @@ AST_APP_OPTIONS(page_opts, {
 	AST_APP_OPTION('i', PAGE_IGNORE_FORWARDS),
 	AST_APP_OPTION_ARG('A', PAGE_ANNOUNCE, OPT_ARG_ANNOUNCE),
 	AST_APP_OPTION('n', PAGE_NOCALLERANNOUNCE),
+	AST_APP_OPTION('f', PAGE_FANOUT),
 });
 
+/*! Frames queued for the fan-out thread before the oldest is dropped */
+#define PAGE_FANOUT_MAX_QUEUE 50
+
+/*! \brief A destination fed by the fan-out stream */
+struct page_target {
+	struct ast_rtp_instance *instance;
+	struct ast_sockaddr address;
+	char type[16];
+	AST_LIST_ENTRY(page_target) next;
+};
+
+/*! \brief The destinations sharing a codec, and the one translation feeding them */
+struct page_stream {
+	/*! Codec the stream is sent in */
+	struct ast_format format;
+	/*! Format of the caller's audio the translation path was built for */
+	struct ast_format source;
+	struct ast_trans_pvt *trans;
+	AST_LIST_HEAD_NOLOCK(, page_target) targets;
+	AST_LIST_ENTRY(page_stream) next;
+};
+
+/*! \brief Shared paging stream for destinations that need no signalling
+ *
+ * A framehook on the caller copies each voice frame it reads into queue, and
+ * a single thread translates it once per codec and writes the result to
+ * every destination of that codec.
+ */
+struct page_fanout {
+	ast_mutex_t lock;
+	ast_cond_t cond;
+	AST_LIST_HEAD_NOLOCK(, ast_frame) queue;
+	unsigned int queued;
+	unsigned int dropped;
+	unsigned int stop:1;
+	pthread_t thread;
+	int framehook_id;
+	unsigned int num_targets;
+	/*! Only touched by the fan-out thread once it is running */
+	AST_LIST_HEAD_NOLOCK(, page_stream) streams;
+};
+
+static void page_fanout_destructor(void *obj)
+{
+	struct page_fanout *fanout = obj;
+	struct page_stream *stream;
+	struct page_target *target;
+	struct ast_frame *f;
+
+	while ((stream = AST_LIST_REMOVE_HEAD(&fanout->streams, next))) {
+		while ((target = AST_LIST_REMOVE_HEAD(&stream->targets, next))) {
+			ast_rtp_instance_destroy(target->instance);
+			ast_free(target);
+		}
+		if (stream->trans) {
+			ast_translator_free_path(stream->trans);
+		}
+		ast_free(stream);
+	}
+	while ((f = AST_LIST_REMOVE_HEAD(&fanout->queue, frame_list))) {
+		ast_frfree(f);
+	}
+	ast_mutex_destroy(&fanout->lock);
+	ast_cond_destroy(&fanout->cond);
+}
+
+/*!
+ * \brief Add a MulticastRTP/type/address:port[/control[/codec]] destination to the fan-out
+ *
+ * \retval 0 success, or the destination duplicates one already added
+ * \retval -1 failure
+ */
+static int page_fanout_add(struct page_fanout *fanout, const char *resource)
+{
+	char *tmp = ast_strdupa(resource), *type = tmp, *destination, *control = NULL, *codec = NULL;
+	struct ast_sockaddr control_address, destination_address;
+	struct ast_format format;
+	struct page_stream *stream;
+	struct page_target *target;
+
+	ast_sockaddr_setnull(&control_address);
+
+	if (!(destination = strchr(tmp, '/'))) {
+		return -1;
+	}
+	*destination++ = '\0';
+	if ((control = strchr(destination, '/'))) {
+		*control++ = '\0';
+		if ((codec = strchr(control, '/'))) {
+			*codec++ = '\0';
+		}
+	}
+
+	if (!ast_sockaddr_parse(&destination_address, destination, PARSE_PORT_REQUIRE) ||
+		(!ast_strlen_zero(control) && !ast_sockaddr_parse(&control_address, control, PARSE_PORT_REQUIRE))) {
+		return -1;
+	}
+	if (ast_strlen_zero(codec)) {
+		ast_format_set(&format, AST_FORMAT_ULAW, 0);
+	} else if (!ast_getformatbyname(codec, &format) || AST_FORMAT_GET_TYPE(format.id) != AST_FORMAT_TYPE_AUDIO) {
+		ast_log(LOG_WARNING, "Unknown audio codec '%s' for paging destination '%s'\n", codec, resource);
+		return -1;
+	}
+
+	AST_LIST_TRAVERSE(&fanout->streams, stream, next) {
+		if (ast_format_cmp(&stream->format, &format) == AST_FORMAT_CMP_EQUAL) {
+			break;
+		}
+	}
+	if (!stream) {
+		if (!(stream = ast_calloc(1, sizeof(*stream)))) {
+			return -1;
+		}
+		ast_format_copy(&stream->format, &format);
+		AST_LIST_INSERT_TAIL(&fanout->streams, stream, next);
+	}
+
+	/* Phones listening on one multicast group are served by a single send */
+	AST_LIST_TRAVERSE(&stream->targets, target, next) {
+		if (!ast_sockaddr_cmp(&target->address, &destination_address) && !strcasecmp(target->type, type)) {
+			return 0;
+		}
+	}
+
+	if (!(target = ast_calloc(1, sizeof(*target)))) {
+		return -1;
+	}
+	if (!(target->instance = ast_rtp_instance_new("multicast", NULL, &control_address, type))) {
+		ast_free(target);
+		return -1;
+	}
+	ast_sockaddr_copy(&target->address, &destination_address);
+	ast_copy_string(target->type, type, sizeof(target->type));
+	ast_rtp_instance_set_remote_address(target->instance, &destination_address);
+	ast_rtp_instance_activate(target->instance);
+	AST_LIST_INSERT_TAIL(&stream->targets, target, next);
+	fanout->num_targets++;
+
+	return 0;
+}
+
+/*! \brief Encode a frame once per codec and send it to every destination */
+static void page_fanout_send(struct page_fanout *fanout, struct ast_frame *f)
+{
+	struct page_stream *stream;
+	struct page_target *target;
+	struct ast_frame *out, *cur;
+
+	AST_LIST_TRAVERSE(&fanout->streams, stream, next) {
+		if (ast_format_cmp(&stream->source, &f->subclass.format) != AST_FORMAT_CMP_EQUAL) {
+			if (stream->trans) {
+				ast_translator_free_path(stream->trans);
+				stream->trans = NULL;
+			}
+			ast_format_copy(&stream->source, &f->subclass.format);
+			if (ast_format_cmp(&stream->format, &f->subclass.format) != AST_FORMAT_CMP_EQUAL &&
+				!(stream->trans = ast_translator_build_path(&stream->format, &f->subclass.format))) {
+				ast_log(LOG_WARNING, "No translation path from %s to %s for paging\n",
+					ast_getformatname(&f->subclass.format), ast_getformatname(&stream->format));
+			}
+		}
+
+		if (stream->trans) {
+			out = ast_translate(stream->trans, f, 0);
+		} else if (ast_format_cmp(&stream->format, &f->subclass.format) == AST_FORMAT_CMP_EQUAL) {
+			out = f;
+		} else {
+			continue;
+		}
+
+		for (cur = out; cur; cur = AST_LIST_NEXT(cur, frame_list)) {
+			AST_LIST_TRAVERSE(&stream->targets, target, next) {
+				ast_rtp_instance_write(target->instance, cur);
+			}
+		}
+
+		if (out && out != f) {
+			ast_frfree(out);
+		}
+	}
+}
+
+static void *page_fanout_thread(void *data)
+{
+	struct page_fanout *fanout = data;
+	struct ast_frame *f;
+
+	for (;;) {
+		ast_mutex_lock(&fanout->lock);
+		while (!fanout->stop && AST_LIST_EMPTY(&fanout->queue)) {
+			ast_cond_wait(&fanout->cond, &fanout->lock);
+		}
+		if (!(f = AST_LIST_REMOVE_HEAD(&fanout->queue, frame_list))) {
+			ast_mutex_unlock(&fanout->lock);
+			break;
+		}
+		fanout->queued--;
+		ast_mutex_unlock(&fanout->lock);
+
+		page_fanout_send(fanout, f);
+		ast_frfree(f);
+	}
+
+	return NULL;
+}
+
+/*! \brief Copy the caller's voice frames to the fan-out thread */
+static struct ast_frame *page_fanout_hook(struct ast_channel *chan, struct ast_frame *frame, enum ast_framehook_event event, void *data)
+{
+	struct page_fanout *fanout = data;
+	struct ast_frame *dup, *old;
+
+	if (event != AST_FRAMEHOOK_EVENT_READ || !frame || frame->frametype != AST_FRAME_VOICE) {
+		return frame;
+	}
+	if (!(dup = ast_frdup(frame))) {
+		return frame;
+	}
+
+	ast_mutex_lock(&fanout->lock);
+	if (fanout->stop) {
+		ast_mutex_unlock(&fanout->lock);
+		ast_frfree(dup);
+		return frame;
+	}
+	if (fanout->queued >= PAGE_FANOUT_MAX_QUEUE && (old = AST_LIST_REMOVE_HEAD(&fanout->queue, frame_list))) {
+		ast_frfree(old);
+		fanout->queued--;
+		fanout->dropped++;
+	}
+	AST_LIST_INSERT_TAIL(&fanout->queue, dup, frame_list);
+	fanout->queued++;
+	ast_cond_signal(&fanout->cond);
+	ast_mutex_unlock(&fanout->lock);
+
+	return frame;
+}
+
+static void page_fanout_hook_destroy(void *data)
+{
+	ao2_ref(data, -1);
+}
+
+static struct page_fanout *page_fanout_alloc(void)
+{
+	struct page_fanout *fanout;
+
+	if (!(fanout = ao2_alloc(sizeof(*fanout), page_fanout_destructor))) {
+		return NULL;
+	}
+	ast_mutex_init(&fanout->lock);
+	ast_cond_init(&fanout->cond, NULL);
+	fanout->thread = AST_PTHREADT_NULL;
+	fanout->framehook_id = -1;
+
+	return fanout;
+}
+
+/*! \brief Start streaming the caller's audio to the fan-out destinations */
+static int page_fanout_start(struct page_fanout *fanout, struct ast_channel *chan)
+{
+	struct ast_framehook_interface interface = {
+		.version = AST_FRAMEHOOK_INTERFACE_VERSION,
+		.event_cb = page_fanout_hook,
+		.destroy_cb = page_fanout_hook_destroy,
+		.data = fanout,
+	};
+
+	if (ast_pthread_create_background(&fanout->thread, NULL, page_fanout_thread, fanout)) {
+		fanout->thread = AST_PTHREADT_NULL;
+		return -1;
+	}
+
+	ao2_ref(fanout, +1);
+	ast_channel_lock(chan);
+	fanout->framehook_id = ast_framehook_attach(chan, &interface);
+	ast_channel_unlock(chan);
+	if (fanout->framehook_id < 0) {
+		ao2_ref(fanout, -1);
+		return -1;
+	}
+
+	ast_verb(3, "Paging %u fan-out destinations from '%s'\n", fanout->num_targets, chan->name);
+
+	return 0;
+}
+
+static void page_fanout_stop(struct page_fanout *fanout, struct ast_channel *chan)
+{
+	if (fanout->framehook_id >= 0) {
+		ast_channel_lock(chan);
+		ast_framehook_detach(chan, fanout->framehook_id);
+		ast_channel_unlock(chan);
+		fanout->framehook_id = -1;
+	}
+
+	ast_mutex_lock(&fanout->lock);
+	fanout->stop = 1;
+	ast_cond_signal(&fanout->cond);
+	ast_mutex_unlock(&fanout->lock);
+
+	if (fanout->thread != AST_PTHREADT_NULL) {
+		pthread_join(fanout->thread, NULL);
+		fanout->thread = AST_PTHREADT_NULL;
+	}
+
+	if (fanout->dropped) {
+		ast_debug(1, "Paging fan-out for '%s' dropped %u frames\n", chan->name, fanout->dropped);
+	}
+}
+
 
 static int page_exec(struct ast_channel *chan, const char *data)
 {
@@ -149,6 +476,7 @@ static int page_exec(struct ast_channel *chan, const char *data)
 	unsigned int num_dials;
 	int timeout = 0;
 	char *parse;
+	struct page_fanout *fanout = NULL;
 
 	AST_DECLARE_APP_ARGS(args,
 		AST_APP_ARG(devices);
@@ -211,6 +539,11 @@ static int page_exec(struct ast_channel *chan, const char *data)
 		return -1;
 	}
 
+	if (ast_test_flag(&flags, PAGE_FANOUT) && !(fanout = page_fanout_alloc())) {
+		ast_free(dial_list);
+		return -1;
+	}
+
 	/* Go through parsing/calling each device */
 	while ((tech = strsep(&args.devices, "&"))) {
 		int state = 0;
@@ -226,6 +559,14 @@ static int page_exec(struct ast_channel *chan, const char *data)
 			continue;
 		}
 
+		/* Destinations that need no signalling share the fan-out stream */
+		if (fanout && !strncasecmp(tech, "MulticastRTP/", 13)) {
+			if (page_fanout_add(fanout, resource + 1)) {
+				ast_log(LOG_WARNING, "Unable to page '%s' through the fan-out stream.\n", tech);
+			}
+			continue;
+		}
+
 		/* Ensure device is not in use if skip option is enabled */
 		if (ast_test_flag(&flags, PAGE_SKIP)) {
 			state = ast_device_state(tech);
@@ -285,9 +626,17 @@ static int page_exec(struct ast_channel *chan, const char *data)
 			snprintf(meetmeopts, sizeof(meetmeopts), "%ud,A%s%sqxdG(%s)", confid, (ast_test_flag(&flags, PAGE_DUPLEX) ? "" : "t"), 
  			  (ast_test_flag(&flags, PAGE_RECORD) ? "r" : ""), opts[OPT_ARG_ANNOUNCE] );
 		}
+		if (fanout && fanout->num_targets && page_fanout_start(fanout, chan)) {
+			ast_log(LOG_WARNING, "Unable to start the paging fan-out stream for '%s'.\n", chan->name);
+		}
 		pbx_exec(chan, app, meetmeopts);
 	}
 
+	if (fanout) {
+		page_fanout_stop(fanout, chan);
+		ao2_ref(fanout, -1);
+	}
+
 	/* Go through each dial attempt cancelling, joining, and destroying */
 	for (i = 0; i < pos; i++) {
 		struct ast_dial *dial = dial_list[i];
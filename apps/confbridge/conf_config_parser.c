@@ -322,6 +322,10 @@ static int set_bridge_option(const char *name, const char *value, struct bridge_
 		if (sscanf(value, "%30u", &b_profile->max_members) != 1) {
 			return -1;
 		}
+	} else if (!strcasecmp(name, "max_talkers")) {
+		if (sscanf(value, "%30u", &b_profile->max_talkers) != 1) {
+			return -1;
+		}
 	} else if (!strcasecmp(name, "record_file")) {
 		ast_copy_string(b_profile->rec_file, value, sizeof(b_profile->rec_file));
 	} else if (strlen(name) >= 5 && !strncasecmp(name, "sound", 5)) {
@@ -484,6 +488,7 @@ static int parse_bridge(const char *cat, struct ast_config *cfg)
 	b_profile->flags = 0;
 	b_profile->max_members = 0;
 	b_profile->mix_interval = 0;
+	b_profile->max_talkers = 0;
 	memset(b_profile->rec_file, 0, sizeof(b_profile->rec_file));
 	if (b_profile->sounds) {
 		ao2_ref(b_profile->sounds, -1); /* sounds is read only.  Once it has been created
@@ -1027,6 +1032,12 @@ static char *handle_cli_confbridge_show_bridge_profile(struct ast_cli_entry *e,
 		ast_cli(a->fd,"Max Members:          No Limit\n");
 	}
 
+	if (b_profile.max_talkers) {
+		ast_cli(a->fd,"Max Talkers:          %d\n", b_profile.max_talkers);
+	} else {
+		ast_cli(a->fd,"Max Talkers:          No Limit\n");
+	}
+
 	switch (b_profile.flags
 		& (BRIDGE_OPT_VIDEO_SRC_LAST_MARKED | BRIDGE_OPT_VIDEO_SRC_FIRST_MARKED
 			| BRIDGE_OPT_VIDEO_SRC_FOLLOW_TALKER)) {
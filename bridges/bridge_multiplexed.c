@@ -23,6 +23,18 @@
  * \author Joshua Colp <jcolp@digium.com>
  *
  * \ingroup bridges
+ *
+ * A fixed pool of threads, one per CPU, services every bridge using this
+ * technology.  Each thread keeps the file descriptors of the channels it
+ * services registered with its own epoll set for as long as they are
+ * bridged, rather than building a new poll array every time it waits, so a
+ * thread can handle thousands of bridges.  Where epoll is not available
+ * the threads fall back to poll().
+ *
+ * New bridges go to the thread servicing the fewest.  Each thread measures
+ * how long it spends reading and writing frames for each of its bridges,
+ * and a thread that is noticeably busier than the others hands a bridge
+ * over to the least busy thread.
  */
 
 /*** MODULEINFO
@@ -39,6 +51,9 @@ ASTERISK_FILE_VERSION(__FILE__, "$Revision: 361422 $")
 #include <sys/types.h>
 #include <sys/stat.h>
 #include <fcntl.h>
+#ifdef HAVE_EPOLL_CREATE1
+#include <sys/epoll.h>
+#endif
 
 #include "asterisk/module.h"
 #include "asterisk/channel.h"
@@ -46,281 +61,674 @@ ASTERISK_FILE_VERSION(__FILE__, "$Revision: 361422 $")
 #include "asterisk/bridging_technology.h"
 #include "asterisk/frame.h"
 #include "asterisk/astobj2.h"
+#include "asterisk/linkedlists.h"
+#include "asterisk/poll-compat.h"
+#include "asterisk/utils.h"
+#include "asterisk/test.h"
+
+/*! \brief Most threads in the pool, however many CPUs there are */
+#define MULTIPLEXED_MAX_THREADS 64
+
+/*! \brief Most events handled in a single wakeup of a thread */
+#define MULTIPLEXED_MAX_EVENTS 64
 
-/*! \brief Number of buckets our multiplexed thread container can have */
-#define MULTIPLEXED_BUCKETS 53
+/*! \brief Interval, in ms, at which threads check for hangup timeouts and changed file descriptors */
+#define MULTIPLEXED_SWEEP_MS 250
 
-/*! \brief Number of channels we handle in a single thread */
-#define MULTIPLEXED_MAX_CHANNELS 8
+/*! \brief Every this many sweeps the registered file descriptors are checked against the kernel's */
+#define MULTIPLEXED_VERIFY_SWEEPS 4
+
+/*! \brief Every this many sweeps a thread measures its load and may hand a bridge over */
+#define MULTIPLEXED_REBALANCE_SWEEPS 8
+
+/*! \brief A thread this much busier, in percent, than the average hands a bridge over */
+#define MULTIPLEXED_REBALANCE_PERCENT 125
+
+struct multiplexed_thread;
+struct multiplexed_bridge;
+struct multiplexed_channel;
+
+/*! \brief A file descriptor of a channel registered with a thread */
+struct multiplexed_fd {
+	/*! Channel the descriptor belongs to */
+	struct multiplexed_channel *mchan;
+	/*! Descriptor registered, -1 if none */
+	int fd;
+	/*! Index of the descriptor in the channel's fds */
+	int index;
+};
+
+/*! \brief A channel serviced by a multiplexed thread */
+struct multiplexed_channel {
+	struct ast_channel *chan;
+	struct multiplexed_bridge *mbridge;
+	struct multiplexed_fd fds[AST_MAX_FDS];
+	/*! Bit set once the channel has left, events for it are then ignored */
+	unsigned int dead:1;
+	AST_LIST_ENTRY(multiplexed_channel) list;
+};
+
+/*! \brief Structure which represents a 2 channel bridge serviced by a multiplexed thread */
+struct multiplexed_bridge {
+	/*! Bridge itself, valid for as long as it has channels */
+	struct ast_bridge *bridge;
+	/*! Thread servicing the bridge, only changed with the bridge locked */
+	struct multiplexed_thread *thread;
+	AST_LIST_HEAD_NOLOCK(, multiplexed_channel) channels;
+	/*! Time spent servicing the bridge in the current load window, in microseconds */
+	unsigned int busy;
+	/*! Time spent servicing the bridge in the last load window, in microseconds */
+	unsigned int load;
+	AST_LIST_ENTRY(multiplexed_bridge) list;
+};
 
 /*! \brief Structure which represents a single thread handling multiple 2 channel bridges */
 struct multiplexed_thread {
 	/*! Thread itself */
 	pthread_t thread;
+	/*! Lock protecting the lists and registrations below */
+	ast_mutex_t lock;
 	/*! Pipe used to wake up the multiplexed thread */
 	int pipe[2];
-	/*! Channels in this thread */
-	struct ast_channel *chans[MULTIPLEXED_MAX_CHANNELS];
-	/*! Number of channels in this thread */
-	unsigned int count;
-	/*! Bit used to indicate that the thread is waiting on channels */
-	unsigned int waiting:1;
-	/*! Number of channels actually being serviced by this thread */
-	unsigned int service_count;
+#ifdef HAVE_EPOLL_CREATE1
+	/*! Set of descriptors the thread waits on */
+	int epfd;
+#endif
+	/*! Bridges serviced by this thread */
+	AST_LIST_HEAD_NOLOCK(, multiplexed_bridge) bridges;
+	/*! Channels that left, freed by the thread once no event can refer to them */
+	AST_LIST_HEAD_NOLOCK(, multiplexed_channel) dead;
+	/*! Number of bridges serviced by this thread */
+	unsigned int num_bridges;
+	/*! Time spent servicing bridges in the current load window, in microseconds */
+	unsigned int busy;
+	/*! Time spent servicing bridges in the last load window, in microseconds */
+	unsigned int load;
+	/*! Bit used to indicate that the thread should stop */
+	unsigned int stop:1;
+};
+
+/*! \brief An event a thread has to handle */
+struct multiplexed_event {
+	/*! Descriptor that tripped, NULL for the wakeup pipe */
+	struct multiplexed_fd *mfd;
+	/*! Bit set if the descriptor has priority data */
+	unsigned int exception:1;
 };
 
-/*! \brief Container of all operating multiplexed threads */
-static struct ao2_container *multiplexed_threads;
+/*! \brief The pool of threads servicing all bridges */
+static struct multiplexed_thread *multiplexed_threads;
 
-/*! \brief Callback function for finding a free multiplexed thread */
-static int find_multiplexed_thread(void *obj, void *arg, int flags)
+/*! \brief Number of threads in the pool */
+static unsigned int multiplexed_num_threads;
+
+/*! \brief Lock serializing the choice of thread for new bridges */
+AST_MUTEX_DEFINE_STATIC(multiplexed_lock);
+
+/*! \brief Internal function which nudges the thread */
+static void multiplexed_nudge(struct multiplexed_thread *multiplexed_thread)
 {
-	struct multiplexed_thread *multiplexed_thread = obj;
-	return (multiplexed_thread->count <= (MULTIPLEXED_MAX_CHANNELS - 2)) ? CMP_MATCH | CMP_STOP : 0;
+	int nudge = 0;
+
+	if (write(multiplexed_thread->pipe[1], &nudge, sizeof(nudge)) != sizeof(nudge) && errno != EAGAIN) {
+		ast_log(LOG_ERROR, "We couldn't poke multiplexed thread '%p'... something is VERY wrong\n", multiplexed_thread);
+	}
 }
 
-/*! \brief Destroy callback for a multiplexed thread structure */
-static void destroy_multiplexed_thread(void *obj)
+#ifdef HAVE_EPOLL_CREATE1
+static int multiplexed_poller_open(struct multiplexed_thread *multiplexed_thread)
 {
-	struct multiplexed_thread *multiplexed_thread = obj;
+	struct epoll_event ev = { .events = EPOLLIN, .data.ptr = NULL, };
 
-	if (multiplexed_thread->pipe[0] > -1) {
-		close(multiplexed_thread->pipe[0]);
+	if ((multiplexed_thread->epfd = epoll_create1(EPOLL_CLOEXEC)) < 0) {
+		ast_log(LOG_WARNING, "Failed to create epoll set for multiplexed thread '%p': %s\n", multiplexed_thread, strerror(errno));
+		return -1;
 	}
-	if (multiplexed_thread->pipe[1] > -1) {
-		close(multiplexed_thread->pipe[1]);
+	if (epoll_ctl(multiplexed_thread->epfd, EPOLL_CTL_ADD, multiplexed_thread->pipe[0], &ev)) {
+		ast_log(LOG_WARNING, "Failed to add nudge pipe to epoll set for multiplexed thread '%p': %s\n", multiplexed_thread, strerror(errno));
+		return -1;
 	}
 
-	return;
+	return 0;
 }
 
-/*! \brief Create function which finds/reserves/references a multiplexed thread structure */
-static int multiplexed_bridge_create(struct ast_bridge *bridge)
+static void multiplexed_poller_close(struct multiplexed_thread *multiplexed_thread)
 {
-	struct multiplexed_thread *multiplexed_thread;
+	if (multiplexed_thread->epfd > -1) {
+		close(multiplexed_thread->epfd);
+		multiplexed_thread->epfd = -1;
+	}
+}
+
+/*!
+ * \internal
+ * \brief Register a channel's descriptor with a thread, replacing what was registered
+ *
+ * \note The thread must be locked.
+ */
+static void multiplexed_poller_set(struct multiplexed_thread *multiplexed_thread, struct multiplexed_fd *mfd, int fd)
+{
+	struct epoll_event ev = { .events = EPOLLIN | EPOLLPRI, .data.ptr = mfd, };
+
+	if (mfd->fd > -1 && epoll_ctl(multiplexed_thread->epfd, EPOLL_CTL_DEL, mfd->fd, &ev) && errno != EBADF && errno != ENOENT) {
+		ast_debug(1, "Failed to remove descriptor %d from multiplexed thread '%p': %s\n", mfd->fd, multiplexed_thread, strerror(errno));
+	}
+	mfd->fd = -1;
+	if (fd > -1) {
+		if (epoll_ctl(multiplexed_thread->epfd, EPOLL_CTL_ADD, fd, &ev)) {
+			ast_debug(1, "Failed to add descriptor %d to multiplexed thread '%p': %s\n", fd, multiplexed_thread, strerror(errno));
+			return;
+		}
+		mfd->fd = fd;
+	}
+}
+
+/*!
+ * \internal
+ * \brief Make sure a registered descriptor is still the one the kernel has
+ *
+ * A descriptor closed and reopened by a channel driver between sweeps keeps
+ * its number, but the kernel drops the closed one from the set.
+ *
+ * \note The thread must be locked.
+ */
+static void multiplexed_poller_verify(struct multiplexed_thread *multiplexed_thread, struct multiplexed_fd *mfd)
+{
+	struct epoll_event ev = { .events = EPOLLIN | EPOLLPRI, .data.ptr = mfd, };
+
+	if (mfd->fd > -1 && epoll_ctl(multiplexed_thread->epfd, EPOLL_CTL_MOD, mfd->fd, &ev) && errno == ENOENT) {
+		epoll_ctl(multiplexed_thread->epfd, EPOLL_CTL_ADD, mfd->fd, &ev);
+	}
+}
+
+/*! \brief Wait for events on the descriptors registered with a thread */
+static int multiplexed_poller_wait(struct multiplexed_thread *multiplexed_thread, struct multiplexed_event *events, int ms)
+{
+	struct epoll_event ev[MULTIPLEXED_MAX_EVENTS];
+	int res, i;
+
+	if ((res = epoll_wait(multiplexed_thread->epfd, ev, ARRAY_LEN(ev), ms)) <= 0) {
+		return res;
+	}
+	for (i = 0; i < res; i++) {
+		events[i].mfd = ev[i].data.ptr;
+		events[i].exception = (ev[i].events & EPOLLPRI) ? 1 : 0;
+	}
+
+	return res;
+}
+#else
+static int multiplexed_poller_open(struct multiplexed_thread *multiplexed_thread)
+{
+	return 0;
+}
+
+static void multiplexed_poller_close(struct multiplexed_thread *multiplexed_thread)
+{
+}
 
-	ao2_lock(multiplexed_threads);
+/*!
+ * \internal
+ * \brief Register a channel's descriptor with a thread, replacing what was registered
+ *
+ * \note The thread must be locked.  The thread builds its poll array from
+ * the registrations each time it waits, so it is nudged to pick them up.
+ */
+static void multiplexed_poller_set(struct multiplexed_thread *multiplexed_thread, struct multiplexed_fd *mfd, int fd)
+{
+	mfd->fd = fd;
+	multiplexed_nudge(multiplexed_thread);
+}
 
-	/* Try to find an existing thread to handle our additional channels */
-	if (!(multiplexed_thread = ao2_callback(multiplexed_threads, 0, find_multiplexed_thread, NULL))) {
-		int flags;
+static void multiplexed_poller_verify(struct multiplexed_thread *multiplexed_thread, struct multiplexed_fd *mfd)
+{
+}
 
-		/* If we failed we will have to create a new one from scratch */
-		if (!(multiplexed_thread = ao2_alloc(sizeof(*multiplexed_thread), destroy_multiplexed_thread))) {
-			ast_debug(1, "Failed to find or create a new multiplexed thread for bridge '%p'\n", bridge);
-			ao2_unlock(multiplexed_threads);
-			return -1;
+/*! \brief Wait for events on the descriptors registered with a thread */
+static int multiplexed_poller_wait(struct multiplexed_thread *multiplexed_thread, struct multiplexed_event *events, int ms)
+{
+	struct multiplexed_bridge *mbridge;
+	struct multiplexed_channel *mchan;
+	struct multiplexed_fd **map;
+	struct pollfd *pfds;
+	int max = 1, num = 0, res, i;
+
+	ast_mutex_lock(&multiplexed_thread->lock);
+	AST_LIST_TRAVERSE(&multiplexed_thread->bridges, mbridge, list) {
+		AST_LIST_TRAVERSE(&mbridge->channels, mchan, list) {
+			max += AST_MAX_FDS;
 		}
+	}
+	pfds = ast_alloca(sizeof(*pfds) * max);
+	map = ast_alloca(sizeof(*map) * max);
+	pfds[num].fd = multiplexed_thread->pipe[0];
+	pfds[num].events = POLLIN;
+	pfds[num].revents = 0;
+	map[num++] = NULL;
+	AST_LIST_TRAVERSE(&multiplexed_thread->bridges, mbridge, list) {
+		AST_LIST_TRAVERSE(&mbridge->channels, mchan, list) {
+			for (i = 0; i < AST_MAX_FDS; i++) {
+				if (mchan->fds[i].fd < 0) {
+					continue;
+				}
+				pfds[num].fd = mchan->fds[i].fd;
+				pfds[num].events = POLLIN | POLLPRI;
+				pfds[num].revents = 0;
+				map[num++] = &mchan->fds[i];
+			}
+		}
+	}
+	ast_mutex_unlock(&multiplexed_thread->lock);
 
-		multiplexed_thread->pipe[0] = multiplexed_thread->pipe[1] = -1;
-		/* Setup a pipe so we can poke the thread itself when needed */
-		if (pipe(multiplexed_thread->pipe)) {
-			ast_debug(1, "Failed to create a pipe for poking a multiplexed thread for bridge '%p'\n", bridge);
-			ao2_ref(multiplexed_thread, -1);
-			ao2_unlock(multiplexed_threads);
-			return -1;
+	if ((res = ast_poll(pfds, num, ms)) <= 0) {
+		return res;
+	}
+	for (i = 0, res = 0; i < num && res < MULTIPLEXED_MAX_EVENTS; i++) {
+		if (!pfds[i].revents) {
+			continue;
 		}
+		events[res].mfd = map[i];
+		events[res].exception = (pfds[i].revents & POLLPRI) ? 1 : 0;
+		res++;
+	}
 
-		/* Setup each pipe for non-blocking operation */
-		flags = fcntl(multiplexed_thread->pipe[0], F_GETFL);
-		if (fcntl(multiplexed_thread->pipe[0], F_SETFL, flags | O_NONBLOCK) < 0) {
-			ast_log(LOG_WARNING, "Failed to setup first nudge pipe for non-blocking operation on %p (%d: %s)\n", bridge, errno, strerror(errno));
-			ao2_ref(multiplexed_thread, -1);
-			ao2_unlock(multiplexed_threads);
-			return -1;
+	return res;
+}
+#endif
+
+/*!
+ * \internal
+ * \brief Bring a channel's registered descriptors up to date with the channel
+ *
+ * \note The thread must be locked.
+ */
+static void multiplexed_channel_sync(struct multiplexed_thread *multiplexed_thread, struct multiplexed_channel *mchan)
+{
+	int i;
+
+	for (i = 0; i < AST_MAX_FDS; i++) {
+		int fd = mchan->dead ? -1 : mchan->chan->fds[i];
+
+		if (mchan->fds[i].fd != fd) {
+			multiplexed_poller_set(multiplexed_thread, &mchan->fds[i], fd);
 		}
-		flags = fcntl(multiplexed_thread->pipe[1], F_GETFL);
-		if (fcntl(multiplexed_thread->pipe[1], F_SETFL, flags | O_NONBLOCK) < 0) {
-			ast_log(LOG_WARNING, "Failed to setup second nudge pipe for non-blocking operation on %p (%d: %s)\n", bridge, errno, strerror(errno));
-			ao2_ref(multiplexed_thread, -1);
-			ao2_unlock(multiplexed_threads);
-			return -1;
+	}
+}
+
+/*!
+ * \internal
+ * \brief Register all of a bridge's channels with a thread and link it in
+ *
+ * \note The thread must be locked.
+ */
+static void multiplexed_thread_add_bridge(struct multiplexed_thread *multiplexed_thread, struct multiplexed_bridge *mbridge)
+{
+	struct multiplexed_channel *mchan;
+
+	AST_LIST_INSERT_TAIL(&multiplexed_thread->bridges, mbridge, list);
+	multiplexed_thread->num_bridges++;
+	mbridge->thread = multiplexed_thread;
+	AST_LIST_TRAVERSE(&mbridge->channels, mchan, list) {
+		multiplexed_channel_sync(multiplexed_thread, mchan);
+	}
+}
+
+/*!
+ * \internal
+ * \brief Unregister all of a bridge's channels from a thread and unlink it
+ *
+ * \note The thread must be locked.
+ */
+static void multiplexed_thread_remove_bridge(struct multiplexed_thread *multiplexed_thread, struct multiplexed_bridge *mbridge)
+{
+	struct multiplexed_channel *mchan;
+	int i;
+
+	AST_LIST_TRAVERSE(&mbridge->channels, mchan, list) {
+		for (i = 0; i < AST_MAX_FDS; i++) {
+			multiplexed_poller_set(multiplexed_thread, &mchan->fds[i], -1);
 		}
+	}
+	AST_LIST_REMOVE(&multiplexed_thread->bridges, mbridge, list);
+	multiplexed_thread->num_bridges--;
+}
 
-		/* Set up default parameters */
-		multiplexed_thread->thread = AST_PTHREADT_NULL;
+/*!
+ * \internal
+ * \brief Lock the thread servicing a bridge
+ *
+ * \note The bridge is normally locked by the caller, in which case it can
+ * not move between threads, but a bridge being destroyed is not.
+ */
+static struct multiplexed_thread *multiplexed_bridge_lock_thread(struct multiplexed_bridge *mbridge)
+{
+	struct multiplexed_thread *multiplexed_thread;
 
-		/* Finally link us into the container so others may find us */
-		ao2_link(multiplexed_threads, multiplexed_thread);
-		ast_debug(1, "Created multiplexed thread '%p' for bridge '%p'\n", multiplexed_thread, bridge);
-	} else {
-		ast_debug(1, "Found multiplexed thread '%p' for bridge '%p'\n", multiplexed_thread, bridge);
+	for (;;) {
+		multiplexed_thread = mbridge->thread;
+		ast_mutex_lock(&multiplexed_thread->lock);
+		if (multiplexed_thread == mbridge->thread) {
+			return multiplexed_thread;
+		}
+		ast_mutex_unlock(&multiplexed_thread->lock);
 	}
+}
 
-	/* Bump the count of the thread structure up by two since the channels for this bridge will be joining shortly */
-	multiplexed_thread->count += 2;
+/*! \brief Create function which assigns the bridge to the thread servicing the fewest */
+static int multiplexed_bridge_create(struct ast_bridge *bridge)
+{
+	struct multiplexed_thread *multiplexed_thread = NULL;
+	struct multiplexed_bridge *mbridge;
+	unsigned int i;
 
-	ao2_unlock(multiplexed_threads);
+	if (!(mbridge = ast_calloc(1, sizeof(*mbridge)))) {
+		ast_debug(1, "Failed to allocate multiplexed state for bridge '%p'\n", bridge);
+		return -1;
+	}
+	mbridge->bridge = bridge;
+
+	ast_mutex_lock(&multiplexed_lock);
+	for (i = 0; i < multiplexed_num_threads; i++) {
+		if (!multiplexed_thread || multiplexed_threads[i].num_bridges < multiplexed_thread->num_bridges) {
+			multiplexed_thread = &multiplexed_threads[i];
+		}
+	}
+	ast_mutex_lock(&multiplexed_thread->lock);
+	multiplexed_thread_add_bridge(multiplexed_thread, mbridge);
+	ast_mutex_unlock(&multiplexed_thread->lock);
+	ast_mutex_unlock(&multiplexed_lock);
 
-	bridge->bridge_pvt = multiplexed_thread;
+	ast_debug(1, "Assigned bridge '%p' to multiplexed thread '%p'\n", bridge, multiplexed_thread);
+
+	bridge->bridge_pvt = mbridge;
 
 	return 0;
 }
 
-/*! \brief Internal function which nudges the thread */
-static void multiplexed_nudge(struct multiplexed_thread *multiplexed_thread)
+/*! \brief Destroy function which removes the bridge from its thread */
+static int multiplexed_bridge_destroy(struct ast_bridge *bridge)
 {
-	int nudge = 0;
+	struct multiplexed_bridge *mbridge = bridge->bridge_pvt;
+	struct multiplexed_thread *multiplexed_thread;
 
-	if (multiplexed_thread->thread == AST_PTHREADT_NULL) {
-		return;
+	if (!mbridge) {
+		return -1;
 	}
 
-	if (write(multiplexed_thread->pipe[1], &nudge, sizeof(nudge)) != sizeof(nudge)) {
-		ast_log(LOG_ERROR, "We couldn't poke multiplexed thread '%p'... something is VERY wrong\n", multiplexed_thread);
+	multiplexed_thread = multiplexed_bridge_lock_thread(mbridge);
+	multiplexed_thread_remove_bridge(multiplexed_thread, mbridge);
+	ast_mutex_unlock(&multiplexed_thread->lock);
+
+	ast_free(mbridge);
+	bridge->bridge_pvt = NULL;
+
+	return 0;
+}
+
+/*!
+ * \internal
+ * \brief Hand the bridge a thread is spending closest to half its excess load on to the least busy thread
+ *
+ * \note Called by the thread itself between batches of events, so none of
+ * its own events can refer to the bridge moved.
+ */
+static void multiplexed_rebalance(struct multiplexed_thread *multiplexed_thread)
+{
+	struct multiplexed_thread *coldest = NULL;
+	struct multiplexed_bridge *mbridge, *best = NULL;
+	unsigned long total = 0;
+	unsigned int i, excess;
+
+	for (i = 0; i < multiplexed_num_threads; i++) {
+		total += multiplexed_threads[i].load;
+		if (!coldest || multiplexed_threads[i].load < coldest->load) {
+			coldest = &multiplexed_threads[i];
+		}
+	}
+	if (coldest == multiplexed_thread || !multiplexed_thread->load ||
+		(unsigned long) multiplexed_thread->load * 100 * multiplexed_num_threads < total * MULTIPLEXED_REBALANCE_PERCENT) {
+		return;
 	}
+	excess = (multiplexed_thread->load - coldest->load) / 2;
 
-	while (multiplexed_thread->waiting) {
-		sched_yield();
+	ast_mutex_lock(&multiplexed_thread->lock);
+	if (multiplexed_thread->num_bridges < 2) {
+		ast_mutex_unlock(&multiplexed_thread->lock);
+		return;
+	}
+	AST_LIST_TRAVERSE(&multiplexed_thread->bridges, mbridge, list) {
+		if (AST_LIST_EMPTY(&mbridge->channels) || !mbridge->load || mbridge->load > excess) {
+			continue;
+		}
+		if (!best || mbridge->load > best->load) {
+			best = mbridge;
+		}
+	}
+	/* A bridge that is busy right now will be looked at again next time */
+	if (!best || ao2_trylock(best->bridge)) {
+		ast_mutex_unlock(&multiplexed_thread->lock);
+		return;
 	}
+	multiplexed_thread_remove_bridge(multiplexed_thread, best);
+	multiplexed_thread->load -= best->load;
+	ast_mutex_unlock(&multiplexed_thread->lock);
 
-	return;
+	ast_mutex_lock(&coldest->lock);
+	multiplexed_thread_add_bridge(coldest, best);
+	coldest->load += best->load;
+	ast_mutex_unlock(&coldest->lock);
+
+	ast_debug(1, "Moved bridge '%p' (%u us) from multiplexed thread '%p' to '%p'\n",
+		best->bridge, best->load, multiplexed_thread, coldest);
+
+	ao2_unlock(best->bridge);
 }
 
-/*! \brief Destroy function which unreserves/unreferences/removes a multiplexed thread structure */
-static int multiplexed_bridge_destroy(struct ast_bridge *bridge)
+/*!
+ * \internal
+ * \brief Periodic housekeeping of a thread's channels
+ *
+ * Picks up descriptors a channel driver has changed without the channel
+ * tripping, and hangs up channels whose hangup time has passed.
+ */
+static void multiplexed_sweep(struct multiplexed_thread *multiplexed_thread, unsigned int sweep)
 {
-	struct multiplexed_thread *multiplexed_thread = bridge->bridge_pvt;
+	struct multiplexed_bridge *mbridge;
+	struct multiplexed_channel *mchan;
+	struct ast_channel *expired[MULTIPLEXED_MAX_EVENTS];
+	struct timeval now = ast_tvnow();
+	int num_expired = 0, i;
+
+	ast_mutex_lock(&multiplexed_thread->lock);
+	AST_LIST_TRAVERSE(&multiplexed_thread->bridges, mbridge, list) {
+		AST_LIST_TRAVERSE(&mbridge->channels, mchan, list) {
+			multiplexed_channel_sync(multiplexed_thread, mchan);
+			if (!(sweep % MULTIPLEXED_VERIFY_SWEEPS)) {
+				for (i = 0; i < AST_MAX_FDS; i++) {
+					multiplexed_poller_verify(multiplexed_thread, &mchan->fds[i]);
+				}
+			}
+			if (!ast_tvzero(mchan->chan->whentohangup) && ast_tvcmp(mchan->chan->whentohangup, now) <= 0 &&
+				!(mchan->chan->_softhangup & AST_SOFTHANGUP_TIMEOUT) && num_expired < ARRAY_LEN(expired)) {
+				expired[num_expired++] = ast_channel_ref(mchan->chan);
+			}
+		}
+		if (!(sweep % MULTIPLEXED_REBALANCE_SWEEPS)) {
+			mbridge->load = mbridge->busy;
+			mbridge->busy = 0;
+		}
+	}
+	if (!(sweep % MULTIPLEXED_REBALANCE_SWEEPS)) {
+		multiplexed_thread->load = multiplexed_thread->busy;
+		multiplexed_thread->busy = 0;
+	}
+	ast_mutex_unlock(&multiplexed_thread->lock);
 
-	ao2_lock(multiplexed_threads);
+	/* The hangup wakes the channel, and the bridge then sees it has hung up */
+	for (i = 0; i < num_expired; i++) {
+		ast_test_suite_event_notify("HANGUP_TIME", "Channel: %s", expired[i]->name);
+		ast_softhangup(expired[i], AST_SOFTHANGUP_TIMEOUT);
+		ast_channel_unref(expired[i]);
+	}
 
-	multiplexed_thread->count -= 2;
+	if (!(sweep % MULTIPLEXED_REBALANCE_SWEEPS) && multiplexed_num_threads > 1) {
+		multiplexed_rebalance(multiplexed_thread);
+	}
+}
 
-	if (!multiplexed_thread->count) {
-		ast_debug(1, "Unlinking multiplexed thread '%p' since nobody is using it anymore\n", multiplexed_thread);
-		ao2_unlink(multiplexed_threads, multiplexed_thread);
+/*!
+ * \internal
+ * \brief Read a frame from a channel that tripped and pass it through its bridge
+ */
+static void multiplexed_service(struct multiplexed_thread *multiplexed_thread, struct multiplexed_event *event)
+{
+	struct multiplexed_channel *mchan = event->mfd->mchan;
+	struct ast_channel *chan;
+	struct ast_bridge *bridge;
+	struct timeval start;
+	unsigned int elapsed;
+
+	ast_mutex_lock(&multiplexed_thread->lock);
+	if (mchan->dead) {
+		ast_mutex_unlock(&multiplexed_thread->lock);
+		return;
 	}
+	chan = ast_channel_ref(mchan->chan);
+	ast_mutex_unlock(&multiplexed_thread->lock);
 
-	multiplexed_nudge(multiplexed_thread);
+	while ((bridge = chan->bridge) && ao2_trylock(bridge)) {
+		sched_yield();
+		if (multiplexed_thread->stop) {
+			bridge = NULL;
+			break;
+		}
+	}
+	/* The channel may have left while we were waiting for the bridge */
+	if (bridge && !mchan->dead) {
+		if (event->exception) {
+			ast_set_flag(chan, AST_FLAG_EXCEPTION);
+		} else {
+			ast_clear_flag(chan, AST_FLAG_EXCEPTION);
+		}
+		chan->fdno = event->mfd->index;
 
-	ao2_unlock(multiplexed_threads);
+		start = ast_tvnow();
+		ast_bridge_handle_trip(bridge, NULL, chan, -1);
+		elapsed = ast_tvdiff_us(ast_tvnow(), start);
 
-	ao2_ref(multiplexed_thread, -1);
+		/* Reading may have masqueraded the channel or changed its descriptors */
+		ast_mutex_lock(&multiplexed_thread->lock);
+		if (!mchan->dead) {
+			mchan->mbridge->busy += elapsed;
+			multiplexed_channel_sync(multiplexed_thread, mchan);
+		}
+		multiplexed_thread->busy += elapsed;
+		ast_mutex_unlock(&multiplexed_thread->lock);
+	}
+	if (bridge) {
+		ao2_unlock(bridge);
+	}
 
-	return 0;
+	ast_channel_unref(chan);
 }
 
 /*! \brief Thread function that executes for multiplexed threads */
 static void *multiplexed_thread_function(void *data)
 {
 	struct multiplexed_thread *multiplexed_thread = data;
-	int fds = multiplexed_thread->pipe[0];
-
-	ao2_lock(multiplexed_thread);
+	struct multiplexed_event events[MULTIPLEXED_MAX_EVENTS];
+	struct multiplexed_channel *mchan;
+	struct timeval next_sweep = ast_tvadd(ast_tvnow(), ast_samp2tv(MULTIPLEXED_SWEEP_MS, 1000));
+	unsigned int sweep = 0;
+	int res, i;
 
 	ast_debug(1, "Starting actual thread for multiplexed thread '%p'\n", multiplexed_thread);
 
-	while (multiplexed_thread->thread != AST_PTHREADT_STOP) {
-		struct ast_channel *winner = NULL, *first = multiplexed_thread->chans[0];
-		int to = -1, outfd = -1;
-
-		/* Move channels around so not just the first one gets priority */
-		memmove(multiplexed_thread->chans, multiplexed_thread->chans + 1, sizeof(struct ast_channel *) * (multiplexed_thread->service_count - 1));
-		multiplexed_thread->chans[multiplexed_thread->service_count - 1] = first;
+	while (!multiplexed_thread->stop) {
+		int ms = MAX(ast_tvdiff_ms(next_sweep, ast_tvnow()), 0);
 
-		multiplexed_thread->waiting = 1;
-		ao2_unlock(multiplexed_thread);
-		winner = ast_waitfor_nandfds(multiplexed_thread->chans, multiplexed_thread->service_count, &fds, 1, NULL, &outfd, &to);
-		multiplexed_thread->waiting = 0;
-		ao2_lock(multiplexed_thread);
-		if (multiplexed_thread->thread == AST_PTHREADT_STOP) {
-			break;
+		if ((res = multiplexed_poller_wait(multiplexed_thread, events, ms)) < 0 && errno != EINTR) {
+			ast_log(LOG_WARNING, "Failed to wait on multiplexed thread '%p': %s\n", multiplexed_thread, strerror(errno));
+			usleep(1000);
 		}
 
-		if (outfd > -1) {
-			int nudge;
+		for (i = 0; i < res && !multiplexed_thread->stop; i++) {
+			if (!events[i].mfd) {
+				int nudge[16];
 
-			if (read(multiplexed_thread->pipe[0], &nudge, sizeof(nudge)) < 0) {
-				if (errno != EINTR && errno != EAGAIN) {
-					ast_log(LOG_WARNING, "read() failed for pipe on multiplexed thread '%p': %s\n", multiplexed_thread, strerror(errno));
+				if (read(multiplexed_thread->pipe[0], nudge, sizeof(nudge)) < 0) {
+					if (errno != EINTR && errno != EAGAIN) {
+						ast_log(LOG_WARNING, "read() failed for pipe on multiplexed thread '%p': %s\n", multiplexed_thread, strerror(errno));
+					}
 				}
+				continue;
 			}
+			multiplexed_service(multiplexed_thread, &events[i]);
 		}
-		if (winner && winner->bridge) {
-			struct ast_bridge *bridge = winner->bridge;
-			int stop = 0;
-			ao2_unlock(multiplexed_thread);
-			while ((bridge = winner->bridge) && ao2_trylock(bridge)) {
-				sched_yield();
-				if (multiplexed_thread->thread == AST_PTHREADT_STOP) {
-					stop = 1;
-					break;
-				}
-			}
-			if (!stop && bridge) {
-				ast_bridge_handle_trip(bridge, NULL, winner, -1);
-				ao2_unlock(bridge);
-			}
-			ao2_lock(multiplexed_thread);
+
+		/* Nothing from this batch can refer to channels that have left any more */
+		ast_mutex_lock(&multiplexed_thread->lock);
+		while ((mchan = AST_LIST_REMOVE_HEAD(&multiplexed_thread->dead, list))) {
+			ast_free(mchan);
 		}
-	}
+		ast_mutex_unlock(&multiplexed_thread->lock);
 
-	multiplexed_thread->thread = AST_PTHREADT_NULL;
+		if (ast_tvcmp(ast_tvnow(), next_sweep) >= 0) {
+			multiplexed_sweep(multiplexed_thread, ++sweep);
+			next_sweep = ast_tvadd(ast_tvnow(), ast_samp2tv(MULTIPLEXED_SWEEP_MS, 1000));
+		}
+	}
 
 	ast_debug(1, "Stopping actual thread for multiplexed thread '%p'\n", multiplexed_thread);
 
-	ao2_unlock(multiplexed_thread);
-	ao2_ref(multiplexed_thread, -1);
-
 	return NULL;
 }
 
-/*! \brief Helper function which adds or removes a channel and nudges the thread */
-static void multiplexed_add_or_remove(struct multiplexed_thread *multiplexed_thread, struct ast_channel *chan, int add)
+/*! \brief Helper function which adds or removes a channel from the thread servicing the bridge */
+static void multiplexed_add_or_remove(struct ast_bridge *bridge, struct ast_channel *chan, int add)
 {
-	int i, removed = 0;
-	pthread_t thread = AST_PTHREADT_NULL;
-
-	ao2_lock(multiplexed_thread);
+	struct multiplexed_bridge *mbridge = bridge->bridge_pvt;
+	struct multiplexed_thread *multiplexed_thread;
+	struct multiplexed_channel *mchan;
+	int i;
 
-	multiplexed_nudge(multiplexed_thread);
+	multiplexed_thread = multiplexed_bridge_lock_thread(mbridge);
 
-	for (i = 0; i < MULTIPLEXED_MAX_CHANNELS; i++) {
-		if (multiplexed_thread->chans[i] == chan) {
-			if (!add) {
-				multiplexed_thread->chans[i] = NULL;
-				multiplexed_thread->service_count--;
-				removed = 1;
-			}
-			break;
-		} else if (!multiplexed_thread->chans[i] && add) {
-			multiplexed_thread->chans[i] = chan;
-			multiplexed_thread->service_count++;
+	AST_LIST_TRAVERSE(&mbridge->channels, mchan, list) {
+		if (mchan->chan == chan) {
 			break;
 		}
 	}
 
-	if (multiplexed_thread->service_count && multiplexed_thread->thread == AST_PTHREADT_NULL) {
-		ao2_ref(multiplexed_thread, +1);
-		if (ast_pthread_create(&multiplexed_thread->thread, NULL, multiplexed_thread_function, multiplexed_thread)) {
-			ao2_ref(multiplexed_thread, -1);
-			ast_debug(1, "Failed to create an actual thread for multiplexed thread '%p', trying next time\n", multiplexed_thread);
+	if (add && !mchan && (mchan = ast_calloc(1, sizeof(*mchan)))) {
+		mchan->chan = chan;
+		mchan->mbridge = mbridge;
+		for (i = 0; i < AST_MAX_FDS; i++) {
+			mchan->fds[i].mchan = mchan;
+			mchan->fds[i].fd = -1;
+			mchan->fds[i].index = i;
 		}
-	} else if (!multiplexed_thread->service_count && multiplexed_thread->thread != AST_PTHREADT_NULL) {
-		thread = multiplexed_thread->thread;
-		multiplexed_thread->thread = AST_PTHREADT_STOP;
-	} else if (!add && removed) {
-		memmove(multiplexed_thread->chans + i, multiplexed_thread->chans + i + 1, sizeof(struct ast_channel *) * (MULTIPLEXED_MAX_CHANNELS - (i + 1)));
+		AST_LIST_INSERT_TAIL(&mbridge->channels, mchan, list);
+		multiplexed_channel_sync(multiplexed_thread, mchan);
+	} else if (!add && mchan) {
+		AST_LIST_REMOVE(&mbridge->channels, mchan, list);
+		mchan->dead = 1;
+		multiplexed_channel_sync(multiplexed_thread, mchan);
+		/* The thread may still have events for it, so it frees it */
+		AST_LIST_INSERT_TAIL(&multiplexed_thread->dead, mchan, list);
 	}
 
-	ao2_unlock(multiplexed_thread);
-
-	if (thread != AST_PTHREADT_NULL) {
-		pthread_join(thread, NULL);
-	}
-
-	return;
+	ast_mutex_unlock(&multiplexed_thread->lock);
 }
 
-/*! \brief Join function which actually adds the channel into the array to be monitored */
+/*! \brief Join function which actually adds the channel to the thread to be monitored */
 static int multiplexed_bridge_join(struct ast_bridge *bridge, struct ast_bridge_channel *bridge_channel)
 {
 	struct ast_channel *c0 = AST_LIST_FIRST(&bridge->channels)->chan, *c1 = AST_LIST_LAST(&bridge->channels)->chan;
-	struct multiplexed_thread *multiplexed_thread = bridge->bridge_pvt;
 
-	ast_debug(1, "Adding channel '%s' to multiplexed thread '%p' for monitoring\n", bridge_channel->chan->name, multiplexed_thread);
+	ast_debug(1, "Adding channel '%s' to multiplexed bridge '%p' for monitoring\n", bridge_channel->chan->name, bridge);
 
-	multiplexed_add_or_remove(multiplexed_thread, bridge_channel->chan, 1);
+	multiplexed_add_or_remove(bridge, bridge_channel->chan, 1);
 
 	/* If the second channel has not yet joined do not make things compatible */
 	if (c0 == c1) {
@@ -336,14 +744,12 @@ static int multiplexed_bridge_join(struct ast_bridge *bridge, struct ast_bridge_
 	return ast_channel_make_compatible(c0, c1);
 }
 
-/*! \brief Leave function which actually removes the channel from the array */
+/*! \brief Leave function which actually removes the channel from the thread */
 static int multiplexed_bridge_leave(struct ast_bridge *bridge, struct ast_bridge_channel *bridge_channel)
 {
-	struct multiplexed_thread *multiplexed_thread = bridge->bridge_pvt;
-
-	ast_debug(1, "Removing channel '%s' from multiplexed thread '%p'\n", bridge_channel->chan->name, multiplexed_thread);
+	ast_debug(1, "Removing channel '%s' from multiplexed bridge '%p'\n", bridge_channel->chan->name, bridge);
 
-	multiplexed_add_or_remove(multiplexed_thread, bridge_channel->chan, 0);
+	multiplexed_add_or_remove(bridge, bridge_channel->chan, 0);
 
 	return 0;
 }
@@ -351,11 +757,9 @@ static int multiplexed_bridge_leave(struct ast_bridge *bridge, struct ast_bridge
 /*! \brief Suspend function which means control of the channel is going elsewhere */
 static void multiplexed_bridge_suspend(struct ast_bridge *bridge, struct ast_bridge_channel *bridge_channel)
 {
-	struct multiplexed_thread *multiplexed_thread = bridge->bridge_pvt;
+	ast_debug(1, "Suspending channel '%s' from multiplexed bridge '%p'\n", bridge_channel->chan->name, bridge);
 
-	ast_debug(1, "Suspending channel '%s' from multiplexed thread '%p'\n", bridge_channel->chan->name, multiplexed_thread);
-
-	multiplexed_add_or_remove(multiplexed_thread, bridge_channel->chan, 0);
+	multiplexed_add_or_remove(bridge, bridge_channel->chan, 0);
 
 	return;
 }
@@ -363,11 +767,9 @@ static void multiplexed_bridge_suspend(struct ast_bridge *bridge, struct ast_bri
 /*! \brief Unsuspend function which means control of the channel is coming back to us */
 static void multiplexed_bridge_unsuspend(struct ast_bridge *bridge, struct ast_bridge_channel *bridge_channel)
 {
-	struct multiplexed_thread *multiplexed_thread = bridge->bridge_pvt;
-
-	ast_debug(1, "Unsuspending channel '%s' from multiplexed thread '%p'\n", bridge_channel->chan->name, multiplexed_thread);
+	ast_debug(1, "Unsuspending channel '%s' from multiplexed bridge '%p'\n", bridge_channel->chan->name, bridge);
 
-	multiplexed_add_or_remove(multiplexed_thread, bridge_channel->chan, 1);
+	multiplexed_add_or_remove(bridge, bridge_channel->chan, 1);
 
 	return;
 }
@@ -405,11 +807,101 @@ static struct ast_bridge_technology multiplexed_bridge = {
 	.write = multiplexed_bridge_write,
 };
 
+/*! \brief Stop the pool's threads and release everything they hold */
+static void multiplexed_threads_destroy(void)
+{
+	struct multiplexed_channel *mchan;
+	unsigned int i;
+
+	for (i = 0; i < multiplexed_num_threads; i++) {
+		struct multiplexed_thread *multiplexed_thread = &multiplexed_threads[i];
+
+		if (multiplexed_thread->thread != AST_PTHREADT_NULL) {
+			multiplexed_thread->stop = 1;
+			multiplexed_nudge(multiplexed_thread);
+			pthread_join(multiplexed_thread->thread, NULL);
+		}
+		while ((mchan = AST_LIST_REMOVE_HEAD(&multiplexed_thread->dead, list))) {
+			ast_free(mchan);
+		}
+		multiplexed_poller_close(multiplexed_thread);
+		if (multiplexed_thread->pipe[0] > -1) {
+			close(multiplexed_thread->pipe[0]);
+		}
+		if (multiplexed_thread->pipe[1] > -1) {
+			close(multiplexed_thread->pipe[1]);
+		}
+		ast_mutex_destroy(&multiplexed_thread->lock);
+	}
+
+	ast_free(multiplexed_threads);
+	multiplexed_threads = NULL;
+	multiplexed_num_threads = 0;
+}
+
+/*! \brief Start one thread per CPU */
+static int multiplexed_threads_create(void)
+{
+	long cpus = sysconf(_SC_NPROCESSORS_ONLN);
+	unsigned int num = MIN(MAX(cpus, 1), MULTIPLEXED_MAX_THREADS);
+	unsigned int i;
+
+	if (!(multiplexed_threads = ast_calloc(num, sizeof(*multiplexed_threads)))) {
+		return -1;
+	}
+
+	for (multiplexed_num_threads = 0; multiplexed_num_threads < num; multiplexed_num_threads++) {
+		struct multiplexed_thread *multiplexed_thread = &multiplexed_threads[multiplexed_num_threads];
+
+		ast_mutex_init(&multiplexed_thread->lock);
+		multiplexed_thread->thread = AST_PTHREADT_NULL;
+		multiplexed_thread->pipe[0] = multiplexed_thread->pipe[1] = -1;
+#ifdef HAVE_EPOLL_CREATE1
+		multiplexed_thread->epfd = -1;
+#endif
+
+		/* Setup a pipe so we can poke the thread itself when needed */
+		if (pipe(multiplexed_thread->pipe)) {
+			ast_log(LOG_WARNING, "Failed to create a pipe for poking multiplexed thread '%p'\n", multiplexed_thread);
+			multiplexed_num_threads++;
+			goto failure;
+		}
+		/* Setup each pipe for non-blocking operation */
+		for (i = 0; i < 2; i++) {
+			int flags = fcntl(multiplexed_thread->pipe[i], F_GETFL);
+
+			if (fcntl(multiplexed_thread->pipe[i], F_SETFL, flags | O_NONBLOCK) < 0) {
+				ast_log(LOG_WARNING, "Failed to setup nudge pipe for non-blocking operation on '%p' (%d: %s)\n", multiplexed_thread, errno, strerror(errno));
+				multiplexed_num_threads++;
+				goto failure;
+			}
+		}
+		if (multiplexed_poller_open(multiplexed_thread)) {
+			multiplexed_num_threads++;
+			goto failure;
+		}
+		if (ast_pthread_create(&multiplexed_thread->thread, NULL, multiplexed_thread_function, multiplexed_thread)) {
+			ast_log(LOG_WARNING, "Failed to create an actual thread for multiplexed thread '%p'\n", multiplexed_thread);
+			multiplexed_thread->thread = AST_PTHREADT_NULL;
+			multiplexed_num_threads++;
+			goto failure;
+		}
+	}
+
+	ast_verb(3, "Multiplexed bridging is using %u threads\n", multiplexed_num_threads);
+
+	return 0;
+
+failure:
+	multiplexed_threads_destroy();
+	return -1;
+}
+
 static int unload_module(void)
 {
 	int res = ast_bridge_technology_unregister(&multiplexed_bridge);
 
-	ao2_ref(multiplexed_threads, -1);
+	multiplexed_threads_destroy();
 	multiplexed_bridge.format_capabilities = ast_format_cap_destroy(multiplexed_bridge.format_capabilities);
 
 	return res;
@@ -417,10 +909,11 @@ static int unload_module(void)
 
 static int load_module(void)
 {
-	if (!(multiplexed_threads = ao2_container_alloc(MULTIPLEXED_BUCKETS, NULL, NULL))) {
+	if (multiplexed_threads_create()) {
 		return AST_MODULE_LOAD_DECLINE;
 	}
 	if (!(multiplexed_bridge.format_capabilities = ast_format_cap_alloc())) {
+		multiplexed_threads_destroy();
 		return AST_MODULE_LOAD_DECLINE;
 	}
 	ast_format_cap_add_all_by_type(multiplexed_bridge.format_capabilities, AST_FORMAT_TYPE_AUDIO);
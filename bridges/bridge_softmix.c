@@ -54,6 +54,16 @@ ASTERISK_FILE_VERSION(__FILE__, "$Revision: 375894 $")
 #include "asterisk/astobj2.h"
 #include "asterisk/timing.h"
 #include "asterisk/translate.h"
+#include "asterisk/utils.h"
+#include "asterisk/test.h"
+
+/* SSE2 and AVX2 kernels are built with per-function target attributes so the
+ * module itself does not need to be compiled for a newer CPU than it runs on. */
+#if (defined(__x86_64__) || defined(__i386__)) && \
+	(defined(__clang__) || (defined(__GNUC__) && (__GNUC__ > 4 || (__GNUC__ == 4 && __GNUC_MINOR__ >= 9))))
+#define SOFTMIX_HAVE_X86_SIMD 1
+#include <immintrin.h>
+#endif
 
 #define MAX_DATALEN 8096
 
@@ -76,6 +86,16 @@ ASTERISK_FILE_VERSION(__FILE__, "$Revision: 375894 $")
 
 #define DEFAULT_ENERGY_HISTORY_LEN 150
 
+/*! \brief Channels mixed out per thread before a bridge starts using workers */
+#define SOFTMIX_CHANNELS_PER_WORKER 64
+
+/*! \brief Most worker threads a single bridge will mix out with */
+#define SOFTMIX_MAX_WORKERS 15
+
+/*! \brief How much louder, in percent, a talker must be to take a mixed talker's place
+ *  when the number of talkers mixed is limited */
+#define SOFTMIX_TALKER_HYSTERESIS 150
+
 struct video_follow_talker_data {
 	/*! audio energy history */
 	int energy_history[DEFAULT_ENERGY_HISTORY_LEN];
@@ -107,6 +127,12 @@ struct softmix_channel {
 	int have_audio:1;
 	/*! Bit used to indicate that a frame is available to be written out to the channel */
 	int have_frame:1;
+	/*! Bit used to indicate the channel was one of the talkers mixed in the last interval */
+	int top_talker:1;
+	/*! Smoothed DSP energy of the channel's audio, used to rank talkers */
+	int talk_energy;
+	/*! Score of the channel among the talkers this interval, set by the mixing thread */
+	int talk_score;
 	/*! Buffer containing final mixed audio from all sources */
 	short final_buf[MAX_DATALEN];
 	/*! Buffer containing only the audio from the channel */
@@ -119,6 +145,12 @@ struct softmix_bridge_data {
 	struct ast_timer *timer;
 	unsigned int internal_rate;
 	unsigned int internal_mixing_interval;
+	/*! Number of mixing intervals since the last report that took longer than the interval itself */
+	unsigned int overruns;
+	/*! Longest time spent mixing a single interval since the last report, in microseconds */
+	unsigned int worst_mix_time;
+	/*! Set while mixing intervals are being overrun, so we only warn once */
+	unsigned int overrunning:1;
 };
 
 struct softmix_stats {
@@ -140,6 +172,12 @@ struct softmix_mixing_array {
 	int max_num_entries;
 	int used_entries;
 	int16_t **buffers;
+	/*! Channels to mix out to in this interval, sized like buffers */
+	struct ast_bridge_channel **channels;
+	int used_channels;
+	/*! Channels talking in this interval when the number of talkers is limited */
+	struct softmix_channel **talkers;
+	int used_talkers;
 };
 
 struct softmix_translate_helper_entry {
@@ -156,6 +194,204 @@ struct softmix_translate_helper {
 	AST_LIST_HEAD_NOLOCK(, softmix_translate_helper_entry) entries;
 };
 
+/*!
+ * \brief Mixing kernels
+ *
+ * Both kernels saturate each sample to +/-32767 exactly as
+ * ast_slinear_saturated_add() and ast_slinear_saturated_subtract() do,
+ * so every implementation produces the same output as the scalar one.
+ */
+struct softmix_kernels {
+	/*! Name of the implementation, for the log and the tests */
+	const char *name;
+	/*! Add samples of src into dst */
+	void (*mix)(int16_t *dst, const int16_t *src, unsigned int samples);
+	/*! Remove samples of src from dst, for a talker's own audio */
+	void (*minus)(int16_t *dst, const int16_t *src, unsigned int samples);
+};
+
+static void softmix_mix_scalar(int16_t *dst, const int16_t *src, unsigned int samples)
+{
+	unsigned int i;
+
+	for (i = 0; i < samples; i++) {
+		ast_slinear_saturated_add(&dst[i], (short *) &src[i]);
+	}
+}
+
+static void softmix_minus_scalar(int16_t *dst, const int16_t *src, unsigned int samples)
+{
+	unsigned int i;
+
+	for (i = 0; i < samples; i++) {
+		ast_slinear_saturated_subtract(&dst[i], (short *) &src[i]);
+	}
+}
+
+static const struct softmix_kernels softmix_kernels_scalar = {
+	.name = "scalar",
+	.mix = softmix_mix_scalar,
+	.minus = softmix_minus_scalar,
+};
+
+#ifdef SOFTMIX_HAVE_X86_SIMD
+/* The saturating instructions clamp to -32768, so the result is raised to
+ * -32767 afterwards to match the scalar helpers. */
+static __attribute__((target("sse2"))) void softmix_mix_sse2(int16_t *dst, const int16_t *src, unsigned int samples)
+{
+	const __m128i floor = _mm_set1_epi16(-32767);
+	unsigned int i = 0;
+
+	for (; i + 8 <= samples; i += 8) {
+		__m128i d = _mm_loadu_si128((const __m128i *) (dst + i));
+		__m128i s = _mm_loadu_si128((const __m128i *) (src + i));
+
+		_mm_storeu_si128((__m128i *) (dst + i), _mm_max_epi16(_mm_adds_epi16(d, s), floor));
+	}
+	softmix_mix_scalar(dst + i, src + i, samples - i);
+}
+
+static __attribute__((target("sse2"))) void softmix_minus_sse2(int16_t *dst, const int16_t *src, unsigned int samples)
+{
+	const __m128i floor = _mm_set1_epi16(-32767);
+	unsigned int i = 0;
+
+	for (; i + 8 <= samples; i += 8) {
+		__m128i d = _mm_loadu_si128((const __m128i *) (dst + i));
+		__m128i s = _mm_loadu_si128((const __m128i *) (src + i));
+
+		_mm_storeu_si128((__m128i *) (dst + i), _mm_max_epi16(_mm_subs_epi16(d, s), floor));
+	}
+	softmix_minus_scalar(dst + i, src + i, samples - i);
+}
+
+static __attribute__((target("avx2"))) void softmix_mix_avx2(int16_t *dst, const int16_t *src, unsigned int samples)
+{
+	const __m256i floor = _mm256_set1_epi16(-32767);
+	unsigned int i = 0;
+
+	for (; i + 16 <= samples; i += 16) {
+		__m256i d = _mm256_loadu_si256((const __m256i *) (dst + i));
+		__m256i s = _mm256_loadu_si256((const __m256i *) (src + i));
+
+		_mm256_storeu_si256((__m256i *) (dst + i), _mm256_max_epi16(_mm256_adds_epi16(d, s), floor));
+	}
+	softmix_mix_sse2(dst + i, src + i, samples - i);
+}
+
+static __attribute__((target("avx2"))) void softmix_minus_avx2(int16_t *dst, const int16_t *src, unsigned int samples)
+{
+	const __m256i floor = _mm256_set1_epi16(-32767);
+	unsigned int i = 0;
+
+	for (; i + 16 <= samples; i += 16) {
+		__m256i d = _mm256_loadu_si256((const __m256i *) (dst + i));
+		__m256i s = _mm256_loadu_si256((const __m256i *) (src + i));
+
+		_mm256_storeu_si256((__m256i *) (dst + i), _mm256_max_epi16(_mm256_subs_epi16(d, s), floor));
+	}
+	softmix_minus_sse2(dst + i, src + i, samples - i);
+}
+
+static const struct softmix_kernels softmix_kernels_sse2 = {
+	.name = "sse2",
+	.mix = softmix_mix_sse2,
+	.minus = softmix_minus_sse2,
+};
+
+static const struct softmix_kernels softmix_kernels_avx2 = {
+	.name = "avx2",
+	.mix = softmix_mix_avx2,
+	.minus = softmix_minus_avx2,
+};
+#endif
+
+/*! \brief Kernels in use, chosen for the CPU when the module loads */
+static const struct softmix_kernels *softmix_kernels = &softmix_kernels_scalar;
+
+/*! \brief Determine if the CPU can run a set of kernels */
+static int softmix_kernels_usable(const struct softmix_kernels *kernels)
+{
+#ifdef SOFTMIX_HAVE_X86_SIMD
+	__builtin_cpu_init();
+	if (kernels == &softmix_kernels_avx2) {
+		return __builtin_cpu_supports("avx2");
+	}
+	if (kernels == &softmix_kernels_sse2) {
+		return __builtin_cpu_supports("sse2");
+	}
+#endif
+	return 1;
+}
+
+/*! \brief Pick the fastest kernels the CPU supports */
+static const struct softmix_kernels *softmix_kernels_select(void)
+{
+#ifdef SOFTMIX_HAVE_X86_SIMD
+	if (softmix_kernels_usable(&softmix_kernels_avx2)) {
+		return &softmix_kernels_avx2;
+	}
+	if (softmix_kernels_usable(&softmix_kernels_sse2)) {
+		return &softmix_kernels_sse2;
+	}
+#endif
+	return &softmix_kernels_scalar;
+}
+
+/*! \brief What is shared with the workers mixing out a single interval */
+struct softmix_mixing_job {
+	/*! Channels to mix out to, split in slices between the threads */
+	struct ast_bridge_channel **channels;
+	unsigned int num_channels;
+	/*! Number of slices channels is split into, one per participating thread */
+	unsigned int slices;
+	/*! Sum of every talker's audio */
+	const int16_t *buf;
+	unsigned int datalen;
+	unsigned int samples;
+	unsigned int rate;
+	enum ast_format_id slin_id;
+};
+
+struct softmix_mixing_pool;
+
+/*! \brief A thread mixing out one slice of the channels in each interval */
+struct softmix_worker {
+	pthread_t thread;
+	struct softmix_mixing_pool *pool;
+	/*! Translations shared by the channels in this worker's slice */
+	struct softmix_translate_helper trans_helper;
+	/*! Rate trans_helper is set up for */
+	unsigned int rate;
+	/*! Generation of the last job this worker picked up */
+	unsigned int generation;
+	/*! Slice of each job this worker mixes out, the mixing thread does slice 0 */
+	unsigned int slice;
+};
+
+/*!
+ * \brief Workers helping a bridge's mixing thread
+ *
+ * The mixing thread sums the talkers once and then splits the minus-one
+ * removal and write translation for each channel between itself and the
+ * workers, waiting for all of them before the interval ends.
+ */
+struct softmix_mixing_pool {
+	ast_mutex_t lock;
+	/*! Signalled when a new job is posted or the pool is stopping */
+	ast_cond_t cond;
+	/*! Signalled when the last worker finishes its slice */
+	ast_cond_t done;
+	/*! Incremented for each job posted */
+	unsigned int generation;
+	/*! Workers still mixing out the current job */
+	unsigned int pending;
+	unsigned int stop:1;
+	unsigned int num_workers;
+	struct softmix_mixing_job job;
+	struct softmix_worker workers[SOFTMIX_MAX_WORKERS];
+};
+
 static struct softmix_translate_helper_entry *softmix_translate_helper_entry_alloc(struct ast_format *dst)
 {
 	struct softmix_translate_helper_entry *entry;
@@ -242,14 +478,11 @@ static void softmix_process_write_audio(struct softmix_translate_helper *trans_h
 	struct softmix_channel *sc)
 {
 	struct softmix_translate_helper_entry *entry = NULL;
-	int i;
 
 	/* If we provided audio that was not determined to be silence,
 	 * then take it out while in slinear format. */
 	if (sc->have_audio && sc->talking) {
-		for (i = 0; i < sc->write_frame.samples; i++) {
-			ast_slinear_saturated_subtract(&sc->final_buf[i], &sc->our_buf[i]);
-		}
+		softmix_kernels->minus(sc->final_buf, sc->our_buf, sc->write_frame.samples);
 		/* do not do any special write translate optimization if we had to make
 		 * a special mix for them to remove their own audio. */
 		return;
@@ -526,6 +759,7 @@ static enum ast_bridge_write_result softmix_bridge_write(struct ast_bridge *brid
 	/* If we made it here, we are going to write the frame into the conference */
 	ast_mutex_lock(&sc->lock);
 	ast_dsp_silence_with_energy(sc->dsp, frame, &totalsilence, &cur_energy);
+	sc->talk_energy = (sc->talk_energy * 7 + cur_energy) / 8;
 
 	if (bridge->video_mode.mode == AST_BRIDGE_VIDEO_MODE_TALKER_SRC) {
 		int cur_slot = sc->video_talker.energy_history_cur_slot;
@@ -640,6 +874,29 @@ static void gather_softmix_stats(struct softmix_stats *stats,
 		stats->num_at_internal_rate++;
 	}
 }
+/*!
+ * \internal
+ * \brief Report mixing intervals overrun since the last statistics run, and start counting again
+ */
+static void report_softmix_stats(struct ast_bridge *bridge, struct softmix_bridge_data *softmix_data,
+	unsigned int num_workers)
+{
+	if (softmix_data->overruns && !softmix_data->overrunning) {
+		ast_log(LOG_WARNING, "Softmix bridge %p overran %u of the last %d mixing intervals of %u ms "
+			"(worst %u us) with %d channels and %u mixing workers\n",
+			bridge, softmix_data->overruns, SOFTMIX_STAT_INTERVAL, softmix_data->internal_mixing_interval,
+			softmix_data->worst_mix_time, bridge->num, num_workers);
+	} else if (!softmix_data->overruns && softmix_data->overrunning) {
+		ast_log(LOG_NOTICE, "Softmix bridge %p is keeping up with mixing again\n", bridge);
+	} else {
+		ast_debug(3, "Softmix bridge %p: %u of %d mixing intervals overrun, worst %u us, %u mixing workers\n",
+			bridge, softmix_data->overruns, SOFTMIX_STAT_INTERVAL, softmix_data->worst_mix_time, num_workers);
+	}
+	softmix_data->overrunning = softmix_data->overruns ? 1 : 0;
+	softmix_data->overruns = 0;
+	softmix_data->worst_mix_time = 0;
+}
+
 /*!
  * \internal
  * \brief Analyse mixing statistics and change bridges internal rate
@@ -717,8 +974,14 @@ static int softmix_mixing_array_init(struct softmix_mixing_array *mixing_array,
 {
 	memset(mixing_array, 0, sizeof(*mixing_array));
 	mixing_array->max_num_entries = starting_num_entries;
-	if (!(mixing_array->buffers = ast_calloc(mixing_array->max_num_entries, sizeof(int16_t *)))) {
+	if (!(mixing_array->buffers = ast_calloc(mixing_array->max_num_entries, sizeof(int16_t *))) ||
+		!(mixing_array->channels = ast_calloc(mixing_array->max_num_entries, sizeof(struct ast_bridge_channel *))) ||
+		!(mixing_array->talkers = ast_calloc(mixing_array->max_num_entries, sizeof(struct softmix_channel *)))) {
 		ast_log(LOG_NOTICE, "Failed to allocate softmix mixing structure. \n");
+		ast_free(mixing_array->buffers);
+		ast_free(mixing_array->channels);
+		mixing_array->buffers = NULL;
+		mixing_array->channels = NULL;
 		return -1;
 	}
 	return 0;
@@ -727,21 +990,267 @@ static int softmix_mixing_array_init(struct softmix_mixing_array *mixing_array,
 static void softmix_mixing_array_destroy(struct softmix_mixing_array *mixing_array)
 {
 	ast_free(mixing_array->buffers);
+	ast_free(mixing_array->channels);
+	ast_free(mixing_array->talkers);
 }
 
 static int softmix_mixing_array_grow(struct softmix_mixing_array *mixing_array, unsigned int num_entries)
 {
 	int16_t **tmp;
+	struct ast_bridge_channel **tmp_channels;
+	struct softmix_channel **tmp_talkers;
 	/* give it some room to grow since memory is cheap but allocations can be expensive */
-	mixing_array->max_num_entries = num_entries;
-	if (!(tmp = ast_realloc(mixing_array->buffers, (mixing_array->max_num_entries * sizeof(int16_t *))))) {
+	if (!(tmp = ast_realloc(mixing_array->buffers, (num_entries * sizeof(int16_t *))))) {
 		ast_log(LOG_NOTICE, "Failed to re-allocate softmix mixing structure. \n");
 		return -1;
 	}
 	mixing_array->buffers = tmp;
+	if (!(tmp_channels = ast_realloc(mixing_array->channels, (num_entries * sizeof(struct ast_bridge_channel *))))) {
+		ast_log(LOG_NOTICE, "Failed to re-allocate softmix mixing structure. \n");
+		return -1;
+	}
+	mixing_array->channels = tmp_channels;
+	if (!(tmp_talkers = ast_realloc(mixing_array->talkers, (num_entries * sizeof(struct softmix_channel *))))) {
+		ast_log(LOG_NOTICE, "Failed to re-allocate softmix mixing structure. \n");
+		return -1;
+	}
+	mixing_array->talkers = tmp_talkers;
+	mixing_array->max_num_entries = num_entries;
 	return 0;
 }
 
+/*!
+ * \internal
+ * \brief Score a talker for ranking against the others
+ *
+ * Talkers that were mixed last interval get a head start so the mix does
+ * not flip between talkers of about the same volume.
+ *
+ * \note The channel must be locked.
+ */
+static int softmix_talker_score(struct softmix_channel *sc)
+{
+	return sc->top_talker ? sc->talk_energy * SOFTMIX_TALKER_HYSTERESIS / 100 : sc->talk_energy;
+}
+
+/*!
+ * \internal
+ * \brief Move the loudest talkers to the front
+ *
+ * Only the first max_talkers entries are sorted, which is all the mixing
+ * thread needs, so this stays cheap with many talkers and a small limit.
+ *
+ * \return the number of talkers to mix
+ */
+static unsigned int softmix_rank_talkers(struct softmix_channel **talkers, unsigned int num, unsigned int max_talkers)
+{
+	unsigned int i, j, best;
+
+	max_talkers = MIN(max_talkers, num);
+	for (i = 0; i < max_talkers; i++) {
+		struct softmix_channel *tmp;
+
+		best = i;
+		for (j = i + 1; j < num; j++) {
+			if (talkers[j]->talk_score > talkers[best]->talk_score) {
+				best = j;
+			}
+		}
+		tmp = talkers[i];
+		talkers[i] = talkers[best];
+		talkers[best] = tmp;
+	}
+
+	return max_talkers;
+}
+
+/*!
+ * \internal
+ * \brief Build a channel's write frame from the mix
+ *
+ * \note The bridge is locked by the mixing thread while this runs, so the
+ * channel cannot leave the bridge underneath us.
+ */
+static void softmix_mix_out_channel(struct softmix_translate_helper *trans_helper,
+	const struct softmix_mixing_job *job, struct ast_bridge_channel *bridge_channel)
+{
+	struct softmix_channel *sc = bridge_channel->bridge_pvt;
+
+	ast_mutex_lock(&sc->lock);
+
+	/* Make SLINEAR write frame from local buffer */
+	if (sc->write_frame.subclass.format.id != job->slin_id) {
+		ast_format_set(&sc->write_frame.subclass.format, job->slin_id, 0);
+	}
+	sc->write_frame.datalen = job->datalen;
+	sc->write_frame.samples = job->samples;
+	memcpy(sc->final_buf, job->buf, job->datalen);
+
+	/* process the softmix channel's new write audio */
+	softmix_process_write_audio(trans_helper, &bridge_channel->chan->rawwriteformat, sc);
+
+	/* The frame is now ready for use... */
+	sc->have_frame = 1;
+
+	ast_mutex_unlock(&sc->lock);
+
+	/* Poke bridged channel thread just in case */
+	pthread_kill(bridge_channel->thread, SIGURG);
+}
+
+/*! \internal \brief Mix out one slice of a job's channels */
+static void softmix_mix_out_slice(struct softmix_translate_helper *trans_helper,
+	const struct softmix_mixing_job *job, unsigned int slice)
+{
+	unsigned int i = job->num_channels * slice / job->slices;
+	unsigned int end = job->num_channels * (slice + 1) / job->slices;
+
+	for (; i < end; i++) {
+		softmix_mix_out_channel(trans_helper, job, job->channels[i]);
+	}
+}
+
+static void *softmix_worker_thread(void *data)
+{
+	struct softmix_worker *worker = data;
+	struct softmix_mixing_pool *pool = worker->pool;
+	struct softmix_mixing_job job;
+
+	ast_mutex_lock(&pool->lock);
+	for (;;) {
+		while (!pool->stop && worker->generation == pool->generation) {
+			ast_cond_wait(&pool->cond, &pool->lock);
+		}
+		if (pool->stop) {
+			break;
+		}
+		worker->generation = pool->generation;
+		if (worker->slice >= pool->job.slices) {
+			/* Not needed for the number of channels in this interval */
+			continue;
+		}
+		job = pool->job;
+		ast_mutex_unlock(&pool->lock);
+
+		if (worker->rate != job.rate) {
+			softmix_translate_helper_change_rate(&worker->trans_helper, job.rate);
+			worker->rate = job.rate;
+		}
+		softmix_mix_out_slice(&worker->trans_helper, &job, worker->slice);
+		softmix_translate_helper_cleanup(&worker->trans_helper);
+
+		ast_mutex_lock(&pool->lock);
+		if (!--pool->pending) {
+			ast_cond_signal(&pool->done);
+		}
+	}
+	ast_mutex_unlock(&pool->lock);
+
+	return NULL;
+}
+
+static struct softmix_mixing_pool *softmix_mixing_pool_alloc(void)
+{
+	struct softmix_mixing_pool *pool;
+
+	if (!(pool = ast_calloc(1, sizeof(*pool)))) {
+		return NULL;
+	}
+	ast_mutex_init(&pool->lock);
+	ast_cond_init(&pool->cond, NULL);
+	ast_cond_init(&pool->done, NULL);
+
+	return pool;
+}
+
+static void softmix_mixing_pool_destroy(struct softmix_mixing_pool *pool)
+{
+	unsigned int i;
+
+	if (!pool) {
+		return;
+	}
+
+	ast_mutex_lock(&pool->lock);
+	pool->stop = 1;
+	ast_cond_broadcast(&pool->cond);
+	ast_mutex_unlock(&pool->lock);
+
+	for (i = 0; i < pool->num_workers; i++) {
+		pthread_join(pool->workers[i].thread, NULL);
+		softmix_translate_helper_destroy(&pool->workers[i].trans_helper);
+	}
+
+	ast_cond_destroy(&pool->done);
+	ast_cond_destroy(&pool->cond);
+	ast_mutex_destroy(&pool->lock);
+	ast_free(pool);
+}
+
+/*!
+ * \internal
+ * \brief Start workers until the pool has the number requested
+ *
+ * \return the number of workers to use, which is the number requested or
+ * fewer if threads could not be started.  A pool grown for a larger bridge
+ * keeps its extra workers, and they sit out the intervals that do not need
+ * them.
+ */
+static unsigned int softmix_mixing_pool_grow(struct softmix_mixing_pool *pool, unsigned int num_workers, unsigned int rate)
+{
+	ast_mutex_lock(&pool->lock);
+	while (pool->num_workers < num_workers) {
+		struct softmix_worker *worker = &pool->workers[pool->num_workers];
+
+		worker->pool = pool;
+		worker->slice = pool->num_workers + 1;
+		worker->generation = pool->generation;
+		worker->rate = rate;
+		softmix_translate_helper_init(&worker->trans_helper, rate);
+		if (ast_pthread_create(&worker->thread, NULL, softmix_worker_thread, worker)) {
+			ast_log(LOG_WARNING, "Failed to start softmix mixing worker, continuing with %u\n", pool->num_workers);
+			break;
+		}
+		pool->num_workers++;
+	}
+	num_workers = MIN(num_workers, pool->num_workers);
+	ast_mutex_unlock(&pool->lock);
+
+	return num_workers;
+}
+
+/*!
+ * \internal
+ * \brief Mix out to every channel in a job
+ *
+ * The mixing thread takes the first slice itself using its own
+ * translation helper, and hands the rest to the pool's workers.
+ */
+static void softmix_mixing_pool_run(struct softmix_mixing_pool *pool,
+	struct softmix_translate_helper *trans_helper, struct softmix_mixing_job *job)
+{
+	if (!pool || job->slices < 2) {
+		job->slices = 1;
+		softmix_mix_out_slice(trans_helper, job, 0);
+		return;
+	}
+
+	ast_mutex_lock(&pool->lock);
+	pool->job = *job;
+	pool->pending = job->slices - 1;
+	pool->generation++;
+	ast_cond_broadcast(&pool->cond);
+	ast_mutex_unlock(&pool->lock);
+
+	softmix_mix_out_slice(trans_helper, job, 0);
+
+	ast_mutex_lock(&pool->lock);
+	while (pool->pending) {
+		ast_cond_wait(&pool->done, &pool->lock);
+	}
+	ast_mutex_unlock(&pool->lock);
+}
+
 /*! \brief Function which acts as the mixing thread */
 static int softmix_bridge_thread(struct ast_bridge *bridge)
 {
@@ -750,11 +1259,14 @@ static int softmix_bridge_thread(struct ast_bridge *bridge)
 	struct softmix_bridge_data *softmix_data = bridge->bridge_pvt;
 	struct ast_timer *timer;
 	struct softmix_translate_helper trans_helper;
+	struct softmix_mixing_pool *pool = NULL;
 	int16_t buf[MAX_DATALEN] = { 0, };
 	unsigned int stat_iteration_counter = 0; /* counts down, gather stats at zero and reset. */
+	/* No more threads mixing out than there are CPUs to run them */
+	unsigned int max_slices = MIN(SOFTMIX_MAX_WORKERS + 1, MAX(sysconf(_SC_NPROCESSORS_ONLN), 1));
 	int timingfd;
 	int update_all_rates = 0; /* set this when the internal sample rate has changed */
-	int i, x;
+	int i;
 	int res = -1;
 
 	if (!(softmix_data = bridge->bridge_pvt)) {
@@ -775,6 +1287,10 @@ static int softmix_bridge_thread(struct ast_bridge *bridge)
 
 	while (!bridge->stop && !bridge->refresh && bridge->array_num) {
 		struct ast_bridge_channel *bridge_channel = NULL;
+		struct softmix_mixing_job job;
+		unsigned int max_talkers = bridge->max_talkers;
+		struct timeval start = ast_tvnow();
+		int64_t mix_time;
 		int timeout = -1;
 		enum ast_format_id cur_slin_id = ast_format_slin_by_rate(softmix_data->internal_rate);
 		unsigned int softmix_samples = SOFTMIX_SAMPLES(softmix_data->internal_rate, softmix_data->internal_mixing_interval);
@@ -797,6 +1313,8 @@ static int softmix_bridge_thread(struct ast_bridge *bridge)
 		/* init the number of buffers stored in the mixing array to 0.
 		 * As buffers are added for mixing, this number is incremented. */
 		mixing_array.used_entries = 0;
+		mixing_array.used_channels = 0;
+		mixing_array.used_talkers = 0;
 
 		/* These variables help determine if a rate change is required */
 		if (!stat_iteration_counter) {
@@ -827,55 +1345,78 @@ static int softmix_bridge_thread(struct ast_bridge *bridge)
 			if (bridge_channel->suspended) {
 				continue;
 			}
+			mixing_array.channels[mixing_array.used_channels++] = bridge_channel;
 
 			/* Try to get audio from the factory if available */
 			ast_mutex_lock(&sc->lock);
-			if ((mixing_array.buffers[mixing_array.used_entries] = softmix_process_read_audio(sc, softmix_samples))) {
-				mixing_array.used_entries++;
+			if (!max_talkers) {
+				if ((mixing_array.buffers[mixing_array.used_entries] = softmix_process_read_audio(sc, softmix_samples))) {
+					mixing_array.used_entries++;
+				}
+			} else if (softmix_process_read_audio(sc, softmix_samples) && sc->talking) {
+				/* Only talkers are candidates for the mix, ranked below */
+				sc->talk_score = softmix_talker_score(sc);
+				mixing_array.talkers[mixing_array.used_talkers++] = sc;
+			} else {
+				/* Not mixed, so it gets the same frame as every other listener */
+				sc->have_audio = 0;
+				sc->top_talker = 0;
 			}
 			ast_mutex_unlock(&sc->lock);
 		}
 
+		/* When the number of talkers is limited only the loudest are mixed. Everyone
+		 * else hears the same mix, so it is only translated once per format. */
+		if (max_talkers) {
+			unsigned int mixed = softmix_rank_talkers(mixing_array.talkers, mixing_array.used_talkers, max_talkers);
+
+			for (i = 0; i < mixing_array.used_talkers; i++) {
+				struct softmix_channel *sc = mixing_array.talkers[i];
+
+				ast_mutex_lock(&sc->lock);
+				if (i < mixed) {
+					sc->top_talker = 1;
+					mixing_array.buffers[mixing_array.used_entries++] = sc->our_buf;
+				} else {
+					sc->top_talker = 0;
+					sc->have_audio = 0;
+				}
+				ast_mutex_unlock(&sc->lock);
+			}
+		}
+
 		/* mix it like crazy */
 		memset(buf, 0, softmix_datalen);
 		for (i = 0; i < mixing_array.used_entries; i++) {
-			for (x = 0; x < softmix_samples; x++) {
-				ast_slinear_saturated_add(buf + x, mixing_array.buffers[i] + x);
-			}
+			softmix_kernels->mix(buf, mixing_array.buffers[i], softmix_samples);
 		}
 
-		/* Next step go through removing the channel's own audio and creating a good frame... */
-		AST_LIST_TRAVERSE(&bridge->channels, bridge_channel, entry) {
-			struct softmix_channel *sc = bridge_channel->bridge_pvt;
-
-			if (bridge_channel->suspended) {
-				continue;
-			}
-
-			ast_mutex_lock(&sc->lock);
-
-			/* Make SLINEAR write frame from local buffer */
-			if (sc->write_frame.subclass.format.id != cur_slin_id) {
-				ast_format_set(&sc->write_frame.subclass.format, cur_slin_id, 0);
-			}
-			sc->write_frame.datalen = softmix_datalen;
-			sc->write_frame.samples = softmix_samples;
-			memcpy(sc->final_buf, buf, softmix_datalen);
-
-			/* process the softmix channel's new write audio */
-			softmix_process_write_audio(&trans_helper, &bridge_channel->chan->rawwriteformat, sc);
-
-			/* The frame is now ready for use... */
-			sc->have_frame = 1;
-
-			ast_mutex_unlock(&sc->lock);
+		/* Next step go through removing the channel's own audio and creating a good frame,
+		 * sharing the work out between worker threads in large bridges. */
+		job.channels = mixing_array.channels;
+		job.num_channels = mixing_array.used_channels;
+		job.slices = MIN(job.num_channels / SOFTMIX_CHANNELS_PER_WORKER, max_slices);
+		job.buf = buf;
+		job.datalen = softmix_datalen;
+		job.samples = softmix_samples;
+		job.rate = softmix_data->internal_rate;
+		job.slin_id = cur_slin_id;
+		if (job.slices > 1 && (pool || (pool = softmix_mixing_pool_alloc()))) {
+			job.slices = softmix_mixing_pool_grow(pool, job.slices - 1, job.rate) + 1;
+		}
+		softmix_mixing_pool_run(pool, &trans_helper, &job);
 
-			/* Poke bridged channel thread just in case */
-			pthread_kill(bridge_channel->thread, SIGURG);
+		/* Anything that took longer than the interval itself has overrun, and
+		 * the channels will hear gaps. */
+		mix_time = ast_tvdiff_us(ast_tvnow(), start);
+		if (mix_time > softmix_data->internal_mixing_interval * 1000) {
+			softmix_data->overruns++;
 		}
+		softmix_data->worst_mix_time = MAX(softmix_data->worst_mix_time, mix_time);
 
 		update_all_rates = 0;
 		if (!stat_iteration_counter) {
+			report_softmix_stats(bridge, softmix_data, pool ? pool->num_workers : 0);
 			update_all_rates = analyse_softmix_stats(&stats, softmix_data);
 			stat_iteration_counter = SOFTMIX_STAT_INTERVAL;
 		}
@@ -904,6 +1445,7 @@ static int softmix_bridge_thread(struct ast_bridge *bridge)
 	res = 0;
 
 softmix_cleanup:
+	softmix_mixing_pool_destroy(pool);
 	softmix_translate_helper_destroy(&trans_helper);
 	softmix_mixing_array_destroy(&mixing_array);
 	if (softmix_data) {
@@ -925,8 +1467,232 @@ static struct ast_bridge_technology softmix_bridge = {
 	.poke = softmix_bridge_poke,
 };
 
+#ifdef TEST_FRAMEWORK
+/*! Samples per buffer in the kernel tests, 40 ms at 48 kHz */
+#define SOFTMIX_TEST_SAMPLES 1920
+/*! Buffers mixed per pass in the kernel tests */
+#define SOFTMIX_TEST_TALKERS 16
+/*! Passes timed per implementation */
+#define SOFTMIX_TEST_PASSES 2000
+
+static void softmix_test_fill(int16_t *buf, unsigned int samples, int loud)
+{
+	unsigned int i;
+
+	for (i = 0; i < samples; i++) {
+		/* Loud buffers hit the rails often, including -32768 itself */
+		buf[i] = loud ? (int16_t) (ast_random() & 0xFFFF) : (int16_t) ((ast_random() % 8192) - 4096);
+	}
+}
+
+/*!
+ * \brief Mix and remove every talker with a set of kernels
+ *
+ * This follows the mixing thread: all talkers are summed into one buffer,
+ * then each talker's own audio is removed from a copy of the sum.
+ */
+static void softmix_test_run(const struct softmix_kernels *kernels, int16_t talkers[][SOFTMIX_TEST_SAMPLES],
+	unsigned int samples, int16_t *mix, int16_t out[][SOFTMIX_TEST_SAMPLES])
+{
+	int i;
+
+	memset(mix, 0, samples * sizeof(*mix));
+	for (i = 0; i < SOFTMIX_TEST_TALKERS; i++) {
+		kernels->mix(mix, talkers[i], samples);
+	}
+	for (i = 0; i < SOFTMIX_TEST_TALKERS; i++) {
+		memcpy(out[i], mix, samples * sizeof(*mix));
+		kernels->minus(out[i], talkers[i], samples);
+	}
+}
+
+AST_TEST_DEFINE(softmix_kernels_exact)
+{
+	static const unsigned int lengths[] = { 0, 1, 7, 8, 15, 16, 17, 31, 33, 80, 160, 161, 320, 479, 960, SOFTMIX_TEST_SAMPLES };
+	const struct softmix_kernels *impls[] = {
+		&softmix_kernels_scalar,
+#ifdef SOFTMIX_HAVE_X86_SIMD
+		&softmix_kernels_sse2,
+		&softmix_kernels_avx2,
+#endif
+	};
+	int16_t (*talkers)[SOFTMIX_TEST_SAMPLES] = NULL;
+	int16_t (*expected)[SOFTMIX_TEST_SAMPLES] = NULL;
+	int16_t (*got)[SOFTMIX_TEST_SAMPLES] = NULL;
+	int16_t expected_mix[SOFTMIX_TEST_SAMPLES], got_mix[SOFTMIX_TEST_SAMPLES];
+	enum ast_test_result_state res = AST_TEST_PASS;
+	unsigned int i, j, k, loud;
+
+	switch (cmd) {
+	case TEST_INIT:
+		info->name = "softmix_kernels_exact";
+		info->category = "/bridges/bridge_softmix/";
+		info->summary = "vectorized mixing kernels match the scalar ones";
+		info->description =
+			"Mixes random quiet and clipping talkers with each mixing kernel the CPU "
+			"supports across odd and even buffer lengths, and checks both the mix and "
+			"every minus-one output are bit-exact with the scalar kernels. Reports the "
+			"time each implementation takes per mixing pass.";
+		return AST_TEST_NOT_RUN;
+	case TEST_EXECUTE:
+		break;
+	}
+
+	if (!(talkers = ast_calloc(SOFTMIX_TEST_TALKERS, sizeof(*talkers))) ||
+		!(expected = ast_calloc(SOFTMIX_TEST_TALKERS, sizeof(*expected))) ||
+		!(got = ast_calloc(SOFTMIX_TEST_TALKERS, sizeof(*got)))) {
+		res = AST_TEST_FAIL;
+		goto cleanup;
+	}
+
+	ast_test_status_update(test, "Using %s kernels\n", softmix_kernels->name);
+
+	for (i = 1; i < ARRAY_LEN(impls); i++) {
+		if (!softmix_kernels_usable(impls[i])) {
+			continue;
+		}
+		for (loud = 0; loud < 2; loud++) {
+			for (j = 0; j < ARRAY_LEN(lengths); j++) {
+				for (k = 0; k < SOFTMIX_TEST_TALKERS; k++) {
+					softmix_test_fill(talkers[k], SOFTMIX_TEST_SAMPLES, loud);
+				}
+				softmix_test_run(impls[0], talkers, lengths[j], expected_mix, expected);
+				softmix_test_run(impls[i], talkers, lengths[j], got_mix, got);
+				if (memcmp(expected_mix, got_mix, lengths[j] * sizeof(*got_mix))) {
+					ast_test_status_update(test, "%s mix differs from scalar with %u samples\n",
+						impls[i]->name, lengths[j]);
+					res = AST_TEST_FAIL;
+				}
+				for (k = 0; k < SOFTMIX_TEST_TALKERS; k++) {
+					if (memcmp(expected[k], got[k], lengths[j] * sizeof(*got[k]))) {
+						ast_test_status_update(test, "%s minus-one for talker %u differs from scalar with %u samples\n",
+							impls[i]->name, k, lengths[j]);
+						res = AST_TEST_FAIL;
+						break;
+					}
+				}
+			}
+		}
+	}
+
+	for (i = 0; i < ARRAY_LEN(impls); i++) {
+		struct timeval start;
+		int64_t usecs;
+
+		if (!softmix_kernels_usable(impls[i])) {
+			continue;
+		}
+		start = ast_tvnow();
+		for (j = 0; j < SOFTMIX_TEST_PASSES; j++) {
+			softmix_test_run(impls[i], talkers, 320, got_mix, got);
+		}
+		usecs = ast_tvdiff_us(ast_tvnow(), start);
+		ast_test_status_update(test, "%s: %.2f us per pass of %d talkers at 16 kHz\n",
+			impls[i]->name, (double) usecs / SOFTMIX_TEST_PASSES, SOFTMIX_TEST_TALKERS);
+	}
+
+cleanup:
+	ast_free(talkers);
+	ast_free(expected);
+	ast_free(got);
+
+	return res;
+}
+
+/*! \brief Rank talkers the way the mixing thread does, returning how many are mixed */
+static unsigned int softmix_test_rank(struct softmix_channel *channels, unsigned int num,
+	struct softmix_channel **talkers, unsigned int max_talkers)
+{
+	unsigned int i, mixed;
+
+	for (i = 0; i < num; i++) {
+		channels[i].talk_score = softmix_talker_score(&channels[i]);
+		talkers[i] = &channels[i];
+	}
+	mixed = softmix_rank_talkers(talkers, num, max_talkers);
+	for (i = 0; i < num; i++) {
+		talkers[i]->top_talker = i < mixed ? 1 : 0;
+	}
+
+	return mixed;
+}
+
+AST_TEST_DEFINE(softmix_top_talkers)
+{
+	struct softmix_channel channels[8];
+	struct softmix_channel *talkers[ARRAY_LEN(channels)];
+	enum ast_test_result_state res = AST_TEST_PASS;
+	unsigned int i, j, mixed;
+
+	switch (cmd) {
+	case TEST_INIT:
+		info->name = "softmix_top_talkers";
+		info->category = "/bridges/bridge_softmix/";
+		info->summary = "loudest talker selection";
+		info->description =
+			"Ranks talkers of increasing energy with a limit on the number mixed, "
+			"checking that the loudest are picked, that a mixed talker keeps its "
+			"place against one only slightly louder, and loses it to one much louder.";
+		return AST_TEST_NOT_RUN;
+	case TEST_EXECUTE:
+		break;
+	}
+
+	memset(channels, 0, sizeof(channels));
+	for (i = 0; i < ARRAY_LEN(channels); i++) {
+		channels[i].talk_energy = (i + 1) * 1000;
+	}
+
+	/* The three loudest are mixed, loudest first */
+	if ((mixed = softmix_test_rank(channels, ARRAY_LEN(channels), talkers, 3)) != 3) {
+		ast_test_status_update(test, "Expected 3 talkers mixed, got %u\n", mixed);
+		return AST_TEST_FAIL;
+	}
+	for (i = 0; i < mixed; i++) {
+		if (talkers[i] != &channels[ARRAY_LEN(channels) - 1 - i]) {
+			ast_test_status_update(test, "Talker %u of %u is not the %u loudest\n", i, mixed, i + 1);
+			res = AST_TEST_FAIL;
+		}
+	}
+
+	/* Slightly louder than the quietest mixed talker is not enough to replace it */
+	channels[0].talk_energy = channels[5].talk_energy * 5 / 4;
+	softmix_test_rank(channels, ARRAY_LEN(channels), talkers, 3);
+	if (channels[0].top_talker || !channels[5].top_talker) {
+		ast_test_status_update(test, "A slightly louder talker replaced a mixed one\n");
+		res = AST_TEST_FAIL;
+	}
+
+	/* Twice as loud is */
+	channels[0].talk_energy = channels[5].talk_energy * 2;
+	softmix_test_rank(channels, ARRAY_LEN(channels), talkers, 3);
+	if (!channels[0].top_talker || channels[5].top_talker) {
+		ast_test_status_update(test, "A much louder talker did not replace the quietest mixed one\n");
+		res = AST_TEST_FAIL;
+	}
+
+	/* A limit above the number of talkers mixes everyone */
+	if ((mixed = softmix_test_rank(channels, ARRAY_LEN(channels), talkers, 100)) != ARRAY_LEN(channels)) {
+		ast_test_status_update(test, "Expected all %d talkers mixed, got %u\n", (int) ARRAY_LEN(channels), mixed);
+		res = AST_TEST_FAIL;
+	}
+	for (i = 1; i < mixed; i++) {
+		for (j = 0; j < i; j++) {
+			if (talkers[j]->talk_score < talkers[i]->talk_score) {
+				ast_test_status_update(test, "Talkers are not ranked loudest first\n");
+				res = AST_TEST_FAIL;
+			}
+		}
+	}
+
+	return res;
+}
+#endif
+
 static int unload_module(void)
 {
+	AST_TEST_UNREGISTER(softmix_kernels_exact);
+	AST_TEST_UNREGISTER(softmix_top_talkers);
 	ast_format_cap_destroy(softmix_bridge.format_capabilities);
 	return ast_bridge_technology_unregister(&softmix_bridge);
 }
@@ -937,6 +1703,10 @@ static int load_module(void)
 	if (!(softmix_bridge.format_capabilities = ast_format_cap_alloc())) {
 		return AST_MODULE_LOAD_DECLINE;
 	}
+	softmix_kernels = softmix_kernels_select();
+	ast_verb(3, "Softmix is using %s mixing kernels\n", softmix_kernels->name);
+	AST_TEST_REGISTER(softmix_kernels_exact);
+	AST_TEST_REGISTER(softmix_top_talkers);
 	ast_format_cap_add(softmix_bridge.format_capabilities, ast_format_set(&tmp, AST_FORMAT_SLINEAR, 0));
 	return ast_bridge_technology_register(&softmix_bridge);
 }
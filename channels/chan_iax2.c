@@ -244,6 +244,12 @@ static int nochecksums = 0;
 
 #define DEFAULT_THREAD_COUNT 10
 #define DEFAULT_MAX_THREAD_COUNT 100
+#define DEFAULT_RECV_SHARDS 0
+#define MAX_RECV_SHARDS 64
+/*! Packets a receive shard may have outstanding before new ones are dropped */
+#define RECV_SHARD_QUEUE_MAX 1024
+/*! Datagrams pulled off the socket per wakeup when receive shards are in use */
+#define RECV_SHARD_BATCH 16
 #define DEFAULT_RETRY_TIME 1000
 #define MEMORY_SIZE 100
 #define DEFAULT_DROP 3
@@ -637,6 +643,7 @@ static int iaxmaxthreadcount = DEFAULT_MAX_THREAD_COUNT;
 static int iaxdynamicthreadcount = 0;
 static int iaxdynamicthreadnum = 0;
 static int iaxactivethreadcount = 0;
+static int iaxrecvshards = DEFAULT_RECV_SHARDS;
 
 struct iax_rr {
 	int jitter;
@@ -992,10 +999,15 @@ enum iax2_thread_iostate {
 enum iax2_thread_type {
 	IAX_THREAD_TYPE_POOL,
 	IAX_THREAD_TYPE_DYNAMIC,
+	/*! Owns every packet of the calls that hash to it, see iaxrecvshards */
+	IAX_THREAD_TYPE_SHARD,
 };
 
 struct iax2_pkt_buf {
 	AST_LIST_ENTRY(iax2_pkt_buf) entry;
+	/*! Where the packet came from; only filled in for receive shards */
+	struct sockaddr_in sin;
+	int fd;
 	size_t len;
 	unsigned char buf[1];
 };
@@ -1037,11 +1049,42 @@ struct iax2_thread {
 	} ffinfo;
 	/*! Queued up full frames for processing.  If more full frames arrive for
 	 *  a call which this thread is already processing a full frame for, they
-	 *  are queued up here. */
+	 *  are queued up here.  Receive shard threads queue every packet routed
+	 *  to them here, in arrival order. */
 	AST_LIST_HEAD_NOLOCK(, iax2_pkt_buf) full_frames;
+	/*! Receive shards only: packets waiting in full_frames */
+	unsigned int queued;
+	/*! Receive shards only: packets dropped because the queue was full */
+	unsigned int dropped;
 	unsigned char stop;
 };
 
+/*! Receive shard threads, indexed by the hash of the remote call */
+static struct iax2_thread **recv_shards;
+static int recv_shard_count;
+
+/*! \brief Trunk frames gathered during one trunk timer tick
+ *
+ * Every trunk peer's meta frame is copied in here by send_trunk() and the
+ * whole lot is handed to the kernel with a single sendmmsg() where the
+ * platform has one, rather than a sendto() per peer.
+ */
+#define TRUNK_BATCH_MAX 64
+#define TRUNK_BATCH_BYTES (128 * 1024)
+struct iax2_trunk_batch {
+	int sockfd;
+	unsigned int count;
+	size_t used;
+	struct sockaddr_in addrs[TRUNK_BATCH_MAX];
+	struct iovec iov[TRUNK_BATCH_MAX];
+	unsigned char data[TRUNK_BATCH_BYTES];
+};
+
+/*! Only touched from the network thread's timing_read() */
+static struct iax2_trunk_batch trunk_batch;
+static unsigned int trunk_batch_flushes;
+static unsigned int trunk_batch_frames;
+
 /* Thread lists */
 static AST_LIST_HEAD_STATIC(idle_list, iax2_thread);
 static AST_LIST_HEAD_STATIC(active_list, iax2_thread);
@@ -1188,7 +1231,7 @@ static int iax2_transfer(struct ast_channel *c, const char *dest);
 static int iax2_write(struct ast_channel *c, struct ast_frame *f);
 static int iax2_sched_add(struct ast_sched_context *sched, int when, ast_sched_cb callback, const void *data);
 
-static int send_trunk(struct iax2_trunk_peer *tpeer, struct timeval *now);
+static int send_trunk(struct iax2_trunk_peer *tpeer, struct timeval *now, struct iax2_trunk_batch *batch);
 static int send_command(struct chan_iax2_pvt *, char, int, unsigned int, const unsigned char *, int, int);
 static int send_command_final(struct chan_iax2_pvt *, char, int, unsigned int, const unsigned char *, int, int);
 static int send_command_immediate(struct chan_iax2_pvt *, char, int, unsigned int, const unsigned char *, int, int);
@@ -3412,6 +3455,86 @@ static int transmit_trunk(struct iax_frame *f, struct sockaddr_in *sin, int sock
 	return res;
 }
 
+/*! \brief Send everything gathered in a trunk batch and empty it */
+static int trunk_batch_flush(struct iax2_trunk_batch *batch)
+{
+	unsigned int sent = 0;
+	int res = 0;
+
+	if (!batch->count) {
+		return 0;
+	}
+
+#ifdef HAVE_SENDMMSG
+	{
+		struct mmsghdr msgs[TRUNK_BATCH_MAX];
+		unsigned int x;
+
+		memset(msgs, 0, sizeof(msgs[0]) * batch->count);
+		for (x = 0; x < batch->count; x++) {
+			msgs[x].msg_hdr.msg_name = &batch->addrs[x];
+			msgs[x].msg_hdr.msg_namelen = sizeof(batch->addrs[x]);
+			msgs[x].msg_hdr.msg_iov = &batch->iov[x];
+			msgs[x].msg_hdr.msg_iovlen = 1;
+		}
+		while (sent < batch->count) {
+			int n = sendmmsg(batch->sockfd, msgs + sent, batch->count - sent, 0);
+			if (n < 0) {
+				/* Skip the datagram the kernel choked on and carry on with the rest */
+				ast_debug(1, "Received error: %s\n", strerror(errno));
+				handle_error();
+				res = -1;
+				sent++;
+				continue;
+			}
+			sent += n;
+		}
+	}
+#else
+	for (; sent < batch->count; sent++) {
+		if (sendto(batch->sockfd, batch->iov[sent].iov_base, batch->iov[sent].iov_len, 0,
+			(struct sockaddr *) &batch->addrs[sent], sizeof(batch->addrs[sent])) < 0) {
+			ast_debug(1, "Received error: %s\n", strerror(errno));
+			handle_error();
+			res = -1;
+		}
+	}
+#endif
+
+	trunk_batch_flushes++;
+	trunk_batch_frames += batch->count;
+	batch->count = 0;
+	batch->used = 0;
+	return res;
+}
+
+/*! \brief Queue a trunk frame on a batch, flushing first if it will not fit
+ *
+ * Frames too large for the batch buffer are sent straight away.
+ */
+static int trunk_batch_add(struct iax2_trunk_batch *batch, struct iax_frame *f, struct sockaddr_in *sin, int sockfd)
+{
+	int res = 0;
+
+	if (f->datalen > sizeof(batch->data)) {
+		return transmit_trunk(f, sin, sockfd);
+	}
+	if (batch->count && (batch->sockfd != sockfd || batch->count == TRUNK_BATCH_MAX
+		|| batch->used + f->datalen > sizeof(batch->data))) {
+		res = trunk_batch_flush(batch);
+	}
+
+	batch->sockfd = sockfd;
+	memcpy(batch->data + batch->used, f->data, f->datalen);
+	batch->iov[batch->count].iov_base = batch->data + batch->used;
+	batch->iov[batch->count].iov_len = f->datalen;
+	memcpy(&batch->addrs[batch->count], sin, sizeof(*sin));
+	batch->used += f->datalen;
+	batch->count++;
+
+	return res;
+}
+
 static int send_packet(struct iax_frame *f)
 {
 	int res;
@@ -6271,7 +6394,7 @@ static int iax2_trunk_queue(struct chan_iax2_pvt *pvt, struct iax_frame *fr)
 		/* if we have enough for a full MTU, ship it now without waiting */
 		if (global_max_trunk_mtu > 0 && tpeer->trunkdatalen + f->datalen + 4 >= global_max_trunk_mtu) {
 			now = ast_tvnow();
-			send_trunk(tpeer, &now); 
+			send_trunk(tpeer, &now, NULL);
 			trunk_untimed ++; 
 		}
 
@@ -6899,6 +7022,7 @@ static char *handle_cli_iax2_show_threads(struct ast_cli_entry *e, int cmd, stru
 	struct iax2_thread *thread = NULL;
 	time_t t;
 	int threadcount = 0, dynamiccount = 0;
+	int x;
 	char type;
 
 	switch (cmd) {
@@ -6960,6 +7084,18 @@ static char *handle_cli_iax2_show_threads(struct ast_cli_entry *e, int cmd, stru
 	}
 	AST_LIST_UNLOCK(&dynamic_list);
 	ast_cli(a->fd, "%d of %d threads accounted for with %d dynamic threads\n", threadcount, iaxthreadcount, dynamiccount);
+	if (recv_shard_count) {
+		ast_cli(a->fd, "Receive Shards:\n");
+		for (x = 0; x < recv_shard_count; x++) {
+			thread = recv_shards[x];
+			ast_mutex_lock(&thread->lock);
+			ast_cli(a->fd, "Shard %d: state=%d, update=%d, actions=%d, queued=%u, dropped=%u\n",
+				thread->threadnum, thread->iostate, (int)(t - thread->checktime), thread->actions,
+				thread->queued, thread->dropped);
+			ast_mutex_unlock(&thread->lock);
+		}
+	}
+	ast_cli(a->fd, "Trunk batches: %u sent carrying %u frames\n", trunk_batch_flushes, trunk_batch_frames);
 	return CLI_SUCCESS;
 }
 
@@ -9221,7 +9357,7 @@ static int iax2_poke_peer_s(const void *data)
 	return 0;
 }
 
-static int send_trunk(struct iax2_trunk_peer *tpeer, struct timeval *now)
+static int send_trunk(struct iax2_trunk_peer *tpeer, struct timeval *now, struct iax2_trunk_batch *batch)
 {
 	int res = 0;
 	struct iax_frame *fr;
@@ -9250,7 +9386,11 @@ static int send_trunk(struct iax2_trunk_peer *tpeer, struct timeval *now)
 		/* Any appropriate call will do */
 		fr->data = fr->afdata;
 		fr->datalen = tpeer->trunkdatalen + sizeof(struct ast_iax2_meta_hdr) + sizeof(struct ast_iax2_meta_trunk_hdr);
-		res = transmit_trunk(fr, &tpeer->addr, tpeer->sockfd);
+		if (batch) {
+			res = trunk_batch_add(batch, fr, &tpeer->addr, tpeer->sockfd);
+		} else {
+			res = transmit_trunk(fr, &tpeer->addr, tpeer->sockfd);
+		}
 		calls = tpeer->calls;
 #if 0
 		ast_debug(1, "Trunking %d call chunks in %d bytes to %s:%d, ts=%d\n", calls, fr->datalen, ast_inet_ntoa(tpeer->addr.sin_addr), ntohs(tpeer->addr.sin_port), ntohl(mth->ts));
@@ -9302,7 +9442,7 @@ static int timing_read(int *id, int fd, short events, void *cbdata)
 			AST_LIST_REMOVE_CURRENT(list);
 			drop = tpeer;
 		} else {
-			res = send_trunk(tpeer, &now);
+			res = send_trunk(tpeer, &now, &trunk_batch);
 			trunk_timed++;
 			if (iaxtrunkdebug)
 				ast_verbose(" - Trunk peer (%s:%d) has %d call chunk%s in transit, %d bytes backloged and has hit a high water mark of %d bytes\n", ast_inet_ntoa(tpeer->addr.sin_addr), ntohs(tpeer->addr.sin_port), res, (res != 1) ? "s" : "", tpeer->trunkdatalen, tpeer->trunkdataalloc);
@@ -9314,6 +9454,8 @@ static int timing_read(int *id, int fd, short events, void *cbdata)
 	AST_LIST_TRAVERSE_SAFE_END;
 	AST_LIST_UNLOCK(&tpeers);
 
+	trunk_batch_flush(&trunk_batch);
+
 	if (drop) {
 		ast_mutex_lock(&drop->lock);
 		/* Once we have this lock, we're sure nobody else is using it or could use it once we release it, 
@@ -9715,6 +9857,124 @@ static void defer_full_frame(struct iax2_thread *from_here, struct iax2_thread *
 	ast_mutex_unlock(&to_here->lock);
 }
 
+/*! \brief Pick the receive shard that owns the call a packet belongs to
+ *
+ * Full and mini frames both carry the sender's call number in their first
+ * two bytes, so every frame of a call from a given peer lands on the same
+ * shard and is processed in arrival order.  Meta trunk frames carry many
+ * calls and are keyed on the peer address alone.
+ */
+static unsigned int recv_shard_index(const unsigned char *buf, ssize_t len, const struct sockaddr_in *sin, int count)
+{
+	unsigned int callno = 0;
+	unsigned int hash;
+
+	if (len >= 4) {
+		callno = (buf[0] << 8) | buf[1];
+		if (callno) {
+			callno &= ~IAX_FLAG_FULL;
+		} else if (buf[2] & 0x80) {
+			/* Video mini frame */
+			callno = ((buf[2] << 8) | buf[3]) & ~0x8000;
+		}
+	}
+
+	hash = ntohl(sin->sin_addr.s_addr) * 2654435761U;
+	hash ^= (ntohs(sin->sin_port) << 16) | callno;
+	hash *= 2654435761U;
+
+	return (hash >> 16) % count;
+}
+
+/*! \brief Hand a received datagram to the shard thread that owns its call */
+static void recv_shard_queue(const unsigned char *buf, ssize_t len, const struct sockaddr_in *sin, int fd)
+{
+	struct iax2_thread *shard = recv_shards[recv_shard_index(buf, len, sin, recv_shard_count)];
+	struct iax2_pkt_buf *pkt_buf;
+
+	ast_mutex_lock(&shard->lock);
+	if (shard->queued >= RECV_SHARD_QUEUE_MAX) {
+		/* Full frames will be retransmitted, media is better late than never */
+		shard->dropped++;
+		ast_mutex_unlock(&shard->lock);
+		return;
+	}
+	ast_mutex_unlock(&shard->lock);
+
+	if (!(pkt_buf = ast_malloc(sizeof(*pkt_buf) + len))) {
+		return;
+	}
+	memcpy(&pkt_buf->sin, sin, sizeof(pkt_buf->sin));
+	pkt_buf->fd = fd;
+	pkt_buf->len = len;
+	memcpy(pkt_buf->buf, buf, len);
+
+	ast_mutex_lock(&shard->lock);
+	AST_LIST_INSERT_TAIL(&shard->full_frames, pkt_buf, entry);
+	if (!shard->queued++) {
+		ast_cond_signal(&shard->cond);
+	}
+	ast_mutex_unlock(&shard->lock);
+}
+
+/*! \brief Read path used when receive shards are configured
+ *
+ * Drains up to RECV_SHARD_BATCH datagrams per wakeup and routes each one to
+ * the shard owning its call, so no idle thread hunt or active list scan is
+ * needed to keep full frames for the same call in order.
+ */
+static int socket_read_sharded(int fd)
+{
+	static unsigned char bufs[RECV_SHARD_BATCH][4096];
+	static struct sockaddr_in sins[RECV_SHARD_BATCH];
+	ssize_t lens[RECV_SHARD_BATCH];
+	int count = 0;
+	int x;
+
+#ifdef HAVE_RECVMMSG
+	struct mmsghdr msgs[RECV_SHARD_BATCH];
+	struct iovec iov[RECV_SHARD_BATCH];
+
+	memset(msgs, 0, sizeof(msgs));
+	for (x = 0; x < RECV_SHARD_BATCH; x++) {
+		iov[x].iov_base = bufs[x];
+		iov[x].iov_len = sizeof(bufs[x]);
+		msgs[x].msg_hdr.msg_name = &sins[x];
+		msgs[x].msg_hdr.msg_namelen = sizeof(sins[x]);
+		msgs[x].msg_hdr.msg_iov = &iov[x];
+		msgs[x].msg_hdr.msg_iovlen = 1;
+	}
+	count = recvmmsg(fd, msgs, RECV_SHARD_BATCH, MSG_DONTWAIT, NULL);
+	for (x = 0; x < count; x++) {
+		lens[x] = msgs[x].msg_len;
+	}
+#else
+	socklen_t len = sizeof(sins[0]);
+
+	if ((lens[0] = recvfrom(fd, bufs[0], sizeof(bufs[0]), 0, (struct sockaddr *) &sins[0], &len)) >= 0) {
+		count = 1;
+	} else {
+		count = -1;
+	}
+#endif
+
+	if (count < 0) {
+		if (errno != ECONNREFUSED && errno != EAGAIN)
+			ast_log(LOG_WARNING, "Error: %s\n", strerror(errno));
+		handle_error();
+		return 1;
+	}
+
+	for (x = 0; x < count; x++) {
+		if (test_losspct && ((100.0 * ast_random() / (RAND_MAX + 1.0)) < test_losspct)) { /* simulate random loss condition */
+			continue;
+		}
+		recv_shard_queue(bufs[x], lens[x], &sins[x], fd);
+	}
+
+	return 1;
+}
+
 static int socket_read(int *id, int fd, short events, void *cbdata)
 {
 	struct iax2_thread *thread;
@@ -9723,6 +9983,10 @@ static int socket_read(int *id, int fd, short events, void *cbdata)
 	static time_t last_errtime = 0;
 	struct ast_iax2_full_hdr *fh;
 
+	if (recv_shard_count) {
+		return socket_read_sharded(fd);
+	}
+
 	if (!(thread = find_idle_thread())) {
 		time(&t);
 		if (t != last_errtime)
@@ -12316,6 +12580,108 @@ static struct ast_channel *iax2_request(const char *type, struct ast_format_cap
 	return c;
 }
 
+/*! \brief Receive shard thread: process packets for the calls it owns, in order */
+static void *iax2_shard_thread(void *data)
+{
+	struct iax2_thread *thread = data;
+	struct iax2_pkt_buf *pkt_buf;
+
+	ast_atomic_fetchadd_int(&iaxactivethreadcount, 1);
+
+	for (;;) {
+		ast_mutex_lock(&thread->lock);
+		while (!thread->stop && !(pkt_buf = AST_LIST_REMOVE_HEAD(&thread->full_frames, entry))) {
+			ast_cond_wait(&thread->cond, &thread->lock);
+		}
+		if (thread->stop) {
+			ast_mutex_unlock(&thread->lock);
+			break;
+		}
+		thread->queued--;
+		ast_mutex_unlock(&thread->lock);
+
+		thread->actions++;
+		thread->iostate = IAX_IOSTATE_PROCESSING;
+		thread->buf = pkt_buf->buf;
+		thread->buf_len = pkt_buf->len;
+		thread->buf_size = pkt_buf->len + 1;
+		thread->iofd = pkt_buf->fd;
+		memcpy(&thread->iosin, &pkt_buf->sin, sizeof(thread->iosin));
+		socket_process(thread);
+		thread->buf = NULL;
+		ast_free(pkt_buf);
+		time(&thread->checktime);
+		thread->iostate = IAX_IOSTATE_IDLE;
+	}
+
+	ast_atomic_fetchadd_int(&iaxactivethreadcount, -1);
+
+	return NULL;
+}
+
+static void stop_recv_shards(void)
+{
+	struct iax2_pkt_buf *pkt_buf;
+	int x;
+
+	for (x = 0; x < recv_shard_count; x++) {
+		struct iax2_thread *thread = recv_shards[x];
+
+		ast_mutex_lock(&thread->lock);
+		thread->stop = 1;
+		ast_cond_signal(&thread->cond);
+		ast_mutex_unlock(&thread->lock);
+		pthread_join(thread->threadid, NULL);
+
+		while ((pkt_buf = AST_LIST_REMOVE_HEAD(&thread->full_frames, entry))) {
+			ast_free(pkt_buf);
+		}
+		ast_mutex_destroy(&thread->lock);
+		ast_cond_destroy(&thread->cond);
+		ast_free(thread);
+	}
+	ast_free(recv_shards);
+	recv_shards = NULL;
+	recv_shard_count = 0;
+}
+
+static int start_recv_shards(void)
+{
+	struct iax2_thread *thread;
+	int x;
+
+	if (!iaxrecvshards) {
+		return 0;
+	}
+	if (!(recv_shards = ast_calloc(iaxrecvshards, sizeof(*recv_shards)))) {
+		return -1;
+	}
+	for (x = 0; x < iaxrecvshards; x++) {
+		if (!(thread = ast_calloc(1, sizeof(*thread)))) {
+			break;
+		}
+		thread->type = IAX_THREAD_TYPE_SHARD;
+		thread->threadnum = x + 1;
+		ast_mutex_init(&thread->lock);
+		ast_cond_init(&thread->cond, NULL);
+		if (ast_pthread_create_background(&thread->threadid, NULL, iax2_shard_thread, thread)) {
+			ast_log(LOG_WARNING, "Failed to create new thread!\n");
+			ast_mutex_destroy(&thread->lock);
+			ast_cond_destroy(&thread->cond);
+			ast_free(thread);
+			break;
+		}
+		recv_shards[recv_shard_count++] = thread;
+	}
+	if (!recv_shard_count) {
+		ast_free(recv_shards);
+		recv_shards = NULL;
+		return -1;
+	}
+	ast_verb(2, "%d receive shard threads started\n", recv_shard_count);
+	return 0;
+}
+
 static void *network_thread(void *ignore)
 {
 	if (timer) {
@@ -12364,6 +12730,9 @@ static int start_network_thread(void)
 			AST_LIST_UNLOCK(&idle_list);
 		}
 	}
+	if (start_recv_shards()) {
+		ast_log(LOG_WARNING, "Unable to start receive shards, using the helper threads for I/O\n");
+	}
 	if (ast_pthread_create_background(&netthreadid, NULL, network_thread, NULL)) {
 		ast_log(LOG_ERROR, "Failed to create new thread!\n");
 		return -1;
@@ -13282,6 +13651,20 @@ static int set_config(const char *config_file, int reload)
 					iaxthreadcount = 256;
 				}
 			}
+		} else if (!strcasecmp(v->name, "iaxrecvshards")) {
+			if (reload) {
+				if (atoi(v->value) != iaxrecvshards)
+					ast_log(LOG_NOTICE, "Ignoring any changes to iaxrecvshards during reload\n");
+			} else {
+				iaxrecvshards = atoi(v->value);
+				if (iaxrecvshards < 0) {
+					ast_log(LOG_NOTICE, "iaxrecvshards must be at least 0.\n");
+					iaxrecvshards = 0;
+				} else if (iaxrecvshards > MAX_RECV_SHARDS) {
+					ast_log(LOG_NOTICE, "Limiting iaxrecvshards to %d\n", MAX_RECV_SHARDS);
+					iaxrecvshards = MAX_RECV_SHARDS;
+				}
+			}
 		} else if (!strcasecmp(v->name, "iaxmaxthreadcount")) {
 			if (reload) {
 				AST_LIST_LOCK(&dynamic_list);
@@ -14451,6 +14834,145 @@ AST_TEST_DEFINE(test_iax2_users_get)
 
 	return AST_TEST_PASS;
 }
+
+AST_TEST_DEFINE(test_iax2_recv_shard_affinity)
+{
+	struct sockaddr_in sin = { .sin_family = AF_INET, };
+	unsigned char full[sizeof(struct ast_iax2_full_hdr)] = { 0, };
+	unsigned char mini[sizeof(struct ast_iax2_mini_hdr)] = { 0, };
+	struct ast_iax2_full_hdr *fh = (struct ast_iax2_full_hdr *) full;
+	struct ast_iax2_mini_hdr *mh = (struct ast_iax2_mini_hdr *) mini;
+	int hits[8] = { 0, };
+	int callno, x;
+
+	switch (cmd) {
+	case TEST_INIT:
+		info->name = "iax2_recv_shard_affinity";
+		info->category = "/channels/chan_iax2/";
+		info->summary = "IAX2 receive shard selection";
+		info->description =
+			"Checks that full and mini frames for the same call are routed "
+			"to the same receive shard and that calls spread over all shards.";
+		return AST_TEST_NOT_RUN;
+	case TEST_EXECUTE:
+		break;
+	}
+
+	sin.sin_addr.s_addr = htonl(0x7f000001);
+	sin.sin_port = htons(IAX_DEFAULT_PORTNO);
+
+	for (callno = 1; callno < IAX_MAX_CALLS; callno++) {
+		unsigned int shard;
+
+		fh->scallno = htons(callno | IAX_FLAG_FULL);
+		mh->callno = htons(callno);
+		shard = recv_shard_index(full, sizeof(full), &sin, ARRAY_LEN(hits));
+		if (shard != recv_shard_index(mini, sizeof(mini), &sin, ARRAY_LEN(hits))) {
+			ast_test_status_update(test, "Full and mini frames for call %d went to different shards\n", callno);
+			return AST_TEST_FAIL;
+		}
+		hits[shard]++;
+	}
+
+	for (x = 0; x < ARRAY_LEN(hits); x++) {
+		/* Allow a generous skew, this only guards against a degenerate hash */
+		if (hits[x] < IAX_MAX_CALLS / ARRAY_LEN(hits) / 2) {
+			ast_test_status_update(test, "Shard %d only received %d of %d calls\n", x, hits[x], IAX_MAX_CALLS - 1);
+			return AST_TEST_FAIL;
+		}
+	}
+
+	return AST_TEST_PASS;
+}
+
+AST_TEST_DEFINE(test_iax2_trunk_batch_benchmark)
+{
+	struct sockaddr_in sin = { .sin_family = AF_INET, };
+	socklen_t sinlen = sizeof(sin);
+	struct iax2_trunk_batch *batch = NULL;
+	struct iax_frame *f = NULL;
+	unsigned char drain[2048];
+	int rxfd = -1, txfd = -1;
+	struct timeval start;
+	int64_t unbatched_ms, batched_ms;
+	int frames = 20000, framelen = 1650;
+	int x, received;
+	enum ast_test_result_state res = AST_TEST_FAIL;
+
+	switch (cmd) {
+	case TEST_INIT:
+		info->name = "iax2_trunk_batch_benchmark";
+		info->category = "/channels/chan_iax2/";
+		info->summary = "IAX2 trunk send batching benchmark";
+		info->description =
+			"Sends trunk sized datagrams over loopback one sendto() at a time and "
+			"then through a trunk batch, and reports the frame rate of each.";
+		return AST_TEST_NOT_RUN;
+	case TEST_EXECUTE:
+		break;
+	}
+
+	sin.sin_addr.s_addr = htonl(INADDR_LOOPBACK);
+	if ((rxfd = socket(AF_INET, SOCK_DGRAM, 0)) < 0 || (txfd = socket(AF_INET, SOCK_DGRAM, 0)) < 0
+		|| bind(rxfd, (struct sockaddr *) &sin, sizeof(sin))
+		|| getsockname(rxfd, (struct sockaddr *) &sin, &sinlen)) {
+		ast_test_status_update(test, "Unable to set up loopback sockets: %s\n", strerror(errno));
+		goto cleanup;
+	}
+	fcntl(rxfd, F_SETFL, fcntl(rxfd, F_GETFL) | O_NONBLOCK);
+
+	if (!(batch = ast_calloc(1, sizeof(*batch))) || !(f = ast_calloc(1, sizeof(*f) + framelen))) {
+		goto cleanup;
+	}
+	f->data = f->afdata;
+	f->datalen = framelen;
+
+	start = ast_tvnow();
+	for (x = 0, received = 0; x < frames; x++) {
+		transmit_trunk(f, &sin, txfd);
+		if (!((x + 1) % TRUNK_BATCH_MAX)) {
+			while (recv(rxfd, drain, sizeof(drain), 0) > 0) {
+				received++;
+			}
+		}
+	}
+	while (recv(rxfd, drain, sizeof(drain), 0) > 0) {
+		received++;
+	}
+	unbatched_ms = ast_tvdiff_ms(ast_tvnow(), start);
+	ast_test_status_update(test, "sendto(): %d frames (%d received) in %" PRId64 " ms\n",
+		frames, received, unbatched_ms);
+
+	start = ast_tvnow();
+	for (x = 0, received = 0; x < frames; x++) {
+		trunk_batch_add(batch, f, &sin, txfd);
+		if (!batch->count) {
+			while (recv(rxfd, drain, sizeof(drain), 0) > 0) {
+				received++;
+			}
+		}
+	}
+	trunk_batch_flush(batch);
+	while (recv(rxfd, drain, sizeof(drain), 0) > 0) {
+		received++;
+	}
+	batched_ms = ast_tvdiff_ms(ast_tvnow(), start);
+	ast_test_status_update(test, "batched:  %d frames (%d received) in %" PRId64 " ms\n",
+		frames, received, batched_ms);
+
+	res = AST_TEST_PASS;
+
+cleanup:
+	if (rxfd > -1) {
+		close(rxfd);
+	}
+	if (txfd > -1) {
+		close(txfd);
+	}
+	ast_free(batch);
+	ast_free(f);
+	return res;
+}
 #endif
 
 static void cleanup_thread_list(void *head)
@@ -14502,6 +15024,7 @@ static int __unload_module(void)
 	}
 
 	/* Call for all threads to halt */
+	stop_recv_shards();
 	cleanup_thread_list(&idle_list);
 	cleanup_thread_list(&active_list);
 	cleanup_thread_list(&dynamic_list);
@@ -14521,6 +15044,8 @@ static int __unload_module(void)
 #ifdef TEST_FRAMEWORK
 	AST_TEST_UNREGISTER(test_iax2_peers_get);
 	AST_TEST_UNREGISTER(test_iax2_users_get);
+	AST_TEST_UNREGISTER(test_iax2_recv_shard_affinity);
+	AST_TEST_UNREGISTER(test_iax2_trunk_batch_benchmark);
 #endif
 	ast_data_unregister(NULL);
 	ast_cli_unregister_multiple(cli_iax2, ARRAY_LEN(cli_iax2));
@@ -14930,6 +15455,8 @@ static int load_module(void)
 #ifdef TEST_FRAMEWORK
 	AST_TEST_REGISTER(test_iax2_peers_get);
 	AST_TEST_REGISTER(test_iax2_users_get);
+	AST_TEST_REGISTER(test_iax2_recv_shard_affinity);
+	AST_TEST_REGISTER(test_iax2_trunk_batch_benchmark);
 #endif
 
 	/* Register AstData providers */
@@ -265,6 +265,7 @@ ASTERISK_FILE_VERSION(__FILE__, "$Revision: 397826 $")
 #include "asterisk/data.h"
 #include "asterisk/aoc.h"
 #include "asterisk/message.h"
+#include "asterisk/taskprocessor.h"
 #include "sip/include/sip.h"
 #include "sip/include/globals.h"
 #include "sip/include/config_parser.h"
@@ -566,6 +567,30 @@ static int unauth_sessions = 0;
 static int authlimit = DEFAULT_AUTHLIMIT;
 static int authtimeout = DEFAULT_AUTHTIMEOUT;
 
+/*! \name Asynchronous REGISTER processing
+ * Incoming REGISTER requests are parsed on the receiving thread and then
+ * handed to a pool of taskprocessors for authentication and persistence.
+ * \{ */
+static int global_regworkers = DEFAULT_REGWORKERS;           /*!< Number of registration workers, 0 processes inline */
+static int global_regqueuelimit = DEFAULT_REGQUEUELIMIT;     /*!< Pending registrations before we answer 503 */
+static int global_regretryafter = DEFAULT_REGRETRYAFTER;     /*!< Retry-After (seconds) sent with the 503 */
+static struct ast_taskprocessor **reg_workers;               /*!< The registration worker pool */
+static int reg_workers_count;                                /*!< Number of entries in reg_workers */
+static int reg_tasks_pending;                                /*!< Registrations queued or being processed */
+static int reg_tasks_rejected;                               /*!< Registrations refused because the queue was full */
+AST_RWLOCK_DEFINE_STATIC(reg_workers_lock);                  /*!< Protects reg_workers and reg_workers_count */
+
+/*! \brief A registration worker replaced by a reload, let go of once its backlog is done */
+struct sip_reg_retiree {
+	struct ast_taskprocessor *worker;
+	int done;                                            /*!< Set by the sentinel queued behind the backlog */
+	AST_LIST_ENTRY(sip_reg_retiree) list;
+};
+static AST_LIST_HEAD_NOLOCK_STATIC(reg_retirees, sip_reg_retiree);
+AST_MUTEX_DEFINE_STATIC(reg_retirees_lock);                  /*!< Protects reg_retirees */
+static ast_cond_t reg_retirees_cond;                         /*!< Signalled when a retiree is done */
+/*! \} */
+
 /*! \brief Global jitterbuffer configuration - by default, jb is disabled
  *  \note Values shown here match the defaults shown in sip.conf.sample */
 static struct ast_jb_conf default_jbconf =
@@ -741,6 +766,25 @@ static unsigned int global_autoframing; /*!< Turn autoframing on or off. */
 static int global_qualifyfreq;          /*!< Qualify frequency */
 static int global_qualify_gap;          /*!< Time between our group of peer pokes */
 static int global_qualify_peers;        /*!< Number of peers to poke at a given time */
+static int global_qualify_rate;         /*!< Max qualify pokes per second, 0 for no budget */
+
+/*! \name Qualify scheduler
+ * When a qualify budget (qualifyrate) is configured, pokes are spread over the
+ * qualify interval, jittered, rate limited with a token bucket and unreachable
+ * peers back off exponentially.
+ * \{ */
+AST_MUTEX_DEFINE_STATIC(qualify_lock);      /*!< Protects the token bucket */
+static struct timeval qualify_refill;       /*!< When the token bucket was last refilled */
+static int qualify_tokens;                  /*!< Available pokes, in thousandths */
+
+/*! \brief Upper bounds (ms) of the qualify latency histogram buckets */
+static const int qualify_hist_bounds[] = { 5, 10, 20, 50, 100, 200, 500, 1000, 2000, 5000, INT_MAX };
+static int qualify_hist[ARRAY_LEN(qualify_hist_bounds)];    /*!< Qualify latency histogram */
+static int qualify_max_latency;             /*!< Worst latency seen */
+static int qualify_sent;                    /*!< OPTIONS pokes sent */
+static int qualify_timeouts;                /*!< Pokes that went unanswered */
+static int qualify_deferred;                /*!< Pokes pushed back because the budget was spent (overruns) */
+/*! \} */
 
 static enum st_mode global_st_mode;           /*!< Mode of operation for Session-Timers           */
 static enum st_refresher_param global_st_refresher; /*!< Session-Timer refresher                        */
@@ -1102,6 +1146,30 @@ struct ao2_container *dialogs_needdestroy;
  */
 struct ao2_container *dialogs_rtpcheck;
 
+/*!
+ * \details
+ * Index of established dialogs by Call-ID plus both tags.  In pedantic mode
+ * several dialogs may share a Call-ID (forks, merged requests), and matching
+ * an in-dialog request used to mean iterating and locking every one of them.
+ * This index resolves requests and responses carrying both tags with a single
+ * hash probe.
+ */
+static struct ao2_container *dialogs_by_tags;
+
+/*!
+ * \brief Entry in the dialogs_by_tags index
+ *
+ * The two tags are stored in a canonical order so that requests (from-tag is
+ * theirs) and responses (from-tag is ours) map to the same entry.
+ */
+struct sip_dialog_tag_entry {
+	struct sip_pvt *dialog;         /*!< Indexed dialog (holds a reference) */
+	const char *callid;
+	const char *tag1;               /*!< Lesser of the two tags */
+	const char *tag2;               /*!< Greater of the two tags */
+	char buf[0];
+};
+
 /*!
  * \details
  * Here we implement the container for dialogs (sip_pvt), defining
@@ -1365,6 +1433,7 @@ static int restart_monitor(void);
 static void peer_mailboxes_to_str(struct ast_str **mailbox_str, struct sip_peer *peer);
 static struct ast_variable *copy_vars(struct ast_variable *src);
 static int dialog_find_multiple(void *obj, void *arg, int flags);
+static void dialog_tag_index_remove(struct sip_pvt *dialog);
 static struct ast_channel *sip_pvt_lock_full(struct sip_pvt *pvt);
 /* static int sip_addrcmp(char *name, struct sockaddr_in *sin);	Support for peer matching */
 static int sip_refer_allocate(struct sip_pvt *p);
@@ -1559,6 +1628,9 @@ static int handle_request_invite(struct sip_pvt *p, struct sip_request *req, int
 static int handle_request_refer(struct sip_pvt *p, struct sip_request *req, int debug, uint32_t seqno, int *nounlock);
 static int handle_request_bye(struct sip_pvt *p, struct sip_request *req);
 static int handle_request_register(struct sip_pvt *p, struct sip_request *req, struct ast_sockaddr *sin, const char *e);
+static int queue_request_register(struct sip_pvt *p, struct sip_request *req, struct ast_sockaddr *addr);
+static void sip_reg_workers_build(int count);
+static void sip_reg_workers_reap(int wait);
 static int handle_request_cancel(struct sip_pvt *p, struct sip_request *req);
 static int handle_request_message(struct sip_pvt *p, struct sip_request *req, struct ast_sockaddr *addr, const char *e);
 static int handle_request_subscribe(struct sip_pvt *p, struct sip_request *req, struct ast_sockaddr *addr, uint32_t seqno, const char *e);
@@ -3262,6 +3334,7 @@ void dialog_unlink_all(struct sip_pvt *dialog)
 	ao2_t_unlink(dialogs, dialog, "unlinking dialog via ao2_unlink");
 	ao2_t_unlink(dialogs_needdestroy, dialog, "unlinking dialog_needdestroy via ao2_unlink");
 	ao2_t_unlink(dialogs_rtpcheck, dialog, "unlinking dialog_rtpcheck via ao2_unlink");
+	dialog_tag_index_remove(dialog);
 
 	/* Unlink us from the owner (channel) if we have one */
 	owner = sip_pvt_lock_full(dialog);
@@ -5005,6 +5078,8 @@ static void sip_destroy_peer_fn(void *peer)
 /*! \brief Destroy peer object from memory */
 static void sip_destroy_peer(struct sip_peer *peer)
 {
+	int x;
+
 	ast_debug(3, "Destroying SIP peer %s\n", peer->name);
 
 	/*
@@ -5060,6 +5135,13 @@ static void sip_destroy_peer(struct sip_peer *peer)
 	ast_string_field_free_memory(peer);
 
 	peer->caps = ast_format_cap_destroy(peer->caps);
+
+	for (x = 0; x < ARRAY_LEN(peer->sdp_templates); x++) {
+		if (peer->sdp_templates[x]) {
+			ao2_t_ref(peer->sdp_templates[x], -1, "Removing peer SDP template");
+			peer->sdp_templates[x] = NULL;
+		}
+	}
 }
 
 /*! \brief Update peer data in database (if used) */
@@ -7667,6 +7749,10 @@ static struct ast_channel *sip_new(struct sip_pvt *i, int state, const char *tit
 	}
 	if (i->rtp) {
 		ast_jb_configure(tmp, &global_jbconf);
+		ast_rtp_instance_set_telemetry_peer(i->rtp, i->peername);
+	}
+	if (i->vrtp) {
+		ast_rtp_instance_set_telemetry_peer(i->vrtp, i->peername);
 	}
 
 	if (!i->relatedpeer) {
@@ -8640,6 +8726,116 @@ static struct ast_channel *sip_pvt_lock_full(struct sip_pvt *pvt)
 	return pvt->owner;
 }
 
+/*! \brief Fill in a dialogs_by_tags key, ordering the tags canonically */
+static void dialog_tag_key_init(struct sip_dialog_tag_entry *key, const char *callid, const char *fromtag, const char *totag)
+{
+	int swap = strcmp(fromtag, totag) > 0;
+
+	key->callid = callid;
+	key->tag1 = swap ? totag : fromtag;
+	key->tag2 = swap ? fromtag : totag;
+}
+
+static int dialog_tag_hash_cb(const void *obj, const int flags)
+{
+	const struct sip_dialog_tag_entry *entry = obj;
+
+	return abs(ast_str_case_hash(entry->callid) ^ ast_str_hash(entry->tag1) ^ (ast_str_hash(entry->tag2) << 1));
+}
+
+static int dialog_tag_cmp_cb(void *obj, void *arg, int flags)
+{
+	struct sip_dialog_tag_entry *entry = obj, *key = arg;
+
+	return (!strcasecmp(entry->callid, key->callid) && !strcmp(entry->tag1, key->tag1)
+		&& !strcmp(entry->tag2, key->tag2)) ? CMP_MATCH | CMP_STOP : 0;
+}
+
+static void dialog_tag_entry_destructor(void *obj)
+{
+	struct sip_dialog_tag_entry *entry = obj;
+
+	dialog_unref(entry->dialog, "dialog tag index entry destroyed");
+}
+
+/*!
+ * \brief Look up a dialog in the Call-ID/tags index
+ * \return a reference to the indexed dialog (unlocked), or NULL
+ */
+static struct sip_pvt *dialog_tag_index_find(const char *callid, const char *fromtag, const char *totag)
+{
+	struct sip_dialog_tag_entry key, *entry;
+	struct sip_pvt *dialog;
+
+	dialog_tag_key_init(&key, callid, fromtag, totag);
+	if (!(entry = ao2_t_find(dialogs_by_tags, &key, OBJ_POINTER, "find dialog tag entry"))) {
+		return NULL;
+	}
+	dialog = dialog_ref(entry->dialog, "found dialog in tag index");
+	ao2_t_ref(entry, -1, "done with dialog tag entry");
+
+	return dialog;
+}
+
+/*!
+ * \brief Index a dialog under a Call-ID and pair of tags
+ *
+ * A dialog has at most one entry, an older one (from before its tags
+ * changed) is replaced.  A dialog already unlinked by dialog_unlink_all()
+ * is not indexed again, the check is made under the same lock.
+ */
+static void dialog_tag_index_add(struct sip_pvt *dialog, const char *callid, const char *fromtag, const char *totag)
+{
+	struct sip_dialog_tag_entry key, *entry;
+	size_t callid_len = strlen(callid) + 1;
+	size_t tag1_len, tag2_len;
+
+	dialog_tag_key_init(&key, callid, fromtag, totag);
+	tag1_len = strlen(key.tag1) + 1;
+	tag2_len = strlen(key.tag2) + 1;
+	if (!(entry = ao2_t_alloc(sizeof(*entry) + callid_len + tag1_len + tag2_len, dialog_tag_entry_destructor, "allocate dialog tag entry"))) {
+		return;
+	}
+	entry->callid = memcpy(entry->buf, callid, callid_len);
+	entry->tag1 = memcpy(entry->buf + callid_len, key.tag1, tag1_len);
+	entry->tag2 = memcpy(entry->buf + callid_len + tag1_len, key.tag2, tag2_len);
+	entry->dialog = dialog_ref(dialog, "dialog tag index entry");
+
+	ao2_lock(dialogs_by_tags);
+	if (dialog->tag_unlinked) {
+		ao2_unlock(dialogs_by_tags);
+		ao2_t_ref(entry, -1, "dialog was unlinked, drop new dialog tag entry");
+		return;
+	}
+	if (dialog->tag_entry) {
+		ao2_t_unlink(dialogs_by_tags, dialog->tag_entry, "replace dialog tag entry");
+		ao2_t_ref(dialog->tag_entry, -1, "drop old dialog tag entry");
+	}
+	/* If another dialog claimed the same key, the newest match wins */
+	ao2_t_callback(dialogs_by_tags, OBJ_POINTER | OBJ_UNLINK | OBJ_NODATA, dialog_tag_cmp_cb, &key, "unlink dialog tag entry with same key");
+	ao2_t_link(dialogs_by_tags, entry, "link dialog tag entry");
+	dialog->tag_entry = entry;
+	ao2_unlock(dialogs_by_tags);
+}
+
+/*! \brief Remove a dialog from the Call-ID/tags index for good */
+static void dialog_tag_index_remove(struct sip_pvt *dialog)
+{
+	struct sip_dialog_tag_entry *entry;
+
+	ao2_lock(dialogs_by_tags);
+	dialog->tag_unlinked = 1;
+	if ((entry = dialog->tag_entry)) {
+		dialog->tag_entry = NULL;
+		ao2_t_unlink(dialogs_by_tags, entry, "unlink dialog tag entry");
+	}
+	ao2_unlock(dialogs_by_tags);
+
+	if (entry) {
+		ao2_t_ref(entry, -1, "drop dialog tag entry");
+	}
+}
+
 /*! \brief find or create a dialog structure for an incoming SIP message.
  * Connect incoming SIP message to current dialog or create new dialog structure
  * Returns a reference to the sip_pvt object, remember to give it back once done.
@@ -8715,11 +8911,7 @@ static struct sip_pvt *find_call(struct sip_request *req, struct ast_sockaddr *a
 		struct sip_pvt *fork_pvt = NULL;
 		struct match_req_args args = { 0, };
 		int found;
-		struct ao2_iterator *iterator = ao2_t_callback(dialogs,
-			OBJ_POINTER | OBJ_MULTIPLE,
-			dialog_find_multiple,
-			&tmp_dialog,
-			"pedantic ao2_find in dialogs");
+		struct ao2_iterator *iterator;
 		struct sip_via *via = NULL;
 
 		args.method = req->method;
@@ -8748,6 +8940,25 @@ static struct sip_pvt *find_call(struct sip_request *req, struct ast_sockaddr *a
 			}
 		}
 
+		/* Messages within an established dialog carry both tags, try the index first */
+		if (!ast_strlen_zero(totag) && (sip_pvt_ptr = dialog_tag_index_find(callid, fromtag, totag))) {
+			sip_pvt_lock(sip_pvt_ptr);
+			found = !strcasecmp(sip_pvt_ptr->callid, callid) ? match_req_to_dialog(sip_pvt_ptr, &args) : SIP_REQ_NOT_MATCH;
+			sip_pvt_unlock(sip_pvt_ptr);
+			if (found == SIP_REQ_MATCH) {
+				free_via(via);
+				return sip_pvt_ptr; /* return pvt with ref */
+			}
+			/* The tags moved on, the full search below sorts it out */
+			dialog_unref(sip_pvt_ptr, "indexed pvt did not match incoming SIP msg");
+		}
+
+		iterator = ao2_t_callback(dialogs,
+			OBJ_POINTER | OBJ_MULTIPLE,
+			dialog_find_multiple,
+			&tmp_dialog,
+			"pedantic ao2_find in dialogs");
+
 		/* Iterate a list of dialogs already matched by Call-id */
 		while (iterator && (sip_pvt_ptr = ao2_iterator_next(iterator))) {
 			sip_pvt_lock(sip_pvt_ptr);
@@ -8759,6 +8970,9 @@ static struct sip_pvt *find_call(struct sip_request *req, struct ast_sockaddr *a
 				ao2_iterator_destroy(iterator);
 				dialog_unref(fork_pvt, "unref fork_pvt");
 				free_via(via);
+				if (!ast_strlen_zero(totag)) {
+					dialog_tag_index_add(sip_pvt_ptr, callid, fromtag, totag);
+				}
 				return sip_pvt_ptr; /* return pvt with ref */
 			case SIP_REQ_LOOP_DETECTED:
 				/* This is likely a forked Request that somehow resulted in us receiving multiple parts of the fork.
@@ -11965,6 +12179,292 @@ static void add_noncodec_to_sdp(const struct sip_pvt *p, int format,
 		ast_str_append(a_buf, 0, "a=fmtp:%d 0-16\r\n", rtp_code);
 }
 
+/*!
+ * \brief One payload type of the audio section of our SDP
+ *
+ * A codec entry has a zero noncodec; a non-codec (RFC 2833 and friends)
+ * entry has its AST_RTP_* bit there and an empty format.
+ */
+struct sdp_template_entry {
+	struct ast_format format;       /*!< Codec, including its attributes */
+	int noncodec;                   /*!< Non-codec capability bit */
+	int code;                       /*!< RTP payload code */
+	int ms;                         /*!< Packetization from the RTP instance */
+};
+
+/*!
+ * \brief Everything the audio section of our SDP is generated from
+ *
+ * The payload types in the order they go on the m= line plus the few
+ * settings that change their attributes.  Two dialogs with equal keys get
+ * byte for byte the same audio codec lines.
+ */
+struct sdp_template_key {
+	unsigned int generation;        /*!< sdp_template_generation */
+	unsigned int flags;             /*!< SDP_TEMPLATE_* */
+	unsigned int hash;              /*!< Hash of all of the above and the entries */
+	int num_entries;
+	struct sdp_template_entry entries[SDP_MAX_RTPMAP_CODECS * 2];
+};
+
+#define SDP_TEMPLATE_SILENCE_SUPP     (1 << 0) /*!< a=silenceSupp:off is added */
+#define SDP_TEMPLATE_G726_NONSTANDARD (1 << 1) /*!< G.726 AAL2 packing */
+
+/*!
+ * \brief Precompiled audio section of our SDP
+ *
+ * Everything in the audio media description that does not change from one
+ * session to the next: the payload type list of the m= line, the rtpmap and
+ * fmtp attributes, silenceSupp and ptime.  Ports, session id/version and
+ * crypto attributes are added per message by add_sdp().
+ *
+ * Templates are immutable once built.  A peer keeps SIP_SDP_TEMPLATES of
+ * them, picked by the hash of their key, so dialogs negotiating different
+ * codecs with the same peer do not evict each other.
+ */
+struct sip_sdp_template {
+	struct ast_str *m_payloads;     /*!< Payload type list appended to the m= line */
+	struct ast_str *attributes;     /*!< Audio a= lines */
+	unsigned int generation;        /*!< Key it was built from, see struct sdp_template_key */
+	unsigned int flags;
+	unsigned int hash;
+	int num_entries;
+	struct sdp_template_entry entries[0];
+};
+
+/*! \brief Bumped on reload to invalidate every SDP template */
+static unsigned int sdp_template_generation;
+static int sdp_template_hits;      /*!< SDP templates reused */
+static int sdp_template_misses;    /*!< SDP templates (re)built */
+
+static void sdp_template_destructor(void *obj)
+{
+	struct sip_sdp_template *tmpl = obj;
+
+	ast_free(tmpl->m_payloads);
+	ast_free(tmpl->attributes);
+}
+
+/*! \brief Append a codec to a template key unless an equivalent one is already there */
+static void sdp_template_key_add_codec(struct sdp_template_key *key, struct ast_rtp_codecs *codecs,
+	struct ast_format *format)
+{
+	struct sdp_template_entry *entry;
+	enum ast_format_cmp_res res;
+	int code, x;
+
+	if (key->num_entries == ARRAY_LEN(key->entries)) {
+		return;
+	}
+	for (x = 0; x < key->num_entries; x++) {
+		if (key->entries[x].noncodec) {
+			continue;
+		}
+		res = ast_format_cmp(format, &key->entries[x].format);
+		if (res == AST_FORMAT_CMP_EQUAL || res == AST_FORMAT_CMP_SUBSET) {
+			return;
+		}
+	}
+	if ((code = ast_rtp_codecs_payload_code(codecs, 1, format, 0)) == -1) {
+		return;
+	}
+
+	entry = &key->entries[key->num_entries++];
+	memset(entry, 0, sizeof(*entry));
+	entry->format.id = format->id;
+	memcpy(&entry->format.fattr, &format->fattr, sizeof(entry->format.fattr));
+	entry->code = code;
+	entry->ms = ast_codec_pref_getsize(&codecs->pref, format).cur_ms;
+	key->hash = (key->hash * 33) ^ entry->format.id ^ (entry->code << 16) ^ (entry->ms << 24);
+}
+
+/*!
+ * \brief Work out which payload types the audio section of the SDP offers
+ *
+ * These are added in this order:
+ * - First what was requested by the calling channel
+ * - Then preferences in order from sip.conf device config for this peer/user
+ * - Then other codecs in capabilities
+ * - Then the non-codec capabilities such as RFC 2833 telephony-event
+ */
+static void sdp_template_key_init(struct sdp_template_key *key, struct sip_pvt *p,
+	struct ast_format_cap *caps, int silence_supp)
+{
+	struct ast_rtp_codecs *codecs = ast_rtp_instance_get_codecs(p->rtp);
+	struct sdp_template_entry *entry;
+	struct ast_format tmp_fmt;
+	int x;
+
+	key->generation = sdp_template_generation;
+	key->flags = (silence_supp ? SDP_TEMPLATE_SILENCE_SUPP : 0)
+		| (ast_test_flag(&p->flags[0], SIP_G726_NONSTANDARD) ? SDP_TEMPLATE_G726_NONSTANDARD : 0);
+	key->hash = key->generation ^ (key->flags << 28);
+	key->num_entries = 0;
+
+	/* Prefer the audio codec we were requested to use, first, no matter what
+	   Note that p->prefcodec can include video codecs, so mask them out
+	*/
+	if (ast_format_cap_has_joint(caps, p->prefcaps)) {
+		ast_format_cap_iter_start(p->prefcaps);
+		while (!(ast_format_cap_iter_next(p->prefcaps, &tmp_fmt))) {
+			if (AST_FORMAT_GET_TYPE(tmp_fmt.id) == AST_FORMAT_TYPE_AUDIO) {
+				sdp_template_key_add_codec(key, codecs, &tmp_fmt);
+			}
+		}
+		ast_format_cap_iter_end(p->prefcaps);
+	}
+
+	for (x = 0; x < AST_CODEC_PREF_SIZE; x++) {
+		if (!(ast_codec_pref_index(&p->prefs, x, &tmp_fmt))) {
+			break;
+		}
+		if (AST_FORMAT_GET_TYPE(tmp_fmt.id) == AST_FORMAT_TYPE_AUDIO
+			&& ast_format_cap_iscompatible(caps, &tmp_fmt)) {
+			sdp_template_key_add_codec(key, codecs, &tmp_fmt);
+		}
+	}
+
+	ast_format_cap_iter_start(caps);
+	while (!(ast_format_cap_iter_next(caps, &tmp_fmt))) {
+		if (AST_FORMAT_GET_TYPE(tmp_fmt.id) == AST_FORMAT_TYPE_AUDIO) {
+			sdp_template_key_add_codec(key, codecs, &tmp_fmt);
+		}
+	}
+	ast_format_cap_iter_end(caps);
+
+	for (x = 1; x <= AST_RTP_MAX && key->num_entries < ARRAY_LEN(key->entries); x <<= 1) {
+		if (!(p->jointnoncodeccapability & x)) {
+			continue;
+		}
+		entry = &key->entries[key->num_entries];
+		memset(entry, 0, sizeof(*entry));
+		if ((entry->code = ast_rtp_codecs_payload_code(codecs, 0, NULL, x)) == -1) {
+			continue;
+		}
+		entry->noncodec = x;
+		key->num_entries++;
+		key->hash = (key->hash * 33) ^ x ^ (entry->code << 16);
+	}
+}
+
+/*! \brief Whether a template was built from this key */
+static int sdp_template_matches(const struct sip_sdp_template *tmpl, const struct sdp_template_key *key)
+{
+	const struct sdp_template_entry *a, *b;
+	int x;
+
+	if (tmpl->hash != key->hash
+		|| tmpl->generation != key->generation
+		|| tmpl->flags != key->flags
+		|| tmpl->num_entries != key->num_entries) {
+		return 0;
+	}
+
+	for (x = 0; x < key->num_entries; x++) {
+		a = &tmpl->entries[x];
+		b = &key->entries[x];
+		if (a->format.id != b->format.id || a->noncodec != b->noncodec
+			|| a->code != b->code || a->ms != b->ms
+			|| memcmp(&a->format.fattr, &b->format.fattr, sizeof(a->format.fattr))) {
+			return 0;
+		}
+	}
+
+	return 1;
+}
+
+/*! \brief Build the audio section of the SDP for a key into a new template */
+static struct sip_sdp_template *sdp_template_build(struct sip_pvt *p, struct sdp_template_key *key, int debug)
+{
+	struct sip_sdp_template *tmpl;
+	int min_audio_packet_size = 0;
+	int x;
+
+	if (!(tmpl = ao2_t_alloc(sizeof(*tmpl) + key->num_entries * sizeof(key->entries[0]),
+		sdp_template_destructor, "allocate SDP template"))) {
+		return NULL;
+	}
+	tmpl->m_payloads = ast_str_create(64);
+	tmpl->attributes = ast_str_create(512);
+	if (!tmpl->m_payloads || !tmpl->attributes) {
+		ao2_t_ref(tmpl, -1, "SDP template allocation failed");
+		return NULL;
+	}
+
+	tmpl->generation = key->generation;
+	tmpl->flags = key->flags;
+	tmpl->hash = key->hash;
+	tmpl->num_entries = key->num_entries;
+	memcpy(tmpl->entries, key->entries, key->num_entries * sizeof(key->entries[0]));
+
+	for (x = 0; x < key->num_entries; x++) {
+		if (key->entries[x].noncodec) {
+			add_noncodec_to_sdp(p, key->entries[x].noncodec, &tmpl->m_payloads, &tmpl->attributes, debug);
+		} else {
+			add_codec_to_sdp(p, &key->entries[x].format, &tmpl->m_payloads, &tmpl->attributes, debug, &min_audio_packet_size);
+		}
+	}
+
+	if (key->flags & SDP_TEMPLATE_SILENCE_SUPP)
+		ast_str_append(&tmpl->attributes, 0, "a=silenceSupp:off - - - -\r\n");
+
+	if (min_audio_packet_size)
+		ast_str_append(&tmpl->attributes, 0, "a=ptime:%d\r\n", min_audio_packet_size);
+
+	return tmpl;
+}
+
+/*!
+ * \brief Add the audio codec list and attributes to the SDP being built
+ *
+ * Reuses the template cached on the dialog's peer for the same key and
+ * builds (and caches) a new one when there is none.
+ */
+static void add_sdp_audio_codecs(struct sip_pvt *p, struct ast_format_cap *caps,
+	struct ast_str **m_audio, struct ast_str **a_audio, int debug)
+{
+	struct sip_sdp_template *tmpl = NULL;
+	struct sip_peer *peer = p->relatedpeer;
+	struct sdp_template_key key;
+	int slot;
+
+	sdp_template_key_init(&key, p, caps, !p->owner || !ast_internal_timing_enabled(p->owner));
+	slot = key.hash % SIP_SDP_TEMPLATES;
+
+	/* Debugging wants to see every codec being added */
+	if (peer && !debug) {
+		ao2_lock(peer);
+		if ((tmpl = peer->sdp_templates[slot]) && sdp_template_matches(tmpl, &key)) {
+			ao2_t_ref(tmpl, +1, "use peer SDP template");
+		} else {
+			tmpl = NULL;
+		}
+		ao2_unlock(peer);
+	}
+
+	if (tmpl) {
+		ast_atomic_fetchadd_int(&sdp_template_hits, +1);
+	} else {
+		ast_atomic_fetchadd_int(&sdp_template_misses, +1);
+		if (!(tmpl = sdp_template_build(p, &key, debug))) {
+			return;
+		}
+		if (peer) {
+			ao2_lock(peer);
+			if (peer->sdp_templates[slot]) {
+				ao2_t_ref(peer->sdp_templates[slot], -1, "replace peer SDP template");
+			}
+			ao2_t_ref(tmpl, +1, "store peer SDP template");
+			peer->sdp_templates[slot] = tmpl;
+			ao2_unlock(peer);
+		}
+	}
+
+	ast_str_append(m_audio, 0, "%s", ast_str_buffer(tmpl->m_payloads));
+	ast_str_append(a_audio, 0, "%s", ast_str_buffer(tmpl->attributes));
+	ao2_t_ref(tmpl, -1, "done with SDP template");
+}
+
 /*! \brief Set all IP media addresses for this call
 	\note called from add_sdp()
 */
@@ -12136,7 +12636,6 @@ static enum sip_result add_sdp(struct sip_request *resp, struct sip_pvt *p, int
 	int needvideo = FALSE;
 	int needtext = FALSE;
 	int debug = sip_debug_test_pvt(p);
-	int min_audio_packet_size = 0;
 	int min_video_packet_size = 0;
 	int min_text_packet_size = 0;
 
@@ -12281,81 +12780,52 @@ static enum sip_result add_sdp(struct sip_request *resp, struct sip_pvt *p, int
 		ast_str_append(&m_audio, 0, "m=audio %d RTP/%s", ast_sockaddr_port(&dest),
 			a_crypto ? "SAVP" : "AVP");
 
-		/* Now, start adding audio codecs. These are added in this order:
-		   - First what was requested by the calling channel
-		   - Then preferences in order from sip.conf device config for this peer/user
-		   - Then other codecs in capabilities, including video
-		*/
+		/* Audio codecs, telephone-event, silenceSupp and ptime rarely change for
+		   a given peer and codec set, so they come from a cached template. */
+		if (needaudio) {
+			add_sdp_audio_codecs(p, tmpcap, &m_audio, &a_audio, debug);
+		}
 
-		/* Prefer the audio codec we were requested to use, first, no matter what
-		   Note that p->prefcodec can include video codecs, so mask them out
+		/* Now add video and text codecs.  These are added in this order:
+		   - Preferences in order from sip.conf device config for this peer/user
+		   - Then other codecs in capabilities
 		*/
-		if (ast_format_cap_has_joint(tmpcap, p->prefcaps)) {
-			ast_format_cap_iter_start(p->prefcaps);
-			while (!(ast_format_cap_iter_next(p->prefcaps, &tmp_fmt))) {
-				if (AST_FORMAT_GET_TYPE(tmp_fmt.id) != AST_FORMAT_TYPE_AUDIO) {
-					continue;
-				}
-				add_codec_to_sdp(p, &tmp_fmt, &m_audio, &a_audio, debug, &min_audio_packet_size);
-				ast_format_cap_add(alreadysent, &tmp_fmt);
-			}
-			ast_format_cap_iter_end(p->prefcaps);
-		}
+		if (needvideo || needtext) {
+			for (x = 0; x < AST_CODEC_PREF_SIZE; x++) {
+				if (!(ast_codec_pref_index(&p->prefs, x, &tmp_fmt)))
+					break;
 
-		/* Start by sending our preferred audio/video codecs */
-		for (x = 0; x < AST_CODEC_PREF_SIZE; x++) {
-			if (!(ast_codec_pref_index(&p->prefs, x, &tmp_fmt)))
-				break;
+				if (!(ast_format_cap_iscompatible(tmpcap, &tmp_fmt)))
+					continue;
 
-			if (!(ast_format_cap_iscompatible(tmpcap, &tmp_fmt)))
-				continue;
+				if (ast_format_cap_iscompatible(alreadysent, &tmp_fmt))
+					continue;
 
-			if (ast_format_cap_iscompatible(alreadysent, &tmp_fmt))
-				continue;
+				if (needvideo && (AST_FORMAT_GET_TYPE(tmp_fmt.id) == AST_FORMAT_TYPE_VIDEO)) {
+					add_vcodec_to_sdp(p, &tmp_fmt, &m_video, &a_video, debug, &min_video_packet_size);
+				} else if (needtext && (AST_FORMAT_GET_TYPE(tmp_fmt.id) == AST_FORMAT_TYPE_TEXT)) {
+					add_tcodec_to_sdp(p, &tmp_fmt, &m_text, &a_text, debug, &min_text_packet_size);
+				}
 
-			if (AST_FORMAT_GET_TYPE(tmp_fmt.id) == AST_FORMAT_TYPE_AUDIO) {
-				add_codec_to_sdp(p, &tmp_fmt, &m_audio, &a_audio, debug, &min_audio_packet_size);
-			} else if (needvideo && (AST_FORMAT_GET_TYPE(tmp_fmt.id) == AST_FORMAT_TYPE_VIDEO)) {
-				add_vcodec_to_sdp(p, &tmp_fmt, &m_video, &a_video, debug, &min_video_packet_size);
-			} else if (needtext && (AST_FORMAT_GET_TYPE(tmp_fmt.id) == AST_FORMAT_TYPE_TEXT)) {
-				add_tcodec_to_sdp(p, &tmp_fmt, &m_text, &a_text, debug, &min_text_packet_size);
+				ast_format_cap_add(alreadysent, &tmp_fmt);
 			}
 
-			ast_format_cap_add(alreadysent, &tmp_fmt);
-		}
-
-		/* Now send any other common audio and video codecs, and non-codec formats: */
-		ast_format_cap_iter_start(tmpcap);
-		while (!(ast_format_cap_iter_next(tmpcap, &tmp_fmt))) {
-			if (ast_format_cap_iscompatible(alreadysent, &tmp_fmt))
-				continue;
+			ast_format_cap_iter_start(tmpcap);
+			while (!(ast_format_cap_iter_next(tmpcap, &tmp_fmt))) {
+				if (ast_format_cap_iscompatible(alreadysent, &tmp_fmt))
+					continue;
 
-			if (AST_FORMAT_GET_TYPE(tmp_fmt.id) == AST_FORMAT_TYPE_AUDIO) {
-				add_codec_to_sdp(p, &tmp_fmt, &m_audio, &a_audio, debug, &min_audio_packet_size);
-			} else if (needvideo && (AST_FORMAT_GET_TYPE(tmp_fmt.id) == AST_FORMAT_TYPE_VIDEO)) {
-				add_vcodec_to_sdp(p, &tmp_fmt, &m_video, &a_video, debug, &min_video_packet_size);
-			} else if (needtext && (AST_FORMAT_GET_TYPE(tmp_fmt.id) == AST_FORMAT_TYPE_TEXT)) {
-				add_tcodec_to_sdp(p, &tmp_fmt, &m_text, &a_text, debug, &min_text_packet_size);
+				if (needvideo && (AST_FORMAT_GET_TYPE(tmp_fmt.id) == AST_FORMAT_TYPE_VIDEO)) {
+					add_vcodec_to_sdp(p, &tmp_fmt, &m_video, &a_video, debug, &min_video_packet_size);
+				} else if (needtext && (AST_FORMAT_GET_TYPE(tmp_fmt.id) == AST_FORMAT_TYPE_TEXT)) {
+					add_tcodec_to_sdp(p, &tmp_fmt, &m_text, &a_text, debug, &min_text_packet_size);
+				}
 			}
-		}
-		ast_format_cap_iter_end(tmpcap);
-
-		/* Now add DTMF RFC2833 telephony-event as a codec */
-		for (x = 1LL; x <= AST_RTP_MAX; x <<= 1) {
-			if (!(p->jointnoncodeccapability & x))
-				continue;
-
-			add_noncodec_to_sdp(p, x, &m_audio, &a_audio, debug);
+			ast_format_cap_iter_end(tmpcap);
 		}
 
 		ast_debug(3, "-- Done with adding codecs to SDP\n");
 
-		if (!p->owner || !ast_internal_timing_enabled(p->owner))
-			ast_str_append(&a_audio, 0, "a=silenceSupp:off - - - -\r\n");
-
-		if (min_audio_packet_size)
-			ast_str_append(&a_audio, 0, "a=ptime:%d\r\n", min_audio_packet_size);
-
 		/* XXX don't think you can have ptime for video */
 		if (min_video_packet_size)
 			ast_str_append(&a_video, 0, "a=ptime:%d\r\n", min_video_packet_size);
@@ -14699,6 +15169,112 @@ static int expire_register(const void *data)
 	return 0;
 }
 
+/*!
+ * \brief Jitter a qualify interval by +/- 10%
+ *
+ * Keeps peers that were poked together from staying in lockstep forever.
+ * Only applied when a qualify budget is configured.
+ */
+static int qualify_jitter(int ms)
+{
+	int spread = ms / 5;
+
+	if (!global_qualify_rate || spread < 2) {
+		return ms;
+	}
+	return ms - spread / 2 + ast_random() % spread;
+}
+
+/*!
+ * \brief Interval before poking a peer that did not answer its last poke(s)
+ *
+ * Without a qualify budget this is always DEFAULT_FREQ_NOTOK.  With one, the
+ * interval doubles with every consecutive miss up to the peer's qualifyfreq.
+ */
+static int qualify_backoff(const struct sip_peer *peer)
+{
+	int ms = DEFAULT_FREQ_NOTOK;
+	int limit = MAX(peer->qualifyfreq, DEFAULT_FREQ_NOTOK);
+	int misses;
+
+	if (!global_qualify_rate) {
+		return ms;
+	}
+	for (misses = peer->qualify_misses; misses > 1 && ms < limit; misses--) {
+		ms *= 2;
+	}
+	return qualify_jitter(MIN(ms, limit));
+}
+
+/*!
+ * \brief Take a poke from the qualify budget
+ *
+ * \retval 0 the poke may be sent now
+ * \return otherwise the number of ms until the budget allows another poke
+ */
+static int qualify_budget_take(void)
+{
+	struct timeval now = ast_tvnow();
+	int64_t elapsed;
+	int wait = 0;
+
+	if (!global_qualify_rate) {
+		return 0;
+	}
+
+	ast_mutex_lock(&qualify_lock);
+	elapsed = ast_tvzero(qualify_refill) ? 1000 : ast_tvdiff_ms(now, qualify_refill);
+	if (elapsed > 0) {
+		qualify_tokens = MIN(qualify_tokens + elapsed * global_qualify_rate, global_qualify_rate * 1000);
+		qualify_refill = now;
+	}
+	if (qualify_tokens >= 1000) {
+		qualify_tokens -= 1000;
+	} else {
+		wait = (1000 - qualify_tokens) / global_qualify_rate + 1;
+	}
+	ast_mutex_unlock(&qualify_lock);
+
+	return wait;
+}
+
+/*! \brief Record the outcome of a qualify poke, latency < 0 means no answer */
+static void qualify_record(int latency)
+{
+	int i;
+
+	if (latency < 0) {
+		ast_atomic_fetchadd_int(&qualify_timeouts, +1);
+		return;
+	}
+	for (i = 0; latency > qualify_hist_bounds[i]; i++);
+	ast_atomic_fetchadd_int(&qualify_hist[i], +1);
+	/* Statistics only, a lost race here is harmless */
+	if (latency > qualify_max_latency) {
+		qualify_max_latency = latency;
+	}
+}
+
+/*! \brief Latency (ms) under which the given percentage of qualify replies fell */
+static int qualify_percentile(int percent)
+{
+	int i, total = 0, seen = 0;
+
+	for (i = 0; i < ARRAY_LEN(qualify_hist); i++) {
+		total += qualify_hist[i];
+	}
+	if (!total) {
+		return 0;
+	}
+	for (i = 0; i < ARRAY_LEN(qualify_hist) - 1; i++) {
+		seen += qualify_hist[i];
+		if (seen * 100 >= total * percent) {
+			break;
+		}
+	}
+	return i == ARRAY_LEN(qualify_hist) - 1 ? qualify_max_latency : qualify_hist_bounds[i];
+}
+
 /*! \brief Poke peer (send qualify to check if peer is alive and well) */
 static int sip_poke_peer_s(const void *data)
 {
@@ -14718,6 +15294,7 @@ static int sip_poke_peer_s(const void *data)
 	}
 
 	sip_unref_peer(foundpeer, "removing above peer ref");
+
 	sip_poke_peer(peer, 0);
 	sip_unref_peer(peer, "removing poke peer ref");
 
@@ -18036,9 +18613,13 @@ static char *_sip_show_peers(int fd, int *total, struct mansession *s, const str
 		peer = peerarray[k] = sip_unref_peer(peer, "toss iterator peer ptr");
 	}
 
-	if (!s)
+	if (!s) {
 		ast_cli(fd, "%d sip peers [Monitored: %d online, %d offline Unmonitored: %d online, %d offline]\n",
 		        total_peers, peers_mon_online, peers_mon_offline, peers_unmon_online, peers_unmon_offline);
+		ast_cli(fd, "Qualify: %d sent, %d unanswered, %d overruns [Latency: 50%% <= %d ms, 90%% <= %d ms, 99%% <= %d ms, max %d ms]\n",
+			qualify_sent, qualify_timeouts, qualify_deferred,
+			qualify_percentile(50), qualify_percentile(90), qualify_percentile(99), qualify_max_latency);
+	}
 
 	if (havepattern)
 		regfree(&regexbuf);
@@ -19323,6 +19904,11 @@ static char *sip_show_settings(struct ast_cli_entry *e, int cmd, struct ast_cli_
 	else
 		ast_cli(a->fd, "  SIP realtime:           Enabled\n" );
 	ast_cli(a->fd, "  Qualify Freq :          %d ms\n", global_qualifyfreq);
+	if (global_qualify_rate) {
+		ast_cli(a->fd, "  Qualify Rate:           %d/sec\n", global_qualify_rate);
+	} else {
+		ast_cli(a->fd, "  Qualify Rate:           Unlimited (%d peers every %d ms)\n", global_qualify_peers, global_qualify_gap);
+	}
 	ast_cli(a->fd, "  Q.850 Reason header:    %s\n", AST_CLI_YESNO(ast_test_flag(&global_flags[1], SIP_PAGE2_Q850_REASON)));
 	ast_cli(a->fd, "  Store SIP_CAUSE:        %s\n", AST_CLI_YESNO(global_store_sip_cause));
 	ast_cli(a->fd, "\nNetwork QoS Settings:\n");
@@ -19341,7 +19927,7 @@ static char *sip_show_settings(struct ast_cli_entry *e, int cmd, struct ast_cli_
 		ast_cli(a->fd, "  Jitterbuffer max size:  %ld\n", global_jbconf.max_size);
 		ast_cli(a->fd, "  Jitterbuffer resync:    %ld\n", global_jbconf.resync_threshold);
 		ast_cli(a->fd, "  Jitterbuffer impl:      %s\n", global_jbconf.impl);
-		if (!strcasecmp(global_jbconf.impl, "adaptive")) {
+		if (!strcasecmp(global_jbconf.impl, "adaptive") || !strcasecmp(global_jbconf.impl, "ring")) {
 			ast_cli(a->fd, "  Jitterbuffer tgt extra: %ld\n", global_jbconf.target_extra);
 		}
 		ast_cli(a->fd, "  Jitterbuffer log:       %s\n", AST_CLI_YESNO(ast_test_flag(&global_jbconf, AST_JB_LOG)));
@@ -19380,6 +19966,7 @@ static char *sip_show_settings(struct ast_cli_entry *e, int cmd, struct ast_cli_
 	ast_cli(a->fd, "  Codec Order:            ");
 	print_codec_to_cli(a->fd, &default_prefs);
 	ast_cli(a->fd, "\n");
+	ast_cli(a->fd, "  SDP templates:          %d reused, %d built\n", sdp_template_hits, sdp_template_misses);
 	ast_cli(a->fd, "  Relax DTMF:             %s\n", AST_CLI_YESNO(global_relaxdtmf));
 	ast_cli(a->fd, "  RFC2833 Compensation:   %s\n", AST_CLI_YESNO(ast_test_flag(&global_flags[1], SIP_PAGE2_RFC2833_COMPENSATE)));
 	ast_cli(a->fd, "  Symmetric RTP:          %s\n", AST_CLI_YESNO(ast_test_flag(&global_flags[1], SIP_PAGE2_SYMMETRICRTP)));
@@ -19395,6 +19982,11 @@ static char *sip_show_settings(struct ast_cli_entry *e, int cmd, struct ast_cli_
 	ast_cli(a->fd, "  Reg. default duration:  %d secs\n", default_expiry);
 	ast_cli(a->fd, "  Outbound reg. timeout:  %d secs\n", global_reg_timeout);
 	ast_cli(a->fd, "  Outbound reg. attempts: %d\n", global_regattempts_max);
+	ast_cli(a->fd, "  Reg. workers:           %d %s\n", reg_workers_count, reg_workers_count ? "" : "(Inline)");
+	if (reg_workers_count) {
+		ast_cli(a->fd, "    Queue limit:          %d (%d pending, %d rejected)\n", global_regqueuelimit, reg_tasks_pending, reg_tasks_rejected);
+		ast_cli(a->fd, "    Retry-After:          %d secs\n", global_regretryafter);
+	}
 	ast_cli(a->fd, "  Notify ringing state:   %s\n", AST_CLI_YESNO(sip_cfg.notifyringing));
 	if (sip_cfg.notifyringing) {
 		ast_cli(a->fd, "    Include CID:          %s%s\n",
@@ -22091,6 +22683,8 @@ static void handle_response_peerpoke(struct sip_pvt *p, int resp, struct sip_req
 		|| was_reachable != is_reachable;
 
 	peer->lastms = pingtime;
+	peer->qualify_misses = 0;
+	qualify_record(pingtime);
 	peer->call = dialog_unref(peer->call, "unref dialog peer->call");
 	if (statechanged) {
 		const char *s = is_reachable ? "Reachable" : "Lagged";
@@ -22114,7 +22708,7 @@ static void handle_response_peerpoke(struct sip_pvt *p, int resp, struct sip_req
 
 	/* Try again eventually */
 	AST_SCHED_REPLACE_UNREF(peer->pokeexpire, sched,
-			is_reachable ? peer->qualifyfreq : DEFAULT_FREQ_NOTOK,
+			qualify_jitter(is_reachable ? peer->qualifyfreq : DEFAULT_FREQ_NOTOK),
 			sip_poke_peer_s, peer,
 			sip_unref_peer(_data, "removing poke peer ref"),
 			sip_unref_peer(peer, "removing poke peer ref"),
@@ -26491,6 +27085,237 @@ static int handle_request_register(struct sip_pvt *p, struct sip_request *req, s
 	return res;
 }
 
+/*! \brief A REGISTER request handed off to a registration worker */
+struct sip_reg_task {
+	struct sip_pvt *p;              /*!< Dialog the request arrived on (holds a reference) */
+	struct sip_request req;         /*!< Private copy of the request */
+	struct ast_sockaddr addr;       /*!< Address the request was received from */
+};
+
+static void sip_reg_task_destroy(struct sip_reg_task *task)
+{
+	deinit_req(&task->req);
+	dialog_unref(task->p, "drop dialog ref held by registration task");
+	ast_free(task);
+	ast_atomic_fetchadd_int(&reg_tasks_pending, -1);
+}
+
+/*! \brief Taskprocessor callback: authenticate and store a queued REGISTER */
+static int sip_reg_task_exec(void *data)
+{
+	struct sip_reg_task *task = data;
+	const char *e;
+	int res;
+
+	sip_pvt_lock(task->p);
+	e = ast_skip_blanks(REQ_OFFSET_TO_STR(&task->req, rlPart2));
+	res = handle_request_register(task->p, &task->req, &task->addr, e);
+	sip_report_security_event(task->p, &task->req, res);
+	sip_pvt_unlock(task->p);
+
+	sip_reg_task_destroy(task);
+	return 0;
+}
+
+/*!
+ * \brief Hand an incoming REGISTER to the registration worker pool
+ *
+ * The worker is chosen by Call-ID so that retransmissions and re-registrations
+ * on the same dialog are always processed in order.  If the pool is saturated
+ * the request is answered with 503 and a Retry-After header right away.
+ *
+ * \note Called with p locked
+ *
+ * \retval 0 the request was queued or rejected and needs no further handling
+ * \retval -1 no workers are configured (or queueing failed); process inline
+ */
+static int queue_request_register(struct sip_pvt *p, struct sip_request *req, struct ast_sockaddr *addr)
+{
+	struct sip_reg_task *task;
+	struct ast_taskprocessor *worker;
+	char seconds[12];
+
+	ast_rwlock_rdlock(&reg_workers_lock);
+	if (!reg_workers_count) {
+		ast_rwlock_unlock(&reg_workers_lock);
+		return -1;
+	}
+
+	if (ast_atomic_fetchadd_int(&reg_tasks_pending, +1) >= global_regqueuelimit) {
+		ast_rwlock_unlock(&reg_workers_lock);
+		ast_atomic_fetchadd_int(&reg_tasks_pending, -1);
+		ast_atomic_fetchadd_int(&reg_tasks_rejected, +1);
+		ast_debug(1, "Registration queue full, rejecting REGISTER from %s\n", ast_sockaddr_stringify(addr));
+		snprintf(seconds, sizeof(seconds), "%d", global_regretryafter);
+		transmit_response_with_retry_after(p, "503 Service Unavailable", req, seconds);
+		sip_scheddestroy(p, DEFAULT_TRANS_TIMEOUT);
+		return 0;
+	}
+
+	if (!(task = ast_calloc(1, sizeof(*task)))) {
+		ast_rwlock_unlock(&reg_workers_lock);
+		ast_atomic_fetchadd_int(&reg_tasks_pending, -1);
+		return -1;
+	}
+	copy_request(&task->req, req);
+	if (!task->req.data) {
+		ast_rwlock_unlock(&reg_workers_lock);
+		ast_free(task);
+		ast_atomic_fetchadd_int(&reg_tasks_pending, -1);
+		return -1;
+	}
+	ast_sockaddr_copy(&task->addr, addr);
+	task->p = dialog_ref(p, "registration task holds dialog ref");
+
+	worker = reg_workers[ast_str_hash(p->callid) % reg_workers_count];
+	if (ast_taskprocessor_push(worker, sip_reg_task_exec, task)) {
+		ast_rwlock_unlock(&reg_workers_lock);
+		sip_reg_task_destroy(task);
+		return -1;
+	}
+	ast_rwlock_unlock(&reg_workers_lock);
+
+	return 0;
+}
+
+/*!
+ * \brief Let go of the retired registration workers whose backlog is done
+ *
+ * \param wait Wait for every retired worker to finish its backlog first
+ *
+ * \note A taskprocessor cannot be destroyed from its own thread, so this runs
+ * from the scheduler, or on unload.
+ */
+static void sip_reg_workers_reap(int wait)
+{
+	AST_LIST_HEAD_NOLOCK(, sip_reg_retiree) done = AST_LIST_HEAD_NOLOCK_INIT_VALUE;
+	struct sip_reg_retiree *retiree;
+
+	ast_mutex_lock(&reg_retirees_lock);
+	for (;;) {
+		int busy = 0;
+
+		AST_LIST_TRAVERSE_SAFE_BEGIN(&reg_retirees, retiree, list) {
+			if (retiree->done) {
+				AST_LIST_REMOVE_CURRENT(list);
+				AST_LIST_INSERT_TAIL(&done, retiree, list);
+			} else {
+				busy = 1;
+			}
+		}
+		AST_LIST_TRAVERSE_SAFE_END;
+		if (!wait || !busy) {
+			break;
+		}
+		ast_cond_wait(&reg_retirees_cond, &reg_retirees_lock);
+	}
+	ast_mutex_unlock(&reg_retirees_lock);
+
+	while ((retiree = AST_LIST_REMOVE_HEAD(&done, list))) {
+		ast_taskprocessor_unreference(retiree->worker);
+		ast_free(retiree);
+	}
+}
+
+static int sip_reg_workers_reap_sched(const void *data)
+{
+	sip_reg_workers_reap(0);
+	return 0;
+}
+
+/*! \brief Sentinel run by a retired registration worker once its backlog is done */
+static int sip_reg_worker_retired(void *data)
+{
+	struct sip_reg_retiree *retiree = data;
+
+	ast_mutex_lock(&reg_retirees_lock);
+	retiree->done = 1;
+	ast_cond_broadcast(&reg_retirees_cond);
+	ast_mutex_unlock(&reg_retirees_lock);
+
+	/* If this cannot be scheduled, the next reload or the unload lets go of it */
+	if (sched && ast_sched_add(sched, 0, sip_reg_workers_reap_sched, NULL) < 0) {
+		ast_debug(1, "Unable to schedule the release of a retired registration worker\n");
+	}
+
+	return 0;
+}
+
+/*!
+ * \brief (Re)build the registration worker pool
+ *
+ * \param count Number of workers wanted, 0 to process REGISTER requests on the
+ * receiving thread.
+ *
+ * \note Requests already queued on a worker that is being replaced still run.
+ * The worker is let go of once a sentinel queued behind them has run, without
+ * waiting for it here.
+ */
+static void sip_reg_workers_build(int count)
+{
+	struct ast_taskprocessor **old_workers, **new_workers = NULL;
+	int old_count, i;
+	char name[32];
+
+	if (count == reg_workers_count) {
+		return;
+	}
+
+	if (count && !(new_workers = ast_calloc(count, sizeof(*new_workers)))) {
+		return;
+	}
+	for (i = 0; i < count; i++) {
+		snprintf(name, sizeof(name), "SIP-register-%d", i);
+		if (!(new_workers[i] = ast_taskprocessor_get(name, TPS_REF_DEFAULT))) {
+			ast_log(LOG_WARNING, "Unable to create registration worker '%s', processing REGISTER inline\n", name);
+			while (i--) {
+				ast_taskprocessor_unreference(new_workers[i]);
+			}
+			ast_free(new_workers);
+			new_workers = NULL;
+			count = 0;
+			break;
+		}
+	}
+
+	ast_rwlock_wrlock(&reg_workers_lock);
+	old_workers = reg_workers;
+	old_count = reg_workers_count;
+	reg_workers = new_workers;
+	reg_workers_count = count;
+	ast_rwlock_unlock(&reg_workers_lock);
+
+	if (!old_workers) {
+		return;
+	}
+
+	/* Taskprocessors do not run their queue on destruction, and each queued
+	 * registration holds a dialog reference and counts as pending until it
+	 * runs.  Queue a sentinel behind the backlog of each old worker, and let
+	 * go of the worker once the sentinel has run. */
+	for (i = 0; i < old_count; i++) {
+		struct sip_reg_retiree *retiree;
+
+		if (!(retiree = ast_calloc(1, sizeof(*retiree)))) {
+			ast_log(LOG_WARNING, "Unable to retire a registration worker, keeping it\n");
+			continue;
+		}
+		retiree->worker = old_workers[i];
+		ast_mutex_lock(&reg_retirees_lock);
+		AST_LIST_INSERT_TAIL(&reg_retirees, retiree, list);
+		if (ast_taskprocessor_push(retiree->worker, sip_reg_worker_retired, retiree)) {
+			ast_log(LOG_WARNING, "Unable to retire a registration worker, keeping it\n");
+			AST_LIST_REMOVE(&reg_retirees, retiree, list);
+			ast_free(retiree);
+		}
+		ast_mutex_unlock(&reg_retirees_lock);
+	}
+	ast_free(old_workers);
+
+	/* Let go of any retired by an earlier reload whose release was not scheduled */
+	sip_reg_workers_reap(0);
+}
+
 /*!
  * \brief Handle incoming SIP requests (methods)
  * \note
@@ -26746,6 +27571,10 @@ static int handle_incoming(struct sip_pvt *p, struct sip_request *req, struct as
 		res = handle_request_subscribe(p, req, addr, seqno, e);
 		break;
 	case SIP_REGISTER:
+		if (!queue_request_register(p, req, addr)) {
+			/* Authentication and the response happen on a registration worker */
+			break;
+		}
 		res = handle_request_register(p, req, addr, e);
 		sip_report_security_event(p, req, res);
 		break;
@@ -27780,6 +28609,8 @@ static int sip_poke_noanswer(const void *data)
 	struct sip_peer *peer = (struct sip_peer *)data;
 
 	peer->pokeexpire = -1;
+	peer->qualify_misses++;
+	qualify_record(-1);
 
 	if (peer->lastms > -1) {
 		ast_log(LOG_NOTICE, "Peer '%s' is now UNREACHABLE!  Last qualify: %d\n", peer->name, peer->lastms);
@@ -27804,9 +28635,9 @@ static int sip_poke_noanswer(const void *data)
 		ast_devstate_changed(AST_DEVICE_UNKNOWN, AST_DEVSTATE_CACHABLE, "SIP/%s", peer->name);
 	}
 
-	/* Try again quickly */
+	/* Try again quickly, backing off if it keeps failing */
 	AST_SCHED_REPLACE_UNREF(peer->pokeexpire, sched,
-			DEFAULT_FREQ_NOTOK, sip_poke_peer_s, peer,
+			qualify_backoff(peer), sip_poke_peer_s, peer,
 			sip_unref_peer(_data, "removing poke peer ref"),
 			sip_unref_peer(peer, "removing poke peer ref"),
 			sip_ref_peer(peer, "adding poke peer ref"));
@@ -27826,6 +28657,7 @@ static int sip_poke_peer(struct sip_peer *peer, int force)
 {
 	struct sip_pvt *p;
 	int xmitres = 0;
+	int wait;
 	
 	if ((!peer->maxms && !force) || ast_sockaddr_isnull(&peer->addr)) {
 		/* IF we have no IP, or this isn't to be monitored, return
@@ -27839,6 +28671,18 @@ static int sip_poke_peer(struct sip_peer *peer, int force)
 		}
 		return 0;
 	}
+	if (!force && (wait = qualify_budget_take())) {
+		/* Over the pokes per second budget, whether scheduled, reloaded or
+		 * registering: come back when a slot frees up */
+		ast_atomic_fetchadd_int(&qualify_deferred, +1);
+		AST_SCHED_REPLACE_UNREF(peer->pokeexpire, sched,
+				wait + ast_random() % (1000 / global_qualify_rate + 1),
+				sip_poke_peer_s, peer,
+				sip_unref_peer(_data, "removing poke peer ref"),
+				sip_unref_peer(peer, "removing poke peer ref"),
+				sip_ref_peer(peer, "adding poke peer ref"));
+		return 0;
+	}
 	if (peer->call) {
 		if (sipdebug) {
 			ast_log(LOG_NOTICE, "Still have a QUALIFY dialog active, deleting\n");
@@ -27895,6 +28739,7 @@ static int sip_poke_peer(struct sip_peer *peer, int force)
 	xmitres = transmit_invite(p, SIP_OPTIONS, 0, 2, NULL); /* sinks the p refcount */
 #endif
 	peer->ps = ast_tvnow();
+	ast_atomic_fetchadd_int(&qualify_sent, +1);
 	if (xmitres == XMIT_ERROR) {
 		/* Immediately unreachable, network problems */
 		sip_poke_noanswer(sip_ref_peer(peer, "add ref for peerexpire (fake, for sip_poke_noanswer to remove)"));
@@ -29725,6 +30570,7 @@ static int reload_config(enum channelreloadreason reason)
 	/* Peer poking settings */
 	global_qualify_gap = DEFAULT_QUALIFY_GAP;
 	global_qualify_peers = DEFAULT_QUALIFY_PEERS;
+	global_qualify_rate = DEFAULT_QUALIFY_RATE;
 
 	/* Initialize some reasonable defaults at SIP reload (used both for channel and as default for devices */
 	ast_copy_string(sip_cfg.default_context, DEFAULT_CONTEXT, sizeof(sip_cfg.default_context));
@@ -29761,6 +30607,9 @@ static int reload_config(enum channelreloadreason reason)
 	global_shrinkcallerid = 1;
 	authlimit = DEFAULT_AUTHLIMIT;
 	authtimeout = DEFAULT_AUTHTIMEOUT;
+	global_regworkers = DEFAULT_REGWORKERS;
+	global_regqueuelimit = DEFAULT_REGQUEUELIMIT;
+	global_regretryafter = DEFAULT_REGRETRYAFTER;
 	global_store_sip_cause = DEFAULT_STORE_SIP_CAUSE;
 
 	sip_cfg.matchexternaddrlocally = DEFAULT_MATCHEXTERNADDRLOCALLY;
@@ -30028,6 +30877,24 @@ static int reload_config(enum channelreloadreason reason)
 				ast_log(LOG_WARNING, "Invalid %s '%s' at line %d of %s\n",
 					v->name, v->value, v->lineno, config);
 			}
+		} else if (!strcasecmp(v->name, "registerworkers")) {
+			if (ast_parse_arg(v->value, PARSE_INT32|PARSE_DEFAULT|PARSE_IN_RANGE,
+					  &global_regworkers, DEFAULT_REGWORKERS, 0, 64)) {
+				ast_log(LOG_WARNING, "Invalid %s '%s' at line %d of %s\n",
+					v->name, v->value, v->lineno, config);
+			}
+		} else if (!strcasecmp(v->name, "registerqueuelimit")) {
+			if (ast_parse_arg(v->value, PARSE_INT32|PARSE_DEFAULT|PARSE_IN_RANGE,
+					  &global_regqueuelimit, DEFAULT_REGQUEUELIMIT, 1, INT_MAX)) {
+				ast_log(LOG_WARNING, "Invalid %s '%s' at line %d of %s\n",
+					v->name, v->value, v->lineno, config);
+			}
+		} else if (!strcasecmp(v->name, "registerretryafter")) {
+			if (ast_parse_arg(v->value, PARSE_INT32|PARSE_DEFAULT|PARSE_IN_RANGE,
+					  &global_regretryafter, DEFAULT_REGRETRYAFTER, 1, 3600)) {
+				ast_log(LOG_WARNING, "Invalid %s '%s' at line %d of %s\n",
+					v->name, v->value, v->lineno, config);
+			}
 		} else if (!strcasecmp(v->name, "sipdebug")) {
 			if (ast_true(v->value))
 				sipdebug |= sip_debug_config;
@@ -30234,6 +31101,12 @@ static int reload_config(enum channelreloadreason reason)
 				ast_log(LOG_WARNING, "Invalid pokepeers '%s' at line %d of %s\n", v->value, v->lineno, config);
 				global_qualify_peers = DEFAULT_QUALIFY_PEERS;
 			}
+		} else if (!strcasecmp(v->name, "qualifyrate")) {
+			if (ast_parse_arg(v->value, PARSE_INT32|PARSE_DEFAULT|PARSE_IN_RANGE,
+					  &global_qualify_rate, DEFAULT_QUALIFY_RATE, 0, 100000)) {
+				ast_log(LOG_WARNING, "Invalid %s '%s' at line %d of %s\n",
+					v->name, v->value, v->lineno, config);
+			}
 		} else if (!strcasecmp(v->name, "disallowed_methods")) {
 			char *disallow = ast_strdupa(v->value);
 			mark_parsed_methods(&sip_cfg.disallowed_methods, disallow);
@@ -30582,6 +31455,9 @@ static int reload_config(enum channelreloadreason reason)
 	/* Release configuration from memory */
 	ast_config_destroy(cfg);
 
+	/* Global settings may have changed what goes into our SDP */
+	ast_atomic_fetchadd_int((int *) &sdp_template_generation, +1);
+
 	/* Load the list of manual NOTIFY types to support */
 	if (notify_types) {
 		ast_config_destroy(notify_types);
@@ -30591,6 +31467,9 @@ static int reload_config(enum channelreloadreason reason)
 		notify_types = NULL;
 	}
 
+	/* Start, resize or stop the REGISTER worker pool */
+	sip_reg_workers_build(global_regworkers);
+
 	/* Done, tell the manager */
 	manager_event(EVENT_FLAG_SYSTEM, "ChannelReload", "ChannelType: SIP\r\nReloadReason: %s\r\nRegistry_Count: %d\r\nPeer_Count: %d\r\n", channelreloadreason2txt(reason), registry_count, peer_count);
 	run_end = time(0);
@@ -31211,7 +32090,7 @@ static int sip_is_xml_parsable(void)
 /*! \brief Send a poke to all known peers */
 static void sip_poke_all_peers(void)
 {
-	int ms = 0, num = 0;
+	int ms = 0, num = 0, qualified = 0, window = 0;
 	struct ao2_iterator i;
 	struct sip_peer *peer;
 
@@ -31219,11 +32098,31 @@ static void sip_poke_all_peers(void)
 		return;
 	}
 
+	if (global_qualify_rate) {
+		/* Spread the pokes evenly over the qualify interval, stretched if
+		 * needed so that the budget is never exceeded. */
+		i = ao2_iterator_init(peers, 0);
+		while ((peer = ao2_t_iterator_next(&i, "iterate thru peers table"))) {
+			if (peer->maxms) {
+				qualified++;
+			}
+			sip_unref_peer(peer, "toss iterator peer ptr");
+		}
+		ao2_iterator_destroy(&i);
+		window = MAX(global_qualifyfreq, (int) ((int64_t) qualified * 1000 / global_qualify_rate));
+	}
+
 	i = ao2_iterator_init(peers, 0);
 	while ((peer = ao2_t_iterator_next(&i, "iterate thru peers table"))) {
 		ao2_lock(peer);
 		/* Don't schedule poking on a peer without qualify */
-		if (peer->maxms) {
+		if (peer->maxms && window) {
+			ms = qualified ? (int) ((int64_t) num++ * window / qualified) : 0;
+			AST_SCHED_REPLACE_UNREF(peer->pokeexpire, sched, ms, sip_poke_peer_s, peer,
+					sip_unref_peer(_data, "removing poke peer ref"),
+					sip_unref_peer(peer, "removing poke peer ref"),
+					sip_ref_peer(peer, "adding poke peer ref"));
+		} else if (peer->maxms) {
 			if (num == global_qualify_peers) {
 				ms += global_qualify_gap;
 				num = 0;
@@ -32327,6 +33226,119 @@ AST_TEST_DEFINE(test_tcp_message_fragmentation)
 	return res;
 }
 
+#define FIND_CALL_BENCH_DIALOGS 50000   /*!< Live dialogs during the find_call benchmark */
+#define FIND_CALL_BENCH_FORKS   4       /*!< Dialogs sharing each Call-ID, as left behind by forking */
+
+AST_TEST_DEFINE(test_sip_find_call_benchmark)
+{
+	struct sip_pvt **bench_dialogs;
+	struct sip_request req;
+	struct ast_sockaddr addr;
+	struct timeval start;
+	int64_t elapsed[2] = { 0, 0 };
+	int created = 0, i, pass;
+	enum ast_test_result_state res = AST_TEST_PASS;
+
+	switch (cmd) {
+		case TEST_INIT:
+			info->name = "find_call_benchmark";
+			info->category = "/channels/chan_sip/";
+			info->summary = "Benchmark of in-dialog request matching";
+			info->description =
+				"Creates 50000 live dialogs, four per Call-ID, and times find_call() "
+				"for an in-dialog BYE on each of them, first through the Call-ID "
+				"search and then through the Call-ID/tags index.";
+			return AST_TEST_NOT_RUN;
+		case TEST_EXECUTE:
+			break;
+	}
+	if (!sip_cfg.pedanticsipchecking) {
+		ast_log(LOG_WARNING, "Not running test. Pedantic SIP checking is not enabled, so tags are not matched\n");
+		return AST_TEST_NOT_RUN;
+	}
+
+	if (!(bench_dialogs = ast_calloc(FIND_CALL_BENCH_DIALOGS, sizeof(*bench_dialogs)))) {
+		return AST_TEST_FAIL;
+	}
+	ast_sockaddr_parse(&addr, "127.0.0.1:5061", 0);
+
+	for (created = 0; created < FIND_CALL_BENCH_DIALOGS; created++) {
+		char callid[64];
+		struct sip_pvt *p;
+
+		snprintf(callid, sizeof(callid), "find-call-bench-%d", created / FIND_CALL_BENCH_FORKS);
+		if (!(p = sip_alloc(callid, &addr, 0, SIP_OPTIONS, NULL))) {
+			ast_test_status_update(test, "Failed to allocate dialog %d\n", created);
+			res = AST_TEST_FAIL;
+			goto cleanup;
+		}
+		ast_string_field_build(p, theirtag, "bench%d", created);
+		bench_dialogs[created] = p;
+	}
+
+	memset(&req, 0, sizeof(req));
+	if (!(req.data = ast_str_create(SIP_MIN_PACKET))) {
+		res = AST_TEST_FAIL;
+		goto cleanup;
+	}
+
+	/* Pass 0 fills the index through the Call-ID search, pass 1 uses it */
+	for (pass = 0; pass < 2; pass++) {
+		for (i = 0; i < FIND_CALL_BENCH_DIALOGS; i++) {
+			struct sip_pvt *found;
+
+			ast_str_set(&req.data, 0,
+				"BYE sip:bench@127.0.0.1 SIP/2.0\r\n"
+				"Via: SIP/2.0/UDP 127.0.0.1:5061;branch=z9hG4bK%d%d\r\n"
+				"From: <sip:bench@127.0.0.1>;tag=%s\r\n"
+				"To: <sip:bench@127.0.0.1>;tag=%s\r\n"
+				"Call-ID: %s\r\n"
+				"CSeq: %d BYE\r\n"
+				"Content-Length: 0\r\n"
+				"\r\n",
+				pass, i, bench_dialogs[i]->theirtag, bench_dialogs[i]->tag,
+				bench_dialogs[i]->callid, 102 + pass);
+			req.headers = req.lines = 0;
+			req.has_to_tag = 0;
+			if (parse_request(&req)) {
+				res = AST_TEST_FAIL;
+				goto cleanup_req;
+			}
+			req.method = find_sip_method(REQ_OFFSET_TO_STR(&req, rlPart1));
+
+			start = ast_tvnow();
+			found = find_call(&req, &addr, req.method);
+			elapsed[pass] += ast_tvdiff_us(ast_tvnow(), start);
+
+			if (found != bench_dialogs[i]) {
+				ast_test_status_update(test, "Pass %d: BYE for dialog %d matched %p instead of %p\n",
+					pass, i, found, bench_dialogs[i]);
+				res = AST_TEST_FAIL;
+			}
+			if (found) {
+				dialog_unref(found, "done with benchmark find_call result");
+			}
+			if (res == AST_TEST_FAIL) {
+				goto cleanup_req;
+			}
+		}
+	}
+
+	ast_test_status_update(test, "%d dialogs: Call-ID search %" PRId64 " ns/lookup, tag index %" PRId64 " ns/lookup\n",
+		FIND_CALL_BENCH_DIALOGS, elapsed[0] * 1000 / FIND_CALL_BENCH_DIALOGS, elapsed[1] * 1000 / FIND_CALL_BENCH_DIALOGS);
+
+cleanup_req:
+	deinit_req(&req);
+cleanup:
+	for (i = 0; i < created; i++) {
+		dialog_unlink_all(bench_dialogs[i]);
+		dialog_unref(bench_dialogs[i], "benchmark dialog done");
+	}
+	ast_free(bench_dialogs);
+
+	return res;
+}
+
 #endif
 
 #define DATA_EXPORT_SIP_PEER(MEMBER)				\
@@ -32510,9 +33522,10 @@ static int load_module(void)
 	dialogs = ao2_t_container_alloc(HASH_DIALOG_SIZE, dialog_hash_cb, dialog_cmp_cb, "allocate dialogs");
 	dialogs_needdestroy = ao2_t_container_alloc(1, NULL, NULL, "allocate dialogs_needdestroy");
 	dialogs_rtpcheck = ao2_t_container_alloc(HASH_DIALOG_SIZE, dialog_hash_cb, dialog_cmp_cb, "allocate dialogs for rtpchecks");
+	dialogs_by_tags = ao2_t_container_alloc(HASH_DIALOG_SIZE, dialog_tag_hash_cb, dialog_tag_cmp_cb, "allocate dialogs by tags");
 	threadt = ao2_t_container_alloc(HASH_DIALOG_SIZE, threadt_hash_cb, threadt_cmp_cb, "allocate threadt table");
 	if (!peers || !peers_by_ip || !dialogs || !dialogs_needdestroy || !dialogs_rtpcheck
-		|| !threadt) {
+		|| !dialogs_by_tags || !threadt) {
 		ast_log(LOG_ERROR, "Unable to create primary SIP container(s)\n");
 		return AST_MODULE_LOAD_FAILURE;
 	}
@@ -32524,6 +33537,7 @@ static int load_module(void)
 
 	ASTOBJ_CONTAINER_INIT(&regl); /* Registry object list -- not searched for anything */
 	ASTOBJ_CONTAINER_INIT(&submwil); /* MWI subscription object list */
+	ast_cond_init(&reg_retirees_cond, NULL);
 
 	if (!(sched = ast_sched_context_create())) {
 		ast_log(LOG_ERROR, "Unable to create scheduler context\n");
@@ -32579,6 +33593,7 @@ static int load_module(void)
 	AST_TEST_REGISTER(test_sip_peers_get);
 	AST_TEST_REGISTER(test_sip_mwi_subscribe_parse);
 	AST_TEST_REGISTER(test_tcp_message_fragmentation);
+	AST_TEST_REGISTER(test_sip_find_call_benchmark);
 #endif
 
 	/* Register AstData providers */
@@ -32694,6 +33709,7 @@ static int unload_module(void)
 	AST_TEST_UNREGISTER(test_sip_peers_get);
 	AST_TEST_UNREGISTER(test_sip_mwi_subscribe_parse);
 	AST_TEST_UNREGISTER(test_tcp_message_fragmentation);
+	AST_TEST_UNREGISTER(test_sip_find_call_benchmark);
 #endif
 	/* Unregister all the AstData providers */
 	ast_data_unregister(NULL);
@@ -32753,6 +33769,10 @@ static int unload_module(void)
 	monitor_thread = AST_PTHREADT_STOP;
 	ast_mutex_unlock(&monlock);
 
+	/* Let queued registrations finish before the dialogs go away */
+	sip_reg_workers_build(0);
+	sip_reg_workers_reap(1);
+
 	/* Destroy all the dialogs and free their memory */
 	i = ao2_iterator_init(dialogs, 0);
 	while ((p = ao2_t_iterator_next(&i, "iterate thru dialogs"))) {
@@ -32818,6 +33838,7 @@ static int unload_module(void)
 	ao2_t_ref(dialogs, -1, "unref the dialogs table");
 	ao2_t_ref(dialogs_needdestroy, -1, "unref dialogs_needdestroy");
 	ao2_t_ref(dialogs_rtpcheck, -1, "unref dialogs_rtpcheck");
+	ao2_t_ref(dialogs_by_tags, -1, "unref dialogs_by_tags");
 	ao2_t_ref(threadt, -1, "unref the thread table");
 	ao2_t_ref(sip_monitor_instances, -1, "unref the sip_monitor_instances table");
 
@@ -4118,7 +4118,7 @@ static char *handle_skinny_show_settings(struct ast_cli_entry *e, int cmd, struc
 		ast_cli(a->fd, "  Jitterbuffer max size:  %ld\n", global_jbconf.max_size);
 		ast_cli(a->fd, "  Jitterbuffer resync:    %ld\n", global_jbconf.resync_threshold);
 		ast_cli(a->fd, "  Jitterbuffer impl:      %s\n", global_jbconf.impl);
-		if (!strcasecmp(global_jbconf.impl, "adaptive")) {
+		if (!strcasecmp(global_jbconf.impl, "adaptive") || !strcasecmp(global_jbconf.impl, "ring")) {
 			ast_cli(a->fd, "  Jitterbuffer tgt extra: %ld\n", global_jbconf.target_extra);
 		}
 		ast_cli(a->fd, "  Jitterbuffer log:       %s\n", AST_CLI_YESNO(ast_test_flag(&global_jbconf, AST_JB_LOG)));
@@ -63,6 +63,10 @@
 #define DEFAULT_AUTHLIMIT            100
 #define DEFAULT_AUTHTIMEOUT          30
 
+#define DEFAULT_REGWORKERS           0     /*!< Process REGISTER on the receiving thread by default */
+#define DEFAULT_REGQUEUELIMIT        1000  /*!< Queued registrations before answering 503 */
+#define DEFAULT_REGRETRYAFTER        5     /*!< Retry-After value for the 503 sent on overload */
+
 /* guard limit must be larger than guard secs */
 /* guard min must be < 1000, and should be >= 250 */
 #define EXPIRY_GUARD_SECS    15   /*!< How long before expiry do we reregister */
@@ -78,6 +82,7 @@
 
 #define DEFAULT_QUALIFY_GAP   100
 #define DEFAULT_QUALIFY_PEERS 1
+#define DEFAULT_QUALIFY_RATE  0      /*!< Qualify pokes per second, 0 disables the budget */
 
 #define CALLERID_UNKNOWN          "Anonymous"
 #define FROMDOMAIN_INVALID        "anonymous.invalid"
@@ -107,6 +112,7 @@
 #define DEFAULT_MIN_SE            90     /*!< Session-Timer Default Min-SE period (RFC 4028) */
 
 #define SDP_MAX_RTPMAP_CODECS     32     /*!< Maximum number of codecs allowed in received SDP */
+#define SIP_SDP_TEMPLATES         8      /*!< Audio SDP templates cached per peer */
 
 #define RTP     1
 #define NO_RTP  0
@@ -1136,6 +1142,9 @@ struct sip_pvt {
 	struct sip_peer *relatedpeer;       /*!< If this dialog is related to a peer, which one
 	                                         Used in peerpoke, mwi subscriptions */
 	struct sip_registry *registry;      /*!< If this is a REGISTER dialog, to which registry */
+	struct sip_dialog_tag_entry *tag_entry; /*!< Entry in the Call-ID/tags dialog index, if any */
+	int tag_unlinked;                       /*!< Set once unlinked, the dialog may not be indexed again
+	                                         *   (both protected by the dialogs_by_tags lock) */
 	struct ast_rtp_instance *rtp;       /*!< RTP Session */
 	struct ast_rtp_instance *vrtp;      /*!< Video RTP session */
 	struct ast_rtp_instance *trtp;      /*!< Text RTP session */
@@ -1227,6 +1236,9 @@ struct sip_mailbox {
 /*! \brief Structure for SIP peer data, we place calls to peers if registered  or fixed IP address (host)
 */
 /* XXX field 'name' must be first otherwise sip_addrcmp() will fail, as will astobj2 hashing of the structure */
+struct sip_sdp_template;
+struct sip_dialog_tag_entry;
+
 struct sip_peer {
 	char name[80];                          /*!< the unique name of this object */
 	AST_DECLARE_STRING_FIELDS(
@@ -1308,6 +1320,7 @@ struct sip_peer {
 	int lastms;                     /*!<  Qualification: How long last response took (in ms), or -1 for no response */
 	int maxms;                      /*!<  Qualification: Max ms we will accept for the host to be up, 0 to not monitor */
 	int qualifyfreq;                /*!<  Qualification: Qualification: How often to check for the host to be up */
+	int qualify_misses;             /*!<  Qualification: Consecutive unanswered pokes, drives the backoff */
 	struct timeval ps;              /*!<  Qualification: Time for sending SIP OPTION in sip_pke_peer() */
 	struct ast_sockaddr defaddr;     /*!<  Default IP address, used until registration */
 	struct ast_ha *ha;              /*!<  Access control list */
@@ -1324,6 +1337,7 @@ struct sip_peer {
 	enum sip_peer_type type; /*!< Distinguish between "user" and "peer" types. This is used solely for CLI and manager commands */
 	unsigned int disallowed_methods;
 	struct ast_cc_config_params *cc_params;
+	struct sip_sdp_template *sdp_templates[SIP_SDP_TEMPLATES]; /*!< Cached audio codec lines of our SDP for this peer */
 };
 
 /*!
@@ -48,7 +48,7 @@ ASTERISK_FILE_VERSION(__FILE__, "$Revision: 375894 $")
 		</synopsis>
 		<syntax>
 			<parameter name="jitterbuffer type" required="true">
-				<para>Jitterbuffer type can be either <literal>fixed</literal> or <literal>adaptive</literal>.</para>
+				<para>Jitterbuffer type can be <literal>fixed</literal>, <literal>adaptive</literal> or <literal>ring</literal>.</para>
 				<para>Used as follows. </para>
 				<para>Set(JITTERBUFFER(type)=max_size[,resync_threshold[,target_extra]])</para>
 				<para>Set(JITTERBUFFER(type)=default) </para>
@@ -62,7 +62,7 @@ ASTERISK_FILE_VERSION(__FILE__, "$Revision: 375894 $")
 			<para>The length in milliseconds over which a timestamp difference will result in resyncing the jitterbuffer. </para>
 			<para> </para>
 			<para>target_extra: Defaults to 40ms</para>
-			<para>This option only affects the adaptive jitterbuffer. It represents the amount time in milliseconds by which the new jitter buffer will pad its size.</para>
+			<para>This option only affects the adaptive and ring jitterbuffers. It represents the amount time in milliseconds by which the new jitter buffer will pad its size.</para>
 			<para> </para>
 			<para>Examples:</para>
 			<para>exten => 1,1,Set(JITTERBUFFER(fixed)=default);Fixed with defaults. </para>
@@ -144,11 +144,16 @@ static int jb_framedata_init(struct jb_framedata *framedata, const char *data, c
 			jb_impl_type = AST_JB_FIXED;
 		} else if (!strcasecmp(data, "adaptive")) {
 			jb_impl_type = AST_JB_ADAPTIVE;
+		} else if (!strcasecmp(data, "ring")) {
+			jb_impl_type = AST_JB_RING;
 		} else {
 			ast_log(LOG_WARNING, "Unknown Jitterbuffer type %s. Failed to create jitterbuffer.\n", data);
 			return -1;
 		}
 		ast_copy_string(framedata->jb_conf.impl, data, sizeof(framedata->jb_conf.impl));
+		if (!(framedata->jb_impl = ast_jb_get_impl(jb_impl_type))) {
+			return -1;
+		}
 	}
 
 	if (!ast_strlen_zero(value) && strcasecmp(value, "default")) {
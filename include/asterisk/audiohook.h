@@ -99,6 +99,8 @@ struct ast_audiohook;
  */
 typedef int (*ast_audiohook_manipulate_callback)(struct ast_audiohook *audiohook, struct ast_channel *chan, struct ast_frame *frame, enum ast_audiohook_direction direction);
 
+struct ast_audiohook_tap;
+
 struct ast_audiohook_options {
 	int read_volume;  /*!< Volume adjustment on frames read from the channel the hook is on */
 	int write_volume; /*!< Volume adjustment on frames written to the channel the hook is on */
@@ -122,6 +124,9 @@ struct ast_audiohook {
 	struct ast_audiohook_options options;                  /*!< Applicable options */
 	unsigned int hook_internal_samp_rate;                           /*!< internal read/write sample rate on the audiohook.*/
 	AST_LIST_ENTRY(ast_audiohook) list;                    /*!< Linked list information */
+	struct ast_audiohook_tap *tap;                         /*!< Audio of the channel a spy reads, shared with the other spies on it */
+	uint64_t tap_pos[2];                                   /*!< Where a spy has read the tap up to, read and write direction */
+	unsigned int tap_epoch;                                /*!< Epoch of the tap those positions belong to */
 };
 
 struct ast_audiohook_list;
@@ -221,6 +221,9 @@ struct ast_bridge {
 	 * for bridge technologies that mix audio. When set to 0, the bridge tech must choose a
 	 * default interval for itself. */
 	unsigned int internal_mixing_interval;
+	/*! The most talkers bridge technologies that mix audio should mix at once, picking
+	 *  the loudest.  When set to 0, everyone talking is mixed. */
+	unsigned int max_talkers;
 	/*! Bit to indicate that the bridge thread is waiting on channels in the bridge array */
 	unsigned int waiting:1;
 	/*! Bit to indicate the bridge thread should stop */
@@ -543,6 +546,14 @@ void ast_bridge_set_internal_sample_rate(struct ast_bridge *bridge, unsigned int
  */
 void ast_bridge_set_mixing_interval(struct ast_bridge *bridge, unsigned int mixing_interval);
 
+/*! \brief Limit the number of talkers mixed at once in multimix mode.
+ *
+ * \param bridge Bridge to change the limit on.
+ * \param max_talkers, the most talkers to mix, the loudest ones are picked.
+ * If 0 is set, everyone talking is mixed.
+ */
+void ast_bridge_set_max_talkers(struct ast_bridge *bridge, unsigned int max_talkers);
+
 /*!
  * \brief Set a bridge to feed a single video source to all participants.
  */
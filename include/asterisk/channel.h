@@ -836,6 +836,8 @@ struct ast_channel {
 	int _softhangup;				/*!< Whether or not we have been hung up...  Do not set this value
 							 *   directly, use ast_softhangup() */
 	int fdno;					/*!< Which fd had an event detected on */
+	unsigned int fd_generation;			/*!< Bumped whenever ast_channel_set_fd() sets a descriptor,
+							 *   even to the number it already had */
 	int streamid;					/*!< For streaming playback, the schedule ID */
 	int vstreamid;					/*!< For streaming video playback, the schedule ID */
 	struct ast_format oldwriteformat;  /*!< Original writer format */
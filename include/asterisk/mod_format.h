@@ -119,6 +119,8 @@ struct ast_filestream {
 	void *_private;	/*!< pointer to private buffer */
 	const char *orig_chan_name;
 	char *write_buffer;
+	/*! Data waiting for the recording writer threads, if they write for this stream */
+	struct ast_filestream_queue *queue;
 };
 
 /*! 
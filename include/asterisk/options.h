@@ -157,6 +157,12 @@ extern double option_maxload;
 #if defined(HAVE_SYSINFO)
 extern long option_minmemfree;		/*!< Minimum amount of free system memory - stop accepting calls if free memory falls below this watermark */
 #endif
+extern int option_prompt_cache;		/*!< Keep sound file lookups and contents in memory */
+extern long option_prompt_cache_size;	/*!< Memory the prompt cache may hold, in MB */
+extern int option_prompt_transcode;	/*!< Transcode prompts once into the formats channels take */
+extern int option_record_writers;	/*!< Threads writing out recordings, 0 to write them from the recording thread */
+extern int option_record_queue_size;	/*!< Data a recording may have waiting for the writer threads, in kB */
+extern int option_record_fsync;		/*!< Seconds between syncs of recordings, 0 to sync on close only, -1 never */
 extern char defaultlanguage[];
 
 extern struct timeval ast_startuptime;
@@ -164,6 +170,7 @@ extern struct timeval ast_lastreloadtime;
 extern pid_t ast_mainpid;
 
 extern char record_cache_dir[AST_CACHE_DIR_LEN];
+extern char prompt_transcode_dir[AST_CACHE_DIR_LEN];
 extern char dahdi_chan_name[AST_CHANNEL_NAME];
 extern int dahdi_chan_name_len;
 
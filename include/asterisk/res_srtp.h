@@ -25,6 +25,15 @@ struct ast_srtp;
 struct ast_srtp_policy;
 struct ast_rtp_instance;
 
+/*! \brief A packet in a batch, protected or unprotected in place */
+struct ast_srtp_packet {
+	void *buf;
+	/*! Length of the packet, set to -1 if it could not be processed */
+	int len;
+	/*! Size of buf, which must leave room for the SRTP trailer when protecting */
+	size_t size;
+};
+
 struct ast_srtp_cb {
 	int (*no_ctx)(struct ast_rtp_instance *rtp, unsigned long ssrc, void *data);
 };
@@ -48,6 +57,10 @@ struct ast_srtp_res {
 	int (*protect)(struct ast_srtp *srtp, void **buf, int *size, int rtcp);
 	/* Obtain a random cryptographic key */
 	int (*get_random)(unsigned char *key, size_t len);
+	/* Unprotect a batch of SRTP packets in place, returns the number that succeeded */
+	int (*unprotect_batch)(struct ast_srtp *srtp, struct ast_srtp_packet *pkts, int count, int rtcp);
+	/* Protect a batch of RTP packets in place, returns the number that succeeded */
+	int (*protect_batch)(struct ast_srtp *srtp, struct ast_srtp_packet *pkts, int count, int rtcp);
 };
 
 /* Crypto suites */
@@ -83,6 +83,7 @@ extern "C" {
 
 struct ast_rtp_instance;
 struct ast_rtp_glue;
+struct ast_rtp_telemetry_sample;
 
 /*! RTP Properties that can be set on an RTP instance */
 enum ast_rtp_property {
@@ -1850,6 +1851,35 @@ struct ast_rtp_glue *ast_rtp_instance_get_active_glue(struct ast_rtp_instance *i
  */
 struct ast_channel *ast_rtp_instance_get_chan(struct ast_rtp_instance *instance);
 
+/*!
+ * \brief Set the peer name quality telemetry of an RTP instance is recorded under
+ *
+ * \param instance The RTP instance
+ * \param peer Name of the peer, NULL or empty to record no peer
+ *
+ * Example:
+ *
+ * \code
+ * ast_rtp_instance_set_telemetry_peer(instance, "carrier1");
+ * \endcode
+ *
+ * \since 10.12.5
+ */
+void ast_rtp_instance_set_telemetry_peer(struct ast_rtp_instance *instance, const char *peer);
+
+/*!
+ * \brief Record a quality sample under the keys of an RTP instance
+ *
+ * \param instance The RTP instance
+ * \param sample The observation, with the codec key filled in by the engine
+ *
+ * The peer and remote media host keys are the ones the instance looked up
+ * when its peer and remote address were set; they are filled in here.
+ *
+ * \since 10.12.5
+ */
+void ast_rtp_instance_record_telemetry(struct ast_rtp_instance *instance, struct ast_rtp_telemetry_sample *sample);
+
 /*!
  * \brief Send a comfort noise packet to the RTP instance
  *
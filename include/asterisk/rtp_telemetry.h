@@ -0,0 +1,114 @@
+/*
+ * Asterisk -- An open source telephony toolkit.
+ *
+ * See http://www.asterisk.org for more information about
+ * the Asterisk project. Please do not directly contact
+ * any of the maintainers of this project for assistance;
+ * the project provides a web site, mailing lists and IRC
+ * channels for your use.
+ *
+ * This program is free software, distributed under the terms of
+ * the GNU General Public License Version 2. See the LICENSE file
+ * at the top of the source tree.
+ */
+
+/*! \file
+ * \brief Aggregated RTP/RTCP call quality telemetry
+ *
+ * RTP engines report a sample for every RTCP report they send or receive.
+ * Samples are folded into per-thread counters keyed on the peer the stream
+ * belongs to, the remote media host (the trunk or carrier gateway) and the
+ * codec.  Keys are looked up once, when the stream's peer, remote address or
+ * codec changes, and held by the stream; recording a sample only takes the
+ * recording thread's own lock.  The counters are summed only when someone
+ * asks for them through the CLI or the manager interface.
+ */
+
+#ifndef _ASTERISK_RTP_TELEMETRY_H
+#define _ASTERISK_RTP_TELEMETRY_H
+
+#if defined(__cplusplus) || defined(c_plusplus)
+extern "C" {
+#endif
+
+struct ast_rtp_telemetry_key;
+
+/*! \brief Dimensions telemetry is aggregated over */
+enum ast_rtp_telemetry_dimension {
+	/*! Peer name set on the RTP instance by the channel driver */
+	AST_RTP_TELEMETRY_PEER = 0,
+	/*! Remote media host */
+	AST_RTP_TELEMETRY_TRUNK,
+	/*! Codec of the stream */
+	AST_RTP_TELEMETRY_CODEC,
+	AST_RTP_TELEMETRY_DIMENSIONS,
+};
+
+/*! \brief One quality observation, taken from an RTCP report */
+struct ast_rtp_telemetry_sample {
+	/*! Key per dimension, NULL where unknown */
+	struct ast_rtp_telemetry_key *keys[AST_RTP_TELEMETRY_DIMENSIONS];
+	/*! Interarrival jitter, in ms */
+	double jitter;
+	/*! Fraction of packets lost since the previous report, in percent */
+	double loss;
+	/*! Round trip time, in ms, or a negative value if not known */
+	double rtt;
+};
+
+/*!
+ * \brief Find the key telemetry for a name is recorded under
+ *
+ * \param dimension What the name is
+ * \param name Peer name, remote media host or codec name
+ *
+ * \return A reference to the key, to be released with
+ *         ast_rtp_telemetry_key_release(), or NULL if name is empty or the key
+ *         table is full of keys in use
+ *
+ * \note Keys no stream holds any more are evicted, oldest first, when the
+ *       table fills up.
+ */
+struct ast_rtp_telemetry_key *ast_rtp_telemetry_key_get(enum ast_rtp_telemetry_dimension dimension, const char *name);
+
+/*!
+ * \brief Release a key returned by ast_rtp_telemetry_key_get()
+ *
+ * \param key The key, may be NULL
+ */
+void ast_rtp_telemetry_key_release(struct ast_rtp_telemetry_key *key);
+
+/*!
+ * \brief Record a quality sample
+ *
+ * \param sample The observation
+ *
+ * \note The caller must hold a reference to every key in the sample.  Only
+ *       the calling thread's own counter lock is taken.
+ */
+void ast_rtp_telemetry_record(const struct ast_rtp_telemetry_sample *sample);
+
+/*!
+ * \brief Estimate a MOS score from network impairments
+ *
+ * \param jitter Interarrival jitter, in ms
+ * \param loss Packet loss, in percent
+ * \param rtt Round trip time, in ms, negative if not known
+ *
+ * \return MOS between 1.0 and 4.5, using the simplified ITU-T G.107 E-model
+ */
+double ast_rtp_telemetry_mos(double jitter, double loss, double rtt);
+
+/*!
+ * \brief Initialize RTP telemetry
+ *
+ * \retval 0 success
+ * \retval -1 failure
+ */
+int ast_rtp_telemetry_init(void);
+
+#if defined(__cplusplus) || defined(c_plusplus)
+}
+#endif
+
+#endif /* _ASTERISK_RTP_TELEMETRY_H */
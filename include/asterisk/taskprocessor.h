@@ -102,4 +102,11 @@ int ast_taskprocessor_push(struct ast_taskprocessor *tps, int (*task_exe)(void *
  */
 const char *ast_taskprocessor_name(struct ast_taskprocessor *tps);
 
+/*!
+ * \brief Return the current size of the taskprocessor queue
+ * \param tps The taskprocessor structure
+ * \return The number of tasks waiting to be executed, or -1 if tps is NULL
+ */
+long ast_taskprocessor_size(struct ast_taskprocessor *tps);
+
 #endif /* __AST_TASKPROCESSOR_H__ */
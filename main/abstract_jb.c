@@ -45,6 +45,7 @@ ASTERISK_FILE_VERSION(__FILE__, "$Revision: 369005 $")
 #include "asterisk/abstract_jb.h"
 #include "fixedjitterbuf.h"
 #include "jitterbuf.h"
+#include "ringjitterbuf.h"
 
 /*! Internal jb flags */
 enum {
@@ -75,6 +76,16 @@ static long jb_next_adaptive(void *jb);
 static int jb_remove_adaptive(void *jb, struct ast_frame **fout);
 static void jb_force_resynch_adaptive(void *jb);
 static void jb_empty_and_reset_adaptive(void *jb);
+/* ring */
+static void *jb_create_ring(struct ast_jb_conf *general_config, long resynch_threshold);
+static void jb_destroy_ring(void *jb);
+static int jb_put_first_ring(void *jb, struct ast_frame *fin, long now);
+static int jb_put_ring(void *jb, struct ast_frame *fin, long now);
+static int jb_get_ring(void *jb, struct ast_frame **fout, long now, long interpl);
+static long jb_next_ring(void *jb);
+static int jb_remove_ring(void *jb, struct ast_frame **fout);
+static void jb_force_resynch_ring(void *jb);
+static void jb_empty_and_reset_ring(void *jb);
 
 /* Available jb implementations */
 static const struct ast_jb_impl avail_impl[] = {
@@ -103,6 +114,19 @@ static const struct ast_jb_impl avail_impl[] = {
 		.remove = jb_remove_adaptive,
 		.force_resync = jb_force_resynch_adaptive,
 		.empty_and_reset = jb_empty_and_reset_adaptive,
+	},
+	{
+		.name = "ring",
+		.type = AST_JB_RING,
+		.create = jb_create_ring,
+		.destroy = jb_destroy_ring,
+		.put_first = jb_put_first_ring,
+		.put = jb_put_ring,
+		.get = jb_get_ring,
+		.next = jb_next_ring,
+		.remove = jb_remove_ring,
+		.force_resync = jb_force_resynch_ring,
+		.empty_and_reset = jb_empty_and_reset_ring,
 	}
 };
 
@@ -113,6 +137,8 @@ static const int fixed_to_abstract_code[] =
 	{AST_JB_IMPL_OK, AST_JB_IMPL_DROP, AST_JB_IMPL_INTERP, AST_JB_IMPL_NOFRAME};
 static const int adaptive_to_abstract_code[] =
 	{AST_JB_IMPL_OK, AST_JB_IMPL_NOFRAME, AST_JB_IMPL_NOFRAME, AST_JB_IMPL_INTERP, AST_JB_IMPL_DROP, AST_JB_IMPL_OK};
+static const int ring_to_abstract_code[] =
+	{AST_JB_IMPL_OK, AST_JB_IMPL_DROP, AST_JB_IMPL_INTERP, AST_JB_IMPL_NOFRAME};
 
 /* JB_GET actions (used only for the frames log) */
 static const char * const jb_get_actions[] = {"Delivered", "Dropped", "Interpolated", "No"};
@@ -792,6 +818,99 @@ static void jb_empty_and_reset_adaptive(void *jb)
 	jb_reset(adaptivejb);
 }
 
+/* ring */
+static void *jb_create_ring(struct ast_jb_conf *general_config, long resynch_threshold)
+{
+	struct ring_jb_conf conf;
+
+	conf.jbsize = general_config->max_size;
+	conf.resync_threshold = resynch_threshold;
+	conf.target_extra = general_config->target_extra;
+
+	return ring_jb_new(&conf);
+}
+
+static void jb_destroy_ring(void *jb)
+{
+	struct ring_jb *ringjb = (struct ring_jb *) jb;
+
+	ring_jb_destroy(ringjb);
+}
+
+
+static int jb_put_first_ring(void *jb, struct ast_frame *fin, long now)
+{
+	struct ring_jb *ringjb = (struct ring_jb *) jb;
+	int res;
+
+	res = ring_jb_put_first(ringjb, fin, fin->len, fin->ts, now);
+
+	return ring_to_abstract_code[res];
+}
+
+
+static int jb_put_ring(void *jb, struct ast_frame *fin, long now)
+{
+	struct ring_jb *ringjb = (struct ring_jb *) jb;
+	int res;
+
+	res = ring_jb_put(ringjb, fin, fin->len, fin->ts, now);
+
+	return ring_to_abstract_code[res];
+}
+
+
+static int jb_get_ring(void *jb, struct ast_frame **fout, long now, long interpl)
+{
+	struct ring_jb *ringjb = (struct ring_jb *) jb;
+	struct ring_jb_frame frame;
+	int res;
+
+	res = ring_jb_get(ringjb, &frame, now, interpl);
+	*fout = frame.data;
+
+	return ring_to_abstract_code[res];
+}
+
+
+static long jb_next_ring(void *jb)
+{
+	struct ring_jb *ringjb = (struct ring_jb *) jb;
+
+	return ring_jb_next(ringjb);
+}
+
+
+static int jb_remove_ring(void *jb, struct ast_frame **fout)
+{
+	struct ring_jb *ringjb = (struct ring_jb *) jb;
+	struct ring_jb_frame frame;
+	int res;
+
+	res = ring_jb_remove(ringjb, &frame);
+	*fout = frame.data;
+
+	return ring_to_abstract_code[res];
+}
+
+
+static void jb_force_resynch_ring(void *jb)
+{
+	struct ring_jb *ringjb = (struct ring_jb *) jb;
+
+	ring_jb_set_force_resynch(ringjb);
+}
+
+static void jb_empty_and_reset_ring(void *jb)
+{
+	struct ring_jb *ringjb = jb;
+	struct ring_jb_frame f;
+
+	while (ring_jb_remove(ringjb, &f) == RING_JB_OK) {
+		ast_frfree(f.data);
+	}
+}
+
 const struct ast_jb_impl *ast_jb_get_impl(enum ast_jb_type type)
 {
 	int i;
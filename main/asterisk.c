@@ -148,6 +148,7 @@ int daemon(int, int);  /* defined in libresolv of all places */
 #include "asterisk/ccss.h"
 #include "asterisk/test.h"
 #include "asterisk/rtp_engine.h"
+#include "asterisk/rtp_telemetry.h"
 #include "asterisk/format.h"
 #include "asterisk/aoc.h"
 
@@ -189,6 +190,12 @@ int option_maxfiles;				/*!< Max number of open file handles (files, sockets) */
 #if defined(HAVE_SYSINFO)
 long option_minmemfree;				/*!< Minimum amount of free system memory - stop accepting calls if free memory falls below this watermark */
 #endif
+int option_prompt_cache;			/*!< Keep sound file lookups and contents in memory */
+long option_prompt_cache_size = 32;		/*!< Memory the prompt cache may hold, in MB */
+int option_prompt_transcode;			/*!< Transcode prompts once into the formats channels take */
+int option_record_writers;			/*!< Threads writing out recordings, 0 to write them from the recording thread */
+int option_record_queue_size = 64;		/*!< Data a recording may have waiting for the writer threads, in kB */
+int option_record_fsync = -1;			/*!< Seconds between syncs of recordings, 0 to sync on close only, -1 never */
 
 /*! @} */
 
@@ -196,6 +203,7 @@ struct ast_eid ast_eid_default;
 
 /* XXX tmpdir is a subdir of the spool directory, and no way to remap it */
 char record_cache_dir[AST_CACHE_DIR_LEN] = DEFAULT_TMP_DIR;
+char prompt_transcode_dir[AST_CACHE_DIR_LEN];
 
 static int ast_socket = -1;		/*!< UNIX Socket for allowing remote control */
 static int ast_consock = -1;		/*!< UNIX Socket for controlling another asterisk */
@@ -494,6 +502,15 @@ static char *handle_show_settings(struct ast_cli_entry *e, int cmd, struct ast_c
 	ast_cli(a->fd, "  Internal timing:             %s\n", ast_test_flag(&ast_options, AST_OPT_FLAG_INTERNAL_TIMING) ? "Enabled" : "Disabled");
 	ast_cli(a->fd, "  Transmit silence during rec: %s\n", ast_test_flag(&ast_options, AST_OPT_FLAG_TRANSMIT_SILENCE) ? "Enabled" : "Disabled");
 	ast_cli(a->fd, "  Generic PLC:                 %s\n", ast_test_flag(&ast_options, AST_OPT_FLAG_GENERIC_PLC) ? "Enabled" : "Disabled");
+	if (option_prompt_cache)
+		ast_cli(a->fd, "  Prompt cache:                %ld MB\n", option_prompt_cache_size);
+	else
+		ast_cli(a->fd, "  Prompt cache:                Disabled\n");
+	ast_cli(a->fd, "  Prompt transcoding:          %s\n", option_prompt_transcode ? "Enabled" : "Disabled");
+	if (option_record_writers)
+		ast_cli(a->fd, "  Recording writers:           %d\n", option_record_writers);
+	else
+		ast_cli(a->fd, "  Recording writers:           Disabled\n");
 
 	ast_cli(a->fd, "\n* Subsystems\n");
 	ast_cli(a->fd, "  -------------\n");
@@ -3165,6 +3182,38 @@ static void ast_readconfig(void)
 		/* Specify cache directory */
 		}  else if (!strcasecmp(v->name, "record_cache_dir")) {
 			ast_copy_string(record_cache_dir, v->value, AST_CACHE_DIR_LEN);
+		/* Keep sound file lookups and contents in memory */
+		} else if (!strcasecmp(v->name, "prompt_cache")) {
+			option_prompt_cache = ast_true(v->value);
+		/* Memory the prompt cache may hold, in MB */
+		} else if (!strcasecmp(v->name, "prompt_cache_size")) {
+			if ((sscanf(v->value, "%30ld", &option_prompt_cache_size) != 1) || (option_prompt_cache_size <= 0)) {
+				ast_log(LOG_WARNING, "Invalid prompt_cache_size '%s', using 32 MB\n", v->value);
+				option_prompt_cache_size = 32;
+			}
+		/* Transcode prompts once into the formats channels take, instead of as they are played */
+		} else if (!strcasecmp(v->name, "prompt_transcode")) {
+			option_prompt_transcode = ast_true(v->value);
+		/* Where transcoded prompts are kept */
+		} else if (!strcasecmp(v->name, "prompt_transcode_dir")) {
+			ast_copy_string(prompt_transcode_dir, v->value, AST_CACHE_DIR_LEN);
+		/* Write recordings from a pool of threads instead of the threads recording them */
+		} else if (!strcasecmp(v->name, "record_writers")) {
+			if ((sscanf(v->value, "%30d", &option_record_writers) != 1) || (option_record_writers < 0)) {
+				option_record_writers = 0;
+			}
+		} else if (!strcasecmp(v->name, "record_queue_size")) {
+			if ((sscanf(v->value, "%30d", &option_record_queue_size) != 1) || (option_record_queue_size < 4)) {
+				ast_log(LOG_WARNING, "Invalid record_queue_size '%s', using 64 kB\n", v->value);
+				option_record_queue_size = 64;
+			}
+		/* When recordings are synced to disk: never, on close, or every so many seconds */
+		} else if (!strcasecmp(v->name, "record_fsync")) {
+			if (!strcasecmp(v->value, "close")) {
+				option_record_fsync = 0;
+			} else if ((sscanf(v->value, "%30d", &option_record_fsync) != 1) || (option_record_fsync <= 0)) {
+				option_record_fsync = -1;
+			}
 		/* Build transcode paths via SLINEAR, instead of directly */
 		} else if (!strcasecmp(v->name, "transcode_via_sln")) {
 			ast_set2_flag(&ast_options, ast_true(v->value), AST_OPT_FLAG_TRANSCODE_VIA_SLIN);
@@ -4027,6 +4076,11 @@ int main(int argc, char *argv[])
 	ast_dsp_init();
 	ast_udptl_init();
 
+	if (ast_rtp_telemetry_init()) {
+		printf("%s", term_quit());
+		exit(1);
+	}
+
 	if (ast_image_init()) {
 		printf("%s", term_quit());
 		exit(1);
@@ -41,9 +41,11 @@ ASTERISK_FILE_VERSION(__FILE__, "$Revision: 369005 $")
 #include "asterisk/slinfactory.h"
 #include "asterisk/frame.h"
 #include "asterisk/translate.h"
+#include "asterisk/astobj2.h"
 
 #define AST_AUDIOHOOK_SYNC_TOLERANCE 100 /*!< Tolerance in milliseconds for audiohooks synchronization */
 #define AST_AUDIOHOOK_SMALL_QUEUE_TOLERANCE 100 /*!< When small queue is enabled, this is the maximum amount of audio that can remain queued at a time. */
+#define AST_AUDIOHOOK_TAP_MS 2000 /*!< Audio a tap holds for each direction, in milliseconds */
 
 struct ast_audiohook_translate {
 	struct ast_trans_pvt *trans_pvt;
@@ -63,8 +65,255 @@ struct ast_audiohook_list {
 	AST_LIST_HEAD_NOLOCK(, ast_audiohook) spy_list;
 	AST_LIST_HEAD_NOLOCK(, ast_audiohook) whisper_list;
 	AST_LIST_HEAD_NOLOCK(, ast_audiohook) manipulate_list;
+	struct ast_audiohook_tap *tap;
 };
 
+/*!
+ * \brief Signed linear audio of a channel, shared by all of its spies
+ *
+ * Each frame passing through the audiohook list is written here once, in
+ * the signed linear the list translated it to, and every spy reads it from
+ * its own position. Spies therefore do not get a copy of every frame fed to
+ * slinfactories of their own, and a spy reading the far side of the call
+ * mixes it straight from here.
+ *
+ * \note The tap is locked after any audiohook reading from it.
+ */
+struct ast_audiohook_tap {
+	/*! Rate of the audio held, a new rate starts the tap over */
+	unsigned int rate;
+	/*! Bumped when the tap starts over, so readers catch up with it */
+	unsigned int epoch;
+	/*! Samples each ring holds */
+	size_t size;
+	struct {
+		int16_t *ring;
+		/*! Samples ever written */
+		uint64_t head;
+		/*! When a frame was last written */
+		struct timeval time;
+	} dir[2];
+};
+
+/*! \brief Index of a direction in the tap and audiohook positions */
+#define TAP_DIR(direction) ((direction) == AST_AUDIOHOOK_DIRECTION_READ ? 0 : 1)
+
+static void audiohook_tap_destructor(void *obj)
+{
+	struct ast_audiohook_tap *tap = obj;
+
+	ast_free(tap->dir[0].ring);
+	ast_free(tap->dir[1].ring);
+}
+
+/*!
+ * \internal
+ * \brief Write a signed linear frame to one direction of a tap
+ * \return when the direction was last written before this frame
+ */
+static struct timeval audiohook_tap_write(struct ast_audiohook_tap *tap, enum ast_audiohook_direction direction, struct ast_frame *frame, unsigned int rate)
+{
+	int d = TAP_DIR(direction);
+	struct timeval previous;
+	const int16_t *data = frame->data.ptr;
+	size_t samples = frame->datalen / sizeof(int16_t);
+
+	ao2_lock(tap);
+	if (tap->rate != rate) {
+		size_t size = rate / 1000 * AST_AUDIOHOOK_TAP_MS;
+		int i;
+
+		/* Readers' positions are no good at a new rate, start over */
+		for (i = 0; i < 2; i++) {
+			ast_free(tap->dir[i].ring);
+			tap->dir[i].ring = ast_malloc(size * sizeof(int16_t));
+			tap->dir[i].head = 0;
+		}
+		if (!tap->dir[0].ring || !tap->dir[1].ring) {
+			size = 0;
+		}
+		tap->size = size;
+		tap->rate = rate;
+		tap->epoch++;
+	}
+	previous = tap->dir[d].time;
+	tap->dir[d].time = ast_tvnow();
+
+	if (tap->size) {
+		/* Anything that would not fit would be overwritten anyway */
+		if (samples > tap->size) {
+			data += samples - tap->size;
+			tap->dir[d].head += samples - tap->size;
+			samples = tap->size;
+		}
+		while (samples) {
+			size_t at = tap->dir[d].head % tap->size;
+			size_t n = MIN(samples, tap->size - at);
+
+			memcpy(tap->dir[d].ring + at, data, n * sizeof(int16_t));
+			tap->dir[d].head += n;
+			data += n;
+			samples -= n;
+		}
+	}
+	ao2_unlock(tap);
+
+	return previous;
+}
+
+/*!
+ * \internal
+ * \brief Bring an audiohook's positions in its tap up to date
+ * \note The tap must be locked.
+ */
+static void audiohook_tap_catch_up(struct ast_audiohook *audiohook)
+{
+	struct ast_audiohook_tap *tap = audiohook->tap;
+	int i;
+
+	for (i = 0; i < 2; i++) {
+		if (audiohook->tap_epoch != tap->epoch) {
+			audiohook->tap_pos[i] = tap->dir[i].head;
+		} else if (tap->dir[i].head - audiohook->tap_pos[i] > tap->size) {
+			/* Fell so far behind the audio was overwritten, skip what is lost */
+			audiohook->tap_pos[i] = tap->dir[i].head - tap->size;
+		}
+	}
+	audiohook->tap_epoch = tap->epoch;
+}
+
+/*! \internal \brief Samples in a tap that an audiohook has not read yet \note The tap must be locked. */
+static size_t audiohook_tap_available(struct ast_audiohook *audiohook, int d)
+{
+	return audiohook->tap->dir[d].head - audiohook->tap_pos[d];
+}
+
+/*!
+ * \internal
+ * \brief Duplicate samples from a tap into a new frame, and consume them
+ * \note The tap must be locked.
+ */
+static struct ast_frame *audiohook_tap_dup(struct ast_audiohook *audiohook, int d, struct ast_frame *frame)
+{
+	struct ast_audiohook_tap *tap = audiohook->tap;
+	size_t at = audiohook->tap_pos[d] % tap->size;
+	size_t samples = frame->samples;
+	int16_t buf[samples];
+
+	if (at + samples <= tap->size) {
+		/* Duplicated straight out of the ring */
+		frame->data.ptr = tap->dir[d].ring + at;
+	} else {
+		size_t n = tap->size - at;
+
+		memcpy(buf, tap->dir[d].ring + at, n * sizeof(int16_t));
+		memcpy(buf + n, tap->dir[d].ring, (samples - n) * sizeof(int16_t));
+		frame->data.ptr = buf;
+	}
+	audiohook->tap_pos[d] += samples;
+
+	return ast_frdup(frame);
+}
+
+/*!
+ * \internal
+ * \brief Mix samples from a tap into a buffer, and consume them
+ * \note The tap must be locked.
+ */
+static void audiohook_tap_mix(struct ast_audiohook *audiohook, int d, int16_t *buf, size_t samples)
+{
+	struct ast_audiohook_tap *tap = audiohook->tap;
+	size_t at = audiohook->tap_pos[d] % tap->size;
+	size_t i;
+
+	for (i = 0; i < samples; i++, at++) {
+		if (at == tap->size) {
+			at = 0;
+		}
+		ast_slinear_saturated_add(&buf[i], &tap->dir[d].ring[at]);
+	}
+	audiohook->tap_pos[d] += samples;
+}
+
+/*! \internal \brief Whether an audiohook has audio of a direction muted */
+static int audiohook_muted(struct ast_audiohook *audiohook, enum ast_audiohook_direction direction)
+{
+	return (ast_test_flag(audiohook, AST_AUDIOHOOK_MUTE_READ) && direction == AST_AUDIOHOOK_DIRECTION_READ) ||
+		(ast_test_flag(audiohook, AST_AUDIOHOOK_MUTE_WRITE) && direction == AST_AUDIOHOOK_DIRECTION_WRITE) ||
+		(ast_test_flag(audiohook, AST_AUDIOHOOK_MUTE_READ | AST_AUDIOHOOK_MUTE_WRITE) == (AST_AUDIOHOOK_MUTE_READ | AST_AUDIOHOOK_MUTE_WRITE));
+}
+
+/*!
+ * \internal
+ * \brief Let a spy know a frame was written to its tap
+ *
+ * Applies the queueing and trigger policy of ast_audiohook_write_frame() to
+ * the spy's positions in the tap.
+ *
+ * \note The audiohook must be locked.
+ */
+static void audiohook_tap_written(struct ast_audiohook *audiohook, enum ast_audiohook_direction direction, struct timeval previous, size_t samples)
+{
+	struct ast_audiohook_tap *tap = audiohook->tap;
+	int d = TAP_DIR(direction);
+	int per_ms, our_ms, other_ms;
+	size_t our_samples, other_samples;
+
+	ao2_lock(tap);
+	audiohook_tap_catch_up(audiohook);
+	per_ms = MAX(tap->rate / 1000, 1);
+	/* What was waiting before this frame, as a slinfactory would have seen it */
+	our_samples = audiohook_tap_available(audiohook, d);
+	our_samples -= MIN(our_samples, samples);
+	our_ms = ast_tvdiff_ms(tap->dir[d].time, previous) + our_samples / per_ms;
+	other_samples = audiohook_tap_available(audiohook, !d);
+	other_ms = other_samples / per_ms;
+
+	if (ast_test_flag(audiohook, AST_AUDIOHOOK_TRIGGER_SYNC) && other_samples && (our_ms - other_ms > AST_AUDIOHOOK_SYNC_TOLERANCE)) {
+		ast_debug(1, "Flushing audiohook %p so it remains in sync\n", audiohook);
+		audiohook->tap_pos[0] = tap->dir[0].head;
+		audiohook->tap_pos[1] = tap->dir[1].head;
+	} else if (ast_test_flag(audiohook, AST_AUDIOHOOK_SMALL_QUEUE) && ((our_ms > AST_AUDIOHOOK_SMALL_QUEUE_TOLERANCE) || (other_ms > AST_AUDIOHOOK_SMALL_QUEUE_TOLERANCE))) {
+		ast_debug(1, "Audiohook %p has stale audio in its tap. Skipping it\n", audiohook);
+		audiohook->tap_pos[0] = tap->dir[0].head;
+		audiohook->tap_pos[1] = tap->dir[1].head;
+	}
+	ao2_unlock(tap);
+
+	if ((ast_test_flag(audiohook, AST_AUDIOHOOK_TRIGGER_MODE) == AST_AUDIOHOOK_TRIGGER_READ) && (direction == AST_AUDIOHOOK_DIRECTION_READ)) {
+		ast_cond_signal(&audiohook->trigger);
+	} else if ((ast_test_flag(audiohook, AST_AUDIOHOOK_TRIGGER_MODE) == AST_AUDIOHOOK_TRIGGER_WRITE) && (direction == AST_AUDIOHOOK_DIRECTION_WRITE)) {
+		ast_cond_signal(&audiohook->trigger);
+	} else if (ast_test_flag(audiohook, AST_AUDIOHOOK_TRIGGER_SYNC)) {
+		ast_cond_signal(&audiohook->trigger);
+	}
+}
+
+/*! \internal \brief Have a spy read from the tap of the list it is being attached to */
+static int audiohook_tap_attach(struct ast_audiohook_list *audiohook_list, struct ast_audiohook *audiohook)
+{
+	if (!audiohook_list->tap && !(audiohook_list->tap = ao2_alloc(sizeof(*audiohook_list->tap), audiohook_tap_destructor))) {
+		return -1;
+	}
+
+	ast_audiohook_lock(audiohook);
+	if (audiohook->tap != audiohook_list->tap) {
+		if (audiohook->tap) {
+			ao2_ref(audiohook->tap, -1);
+		}
+		ao2_ref(audiohook_list->tap, +1);
+		audiohook->tap = audiohook_list->tap;
+		/* Only audio from here on is of interest */
+		ao2_lock(audiohook->tap);
+		audiohook->tap_epoch = audiohook->tap->epoch - 1;
+		audiohook_tap_catch_up(audiohook);
+		ao2_unlock(audiohook->tap);
+	}
+	ast_audiohook_unlock(audiohook);
+
+	return 0;
+}
+
 static int audiohook_set_internal_rate(struct ast_audiohook *audiohook, int rate, int reset)
 {
 	struct ast_format slin;
@@ -144,6 +393,11 @@ int ast_audiohook_destroy(struct ast_audiohook *audiohook)
 	if (audiohook->trans_pvt)
 		ast_translator_free_path(audiohook->trans_pvt);
 
+	if (audiohook->tap) {
+		ao2_ref(audiohook->tap, -1);
+		audiohook->tap = NULL;
+	}
+
 	/* Lock and trigger be gone! */
 	ast_cond_destroy(&audiohook->trigger);
 	ast_mutex_destroy(&audiohook->lock);
@@ -214,6 +468,146 @@ int ast_audiohook_write_frame(struct ast_audiohook *audiohook, enum ast_audiohoo
 	return 0;
 }
 
+static struct ast_frame *audiohook_tap_read_frame_single(struct ast_audiohook *audiohook, size_t samples, enum ast_audiohook_direction direction)
+{
+	struct ast_audiohook_tap *tap = audiohook->tap;
+	int d = TAP_DIR(direction);
+	int vol = (direction == AST_AUDIOHOOK_DIRECTION_READ ? audiohook->options.read_volume : audiohook->options.write_volume);
+	struct ast_frame frame = {
+		.frametype = AST_FRAME_VOICE,
+		.datalen = samples * sizeof(int16_t),
+		.samples = samples,
+	};
+	struct ast_frame *out;
+
+	ast_format_set(&frame.subclass.format, ast_format_slin_by_rate(audiohook->hook_internal_samp_rate), 0);
+
+	ao2_lock(tap);
+	audiohook_tap_catch_up(audiohook);
+	if (!tap->size || samples > audiohook_tap_available(audiohook, d)) {
+		ao2_unlock(tap);
+		return NULL;
+	}
+	out = audiohook_tap_dup(audiohook, d, &frame);
+	ao2_unlock(tap);
+
+	if (out && audiohook_muted(audiohook, direction)) {
+		ast_frame_clear(out);
+	} else if (out && vol) {
+		ast_frame_adjust_volume(out, vol);
+	}
+
+	return out;
+}
+
+/*!
+ * \internal
+ * \brief Read both directions of a tap, mixed
+ *
+ * Only the frames that are handed out are allocated. The far side is mixed
+ * straight from the tap unless it has to be adjusted or referenced first.
+ */
+static struct ast_frame *audiohook_tap_read_frame_both(struct ast_audiohook *audiohook, size_t samples, struct ast_frame **read_reference, struct ast_frame **write_reference)
+{
+	struct ast_audiohook_tap *tap = audiohook->tap;
+	struct ast_frame frame = {
+		.frametype = AST_FRAME_VOICE,
+		.datalen = samples * sizeof(int16_t),
+		.samples = samples,
+	};
+	struct ast_frame *read_frame = NULL, *write_frame = NULL;
+	int usable_read, usable_write, mute_read, mute_write;
+
+	ast_format_set(&frame.subclass.format, ast_format_slin_by_rate(audiohook->hook_internal_samp_rate), 0);
+	mute_read = audiohook_muted(audiohook, AST_AUDIOHOOK_DIRECTION_READ);
+	mute_write = audiohook_muted(audiohook, AST_AUDIOHOOK_DIRECTION_WRITE);
+
+	ao2_lock(tap);
+	audiohook_tap_catch_up(audiohook);
+
+	/* Make sure both directions have the required samples */
+	usable_read = tap->size && audiohook_tap_available(audiohook, 0) >= samples;
+	usable_write = tap->size && audiohook_tap_available(audiohook, 1) >= samples;
+
+	if (!usable_read && !usable_write) {
+		ao2_unlock(tap);
+		ast_debug(1, "Tap %p fails to provide %zd samples in either direction for audiohook %p\n", tap, samples, audiohook);
+		return NULL;
+	}
+
+	/* If we want to provide only the read direction make sure we aren't waiting for other audio */
+	if (usable_read && !usable_write && (ast_tvdiff_ms(ast_tvnow(), tap->dir[1].time) < (samples/8)*2)) {
+		ao2_unlock(tap);
+		ast_debug(3, "Write direction of tap %p was pretty quick last time, waiting for it.\n", tap);
+		return NULL;
+	}
+
+	/* If we want to provide only the write direction make sure we aren't waiting for other audio */
+	if (usable_write && !usable_read && (ast_tvdiff_ms(ast_tvnow(), tap->dir[0].time) < (samples/8)*2)) {
+		ao2_unlock(tap);
+		ast_debug(3, "Read direction of tap %p was pretty quick last time, waiting for it.\n", tap);
+		return NULL;
+	}
+
+	if (usable_read && !(read_frame = audiohook_tap_dup(audiohook, 0, &frame))) {
+		ao2_unlock(tap);
+		return NULL;
+	}
+	if (usable_write) {
+		if (read_frame && !mute_write && !audiohook->options.write_volume && !write_reference) {
+			/* Nothing to do to it on its own, mix it in where it lies */
+			if (mute_read) {
+				ast_frame_clear(read_frame);
+				mute_read = 0;
+			} else if (audiohook->options.read_volume) {
+				ast_frame_adjust_volume(read_frame, audiohook->options.read_volume);
+			}
+			if (read_reference) {
+				*read_reference = ast_frdup(read_frame);
+			}
+			audiohook_tap_mix(audiohook, 1, read_frame->data.ptr, samples);
+			ao2_unlock(tap);
+			return read_frame;
+		}
+		write_frame = audiohook_tap_dup(audiohook, 1, &frame);
+	}
+	ao2_unlock(tap);
+
+	if (read_frame) {
+		if (mute_read) {
+			ast_frame_clear(read_frame);
+		} else if (audiohook->options.read_volume) {
+			ast_frame_adjust_volume(read_frame, audiohook->options.read_volume);
+		}
+		if (read_reference) {
+			*read_reference = ast_frdup(read_frame);
+		}
+	}
+	if (write_frame) {
+		if (mute_write) {
+			ast_frame_clear(write_frame);
+		} else if (audiohook->options.write_volume) {
+			ast_frame_adjust_volume(write_frame, audiohook->options.write_volume);
+		}
+		if (write_reference) {
+			*write_reference = ast_frdup(write_frame);
+		}
+	}
+
+	if (read_frame && write_frame) {
+		int16_t *data1 = read_frame->data.ptr, *data2 = write_frame->data.ptr;
+		size_t i;
+
+		for (i = 0; i < samples; i++, data1++, data2++) {
+			ast_slinear_saturated_add(data1, data2);
+		}
+		ast_frfree(write_frame);
+		return read_frame;
+	}
+
+	return read_frame ? read_frame : write_frame;
+}
+
 static struct ast_frame *audiohook_read_frame_single(struct ast_audiohook *audiohook, size_t samples, enum ast_audiohook_direction direction)
 {
 	struct ast_slinfactory *factory = (direction == AST_AUDIOHOOK_DIRECTION_READ ? &audiohook->read_factory : &audiohook->write_factory);
@@ -362,10 +756,17 @@ static struct ast_frame *audiohook_read_frame_helper(struct ast_audiohook *audio
 		samples_converted = samples * (ast_format_rate(format) / (float) audiohook->hook_internal_samp_rate);
 	}
 
-	if (!(read_frame = (direction == AST_AUDIOHOOK_DIRECTION_BOTH ? 
-		audiohook_read_frame_both(audiohook, samples_converted, read_reference, write_reference) : 
-		audiohook_read_frame_single(audiohook, samples_converted, direction)))) { 
-		return NULL; 
+	if (audiohook->tap) {
+		read_frame = (direction == AST_AUDIOHOOK_DIRECTION_BOTH ?
+			audiohook_tap_read_frame_both(audiohook, samples_converted, read_reference, write_reference) :
+			audiohook_tap_read_frame_single(audiohook, samples_converted, direction));
+	} else {
+		read_frame = (direction == AST_AUDIOHOOK_DIRECTION_BOTH ?
+			audiohook_read_frame_both(audiohook, samples_converted, read_reference, write_reference) :
+			audiohook_read_frame_single(audiohook, samples_converted, direction));
+	}
+	if (!read_frame) {
+		return NULL;
 	}
 
 	/* If they don't want signed linear back out, we'll have to send it through the translation path */
@@ -453,6 +854,12 @@ int ast_audiohook_attach(struct ast_channel *chan, struct ast_audiohook *audioho
 		chan->audiohooks->list_internal_samp_rate = 8000;
 	}
 
+	/* Spies read the audio the list shares with all of them */
+	if (audiohook->type == AST_AUDIOHOOK_TYPE_SPY && audiohook_tap_attach(chan->audiohooks, audiohook)) {
+		ast_channel_unlock(chan);
+		return -1;
+	}
+
 	/* Drop into respective list */
 	if (audiohook->type == AST_AUDIOHOOK_TYPE_SPY)
 		AST_LIST_INSERT_TAIL(&chan->audiohooks->spy_list, audiohook, list);
@@ -540,6 +947,11 @@ int ast_audiohook_detach_list(struct ast_audiohook_list *audiohook_list)
 		if (audiohook_list->out_translate[i].trans_pvt)
 			ast_translator_free_path(audiohook_list->out_translate[i].trans_pvt);
 	}
+
+	/* Spies still hold on to the tap until they are destroyed */
+	if (audiohook_list->tap) {
+		ao2_ref(audiohook_list->tap, -1);
+	}
 	
 	/* Free ourselves */
 	ast_free(audiohook_list);
@@ -785,6 +1197,7 @@ static struct ast_frame *audio_audiohook_write_list(struct ast_channel *chan, st
 {
 	struct ast_frame *start_frame = frame, *middle_frame = frame, *end_frame = frame;
 	struct ast_audiohook *audiohook = NULL;
+	struct timeval previous = { 0, };
 	int samples;
 	int middle_frame_manipulated = 0;
 	int removed = 0;
@@ -796,7 +1209,10 @@ static struct ast_frame *audio_audiohook_write_list(struct ast_channel *chan, st
 	samples = middle_frame->samples;
 
 	/* ---Part_2: Send middle_frame to spy and manipulator lists.  middle_frame is guaranteed to be SLINEAR here.*/
-	/* Queue up signed linear frame to each spy */
+	/* Write the signed linear frame to the tap once, for all spies to read */
+	if (!AST_LIST_EMPTY(&audiohook_list->spy_list)) {
+		previous = audiohook_tap_write(audiohook_list->tap, direction, middle_frame, audiohook_list->list_internal_samp_rate);
+	}
 	AST_LIST_TRAVERSE_SAFE_BEGIN(&audiohook_list->spy_list, audiohook, list) {
 		ast_audiohook_lock(audiohook);
 		if (audiohook->status != AST_AUDIOHOOK_STATUS_RUNNING) {
@@ -807,7 +1223,7 @@ static struct ast_frame *audio_audiohook_write_list(struct ast_channel *chan, st
 			continue;
 		}
 		audiohook_set_internal_rate(audiohook, audiohook_list->list_internal_samp_rate, 1);
-		ast_audiohook_write_frame(audiohook, direction, middle_frame);
+		audiohook_tap_written(audiohook, direction, previous, samples);
 		ast_audiohook_unlock(audiohook);
 	}
 	AST_LIST_TRAVERSE_SAFE_END;
@@ -1488,6 +1488,13 @@ void ast_bridge_set_mixing_interval(struct ast_bridge *bridge, unsigned int mixi
 	ao2_unlock(bridge);
 }
 
+void ast_bridge_set_max_talkers(struct ast_bridge *bridge, unsigned int max_talkers)
+{
+	ao2_lock(bridge);
+	bridge->max_talkers = max_talkers;
+	ao2_unlock(bridge);
+}
+
 void ast_bridge_set_internal_sample_rate(struct ast_bridge *bridge, unsigned int sample_rate)
 {
 
@@ -2683,6 +2683,7 @@ void ast_channel_set_fd(struct ast_channel *chan, int which, int fd)
 	}
 #endif
 	chan->fds[which] = fd;
+	chan->fd_generation++;
 	return;
 }
 
@@ -35,9 +35,13 @@ ASTERISK_FILE_VERSION(__FILE__, "$Revision: 378320 $")
 
 #include <pthread.h>
 #include <signal.h>
+#include <fcntl.h>
 #include <sys/time.h>
 #include <sys/signal.h>
 #include <netinet/in.h>
+#ifdef HAVE_EPOLL_CREATE1
+#include <sys/epoll.h>
+#endif
 
 #include "asterisk/lock.h"
 #include "asterisk/file.h"
@@ -61,6 +65,8 @@ ASTERISK_FILE_VERSION(__FILE__, "$Revision: 378320 $")
 #include "asterisk/global_datastores.h"
 #include "asterisk/astobj2.h"
 #include "asterisk/cel.h"
+#include "asterisk/sched.h"
+#include "asterisk/poll-compat.h"
 #include "asterisk/test.h"
 
 /*
@@ -463,6 +469,18 @@ struct parking_dp_context {
 /*! Parking lot dialplan usage map. */
 AST_LIST_HEAD_NOLOCK(parking_dp_map, parking_dp_context);
 
+struct parkeduser;
+
+/*! \brief A parked channel descriptor watched by the parking thread */
+struct parked_fd {
+	/*! Parked call the descriptor belongs to */
+	struct parkeduser *pu;
+	/*! Descriptor registered with the parking thread, -1 if none */
+	int fd;
+	/*! Index of the descriptor in the channel */
+	int index;
+};
+
 /*!
  * \brief Description of one parked call, added to a list while active, then removed.
  * The list belongs to a parkinglot.
@@ -482,9 +500,23 @@ struct parkeduser {
 	unsigned int options_specified:1;
 	char peername[AST_CHANNEL_NAME];
 	unsigned char moh_trys;
+	/*! TRUE while the parking thread watches the call for its timeout and for channel activity */
+	unsigned int watched:1;
+	/*! TRUE once the call has left the parking lot and waits for the parking thread to free it */
+	unsigned int retired:1;
+	/*! Scheduler id of the parking timeout, -1 when not scheduled */
+	int timeout_id;
+	/*! Channel descriptors registered with the parking thread */
+	struct parked_fd fds[AST_MAX_FDS];
+	/*! Channel fd_generation the registered descriptors were last synced with */
+	unsigned int fd_generation;
 	/*! Parking lot this entry belongs to.  Holds a parking lot reference. */
 	struct ast_parkinglot *parkinglot;
 	AST_LIST_ENTRY(parkeduser) list;
+#ifndef HAVE_EPOLL_CREATE1
+	/*! Entry in the list of calls the parking thread polls */
+	AST_LIST_ENTRY(parkeduser) watch_list;
+#endif
 };
 
 /*! Parking lot configuration options. */
@@ -562,6 +594,11 @@ struct ast_parkinglot {
 	/*! Parking space to start next park search. */
 	int next_parking_space;
 
+	/*! Parking spaces in use, one bit per space from spaces_start to spaces_stop */
+	unsigned int *spaces;
+	int spaces_start;
+	int spaces_stop;
+
 	/*! That which bears the_mark shall be deleted if parking lot empty! (Used during reloads.) */
 	unsigned int the_mark:1;
 	/*! TRUE if the parking lot is disabled. */
@@ -642,6 +679,29 @@ static struct ast_app *stopmixmonitor_app = NULL;
 static int stopmixmonitor_ok = 1;
 
 static pthread_t parking_thread;
+
+/*! Parked call timeouts, run by the parking thread */
+static struct ast_sched_context *parking_sched;
+/*! Wakes the parking thread to pick up a new timeout */
+static int parking_wake[2] = { -1, -1 };
+#ifdef HAVE_EPOLL_CREATE1
+/*! Descriptors of every parked channel, registered once rather than passed on every wait */
+static int parking_epfd = -1;
+/*!
+ * Parked descriptor each registered descriptor number belongs to, so a call
+ * only ever removes its own registration and not that of a call which got
+ * the number after the call closed it.
+ */
+static struct parked_fd **parking_fd_owners;
+static int parking_fd_owners_len;
+AST_MUTEX_DEFINE_STATIC(parking_fd_owners_lock);
+#else
+/*! Parked calls whose descriptors the parking thread polls */
+static AST_LIST_HEAD_STATIC(parking_watched, parkeduser);
+#endif
+/*! Parked calls that have left their parking lot, freed by the parking thread */
+static AST_LIST_HEAD_STATIC(parking_retired, parkeduser);
+
 struct ast_dial_features {
 	/*! Channel's feature flags. */
 	struct ast_flags my_features;
@@ -802,6 +862,7 @@ static void parkinglot_unref(struct ast_parkinglot *parkinglot);
 static struct ast_parkinglot *find_parkinglot(const char *name);
 static struct ast_parkinglot *create_parkinglot(const char *name);
 static struct ast_parkinglot *copy_parkinglot(const char *name, const struct ast_parkinglot *parkinglot);
+static int parked_call_expire(const void *data);
 static int parkinglot_activate(struct ast_parkinglot *parkinglot);
 static int play_message_on_chan(struct ast_channel *play_to, struct ast_channel *other, const char *msg, const char *audiofile);
 
@@ -1255,6 +1316,290 @@ static struct ast_parkinglot *create_dynamic_parkinglot(const char *name, struct
 	return parkinglot;
 }
 
+/*! Bits in each word of a parking lot space map */
+#define PARKING_SPACE_BITS (sizeof(unsigned int) * 8)
+
+/*!
+ * \internal
+ * \brief Mark a parking space used or free in the parking lot space map.
+ *
+ * \note The parking lot parkings list is locked on entry.
+ */
+static void parkinglot_space_set(struct ast_parkinglot *parkinglot, int space, int in_use)
+{
+	unsigned int bit;
+
+	if (!parkinglot->spaces || space < parkinglot->spaces_start || parkinglot->spaces_stop < space) {
+		return;
+	}
+	space -= parkinglot->spaces_start;
+	bit = 1U << (space % PARKING_SPACE_BITS);
+	if (in_use) {
+		parkinglot->spaces[space / PARKING_SPACE_BITS] |= bit;
+	} else {
+		parkinglot->spaces[space / PARKING_SPACE_BITS] &= ~bit;
+	}
+}
+
+/*!
+ * \internal
+ * \brief Check if a parking space is in use.
+ *
+ * \note The parking lot parkings list is locked on entry and the space map
+ * is in sync.
+ */
+static int parkinglot_space_used(struct ast_parkinglot *parkinglot, int space)
+{
+	space -= parkinglot->spaces_start;
+	return (parkinglot->spaces[space / PARKING_SPACE_BITS] >> (space % PARKING_SPACE_BITS)) & 1;
+}
+
+/*!
+ * \internal
+ * \brief Size the parking lot space map to the configured parking spaces.
+ *
+ * \note The parking lot parkings list is locked on entry.  The configured
+ * spaces only change while the lot is empty, but any parked call found is
+ * marked anyway.
+ *
+ * \retval 0 on success.
+ * \retval -1 on error.
+ */
+static int parkinglot_spaces_sync(struct ast_parkinglot *parkinglot)
+{
+	struct parkeduser *cur;
+	unsigned int *spaces;
+	int num;
+
+	if (parkinglot->spaces && parkinglot->spaces_start == parkinglot->cfg.parking_start
+		&& parkinglot->spaces_stop == parkinglot->cfg.parking_stop) {
+		return 0;
+	}
+
+	num = parkinglot->cfg.parking_stop - parkinglot->cfg.parking_start + 1;
+	if (num <= 0 || !(spaces = ast_calloc((num + PARKING_SPACE_BITS - 1) / PARKING_SPACE_BITS, sizeof(*spaces)))) {
+		return -1;
+	}
+	ast_free(parkinglot->spaces);
+	parkinglot->spaces = spaces;
+	parkinglot->spaces_start = parkinglot->cfg.parking_start;
+	parkinglot->spaces_stop = parkinglot->cfg.parking_stop;
+	AST_LIST_TRAVERSE(&parkinglot->parkings, cur, list) {
+		parkinglot_space_set(parkinglot, cur->parkingnum, 1);
+	}
+
+	return 0;
+}
+
+/*!
+ * \internal
+ * \brief Find the first free parking space from start, wrapping around the lot.
+ *
+ * \details
+ * Whole words of the space map are skipped while they are full, so a lot
+ * with thousands of spaces is searched a word at a time.
+ *
+ * \note The parking lot parkings list is locked on entry and the space map
+ * is in sync.
+ *
+ * \return Free parking space or -1 if the lot is full.
+ */
+static int parkinglot_space_find(struct ast_parkinglot *parkinglot, int start)
+{
+	int num = parkinglot->spaces_stop - parkinglot->spaces_start + 1;
+	int words = (num + PARKING_SPACE_BITS - 1) / PARKING_SPACE_BITS;
+	int offset = start - parkinglot->spaces_start;
+	int i;
+
+	/* The word holding start is looked at twice, from start on first and before start last. */
+	for (i = 0; i <= words; i++) {
+		int word = (offset / PARKING_SPACE_BITS + i) % words;
+		unsigned int free_bits = ~parkinglot->spaces[word];
+
+		if (i == 0) {
+			free_bits &= ~0U << (offset % PARKING_SPACE_BITS);
+		} else if (i == words) {
+			free_bits &= ~(~0U << (offset % PARKING_SPACE_BITS));
+		}
+		if (word == words - 1 && num % PARKING_SPACE_BITS) {
+			free_bits &= ~(~0U << (num % PARKING_SPACE_BITS));
+		}
+		if (free_bits) {
+			return parkinglot->spaces_start + word * PARKING_SPACE_BITS + ffs(free_bits) - 1;
+		}
+	}
+
+	return -1;
+}
+
+/*! \brief Wake the parking thread */
+static void parking_thread_wake(void)
+{
+	int nudge = 0;
+
+	if (write(parking_wake[1], &nudge, sizeof(nudge)) != sizeof(nudge) && errno != EAGAIN) {
+		ast_log(LOG_ERROR, "Unable to wake the parking thread: %s\n", strerror(errno));
+	}
+}
+
+#ifdef HAVE_EPOLL_CREATE1
+/*!
+ * \internal
+ * \brief Register a parked channel descriptor, replacing what was registered.
+ *
+ * \details
+ * The old descriptor is only removed from the set if this call still owns
+ * its number.  If it was closed, the kernel already dropped it, and its
+ * number may now be registered by another call.
+ *
+ * \note The parking lot parkings list is locked on entry.
+ */
+static void parking_poller_set(struct parked_fd *pfd, int fd)
+{
+	struct epoll_event ev = { .events = EPOLLIN | EPOLLPRI, .data.ptr = pfd, };
+
+	ast_mutex_lock(&parking_fd_owners_lock);
+	if (pfd->fd > -1 && parking_fd_owners[pfd->fd] == pfd) {
+		parking_fd_owners[pfd->fd] = NULL;
+		if (epoll_ctl(parking_epfd, EPOLL_CTL_DEL, pfd->fd, &ev) && errno != EBADF && errno != ENOENT) {
+			ast_debug(1, "Failed to stop watching parked descriptor %d: %s\n", pfd->fd, strerror(errno));
+		}
+	}
+	pfd->fd = -1;
+	if (fd > -1 && fd >= parking_fd_owners_len) {
+		struct parked_fd **owners;
+		int len = MAX(fd + 1, parking_fd_owners_len * 2);
+
+		if (!(owners = ast_realloc(parking_fd_owners, len * sizeof(*owners)))) {
+			ast_mutex_unlock(&parking_fd_owners_lock);
+			return;
+		}
+		memset(owners + parking_fd_owners_len, 0, (len - parking_fd_owners_len) * sizeof(*owners));
+		parking_fd_owners = owners;
+		parking_fd_owners_len = len;
+	}
+	if (fd > -1) {
+		/* A number still registered for the same open file is taken over */
+		if (epoll_ctl(parking_epfd, EPOLL_CTL_ADD, fd, &ev)
+			&& (errno != EEXIST || epoll_ctl(parking_epfd, EPOLL_CTL_MOD, fd, &ev))) {
+			ast_debug(1, "Failed to watch parked descriptor %d: %s\n", fd, strerror(errno));
+		} else {
+			parking_fd_owners[fd] = pfd;
+			pfd->fd = fd;
+		}
+	}
+	ast_mutex_unlock(&parking_fd_owners_lock);
+}
+#else
+static void parking_poller_set(struct parked_fd *pfd, int fd)
+{
+	AST_LIST_LOCK(&parking_watched);
+	pfd->fd = fd;
+	AST_LIST_UNLOCK(&parking_watched);
+}
+#endif
+
+/*!
+ * \internal
+ * \brief Bring the registered descriptors of a parked call up to date with its channel.
+ *
+ * \details
+ * Only descriptors that changed are registered again.  A descriptor closed
+ * and reopened under the same number is only told apart by the channel's
+ * fd_generation, and the kernel dropped the closed one from the set.
+ *
+ * \note The parking lot parkings list is locked on entry.
+ */
+static void parked_call_sync_fds(struct parkeduser *pu)
+{
+	unsigned int generation = pu->chan->fd_generation;
+	int x;
+
+	for (x = 0; x < AST_MAX_FDS; x++) {
+		if (pu->fds[x].fd != pu->chan->fds[x]
+			|| (generation != pu->fd_generation && pu->fds[x].fd > -1)) {
+			parking_poller_set(&pu->fds[x], pu->chan->fds[x]);
+		}
+	}
+	pu->fd_generation = generation;
+}
+
+/*!
+ * \internal
+ * \brief Start watching a parked call for its timeout and for channel activity.
+ *
+ * \note The parking lot parkings list is locked on entry.
+ */
+static void parked_call_watch(struct parkeduser *pu)
+{
+	int ms;
+
+	if (pu->watched) {
+		return;
+	}
+	pu->watched = 1;
+
+	ms = pu->parkingtime - ast_tvdiff_ms(ast_tvnow(), pu->start);
+	pu->timeout_id = ast_sched_add(parking_sched, MAX(ms, 0), parked_call_expire, pu);
+	if (pu->timeout_id < 0) {
+		ast_log(LOG_WARNING, "Unable to schedule the parking timeout for %s\n", pu->chan->name);
+	}
+#ifndef HAVE_EPOLL_CREATE1
+	AST_LIST_LOCK(&parking_watched);
+	AST_LIST_INSERT_TAIL(&parking_watched, pu, watch_list);
+	AST_LIST_UNLOCK(&parking_watched);
+#endif
+	parked_call_sync_fds(pu);
+
+	/* The parking thread may be waiting past the new timeout. */
+	parking_thread_wake();
+}
+
+/*!
+ * \internal
+ * \brief Stop watching a parked call.
+ *
+ * \note The parking lot parkings list is locked on entry.  The channel
+ * descriptors must still be open.
+ */
+static void parked_call_unwatch(struct parkeduser *pu)
+{
+	int x;
+
+	if (!pu->watched) {
+		return;
+	}
+	pu->watched = 0;
+
+	AST_SCHED_DEL(parking_sched, pu->timeout_id);
+	for (x = 0; x < AST_MAX_FDS; x++) {
+		parking_poller_set(&pu->fds[x], -1);
+	}
+#ifndef HAVE_EPOLL_CREATE1
+	AST_LIST_LOCK(&parking_watched);
+	AST_LIST_REMOVE(&parking_watched, pu, watch_list);
+	AST_LIST_UNLOCK(&parking_watched);
+#endif
+}
+
+/*!
+ * \internal
+ * \brief Hand a parked call that has left its parking lot to the parking thread to free.
+ *
+ * \details
+ * The parking thread may still hold the call from its last wait, so only
+ * it frees parked calls, once it is done with what it waited for.
+ *
+ * \note The call must be unwatched and out of its parking lot list.
+ */
+static void parked_call_retire(struct parkeduser *pu)
+{
+	pu->retired = 1;
+	AST_LIST_LOCK(&parking_retired);
+	AST_LIST_INSERT_TAIL(&parking_retired, pu, list);
+	AST_LIST_UNLOCK(&parking_retired);
+}
+
 /*!
  * \internal
  * \brief Abort parking a call that has not completed parking yet.
@@ -1273,6 +1618,7 @@ static void park_space_abort(struct parkeduser *pu)
 
 	/* Put back the parking space just allocated. */
 	--parkinglot->next_parking_space;
+	parkinglot_space_set(parkinglot, pu->parkingnum, 0);
 
 	AST_LIST_REMOVE(&parkinglot->parkings, pu, list);
 
@@ -1299,7 +1645,6 @@ static struct parkeduser *park_space_reserve(struct ast_channel *park_me, struct
 	int parking_space = -1;
 	const char *parkinglotname;
 	const char *parkingexten;
-	struct parkeduser *cur;
 	struct ast_parkinglot *parkinglot = NULL;
 
 	if (args->parkinglot) {
@@ -1344,9 +1689,23 @@ static struct parkeduser *park_space_reserve(struct ast_channel *park_me, struct
 		return NULL;
 	}
 
+	pu->timeout_id = -1;
+	for (i = 0; i < AST_MAX_FDS; i++) {
+		pu->fds[i].pu = pu;
+		pu->fds[i].fd = -1;
+		pu->fds[i].index = i;
+	}
+
 	/* Lock parking list */
 	AST_LIST_LOCK(&parkinglot->parkings);
 
+	if (parkinglot_spaces_sync(parkinglot)) {
+		AST_LIST_UNLOCK(&parkinglot->parkings);
+		parkinglot_unref(parkinglot);
+		ast_free(pu);
+		return NULL;
+	}
+
 	/* Check for channel variable PARKINGEXTEN */
 	parkingexten = ast_strdupa(S_OR(pbx_builtin_getvar_helper(park_me, "PARKINGEXTEN"), ""));
 	if (!ast_strlen_zero(parkingexten)) {
@@ -1383,20 +1742,17 @@ static struct parkeduser *park_space_reserve(struct ast_channel *park_me, struct
 		}
 
 		/* Check if requested parking space is in use. */
-		AST_LIST_TRAVERSE(&parkinglot->parkings, cur, list) {
-			if (cur->parkingnum == parking_space) {
-				ast_log(LOG_WARNING, "PARKINGEXTEN=%d is already in use in %s\n",
-					parking_space, parkinglot->name);
-				AST_LIST_UNLOCK(&parkinglot->parkings);
-				parkinglot_unref(parkinglot);
-				ast_free(pu);
-				return NULL;
-			}
+		if (parkinglot_space_used(parkinglot, parking_space)) {
+			ast_log(LOG_WARNING, "PARKINGEXTEN=%d is already in use in %s\n",
+				parking_space, parkinglot->name);
+			AST_LIST_UNLOCK(&parkinglot->parkings);
+			parkinglot_unref(parkinglot);
+			ast_free(pu);
+			return NULL;
 		}
 	} else {
 		/* PARKINGEXTEN is empty, so find a usable extension in the lot to park the call */
 		int start; /* The first slot we look in the parkinglot. It can be randomized. */
-		int start_checked = 0; /* flag raised once the first slot is checked */
 
 		/* If using randomize mode, set start to random position on parking range */
 		if (ast_test_flag(args, AST_PARK_OPT_RANDOMIZE)) {
@@ -1412,34 +1768,7 @@ static struct parkeduser *park_space_reserve(struct ast_channel *park_me, struct
 			start = parkinglot->cfg.parking_start;
 		}
 
-		/* free parking extension linear search: O(n^2) */
-		for (i = start; ; i++) {
-			/* If we are past the end, wrap around to the first parking slot*/
-			if (i == parkinglot->cfg.parking_stop + 1) {
-				i = parkinglot->cfg.parking_start;
-			}
-
-			if (i == start) {
-				/* At this point, if start_checked, we've exhausted all the possible slots. */
-				if (start_checked) {
-					break;
-				} else {
-					start_checked = 1;
-				}
-			}
-
-			/* Search the list of parked calls already in use for i. If we find it, it's in use. */
-			AST_LIST_TRAVERSE(&parkinglot->parkings, cur, list) {
-				if (cur->parkingnum == i) {
-					break;
-				}
-			}
-			if (!cur) {
-				/* We found a parking space. */
-				parking_space = i;
-				break;
-			}
-		}
+		parking_space = parkinglot_space_find(parkinglot, start);
 		if (parking_space == -1) {
 			/* We did not find a parking space.  Lot is full. */
 			ast_log(LOG_WARNING, "No more parking spaces in %s\n", parkinglot->name);
@@ -1457,6 +1786,7 @@ static struct parkeduser *park_space_reserve(struct ast_channel *park_me, struct
 	pu->notquiteyet = 1;
 	pu->parkingnum = parking_space;
 	pu->parkinglot = parkinglot;
+	parkinglot_space_set(parkinglot, parking_space, 1);
 	AST_LIST_INSERT_TAIL(&parkinglot->parkings, pu, list);
 
 	return pu;
@@ -1563,10 +1893,8 @@ static int park_call_full(struct ast_channel *chan, struct ast_channel *peer, st
 	 */
 	if (peer != chan) {
 		pu->notquiteyet = 0;
+		parked_call_watch(pu);
 	}
-
-	/* Wake up the (presumably select()ing) thread */
-	pthread_kill(parking_thread, SIGURG);
 	ast_verb(2, "Parked %s on %d (lot %s). Will timeout back to extension [%s] %s, %d in %d seconds\n",
 		chan->name, pu->parkingnum, pu->parkinglot->name,
 		pu->context, pu->exten, pu->priority, (pu->parkingtime / 1000));
@@ -1639,8 +1967,10 @@ static int park_call_full(struct ast_channel *chan, struct ast_channel *peer, st
 				S_OR(pu->parkinglot->cfg.mohclass, NULL),
 				!ast_strlen_zero(pu->parkinglot->cfg.mohclass) ? strlen(pu->parkinglot->cfg.mohclass) + 1 : 0);
 		}
+		AST_LIST_LOCK(&pu->parkinglot->parkings);
 		pu->notquiteyet = 0;
-		pthread_kill(parking_thread, SIGURG);
+		parked_call_watch(pu);
+		AST_LIST_UNLOCK(&pu->parkinglot->parkings);
 	}
 	return 0;
 }
@@ -4700,307 +5030,446 @@ static char *callback_dialoptions(struct ast_flags *features_callee, struct ast_
 
 /*!
  * \internal
- * \brief Run management on a parked call.
+ * \brief Take a parked call out of its parking lot once parking is over for it.
  *
- * \note The parkinglot parkings list is locked on entry.
+ * \note The parking lot parkings list is locked on entry.  The call is
+ * retired, so it remains valid until the parking thread next frees calls.
+ */
+static void parked_call_finish(struct parkeduser *pu)
+{
+	struct ast_context *con;
+
+	parked_call_unwatch(pu);
+
+	con = ast_context_find(pu->parkinglot->cfg.parking_con);
+	if (con) {
+		if (ast_context_remove_extension2(con, pu->parkingexten, 1, NULL, 0)) {
+			ast_log(LOG_WARNING,
+				"Whoa, failed to remove the parking extension %s@%s!\n",
+				pu->parkingexten, pu->parkinglot->cfg.parking_con);
+		}
+		notify_metermaids(pu->parkingexten, pu->parkinglot->cfg.parking_con,
+			AST_DEVICE_NOT_INUSE);
+	} else {
+		ast_log(LOG_WARNING,
+			"Whoa, parking lot '%s' context '%s' does not exist.\n",
+			pu->parkinglot->name, pu->parkinglot->cfg.parking_con);
+	}
+	AST_LIST_REMOVE(&pu->parkinglot->parkings, pu, list);
+	parkinglot_space_set(pu->parkinglot, pu->parkingnum, 0);
+	parked_call_retire(pu);
+}
+
+/*!
+ * \internal
+ * \brief Return a call that has been parked too long.
  *
- * \retval TRUE if the parking completed.
+ * \note The parking lot parkings list is locked on entry.
  */
-static int manage_parked_call(struct parkeduser *pu, const struct pollfd *pfds, int nfds, struct pollfd **new_pfds, int *new_nfds, int *ms)
+static void parked_call_timeout(struct parkeduser *pu)
 {
 	struct ast_channel *chan = pu->chan;	/* shorthand */
-	int tms;        /* timeout for this item */
-	int x;          /* fd index in channel */
 
-	tms = ast_tvdiff_ms(ast_tvnow(), pu->start);
-	if (tms > pu->parkingtime) {
-		/*
-		 * Call has been parked too long.
-		 * Stop entertaining the caller.
-		 */
-		switch (pu->hold_method) {
-		case AST_CONTROL_HOLD:
-			ast_indicate(pu->chan, AST_CONTROL_UNHOLD);
-			break;
-		case AST_CONTROL_RINGING:
-			ast_indicate(pu->chan, -1);
-			break;
-		default:
-			break;
-		}
-		pu->hold_method = 0;
+	/*
+	 * Call has been parked too long.
+	 * Stop entertaining the caller.
+	 */
+	switch (pu->hold_method) {
+	case AST_CONTROL_HOLD:
+		ast_indicate(pu->chan, AST_CONTROL_UNHOLD);
+		break;
+	case AST_CONTROL_RINGING:
+		ast_indicate(pu->chan, -1);
+		break;
+	default:
+		break;
+	}
+	pu->hold_method = 0;
 
-		/* Get chan, exten from derived kludge */
-		if (pu->peername[0]) {
-			char *peername;
-			char *dash;
-			char *peername_flat; /* using something like DAHDI/52 for an extension name is NOT a good idea */
-			int i;
-
-			peername = ast_strdupa(pu->peername);
-			dash = strrchr(peername, '-');
-			if (dash) {
-				*dash = '\0';
-			}
+	/* Get chan, exten from derived kludge */
+	if (pu->peername[0]) {
+		char *peername;
+		char *dash;
+		char *peername_flat; /* using something like DAHDI/52 for an extension name is NOT a good idea */
+		int i;
 
-			peername_flat = ast_strdupa(peername);
-			for (i = 0; peername_flat[i]; i++) {
-				if (peername_flat[i] == '/') {
-					peername_flat[i] = '_';
-				}
-			}
+		peername = ast_strdupa(pu->peername);
+		dash = strrchr(peername, '-');
+		if (dash) {
+			*dash = '\0';
+		}
 
-			if (!ast_context_find_or_create(NULL, NULL, parking_con_dial, registrar)) {
-				ast_log(LOG_ERROR,
-					"Parking dial context '%s' does not exist and unable to create\n",
-					parking_con_dial);
-			} else {
-				char returnexten[AST_MAX_EXTENSION];
-				struct ast_datastore *features_datastore;
-				struct ast_dial_features *dialfeatures;
+		peername_flat = ast_strdupa(peername);
+		for (i = 0; peername_flat[i]; i++) {
+			if (peername_flat[i] == '/') {
+				peername_flat[i] = '_';
+			}
+		}
 
-				if (!strncmp(peername, "Parked/", 7)) {
-					peername += 7;
-				}
+		if (!ast_context_find_or_create(NULL, NULL, parking_con_dial, registrar)) {
+			ast_log(LOG_ERROR,
+				"Parking dial context '%s' does not exist and unable to create\n",
+				parking_con_dial);
+		} else {
+			char returnexten[AST_MAX_EXTENSION];
+			struct ast_datastore *features_datastore;
+			struct ast_dial_features *dialfeatures;
 
-				ast_channel_lock(chan);
-				features_datastore = ast_channel_datastore_find(chan, &dial_features_info,
-					NULL);
-				if (features_datastore && (dialfeatures = features_datastore->data)) {
-					char buf[MAX_DIAL_FEATURE_OPTIONS] = {0,};
-
-					snprintf(returnexten, sizeof(returnexten), "%s,30,%s", peername,
-						callback_dialoptions(&dialfeatures->peer_features,
-							&dialfeatures->my_features, buf, sizeof(buf)));
-				} else { /* Existing default */
-					ast_log(LOG_NOTICE, "Dial features not found on %s, using default!\n",
-						chan->name);
-					snprintf(returnexten, sizeof(returnexten), "%s,30,t", peername);
-				}
-				ast_channel_unlock(chan);
+			if (!strncmp(peername, "Parked/", 7)) {
+				peername += 7;
+			}
 
-				if (ast_add_extension(parking_con_dial, 1, peername_flat, 1, NULL, NULL,
-					"Dial", ast_strdup(returnexten), ast_free_ptr, registrar)) {
-					ast_log(LOG_ERROR,
-						"Could not create parking return dial exten: %s@%s\n",
-						peername_flat, parking_con_dial);
-				}
+			ast_channel_lock(chan);
+			features_datastore = ast_channel_datastore_find(chan, &dial_features_info,
+				NULL);
+			if (features_datastore && (dialfeatures = features_datastore->data)) {
+				char buf[MAX_DIAL_FEATURE_OPTIONS] = {0,};
+
+				snprintf(returnexten, sizeof(returnexten), "%s,30,%s", peername,
+					callback_dialoptions(&dialfeatures->peer_features,
+						&dialfeatures->my_features, buf, sizeof(buf)));
+			} else { /* Existing default */
+				ast_log(LOG_NOTICE, "Dial features not found on %s, using default!\n",
+					chan->name);
+				snprintf(returnexten, sizeof(returnexten), "%s,30,t", peername);
 			}
-			if (pu->options_specified) {
-				/*
-				 * Park() was called with overriding return arguments, respect
-				 * those arguments.
-				 */
-				set_c_e_p(chan, pu->context, pu->exten, pu->priority);
-			} else if (comebacktoorigin) {
-				set_c_e_p(chan, parking_con_dial, peername_flat, 1);
-			} else {
-				char parkingslot[AST_MAX_EXTENSION];
+			ast_channel_unlock(chan);
 
-				snprintf(parkingslot, sizeof(parkingslot), "%d", pu->parkingnum);
-				pbx_builtin_setvar_helper(chan, "PARKINGSLOT", parkingslot);
-				set_c_e_p(chan, "parkedcallstimeout", peername_flat, 1);
+			if (ast_add_extension(parking_con_dial, 1, peername_flat, 1, NULL, NULL,
+				"Dial", ast_strdup(returnexten), ast_free_ptr, registrar)) {
+				ast_log(LOG_ERROR,
+					"Could not create parking return dial exten: %s@%s\n",
+					peername_flat, parking_con_dial);
 			}
-		} else {
+		}
+		if (pu->options_specified) {
 			/*
-			 * They've been waiting too long, send them back to where they
-			 * came.  Theoretically they should have their original
-			 * extensions and such, but we copy to be on the safe side.
+			 * Park() was called with overriding return arguments, respect
+			 * those arguments.
 			 */
 			set_c_e_p(chan, pu->context, pu->exten, pu->priority);
+		} else if (comebacktoorigin) {
+			set_c_e_p(chan, parking_con_dial, peername_flat, 1);
+		} else {
+			char parkingslot[AST_MAX_EXTENSION];
+
+			snprintf(parkingslot, sizeof(parkingslot), "%d", pu->parkingnum);
+			pbx_builtin_setvar_helper(chan, "PARKINGSLOT", parkingslot);
+			set_c_e_p(chan, "parkedcallstimeout", peername_flat, 1);
 		}
-		post_manager_event("ParkedCallTimeOut", pu);
-		ast_cel_report_event(pu->chan, AST_CEL_PARK_END, NULL, "ParkedCallTimeOut", NULL);
+	} else {
+		/*
+		 * They've been waiting too long, send them back to where they
+		 * came.  Theoretically they should have their original
+		 * extensions and such, but we copy to be on the safe side.
+		 */
+		set_c_e_p(chan, pu->context, pu->exten, pu->priority);
+	}
+	post_manager_event("ParkedCallTimeOut", pu);
+	ast_cel_report_event(pu->chan, AST_CEL_PARK_END, NULL, "ParkedCallTimeOut", NULL);
 
-		ast_verb(2, "Timeout for %s parked on %d (%s). Returning to %s,%s,%d\n",
-			pu->chan->name, pu->parkingnum, pu->parkinglot->name, pu->chan->context,
-			pu->chan->exten, pu->chan->priority);
+	ast_verb(2, "Timeout for %s parked on %d (%s). Returning to %s,%s,%d\n",
+		pu->chan->name, pu->parkingnum, pu->parkinglot->name, pu->chan->context,
+		pu->chan->exten, pu->chan->priority);
 
-		/* Start up the PBX, or hang them up */
-		if (ast_pbx_start(chan))  {
-			ast_log(LOG_WARNING,
-				"Unable to restart the PBX for user on '%s', hanging them up...\n",
-				pu->chan->name);
-			ast_hangup(chan);
-		}
+	/* Take them out of the parking lot before anything else can run on the channel */
+	parked_call_finish(pu);
 
-		/* And take them out of the parking lot */
-		return 1;
+	/* Start up the PBX, or hang them up */
+	if (ast_pbx_start(chan))  {
+		ast_log(LOG_WARNING,
+			"Unable to restart the PBX for user on '%s', hanging them up...\n",
+			chan->name);
+		ast_hangup(chan);
 	}
+}
 
-	/* still within parking time, process descriptors */
-	if (pfds) {
-		for (x = 0; x < AST_MAX_FDS; x++) {
-			struct ast_frame *f;
-			int y;
+/*! \brief Parking timeout scheduled for a parked call */
+static int parked_call_expire(const void *data)
+{
+	struct parkeduser *pu = (struct parkeduser *) data;
+	struct ast_parkinglot *parkinglot = pu->parkinglot;
 
-			if (chan->fds[x] == -1) {
-				continue;	/* nothing on this descriptor */
-			}
+	AST_LIST_LOCK(&parkinglot->parkings);
+	pu->timeout_id = -1;
+	if (pu->watched && !pu->retired) {
+		parked_call_timeout(pu);
+	}
+	AST_LIST_UNLOCK(&parkinglot->parkings);
 
-			for (y = 0; y < nfds; y++) {
-				if (pfds[y].fd == chan->fds[x]) {
-					/* Found poll record! */
-					break;
-				}
-			}
-			if (y == nfds) {
-				/* Not found */
-				continue;
-			}
+	return 0;
+}
 
-			if (!(pfds[y].revents & (POLLIN | POLLERR | POLLPRI))) {
-				/* Next x */
-				continue;
-			}
+/*!
+ * \internal
+ * \brief Service a parked channel with a descriptor ready to read.
+ *
+ * \param pfd Descriptor the parking thread was told about.
+ * \param exception TRUE if urgent data is waiting.
+ */
+static void parked_call_service(struct parked_fd *pfd, int exception)
+{
+	struct parkeduser *pu = pfd->pu;
+	struct ast_parkinglot *parkinglot = pu->parkinglot;
+	struct ast_channel *chan = pu->chan;	/* shorthand */
+	struct ast_frame *f;
 
-			if (pfds[y].revents & POLLPRI) {
-				ast_set_flag(chan, AST_FLAG_EXCEPTION);
-			} else {
-				ast_clear_flag(chan, AST_FLAG_EXCEPTION);
-			}
-			chan->fdno = x;
-
-			/* See if they need servicing */
-			f = ast_read(pu->chan);
-			/* Hangup? */
-			if (!f || (f->frametype == AST_FRAME_CONTROL
-				&& f->subclass.integer == AST_CONTROL_HANGUP)) {
-				if (f) {
-					ast_frfree(f);
-				}
-				post_manager_event("ParkedCallGiveUp", pu);
-				ast_cel_report_event(pu->chan, AST_CEL_PARK_END, NULL, "ParkedCallGiveUp",
-					NULL);
+	AST_LIST_LOCK(&parkinglot->parkings);
+	if (!pu->watched || pu->retired || pfd->fd < 0) {
+		/* Picked up, or the descriptor changed, since the parking thread waited. */
+		AST_LIST_UNLOCK(&parkinglot->parkings);
+		return;
+	}
 
-				/* There's a problem, hang them up */
-				ast_verb(2, "%s got tired of being parked\n", chan->name);
-				ast_hangup(chan);
+	if (exception) {
+		ast_set_flag(chan, AST_FLAG_EXCEPTION);
+	} else {
+		ast_clear_flag(chan, AST_FLAG_EXCEPTION);
+	}
+	chan->fdno = pfd->index;
 
-				/* And take them out of the parking lot */
-				return 1;
-			} else {
-				/* XXX Maybe we could do something with packets, like dial "0" for operator or something XXX */
-				ast_frfree(f);
-				if (pu->hold_method == AST_CONTROL_HOLD
-					&& pu->moh_trys < 3
-					&& !chan->generatordata) {
-					ast_debug(1,
-						"MOH on parked call stopped by outside source.  Restarting on channel %s.\n",
-						chan->name);
-					ast_indicate_data(chan, AST_CONTROL_HOLD,
-						S_OR(pu->parkinglot->cfg.mohclass, NULL),
-						(!ast_strlen_zero(pu->parkinglot->cfg.mohclass)
-							? strlen(pu->parkinglot->cfg.mohclass) + 1 : 0));
-					pu->moh_trys++;
-				}
-				break;
-			}
-		} /* End for */
+	/* See if they need servicing */
+	f = ast_read(chan);
+	/* Hangup? */
+	if (!f || (f->frametype == AST_FRAME_CONTROL
+		&& f->subclass.integer == AST_CONTROL_HANGUP)) {
+		if (f) {
+			ast_frfree(f);
+		}
+		post_manager_event("ParkedCallGiveUp", pu);
+		ast_cel_report_event(chan, AST_CEL_PARK_END, NULL, "ParkedCallGiveUp",
+			NULL);
+
+		/* There's a problem, hang them up */
+		ast_verb(2, "%s got tired of being parked\n", chan->name);
+		parked_call_finish(pu);
+		ast_hangup(chan);
+	} else {
+		/* XXX Maybe we could do something with packets, like dial "0" for operator or something XXX */
+		ast_frfree(f);
+		if (pu->hold_method == AST_CONTROL_HOLD
+			&& pu->moh_trys < 3
+			&& !chan->generatordata) {
+			ast_debug(1,
+				"MOH on parked call stopped by outside source.  Restarting on channel %s.\n",
+				chan->name);
+			ast_indicate_data(chan, AST_CONTROL_HOLD,
+				S_OR(pu->parkinglot->cfg.mohclass, NULL),
+				(!ast_strlen_zero(pu->parkinglot->cfg.mohclass)
+					? strlen(pu->parkinglot->cfg.mohclass) + 1 : 0));
+			pu->moh_trys++;
+		}
+		/* Reading may have changed the channel descriptors. */
+		parked_call_sync_fds(pu);
 	}
+	AST_LIST_UNLOCK(&parkinglot->parkings);
+}
 
-	/* mark fds for next round */
-	for (x = 0; x < AST_MAX_FDS; x++) {
-		if (chan->fds[x] > -1) {
-			void *tmp = ast_realloc(*new_pfds,
-				(*new_nfds + 1) * sizeof(struct pollfd));
+/*! How often the registered descriptors of every parked call are checked, in ms */
+#define PARKING_SWEEP_INTERVAL 1000
 
-			if (!tmp) {
+/*!
+ * \internal
+ * \brief Catch descriptor changes made to parked channels by other threads.
+ *
+ * \details
+ * A masquerade or a channel driver can replace the descriptors of a parked
+ * channel without it becoming readable, so every so often the registrations
+ * are checked against the channels.  Calls whose descriptors did not change
+ * cost no system call.
+ */
+static int parking_sweep(const void *data)
+{
+	struct ao2_iterator iter;
+	struct ast_parkinglot *curlot;
+	struct parkeduser *pu;
+
+	iter = ao2_iterator_init(parkinglots, 0);
+	while ((curlot = ao2_iterator_next(&iter))) {
+		AST_LIST_LOCK(&curlot->parkings);
+		AST_LIST_TRAVERSE(&curlot->parkings, pu, list) {
+			if (!pu->watched) {
 				continue;
 			}
-			*new_pfds = tmp;
-			(*new_pfds)[*new_nfds].fd = chan->fds[x];
-			(*new_pfds)[*new_nfds].events = POLLIN | POLLERR | POLLPRI;
-			(*new_pfds)[*new_nfds].revents = 0;
-			(*new_nfds)++;
+			parked_call_sync_fds(pu);
 		}
+		AST_LIST_UNLOCK(&curlot->parkings);
+		ao2_ref(curlot, -1);
 	}
-	/* Keep track of our shortest wait */
-	if (tms < *ms || *ms < 0) {
-		*ms = tms;
-	}
+	ao2_iterator_destroy(&iter);
 
-	/* Stay in the parking lot. */
-	return 0;
+	/* Run again after the same interval */
+	return 1;
 }
 
-/*! \brief Run management on parkinglots, called once per parkinglot */
-static void manage_parkinglot(struct ast_parkinglot *curlot, const struct pollfd *pfds, int nfds, struct pollfd **new_pfds, int *new_nfds, int *ms)
+/*! \brief Free the parked calls that have left their parking lots */
+static void parking_reap(void)
 {
+	AST_LIST_HEAD_NOLOCK(, parkeduser) doomed = AST_LIST_HEAD_NOLOCK_INIT_VALUE;
 	struct parkeduser *pu;
-	struct ast_context *con;
 
-	/* Lock parkings list */
-	AST_LIST_LOCK(&curlot->parkings);
-	AST_LIST_TRAVERSE_SAFE_BEGIN(&curlot->parkings, pu, list) {
-		if (pu->notquiteyet) { /* Pretend this one isn't here yet */
-			continue;
-		}
-		if (manage_parked_call(pu, pfds, nfds, new_pfds, new_nfds, ms)) {
-			/* Parking is complete for this call so remove it from the parking lot. */
-			con = ast_context_find(pu->parkinglot->cfg.parking_con);
-			if (con) {
-				if (ast_context_remove_extension2(con, pu->parkingexten, 1, NULL, 0)) {
-					ast_log(LOG_WARNING,
-						"Whoa, failed to remove the parking extension %s@%s!\n",
-						pu->parkingexten, pu->parkinglot->cfg.parking_con);
-				}
-				notify_metermaids(pu->parkingexten, pu->parkinglot->cfg.parking_con,
-					AST_DEVICE_NOT_INUSE);
-			} else {
-				ast_log(LOG_WARNING,
-					"Whoa, parking lot '%s' context '%s' does not exist.\n",
-					pu->parkinglot->name, pu->parkinglot->cfg.parking_con);
+	AST_LIST_LOCK(&parking_retired);
+	AST_LIST_APPEND_LIST(&doomed, &parking_retired, list);
+	AST_LIST_UNLOCK(&parking_retired);
+
+	while ((pu = AST_LIST_REMOVE_HEAD(&doomed, list))) {
+		parkinglot_unref(pu->parkinglot);
+		ast_free(pu);
+	}
+}
+
+/*! Most descriptors serviced for each wait */
+#define PARKING_MAX_EVENTS 64
+
+/*! \brief A parked channel descriptor that is ready, or the wake pipe if pfd is NULL */
+struct parking_event {
+	struct parked_fd *pfd;
+	int exception;
+};
+
+#ifdef HAVE_EPOLL_CREATE1
+static int parking_poller_wait(struct parking_event *events, int ms)
+{
+	struct epoll_event ev[PARKING_MAX_EVENTS];
+	int res, i;
+
+	if ((res = epoll_wait(parking_epfd, ev, ARRAY_LEN(ev), ms)) <= 0) {
+		return res;
+	}
+	for (i = 0; i < res; i++) {
+		events[i].pfd = ev[i].data.ptr;
+		events[i].exception = (ev[i].events & EPOLLPRI) ? 1 : 0;
+	}
+
+	return res;
+}
+#else
+static int parking_poller_wait(struct parking_event *events, int ms)
+{
+	struct parkeduser *pu;
+	struct parked_fd **map;
+	struct pollfd *pfds;
+	int max = 1, num = 0, ready, res, x;
+
+	AST_LIST_LOCK(&parking_watched);
+	AST_LIST_TRAVERSE(&parking_watched, pu, watch_list) {
+		max += AST_MAX_FDS;
+	}
+	pfds = ast_malloc(sizeof(*pfds) * max);
+	map = ast_malloc(sizeof(*map) * max);
+	if (!pfds || !map) {
+		AST_LIST_UNLOCK(&parking_watched);
+		ast_free(pfds);
+		ast_free(map);
+		usleep(MIN(MAX(ms, 0), 100) * 1000);
+		return 0;
+	}
+	pfds[num].fd = parking_wake[0];
+	pfds[num].events = POLLIN;
+	pfds[num].revents = 0;
+	map[num++] = NULL;
+	AST_LIST_TRAVERSE(&parking_watched, pu, watch_list) {
+		for (x = 0; x < AST_MAX_FDS; x++) {
+			if (pu->fds[x].fd < 0) {
+				continue;
 			}
-			AST_LIST_REMOVE_CURRENT(list);
-			parkinglot_unref(pu->parkinglot);
-			ast_free(pu);
+			pfds[num].fd = pu->fds[x].fd;
+			pfds[num].events = POLLIN | POLLERR | POLLPRI;
+			pfds[num].revents = 0;
+			map[num++] = &pu->fds[x];
 		}
 	}
-	AST_LIST_TRAVERSE_SAFE_END;
-	AST_LIST_UNLOCK(&curlot->parkings);
+	AST_LIST_UNLOCK(&parking_watched);
+
+	ready = ast_poll(pfds, num, ms);
+	for (x = 0, res = 0; ready > 0 && x < num && res < PARKING_MAX_EVENTS; x++) {
+		if (!pfds[x].revents) {
+			continue;
+		}
+		events[res].pfd = map[x];
+		events[res].exception = (pfds[x].revents & POLLPRI) ? 1 : 0;
+		res++;
+		ready--;
+	}
+	ast_free(pfds);
+	ast_free(map);
+
+	return res;
 }
+#endif
 
 /*! 
  * \brief Take care of parked calls and unpark them if needed 
  * \param ignore unused var.
  * 
- * Start inf loop, lock parking lot, check if any parked channels have gone above timeout
- * if so, remove channel from parking lot and return it to the extension that parked it.
- * Check if parked channel decided to hangup, wait until next FD via select().
+ * Wait for a parked channel to have something to read or for a parking
+ * timeout to come due.  Only the channels that are ready are serviced, and
+ * timed out calls are returned to the extension that parked them.
  */
 static void *do_parking_thread(void *ignore)
 {
-	struct pollfd *pfds = NULL, *new_pfds = NULL;
-	int nfds = 0, new_nfds = 0;
+	struct parking_event events[PARKING_MAX_EVENTS];
+	int res, i, nudge;
 
 	for (;;) {
-		struct ao2_iterator iter;
-		struct ast_parkinglot *curlot;
-		int ms = -1;	/* poll2 timeout, uninitialized */
-
-		iter = ao2_iterator_init(parkinglots, 0);
-		while ((curlot = ao2_iterator_next(&iter))) {
-			manage_parkinglot(curlot, pfds, nfds, &new_pfds, &new_nfds, &ms);
-			ao2_ref(curlot, -1);
+		res = parking_poller_wait(events, ast_sched_wait(parking_sched));
+		for (i = 0; i < res; i++) {
+			if (!events[i].pfd) {
+				while (read(parking_wake[0], &nudge, sizeof(nudge)) == sizeof(nudge)) {
+				}
+				continue;
+			}
+			parked_call_service(events[i].pfd, events[i].exception);
 		}
-		ao2_iterator_destroy(&iter);
-
-		/* Recycle */
-		ast_free(pfds);
-		pfds = new_pfds;
-		nfds = new_nfds;
-		new_pfds = NULL;
-		new_nfds = 0;
+		ast_sched_runq(parking_sched);
 
-		/* Wait for something to happen */
-		ast_poll(pfds, nfds, ms);
+		/* Nothing from this wait refers to a retired call any more. */
+		parking_reap();
 		pthread_testcancel();
 	}
-	/* If this WERE reached, we'd need to free(pfds) */
+
 	return NULL;	/* Never reached */
 }
 
+/*!
+ * \internal
+ * \brief Set up the parking thread's timers and descriptor set.
+ *
+ * \retval 0 on success.
+ * \retval -1 on error.
+ */
+static int parking_thread_init(void)
+{
+	int i;
+
+	if (!(parking_sched = ast_sched_context_create())) {
+		return -1;
+	}
+	if (ast_sched_add(parking_sched, PARKING_SWEEP_INTERVAL, parking_sweep, NULL) < 0) {
+		return -1;
+	}
+	if (pipe(parking_wake)) {
+		ast_log(LOG_ERROR, "Unable to create the parking thread wake pipe: %s\n", strerror(errno));
+		return -1;
+	}
+	for (i = 0; i < 2; i++) {
+		fcntl(parking_wake[i], F_SETFL, fcntl(parking_wake[i], F_GETFL) | O_NONBLOCK);
+	}
+#ifdef HAVE_EPOLL_CREATE1
+	{
+		struct epoll_event ev = { .events = EPOLLIN, .data.ptr = NULL, };
+
+		if ((parking_epfd = epoll_create1(EPOLL_CLOEXEC)) < 0
+			|| epoll_ctl(parking_epfd, EPOLL_CTL_ADD, parking_wake[0], &ev)) {
+			ast_log(LOG_ERROR, "Unable to create the parking epoll set: %s\n", strerror(errno));
+			return -1;
+		}
+	}
+#endif
+
+	return 0;
+}
+
 /*! \brief Find parkinglot by name */
 static struct ast_parkinglot *find_parkinglot(const char *name)
 {
@@ -5225,6 +5694,8 @@ static int parked_call_exec(struct ast_channel *chan, const char *data)
 	if (pu) {
 		/* Found a parked call to pickup. */
 		peer = pu->chan;
+		parked_call_unwatch(pu);
+		parkinglot_space_set(parkinglot, pu->parkingnum, 0);
 		con = ast_context_find(parkinglot->cfg.parking_con);
 		if (con) {
 			if (ast_context_remove_extension2(con, pu->parkingexten, 1, NULL, 0)) {
@@ -5268,8 +5739,7 @@ static int parked_call_exec(struct ast_channel *chan, const char *data)
 		}
 		pu->hold_method = 0;
 
-		parkinglot_unref(pu->parkinglot);
-		ast_free(pu);
+		parked_call_retire(pu);
 	}
 	AST_LIST_UNLOCK(&parkinglot->parkings);
 
@@ -5441,6 +5911,7 @@ static void parkinglot_destroy(void *obj)
 	 */
 	ast_assert(AST_LIST_EMPTY(&doomed->parkings));
 	AST_LIST_HEAD_DESTROY(&doomed->parkings);
+	ast_free(doomed->spaces);
 }
 
 /*! \brief Allocate parking lot structure */
@@ -8125,11 +8596,12 @@ static int unpark_test_channel(struct ast_channel *toremove, struct ast_park_cal
 	struct parkeduser *pu_toremove;
 	int res = 0;
 
-	args->pu->notquiteyet = 1; /* go ahead and stop processing the test parking */
-
 	AST_LIST_LOCK(&args->pu->parkinglot->parkings);
 	AST_LIST_TRAVERSE_SAFE_BEGIN(&args->pu->parkinglot->parkings, pu_toremove, list) {
 		if (pu_toremove == args->pu) {
+			/* go ahead and stop processing the test parking */
+			parked_call_unwatch(pu_toremove);
+			parkinglot_space_set(pu_toremove->parkinglot, pu_toremove->parkingnum, 0);
 			AST_LIST_REMOVE_CURRENT(list);
 			break;
 		}
@@ -8156,8 +8628,7 @@ static int unpark_test_channel(struct ast_channel *toremove, struct ast_park_cal
 		res = -1;
 	}
 
-	parkinglot_unref(pu_toremove->parkinglot);
-	ast_free(pu_toremove);
+	parked_call_retire(pu_toremove);
 	args->pu = NULL;
 
 	if (!res && toremove) {
@@ -8355,7 +8826,8 @@ int ast_features_init(void)
 		return res;
 	}
 	ast_cli_register_multiple(cli_features, ARRAY_LEN(cli_features));
-	if (ast_pthread_create(&parking_thread, NULL, do_parking_thread, NULL)) {
+	if (parking_thread_init()
+		|| ast_pthread_create(&parking_thread, NULL, do_parking_thread, NULL)) {
 		return -1;
 	}
 	ast_register_application2(app_bridge, bridge_exec, NULL, NULL, NULL);
@@ -32,9 +32,13 @@
 ASTERISK_FILE_VERSION(__FILE__, "$Revision: 377882 $")
 
 #include <dirent.h>
+#include <fcntl.h>
 #include <sys/stat.h>
 #include <sys/wait.h>
 #include <math.h>
+#ifdef HAVE_INOTIFY
+#include <sys/inotify.h>
+#endif
 
 #include "asterisk/_private.h"	/* declare ast_file_init() */
 #include "asterisk/paths.h"	/* use ast_config_AST_DATA_DIR */
@@ -50,6 +54,9 @@ ASTERISK_FILE_VERSION(__FILE__, "$Revision: 377882 $")
 #include "asterisk/linkedlists.h"
 #include "asterisk/module.h"
 #include "asterisk/astobj2.h"
+#include "asterisk/dlinkedlists.h"
+#include "asterisk/md5.h"
+#include "asterisk/taskprocessor.h"
 #include "asterisk/test.h"
 
 /*! \brief
@@ -289,6 +296,1129 @@ static int exts_compare(const char *exts, const char *type)
 	return 0;
 }
 
+/*!
+ * \page PromptCache Prompt cache
+ *
+ * When prompt_cache is set in asterisk.conf, sound files looked up and opened
+ * through filehelper() are resolved through an in-memory cache instead of
+ * probing the filesystem on every call. Each path that is looked up gets an
+ * entry recording the outcome of stat(), including files that do not exist,
+ * so the probing of formats and languages costs no system calls once warm.
+ * The contents of a file are copied to the heap the first time it is opened,
+ * and every stream playing it then reads from that one shared copy. The
+ * contents are never mapped: a file rewritten in place, such as a greeting
+ * recorded again, would pull the pages out from under the streams playing it.
+ *
+ * Entries are dropped when inotify reports a change in their directory, or,
+ * where inotify is not available, revalidated with stat() once they are
+ * older than PROMPT_CACHE_TTL. The least recently used entries are evicted
+ * once the cache holds more than prompt_cache_size MB. Streams that are
+ * still playing an evicted or invalidated file keep its contents until they
+ * are closed.
+ */
+
+/*! Buckets in the prompt cache */
+#define PROMPT_CACHE_BUCKETS 563
+/*! Largest share of the cache the contents of a single file may take */
+#define PROMPT_CACHE_FILE_SHARE 8
+#ifndef HAVE_INOTIFY
+/*! How long the outcome of stat() is trusted without inotify, in ms */
+#define PROMPT_CACHE_TTL 5000
+#endif
+
+#if defined(HAVE_FUNOPEN)
+#define COOKIE_HOOK_T int
+#define COOKIE_LEN_T int
+#else
+#define COOKIE_HOOK_T ssize_t
+#define COOKIE_LEN_T size_t
+#endif
+
+/*! \brief Contents of a cached sound file, shared by every stream playing it */
+struct prompt_data {
+	size_t size;
+	char *buf;
+};
+
+/*! \brief A sound file path resolved through the prompt cache */
+struct prompt_entry {
+	/*! Set if stat() found no file at path */
+	unsigned int missing:1;
+	/*! Set while the entry is held by the cache */
+	unsigned int linked:1;
+	struct stat st;
+	/*! When stat() was run */
+	struct timeval checked;
+	/*! Contents, read the first time the file is opened */
+	struct prompt_data *data;
+	/*! Memory charged against the cache for this entry */
+	size_t charged;
+	AST_DLLIST_ENTRY(prompt_entry) lru;
+	char path[0];
+};
+
+/*! \brief Read position of one stream in a cached sound file */
+struct prompt_reader {
+	struct prompt_data *data;
+	off_t pos;
+};
+
+static struct ao2_container *prompt_cache;
+/*! Entries held by the cache, most recently used first */
+static AST_DLLIST_HEAD_NOLOCK_STATIC(prompt_lru, prompt_entry);
+/*! Protects prompt_lru, prompt_cache_bytes and the linked flag of entries */
+AST_MUTEX_DEFINE_STATIC(prompt_cache_lock);
+static size_t prompt_cache_bytes;
+static size_t prompt_cache_max;
+
+static struct {
+	int lookup_hits;
+	int lookup_misses;
+	int open_hits;
+	int open_misses;
+	int evictions;
+	int invalidations;
+} prompt_cache_stats;
+
+static int prompt_entry_hash(const void *obj, const int flags)
+{
+	const struct prompt_entry *entry = obj;
+
+	return ast_str_hash(entry->path);
+}
+
+static int prompt_entry_cmp(void *obj, void *arg, int flags)
+{
+	struct prompt_entry *entry = obj, *key = arg;
+
+	return !strcmp(entry->path, key->path) ? CMP_MATCH | CMP_STOP : 0;
+}
+
+static void prompt_data_destructor(void *obj)
+{
+	struct prompt_data *data = obj;
+
+	ast_free(data->buf);
+}
+
+static void prompt_entry_destructor(void *obj)
+{
+	struct prompt_entry *entry = obj;
+
+	if (entry->data) {
+		ao2_ref(entry->data, -1);
+	}
+}
+
+/*!
+ * \internal
+ * \brief Take an entry off the LRU list and stop charging for it
+ * \note prompt_cache_lock must be held. Unlinking it from prompt_cache is
+ * left to the caller.
+ */
+static void prompt_entry_retire(struct prompt_entry *entry)
+{
+	entry->linked = 0;
+	AST_DLLIST_REMOVE(&prompt_lru, entry, lru);
+	prompt_cache_bytes -= entry->charged;
+}
+
+/*!
+ * \internal
+ * \brief Evict the least recently used entries until the cache fits its limit
+ * \note prompt_cache_lock must be held.
+ */
+static void prompt_cache_trim(void)
+{
+	struct prompt_entry *entry;
+
+	while (prompt_cache_bytes > prompt_cache_max && (entry = AST_DLLIST_LAST(&prompt_lru))) {
+		prompt_entry_retire(entry);
+		ao2_unlink(prompt_cache, entry);
+		prompt_cache_stats.evictions++;
+	}
+}
+
+static int prompt_entry_under(void *obj, void *arg, int flags)
+{
+	struct prompt_entry *entry = obj;
+	const char *prefix = arg;
+
+	if (strncmp(entry->path, prefix, strlen(prefix))) {
+		return 0;
+	}
+	prompt_entry_retire(entry);
+	prompt_cache_stats.invalidations++;
+
+	return CMP_MATCH;
+}
+
+/*! \internal \brief Drop every entry whose path starts with prefix */
+static void prompt_cache_flush(const char *prefix)
+{
+	ast_mutex_lock(&prompt_cache_lock);
+	ao2_callback(prompt_cache, OBJ_MULTIPLE | OBJ_NODATA | OBJ_UNLINK, prompt_entry_under, (void *) prefix);
+	ast_mutex_unlock(&prompt_cache_lock);
+}
+
+/*! \internal \brief Drop the entry for a path that has been written, moved or removed */
+static void prompt_cache_forget(const char *path)
+{
+	struct prompt_entry *key, *entry;
+	size_t len = strlen(path) + 1;
+
+	if (!prompt_cache) {
+		return;
+	}
+
+	key = ast_alloca(sizeof(*key) + len);
+	memcpy(key->path, path, len);
+
+	ast_mutex_lock(&prompt_cache_lock);
+	if ((entry = ao2_find(prompt_cache, key, OBJ_POINTER))) {
+		if (entry->linked) {
+			prompt_entry_retire(entry);
+			ao2_unlink(prompt_cache, entry);
+			prompt_cache_stats.invalidations++;
+		}
+		ao2_ref(entry, -1);
+	}
+	ast_mutex_unlock(&prompt_cache_lock);
+}
+
+#ifdef HAVE_INOTIFY
+/*! Watched mask for directories holding cached paths */
+#define PROMPT_WATCH_MASK (IN_CLOSE_WRITE | IN_CREATE | IN_DELETE | IN_MOVED_FROM | IN_MOVED_TO | IN_ATTRIB | \
+	IN_DELETE_SELF | IN_MOVE_SELF)
+
+/*! \brief A watched directory, by the path cached entries know it by */
+struct prompt_dir {
+	int wd;
+	char path[0];
+};
+
+static struct ao2_container *prompt_dirs;
+static int prompt_inotify_fd = -1;
+static pthread_t prompt_inotify_thread = AST_PTHREADT_NULL;
+
+static int prompt_dir_hash(const void *obj, const int flags)
+{
+	const struct prompt_dir *dir = obj;
+
+	return dir->wd;
+}
+
+static int prompt_dir_cmp(void *obj, void *arg, int flags)
+{
+	struct prompt_dir *dir = obj, *key = arg;
+
+	return dir->wd == key->wd && !strcmp(dir->path, key->path) ? CMP_MATCH | CMP_STOP : 0;
+}
+
+static int prompt_dir_event(void *obj, void *arg, void *data, int flags)
+{
+	struct prompt_dir *dir = obj, *key = arg;
+	const struct inotify_event *iev = data;
+	char *path;
+
+	if (dir->wd != key->wd) {
+		return 0;
+	}
+
+	if (!iev->len || (iev->mask & (IN_IGNORED | IN_DELETE_SELF | IN_MOVE_SELF))) {
+		/* The directory itself went away, so everything below it did too */
+		if (ast_asprintf(&path, "%s/", dir->path) >= 0) {
+			prompt_cache_flush(path);
+			ast_free(path);
+		}
+	} else if (iev->mask & IN_ISDIR) {
+		/* Cached misses below a directory that did not exist yet were watched through this one */
+		if (ast_asprintf(&path, "%s/%s/", dir->path, iev->name) >= 0) {
+			prompt_cache_flush(path);
+			ast_free(path);
+		}
+	} else if (ast_asprintf(&path, "%s/%s", dir->path, iev->name) >= 0) {
+		prompt_cache_forget(path);
+		ast_free(path);
+	}
+
+	return CMP_MATCH;
+}
+
+static void *prompt_inotify_daemon(void *unused)
+{
+	char buf[4096] __attribute__((aligned(__alignof__(struct inotify_event))));
+	const struct inotify_event *iev;
+	struct prompt_dir key = { 0, };
+	ssize_t res;
+	char *ptr;
+
+	for (;;) {
+		if ((res = read(prompt_inotify_fd, buf, sizeof(buf))) <= 0) {
+			if (res < 0 && errno == EINTR) {
+				continue;
+			}
+			ast_log(LOG_ERROR, "Prompt cache file notification failed: %s\n", res ? strerror(errno) : "end of file");
+			break;
+		}
+
+		for (ptr = buf; ptr < buf + res; ptr += sizeof(*iev) + iev->len) {
+			iev = (const struct inotify_event *) ptr;
+			if (iev->mask & IN_Q_OVERFLOW) {
+				/* Events were lost, so nothing cached can be trusted */
+				prompt_cache_flush("");
+				continue;
+			}
+			if (iev->mask & IN_MOVE_SELF) {
+				/* Whatever now sits at the old path needs a watch of its own */
+				inotify_rm_watch(prompt_inotify_fd, iev->wd);
+			}
+			key.wd = iev->wd;
+			ao2_callback_data(prompt_dirs, OBJ_POINTER | OBJ_MULTIPLE | OBJ_NODATA | ((iev->mask & IN_IGNORED) ? OBJ_UNLINK : 0),
+				prompt_dir_event, &key, (void *) iev);
+		}
+	}
+
+	/* Without notifications the cache can only go stale, so stop using it */
+	option_prompt_cache = 0;
+	prompt_cache_flush("");
+
+	return NULL;
+}
+
+/*!
+ * \internal
+ * \brief Watch the directory a path is in, or its nearest existing ancestor
+ *
+ * This must be done before stat() is run on the path, so no change made in
+ * between can go unnoticed.
+ */
+static void prompt_cache_watch(const char *path)
+{
+	struct prompt_dir *key, *dir;
+	char *slash;
+	int wd;
+
+	if (prompt_inotify_fd < 0) {
+		ast_mutex_lock(&prompt_cache_lock);
+		if (prompt_inotify_fd < 0 && prompt_inotify_thread == AST_PTHREADT_NULL) {
+			if ((prompt_inotify_fd = inotify_init()) < 0) {
+				ast_log(LOG_WARNING, "Unable to initialize file notification for the prompt cache: %s\n", strerror(errno));
+			} else if (ast_pthread_create_background(&prompt_inotify_thread, NULL, prompt_inotify_daemon, NULL)) {
+				close(prompt_inotify_fd);
+				prompt_inotify_fd = -1;
+			}
+			if (prompt_inotify_fd < 0) {
+				/* Cached results could never be invalidated */
+				option_prompt_cache = 0;
+			}
+		}
+		ast_mutex_unlock(&prompt_cache_lock);
+		if (prompt_inotify_fd < 0) {
+			return;
+		}
+	}
+
+	key = ast_alloca(sizeof(*key) + strlen(path) + 1);
+	strcpy(key->path, path);
+	while ((slash = strrchr(key->path, '/')) && slash != key->path) {
+		*slash = '\0';
+		if ((wd = inotify_add_watch(prompt_inotify_fd, key->path, PROMPT_WATCH_MASK)) > -1) {
+			break;
+		}
+		if (errno != ENOENT && errno != ENOTDIR) {
+			ast_log(LOG_WARNING, "Unable to watch '%s' for the prompt cache: %s\n", key->path, strerror(errno));
+			return;
+		}
+	}
+	if (!slash || slash == key->path) {
+		return;
+	}
+
+	key->wd = wd;
+	ao2_lock(prompt_dirs);
+	if ((dir = ao2_find(prompt_dirs, key, OBJ_POINTER | OBJ_NOLOCK))) {
+		ao2_ref(dir, -1);
+	} else if ((dir = ao2_alloc(sizeof(*dir) + strlen(key->path) + 1, NULL))) {
+		dir->wd = wd;
+		strcpy(dir->path, key->path);
+		ao2_link_nolock(prompt_dirs, dir);
+		ao2_ref(dir, -1);
+	}
+	ao2_unlock(prompt_dirs);
+}
+#else
+static void prompt_cache_watch(const char *path)
+{
+}
+
+/*! \internal \brief Check whether a file changed since its entry was made */
+static int prompt_entry_changed(struct prompt_entry *entry)
+{
+	struct stat st;
+	int missing = stat(entry->path, &st) ? 1 : 0;
+
+	if (missing != entry->missing || (!missing && (st.st_ino != entry->st.st_ino ||
+		st.st_size != entry->st.st_size || st.st_mtime != entry->st.st_mtime))) {
+		return 1;
+	}
+	ao2_lock(entry);
+	entry->checked = ast_tvnow();
+	ao2_unlock(entry);
+
+	return 0;
+}
+#endif
+
+/*!
+ * \internal
+ * \brief Resolve a sound file path through the prompt cache
+ *
+ * On a miss stat() is run on the path and the outcome is cached, whether or
+ * not the file exists.
+ *
+ * \return the entry for path, with a reference, or NULL on allocation failure
+ */
+static struct prompt_entry *prompt_cache_lookup(const char *path)
+{
+	struct prompt_entry *key, *entry, *found;
+	size_t len = strlen(path) + 1;
+
+	key = ast_alloca(sizeof(*key) + len);
+	memcpy(key->path, path, len);
+
+	if ((entry = ao2_find(prompt_cache, key, OBJ_POINTER))) {
+#ifndef HAVE_INOTIFY
+		if (ast_tvdiff_ms(ast_tvnow(), entry->checked) > PROMPT_CACHE_TTL && prompt_entry_changed(entry)) {
+			ao2_ref(entry, -1);
+			prompt_cache_forget(path);
+		} else
+#endif
+		{
+			ast_atomic_fetchadd_int(&prompt_cache_stats.lookup_hits, 1);
+			ast_mutex_lock(&prompt_cache_lock);
+			if (entry->linked && entry != AST_DLLIST_FIRST(&prompt_lru)) {
+				AST_DLLIST_REMOVE(&prompt_lru, entry, lru);
+				AST_DLLIST_INSERT_HEAD(&prompt_lru, entry, lru);
+			}
+			ast_mutex_unlock(&prompt_cache_lock);
+			return entry;
+		}
+	}
+
+	ast_atomic_fetchadd_int(&prompt_cache_stats.lookup_misses, 1);
+	if (!(entry = ao2_alloc(sizeof(*entry) + len, prompt_entry_destructor))) {
+		return NULL;
+	}
+	memcpy(entry->path, path, len);
+	entry->charged = sizeof(*entry) + len;
+
+	prompt_cache_watch(path);
+	entry->missing = stat(path, &entry->st) ? 1 : 0;
+	entry->checked = ast_tvnow();
+
+	ast_mutex_lock(&prompt_cache_lock);
+	if ((found = ao2_find(prompt_cache, key, OBJ_POINTER))) {
+		/* Somebody else got here first */
+		ao2_ref(entry, -1);
+		entry = found;
+	} else {
+		entry->linked = 1;
+		ao2_link(prompt_cache, entry);
+		AST_DLLIST_INSERT_HEAD(&prompt_lru, entry, lru);
+		prompt_cache_bytes += entry->charged;
+		prompt_cache_trim();
+	}
+	ast_mutex_unlock(&prompt_cache_lock);
+
+	return entry;
+}
+
+/*! \internal \brief Read the contents of a sound file */
+static struct prompt_data *prompt_data_load(const char *path)
+{
+	struct prompt_data *data;
+	struct stat st;
+	ssize_t res;
+	size_t got;
+	int fd;
+
+	if ((fd = open(path, O_RDONLY)) < 0) {
+		return NULL;
+	}
+	if (fstat(fd, &st) || st.st_size <= 0 || st.st_size > prompt_cache_max / PROMPT_CACHE_FILE_SHARE ||
+		!(data = ao2_alloc(sizeof(*data), prompt_data_destructor))) {
+		close(fd);
+		return NULL;
+	}
+	data->size = st.st_size;
+
+	if (!(data->buf = ast_malloc(data->size))) {
+		close(fd);
+		ao2_ref(data, -1);
+		return NULL;
+	}
+	for (got = 0; got < data->size; got += res) {
+		if ((res = read(fd, data->buf + got, data->size - got)) <= 0) {
+			if (res < 0 && errno == EINTR) {
+				res = 0;
+				continue;
+			}
+			/* The file shrank under us, let the next lookup find out what happened */
+			close(fd);
+			ao2_ref(data, -1);
+			return NULL;
+		}
+	}
+	close(fd);
+
+	return data;
+}
+
+static COOKIE_HOOK_T prompt_reader_read(void *cookie, char *buf, COOKIE_LEN_T len)
+{
+	struct prompt_reader *reader = cookie;
+	size_t left = reader->pos < reader->data->size ? reader->data->size - reader->pos : 0;
+
+	if (len > left) {
+		len = left;
+	}
+	memcpy(buf, reader->data->buf + reader->pos, len);
+	reader->pos += len;
+
+	return len;
+}
+
+static int prompt_reader_seek_to(struct prompt_reader *reader, off_t *offset, int whence)
+{
+	off_t pos;
+
+	switch (whence) {
+	case SEEK_SET:
+		pos = *offset;
+		break;
+	case SEEK_CUR:
+		pos = reader->pos + *offset;
+		break;
+	case SEEK_END:
+		pos = reader->data->size + *offset;
+		break;
+	default:
+		errno = EINVAL;
+		return -1;
+	}
+	if (pos < 0) {
+		errno = EINVAL;
+		return -1;
+	}
+	*offset = reader->pos = pos;
+
+	return 0;
+}
+
+static int prompt_reader_close(void *cookie)
+{
+	struct prompt_reader *reader = cookie;
+
+	ao2_ref(reader->data, -1);
+	ast_free(reader);
+
+	return 0;
+}
+
+#if defined(HAVE_FUNOPEN)
+static fpos_t prompt_reader_seek(void *cookie, fpos_t pos, int whence)
+{
+	off_t offset = pos;
+
+	return prompt_reader_seek_to(cookie, &offset, whence) ? -1 : offset;
+}
+#elif defined(HAVE_FOPENCOOKIE)
+static int prompt_reader_seek(void *cookie, off64_t *pos, int whence)
+{
+	off_t offset = *pos;
+	int res = prompt_reader_seek_to(cookie, &offset, whence);
+
+	*pos = offset;
+	return res;
+}
+#endif
+
+/*!
+ * \internal
+ * \brief Open a cached sound file for reading from memory
+ *
+ * \return a stream over the shared contents of the file, or NULL if they
+ * cannot be cached and the file should be opened as usual
+ */
+static FILE *prompt_cache_fopen(struct prompt_entry *entry)
+{
+#if defined(HAVE_FUNOPEN) || defined(HAVE_FOPENCOOKIE)
+	struct prompt_reader *reader;
+	struct prompt_data *data;
+	int loaded = 0;
+	FILE *f;
+
+	if (entry->st.st_size <= 0 || entry->st.st_size > prompt_cache_max / PROMPT_CACHE_FILE_SHARE) {
+		return NULL;
+	}
+
+	ao2_lock(entry);
+	if (!(data = entry->data) && (data = entry->data = prompt_data_load(entry->path))) {
+		loaded = 1;
+	}
+	if (data) {
+		ao2_ref(data, +1);
+	}
+	ao2_unlock(entry);
+
+	if (!data) {
+		return NULL;
+	}
+	if (loaded) {
+		ast_atomic_fetchadd_int(&prompt_cache_stats.open_misses, 1);
+		ast_mutex_lock(&prompt_cache_lock);
+		if (entry->linked) {
+			entry->charged += data->size;
+			prompt_cache_bytes += data->size;
+			prompt_cache_trim();
+		}
+		ast_mutex_unlock(&prompt_cache_lock);
+	} else {
+		ast_atomic_fetchadd_int(&prompt_cache_stats.open_hits, 1);
+	}
+
+	if (!(reader = ast_calloc(1, sizeof(*reader)))) {
+		ao2_ref(data, -1);
+		return NULL;
+	}
+	reader->data = data;
+
+#if defined(HAVE_FUNOPEN)
+	f = funopen(reader, prompt_reader_read, NULL, prompt_reader_seek, prompt_reader_close);
+#else
+	{
+		static const cookie_io_functions_t cookie_funcs = {
+			prompt_reader_read, NULL, prompt_reader_seek, prompt_reader_close
+		};
+		f = fopencookie(reader, "r", cookie_funcs);
+	}
+#endif
+	if (!f) {
+		prompt_reader_close(reader);
+		return NULL;
+	}
+	/* Frames are copied straight out of the shared contents */
+	setvbuf(f, NULL, _IONBF, 0);
+
+	return f;
+#else
+	return NULL;
+#endif
+}
+
+/*! \internal \brief Drop the entries for a file name in each of the extensions of a format */
+static void prompt_cache_forget_exts(const char *filename, const char *exts)
+{
+	char *stringp = ast_strdupa(exts), *ext, *fn;
+
+	while ((ext = strsep(&stringp, "|"))) {
+		if ((fn = build_filename(filename, ext))) {
+			prompt_cache_forget(fn);
+			ast_free(fn);
+		}
+	}
+}
+
+/*!
+ * \page RecordingWriters Recording writers
+ *
+ * When record_writers is set in asterisk.conf, streams opened with
+ * ast_writefile() do not write to their file themselves. Whatever the format
+ * writes is copied into a ring buffer of record_queue_size kB belonging to
+ * the stream, along with the file offset it belongs at, and a pool of
+ * record_writers threads writes it out with one pwrite() for each run of
+ * contiguous data. A stream is handed to the pool once it has
+ * FILE_QUEUE_BATCH bytes waiting, or within a second otherwise. The thread
+ * recording a call therefore never waits on the disk unless its ring is
+ * full, which is counted as a stall.
+ *
+ * Closing, truncating or reading a stream writes out whatever it still has
+ * waiting first, from the calling thread, so the file is complete as soon as
+ * ast_closestream() returns. record_fsync selects whether files are synced
+ * never, when they are closed, or also every so many seconds while written.
+ */
+
+/*! Waiting data that gets a stream handed to a writer thread */
+#define FILE_QUEUE_BATCH (16 * 1024)
+/*! Separately placed runs of data a ring can hold */
+#define FILE_QUEUE_SEGMENTS 16
+
+/*! \brief A run of data in a ring that belongs at one place in the file */
+struct file_queue_segment {
+	off_t offset;
+	size_t len;
+};
+
+/*! \brief Recording writer counters, kept per stream and added up when shown */
+struct file_writer_stats {
+	uint64_t bytes;
+	uint64_t writes;
+	uint64_t syncs;
+	uint64_t stalls;
+	uint64_t stall_usecs;
+	uint64_t errors;
+	/*! Most data seen waiting in one ring */
+	size_t max_waiting;
+};
+
+/*! \brief Data written through a stream, waiting for a writer thread */
+struct ast_filestream_queue {
+	int fd;
+	ast_mutex_t lock;
+	/*! Signalled when data has been written out */
+	ast_cond_t cond;
+	char *ring;
+	size_t size;
+	/*! Bytes ever queued and written out; their difference is waiting */
+	size_t head;
+	size_t tail;
+	struct file_queue_segment segs[FILE_QUEUE_SEGMENTS];
+	unsigned int seg_head;
+	unsigned int seg_tail;
+	/*! Position and size of the file as the stream sees it */
+	off_t pos;
+	off_t end;
+	/*! errno of a write that failed, returned by the next one */
+	int error;
+	/*! Set while a thread is writing out data */
+	unsigned int busy:1;
+	/*! Set while on the ready list, protected by the pool lock */
+	unsigned int scheduled:1;
+	struct timeval synced;
+	struct file_writer_stats stats;
+	AST_LIST_ENTRY(ast_filestream_queue) ready;
+	AST_LIST_ENTRY(ast_filestream_queue) list;
+};
+
+/*!
+ * \note The pool lock is taken before the lock of any queue, and a queue
+ * cannot be freed while the pool lock is held.
+ */
+static struct {
+	ast_mutex_t lock;
+	ast_cond_t cond;
+	/*! Queues with data waiting for a writer thread */
+	AST_LIST_HEAD_NOLOCK(, ast_filestream_queue) ready;
+	/*! Every open queue */
+	AST_LIST_HEAD_NOLOCK(, ast_filestream_queue) queues;
+	int threads;
+	int streams;
+	struct timeval swept;
+	/*! Counters of the streams that have been closed */
+	struct file_writer_stats closed;
+} file_writers;
+
+static void file_writer_stats_add(struct file_writer_stats *total, const struct file_writer_stats *stats)
+{
+	total->bytes += stats->bytes;
+	total->writes += stats->writes;
+	total->syncs += stats->syncs;
+	total->stalls += stats->stalls;
+	total->stall_usecs += stats->stall_usecs;
+	total->errors += stats->errors;
+	total->max_waiting = MAX(total->max_waiting, stats->max_waiting);
+}
+
+/*!
+ * \internal
+ * \brief Write out the data waiting in a queue
+ * \note The queue must be locked and not busy. It is unlocked while writing.
+ */
+static void file_queue_write(struct ast_filestream_queue *q)
+{
+	int failed = 0;
+
+	q->busy = 1;
+	while (q->tail != q->head) {
+		struct file_queue_segment *seg = &q->segs[q->seg_tail % FILE_QUEUE_SEGMENTS];
+		size_t at = q->tail % q->size;
+		size_t len = MIN(seg->len, q->size - at);
+		off_t offset = seg->offset;
+		ssize_t res;
+
+		ast_mutex_unlock(&q->lock);
+		while ((res = pwrite(q->fd, q->ring + at, len, offset)) < 0 && errno == EINTR) {
+		}
+		ast_mutex_lock(&q->lock);
+
+		if (res <= 0) {
+			/* Nothing more will fit, so drop what is waiting rather than retry forever */
+			q->error = res ? errno : ENOSPC;
+			q->tail = q->head;
+			q->seg_tail = q->seg_head;
+			q->stats.errors++;
+			failed = 1;
+			break;
+		}
+		q->stats.writes++;
+		q->stats.bytes += res;
+		q->tail += res;
+		seg->offset += res;
+		if (!(seg->len -= res)) {
+			q->seg_tail++;
+		}
+		ast_cond_broadcast(&q->cond);
+	}
+
+	if (option_record_fsync > 0 && !failed && ast_tvdiff_ms(ast_tvnow(), q->synced) >= option_record_fsync * 1000) {
+		ast_mutex_unlock(&q->lock);
+		fsync(q->fd);
+		ast_mutex_lock(&q->lock);
+		q->synced = ast_tvnow();
+		q->stats.syncs++;
+	}
+	q->busy = 0;
+	ast_cond_broadcast(&q->cond);
+
+	if (failed) {
+		ast_log(LOG_WARNING, "Unable to write recording: %s\n", strerror(q->error));
+	}
+}
+
+/*! \internal \brief Hand a queue to the writer threads */
+static void file_queue_schedule(struct ast_filestream_queue *q)
+{
+	ast_mutex_lock(&file_writers.lock);
+	if (!q->scheduled) {
+		q->scheduled = 1;
+		AST_LIST_INSERT_TAIL(&file_writers.ready, q, ready);
+		ast_cond_signal(&file_writers.cond);
+	}
+	ast_mutex_unlock(&file_writers.lock);
+}
+
+/*!
+ * \internal
+ * \brief Write out everything waiting in a queue from the calling thread
+ * \note The queue must be locked.
+ */
+static void file_queue_drain(struct ast_filestream_queue *q)
+{
+	while (q->busy) {
+		ast_cond_wait(&q->cond, &q->lock);
+	}
+	if (q->tail != q->head) {
+		file_queue_write(q);
+	}
+}
+
+static void *file_writer_thread(void *data)
+{
+	struct ast_filestream_queue *q;
+
+	ast_mutex_lock(&file_writers.lock);
+	for (;;) {
+		if (file_writers.threads > option_record_writers && !file_writers.streams) {
+			/* record_writers was lowered, and nothing is left that needs us */
+			file_writers.threads--;
+			break;
+		}
+		if (ast_tvdiff_ms(ast_tvnow(), file_writers.swept) >= 1000) {
+			/* Nothing waits much longer than a second, however little there is */
+			file_writers.swept = ast_tvnow();
+			AST_LIST_TRAVERSE(&file_writers.queues, q, list) {
+				if (!q->scheduled && q->tail != q->head) {
+					q->scheduled = 1;
+					AST_LIST_INSERT_TAIL(&file_writers.ready, q, ready);
+				}
+			}
+		}
+		if (!(q = AST_LIST_REMOVE_HEAD(&file_writers.ready, ready))) {
+			struct timeval wait = ast_tvadd(file_writers.swept, ast_tv(1, 0));
+			struct timespec ts = { .tv_sec = wait.tv_sec, .tv_nsec = wait.tv_usec * 1000 };
+
+			ast_cond_timedwait(&file_writers.cond, &file_writers.lock, &ts);
+			continue;
+		}
+		q->scheduled = 0;
+		/* Locked before the pool is let go of, so the stream cannot be closed under us */
+		ast_mutex_lock(&q->lock);
+		ast_mutex_unlock(&file_writers.lock);
+
+		/* If another thread is at it already, it keeps going until there is nothing left */
+		if (!q->busy) {
+			file_queue_write(q);
+		}
+		ast_mutex_unlock(&q->lock);
+
+		ast_mutex_lock(&file_writers.lock);
+	}
+	ast_mutex_unlock(&file_writers.lock);
+
+	return NULL;
+}
+
+/*! \internal \brief Start the writer threads, if they are not running yet */
+static int file_writers_start(void)
+{
+	pthread_t thread;
+	int res = 0;
+
+	ast_mutex_lock(&file_writers.lock);
+	while (file_writers.threads < option_record_writers) {
+		if (ast_pthread_create_detached_background(&thread, NULL, file_writer_thread, NULL)) {
+			ast_log(LOG_WARNING, "Unable to start a recording writer thread\n");
+			res = file_writers.threads ? 0 : -1;
+			break;
+		}
+		file_writers.threads++;
+	}
+	ast_mutex_unlock(&file_writers.lock);
+
+	return res;
+}
+
+static COOKIE_HOOK_T file_queue_cookie_write(void *cookie, const char *buf, COOKIE_LEN_T len)
+{
+	struct ast_filestream_queue *q = cookie;
+	struct file_queue_segment *seg;
+	size_t done = 0, waiting;
+	int schedule;
+
+	ast_mutex_lock(&q->lock);
+	if (q->error) {
+		errno = q->error;
+		q->error = 0;
+		ast_mutex_unlock(&q->lock);
+		return -1;
+	}
+	while (done < len) {
+		size_t at = q->head % q->size;
+		size_t n = MIN(MIN(len - done, q->size - (q->head - q->tail)), q->size - at);
+
+		seg = &q->segs[(q->seg_head - 1) % FILE_QUEUE_SEGMENTS];
+		if (!n || (q->seg_head == q->seg_tail || seg->offset + seg->len != q->pos)) {
+			/* Data for a new place in the file needs a segment of its own */
+			if (n && q->seg_head - q->seg_tail < FILE_QUEUE_SEGMENTS) {
+				seg = &q->segs[q->seg_head++ % FILE_QUEUE_SEGMENTS];
+				seg->offset = q->pos;
+				seg->len = 0;
+			} else {
+				struct timeval start = ast_tvnow();
+
+				/* Full, so the writers are behind: wait for them */
+				ast_mutex_unlock(&q->lock);
+				file_queue_schedule(q);
+				ast_mutex_lock(&q->lock);
+				if (q->head - q->tail == q->size || q->seg_head - q->seg_tail == FILE_QUEUE_SEGMENTS) {
+					ast_cond_wait(&q->cond, &q->lock);
+				}
+				q->stats.stalls++;
+				q->stats.stall_usecs += ast_tvdiff_us(ast_tvnow(), start);
+				continue;
+			}
+		}
+		memcpy(q->ring + at, buf + done, n);
+		q->head += n;
+		seg->len += n;
+		q->pos += n;
+		done += n;
+	}
+	if (q->pos > q->end) {
+		q->end = q->pos;
+	}
+	waiting = q->head - q->tail;
+	if (waiting > q->stats.max_waiting) {
+		q->stats.max_waiting = waiting;
+	}
+	schedule = waiting >= FILE_QUEUE_BATCH || q->seg_head - q->seg_tail > FILE_QUEUE_SEGMENTS / 2;
+	ast_mutex_unlock(&q->lock);
+
+	if (schedule) {
+		file_queue_schedule(q);
+	}
+
+	return len;
+}
+
+static COOKIE_HOOK_T file_queue_cookie_read(void *cookie, char *buf, COOKIE_LEN_T len)
+{
+	struct ast_filestream_queue *q = cookie;
+	ssize_t res;
+
+	ast_mutex_lock(&q->lock);
+	file_queue_drain(q);
+	if ((res = pread(q->fd, buf, len, q->pos)) > 0) {
+		q->pos += res;
+	}
+	ast_mutex_unlock(&q->lock);
+
+	return res;
+}
+
+static int file_queue_seek_to(struct ast_filestream_queue *q, off_t *offset, int whence)
+{
+	off_t pos;
+	int res = 0;
+
+	ast_mutex_lock(&q->lock);
+	switch (whence) {
+	case SEEK_SET:
+		pos = *offset;
+		break;
+	case SEEK_CUR:
+		pos = q->pos + *offset;
+		break;
+	case SEEK_END:
+		pos = q->end + *offset;
+		break;
+	default:
+		pos = -1;
+		break;
+	}
+	if (pos < 0) {
+		errno = EINVAL;
+		res = -1;
+	} else {
+		*offset = q->pos = pos;
+	}
+	ast_mutex_unlock(&q->lock);
+
+	return res;
+}
+
+#if defined(HAVE_FUNOPEN)
+static fpos_t file_queue_cookie_seek(void *cookie, fpos_t pos, int whence)
+{
+	off_t offset = pos;
+
+	return file_queue_seek_to(cookie, &offset, whence) ? -1 : offset;
+}
+#elif defined(HAVE_FOPENCOOKIE)
+static int file_queue_cookie_seek(void *cookie, off64_t *pos, int whence)
+{
+	off_t offset = *pos;
+	int res = file_queue_seek_to(cookie, &offset, whence);
+
+	*pos = offset;
+	return res;
+}
+#endif
+
+static int file_queue_cookie_close(void *cookie)
+{
+	struct ast_filestream_queue *q = cookie;
+	int res;
+
+	ast_mutex_lock(&file_writers.lock);
+	if (q->scheduled) {
+		AST_LIST_REMOVE(&file_writers.ready, q, ready);
+		q->scheduled = 0;
+	}
+	AST_LIST_REMOVE(&file_writers.queues, q, list);
+	file_writers.streams--;
+	ast_mutex_unlock(&file_writers.lock);
+
+	ast_mutex_lock(&q->lock);
+	file_queue_drain(q);
+	res = q->error ? -1 : 0;
+	ast_mutex_unlock(&q->lock);
+
+	if (option_record_fsync >= 0) {
+		fsync(q->fd);
+		q->stats.syncs++;
+	}
+	close(q->fd);
+
+	ast_mutex_lock(&file_writers.lock);
+	file_writer_stats_add(&file_writers.closed, &q->stats);
+	ast_mutex_unlock(&file_writers.lock);
+
+	ast_mutex_destroy(&q->lock);
+	ast_cond_destroy(&q->cond);
+	ast_free(q->ring);
+	ast_free(q);
+
+	return res;
+}
+
+/*!
+ * \internal
+ * \brief Open a descriptor for writing through the recording writer threads
+ *
+ * \return a stream writing to fd, which it takes over, or NULL if recording
+ * writers are not enabled or available and fd should be used directly
+ */
+static FILE *file_queue_open(int fd, struct ast_filestream_queue **queue)
+{
+#if defined(HAVE_FUNOPEN) || defined(HAVE_FOPENCOOKIE)
+	struct ast_filestream_queue *q;
+	struct stat st;
+	FILE *f;
+
+	if (option_record_writers <= 0 || file_writers_start() || fstat(fd, &st) ||
+		!(q = ast_calloc(1, sizeof(*q)))) {
+		return NULL;
+	}
+	q->size = option_record_queue_size * 1024;
+	if (!(q->ring = ast_malloc(q->size))) {
+		ast_free(q);
+		return NULL;
+	}
+	q->fd = fd;
+	q->end = st.st_size;
+	q->synced = ast_tvnow();
+	ast_mutex_init(&q->lock);
+	ast_cond_init(&q->cond, NULL);
+
+#if defined(HAVE_FUNOPEN)
+	f = funopen(q, file_queue_cookie_read, file_queue_cookie_write, file_queue_cookie_seek, file_queue_cookie_close);
+#else
+	{
+		static const cookie_io_functions_t cookie_funcs = {
+			file_queue_cookie_read, file_queue_cookie_write, file_queue_cookie_seek, file_queue_cookie_close
+		};
+		f = fopencookie(q, "w+", cookie_funcs);
+	}
+#endif
+	if (!f) {
+		ast_mutex_destroy(&q->lock);
+		ast_cond_destroy(&q->cond);
+		ast_free(q->ring);
+		ast_free(q);
+		return NULL;
+	}
+	/* The ring is the buffer, and frames reach it as they are written */
+	setvbuf(f, NULL, _IONBF, 0);
+
+	ast_mutex_lock(&file_writers.lock);
+	AST_LIST_INSERT_TAIL(&file_writers.queues, q, list);
+	file_writers.streams++;
+	ast_mutex_unlock(&file_writers.lock);
+
+	*queue = q;
+	return f;
+#else
+	return NULL;
+#endif
+}
+
+/*! \internal \brief Truncate a queued stream's file at its current position */
+static int file_queue_trunc(struct ast_filestream_queue *q)
+{
+	int res;
+
+	ast_mutex_lock(&q->lock);
+	file_queue_drain(q);
+	if (!(res = ftruncate(q->fd, q->pos))) {
+		q->end = q->pos;
+	}
+	ast_mutex_unlock(&q->lock);
+
+	return res;
+}
+
 /*! \internal \brief Close the file stream by canceling any pending read / write callbacks */
 static void filestream_close(struct ast_filestream *f)
 {
@@ -341,16 +1471,21 @@ static void filestream_destructor(void *arg)
 		}
 	}
 
-	if (f->filename)
-		free(f->filename);
-	if (f->realfilename)
-		free(f->realfilename);
 	if (f->fmt->close) {
 		void (*closefn)(struct ast_filestream *) = f->fmt->close;
 		closefn(f);
 	}
 	if (f->f)
 		fclose(f->f);
+	/* Whatever was written or read through a named stream must not be served stale from the prompt cache */
+	if (f->realfilename)
+		prompt_cache_forget(f->realfilename);
+	else if (f->filename)
+		prompt_cache_forget_exts(f->filename, f->fmt->exts);
+	if (f->filename)
+		free(f->filename);
+	if (f->realfilename)
+		free(f->realfilename);
 	if (f->vfs)
 		ast_closestream(f->vfs);
 	if (f->write_buffer) {
@@ -452,12 +1587,25 @@ static int filehelper(const char *filename, const void *arg2, const char *fmt, c
 		stringp = ast_strdupa(f->exts);	/* this is in the stack so does not need to be freed */
 		while ( (ext = strsep(&stringp, "|")) ) {
 			struct stat st;
+			struct prompt_entry *entry = NULL;
 			char *fn = build_filename(filename, ext);
+			int found;
 
 			if (fn == NULL)
 				continue;
 
-			if ( stat(fn, &st) ) { /* file not existent */
+			if (option_prompt_cache && (action == ACTION_EXISTS || action == ACTION_OPEN) &&
+				(entry = prompt_cache_lookup(fn))) {
+				found = !entry->missing;
+				st = entry->st;
+				if (action != ACTION_OPEN || !found) {
+					ao2_ref(entry, -1);
+					entry = NULL;
+				}
+			} else {
+				found = !stat(fn, &st);
+			}
+			if (!found) { /* file not existent */
 				ast_free(fn);
 				continue;
 			}
@@ -472,10 +1620,18 @@ static int filehelper(const char *filename, const void *arg2, const char *fmt, c
 				if ((ast_format_cmp(&chan->writeformat, &f->format) == AST_FORMAT_CMP_NOT_EQUAL) &&
 				     !(((AST_FORMAT_GET_TYPE(f->format.id) == AST_FORMAT_TYPE_AUDIO) && fmt) ||
 					  ((AST_FORMAT_GET_TYPE(f->format.id) == AST_FORMAT_TYPE_VIDEO) && fmt))) {
+					if (entry) {
+						ao2_ref(entry, -1);
+					}
 					ast_free(fn);
 					continue;	/* not a supported format */
 				}
-				if ( (bfile = fopen(fn, "r")) == NULL) {
+				bfile = NULL;
+				if (entry) {
+					bfile = prompt_cache_fopen(entry);
+					ao2_ref(entry, -1);
+				}
+				if (!bfile && (bfile = fopen(fn, "r")) == NULL) {
 					ast_free(fn);
 					continue;	/* cannot open file */
 				}
@@ -509,49 +1665,416 @@ static int filehelper(const char *filename, const void *arg2, const char *fmt, c
 					chan->vstream = s;
 				}
 				ast_free(fn);
-				break;
+				break;
+			}
+			switch (action) {
+			case ACTION_OPEN:
+				break;	/* will never get here */
+
+			case ACTION_EXISTS:	/* return the matching format */
+				/* if arg2 is present, it is a format capabilities structure.
+				 * Add this format to the set of formats this file can be played in */
+				if (arg2) {
+					ast_format_cap_add((struct ast_format_cap *) arg2, &f->format);
+				}
+				res = 1; /* file does exist and format it exists in is returned in arg2 */
+				break;
+
+			case ACTION_DELETE:
+				if ( (res = unlink(fn)) )
+					ast_log(LOG_WARNING, "unlink(%s) failed: %s\n", fn, strerror(errno));
+				prompt_cache_forget(fn);
+				break;
+
+			case ACTION_RENAME:
+			case ACTION_COPY: {
+				char *nfn = build_filename((const char *)arg2, ext);
+				if (!nfn)
+					ast_log(LOG_WARNING, "Out of memory\n");
+				else {
+					res = action == ACTION_COPY ? copy(fn, nfn) : rename(fn, nfn);
+					if (res)
+						ast_log(LOG_WARNING, "%s(%s,%s) failed: %s\n",
+							action == ACTION_COPY ? "copy" : "rename",
+							 fn, nfn, strerror(errno));
+					prompt_cache_forget(fn);
+					prompt_cache_forget(nfn);
+					ast_free(nfn);
+				}
+			    }
+				break;
+
+			default:
+				ast_log(LOG_WARNING, "Unknown helper %d\n", action);
+			}
+			ast_free(fn);
+		}
+	}
+	AST_RWLIST_UNLOCK(&formats);
+	return res;
+}
+
+/*!
+ * \page PromptTranscode Transcoded prompt variants
+ *
+ * When prompt_transcode is set in asterisk.conf and a channel is to play a
+ * sound file that exists in no format the channel takes natively, the file
+ * is transcoded once into the format the channel writes, on the
+ * prompt_transcode taskprocessor, and the channel is played the result from
+ * then on. Until the variant exists, playback is translated frame by frame
+ * as before.
+ *
+ * Variants are named by the MD5 of the source contents and the source
+ * format, so a changed source gets a new variant, identical sources share
+ * one, and variants remain valid across restarts. The hash of each source is
+ * remembered in memory along with the identity of the file it was taken
+ * from, so it is only taken again once the source changes.
+ */
+
+/*! \brief A sound file that a transcoded variant has been asked for */
+struct transcode_source {
+	/*! Identity of the file the hash was taken from */
+	ino_t ino;
+	off_t size;
+	time_t mtime;
+	/*! MD5 of the contents in hex, empty until a job has taken it */
+	char hash[33];
+	/*! Formats a job has been queued for, whether or not it succeeded */
+	struct ast_format_cap *queued;
+	char path[0];
+};
+
+/*! \brief A request to transcode a sound file */
+struct transcode_job {
+	struct transcode_source *source;
+	struct ast_format dst;
+	/*! Name of the source file format, part of the variant name */
+	char src_name[80];
+	char src_ext[80];
+	char dst_ext[80];
+	/*! Source as given to ast_readfile(), without an extension */
+	char name[0];
+};
+
+static struct ao2_container *transcode_sources;
+static struct ast_taskprocessor *transcode_tps;
+
+static struct {
+	int played;
+	int generated;
+	int failed;
+} transcode_stats;
+
+static int transcode_source_hash(const void *obj, const int flags)
+{
+	const struct transcode_source *source = obj;
+
+	return ast_str_hash(source->path);
+}
+
+static int transcode_source_cmp(void *obj, void *arg, int flags)
+{
+	struct transcode_source *source = obj, *key = arg;
+
+	return !strcmp(source->path, key->path) ? CMP_MATCH | CMP_STOP : 0;
+}
+
+static void transcode_source_destructor(void *obj)
+{
+	struct transcode_source *source = obj;
+
+	source->queued = ast_format_cap_destroy(source->queued);
+}
+
+/*! \internal \brief stat() a sound file, through the prompt cache when it is enabled */
+static int prompt_stat(const char *path, struct stat *st)
+{
+	struct prompt_entry *entry;
+	int res;
+
+	if (!option_prompt_cache || !(entry = prompt_cache_lookup(path))) {
+		return stat(path, st);
+	}
+	res = entry->missing ? -1 : 0;
+	*st = entry->st;
+	ao2_ref(entry, -1);
+
+	return res;
+}
+
+/*!
+ * \internal
+ * \brief Find the file format that stores a media format
+ *
+ * \param format media format to store
+ * \param filename if not NULL, only a file format that filename exists in
+ * will do, and ext is set to the extension it exists with
+ * \param name set to the name of the file format
+ * \param ext set to the extension of the file format
+ *
+ * \retval 0 on success
+ * \retval -1 if there is no such file format
+ */
+static int transcode_format(const struct ast_format *format, const char *filename, char *name, char *ext)
+{
+	struct ast_format_def *f;
+	int res = -1;
+
+	AST_RWLIST_RDLOCK(&formats);
+	AST_RWLIST_TRAVERSE(&formats, f, list) {
+		char *stringp, *e;
+
+		if (ast_format_cmp(&f->format, format) == AST_FORMAT_CMP_NOT_EQUAL || !f->write) {
+			continue;
+		}
+		stringp = ast_strdupa(f->exts);
+		while ((e = strsep(&stringp, "|"))) {
+			struct stat st;
+			char *fn;
+
+			if (filename) {
+				if (!(fn = build_filename(filename, e))) {
+					continue;
+				}
+				res = prompt_stat(fn, &st);
+				ast_free(fn);
+				if (res) {
+					continue;
+				}
 			}
-			switch (action) {
-			case ACTION_OPEN:
-				break;	/* will never get here */
+			ast_copy_string(name, f->name, sizeof(f->name));
+			ast_copy_string(ext, e, sizeof(f->exts));
+			res = 0;
+			break;
+		}
+		if (!res) {
+			break;
+		}
+	}
+	AST_RWLIST_UNLOCK(&formats);
 
-			case ACTION_EXISTS:	/* return the matching format */
-				/* if arg2 is present, it is a format capabilities structure.
-				 * Add this format to the set of formats this file can be played in */
-				if (arg2) {
-					ast_format_cap_add((struct ast_format_cap *) arg2, &f->format);
-				}
-				res = 1; /* file does exist and format it exists in is returned in arg2 */
-				break;
+	return res;
+}
 
-			case ACTION_DELETE:
-				if ( (res = unlink(fn)) )
-					ast_log(LOG_WARNING, "unlink(%s) failed: %s\n", fn, strerror(errno));
-				break;
+/*! \internal \brief Take the MD5 of the contents of a file, and its identity */
+static int transcode_hash(const char *path, char *hash, struct stat *st)
+{
+	struct MD5Context md5;
+	unsigned char digest[16], buf[4096];
+	ssize_t res;
+	int fd, x;
 
-			case ACTION_RENAME:
-			case ACTION_COPY: {
-				char *nfn = build_filename((const char *)arg2, ext);
-				if (!nfn)
-					ast_log(LOG_WARNING, "Out of memory\n");
-				else {
-					res = action == ACTION_COPY ? copy(fn, nfn) : rename(fn, nfn);
-					if (res)
-						ast_log(LOG_WARNING, "%s(%s,%s) failed: %s\n",
-							action == ACTION_COPY ? "copy" : "rename",
-							 fn, nfn, strerror(errno));
-					ast_free(nfn);
-				}
-			    }
-				break;
+	if ((fd = open(path, O_RDONLY)) < 0) {
+		return -1;
+	}
+	if (fstat(fd, st)) {
+		close(fd);
+		return -1;
+	}
+	MD5Init(&md5);
+	while ((res = read(fd, buf, sizeof(buf))) > 0 || (res < 0 && errno == EINTR)) {
+		if (res > 0) {
+			MD5Update(&md5, buf, res);
+		}
+	}
+	close(fd);
+	if (res < 0) {
+		return -1;
+	}
+	MD5Final(digest, &md5);
+	for (x = 0; x < 16; x++) {
+		sprintf(hash + x * 2, "%2.2x", digest[x]);
+	}
 
-			default:
-				ast_log(LOG_WARNING, "Unknown helper %d\n", action);
-			}
-			ast_free(fn);
+	return 0;
+}
+
+static int transcode_exec(void *data)
+{
+	struct transcode_job *job = data;
+	struct transcode_source *source = job->source;
+	struct ast_filestream *rs = NULL, *ws = NULL;
+	char hash[33], *variant = NULL, *tmp = NULL;
+	struct ast_frame *fr;
+	struct stat st;
+	int res = -1;
+
+	if (transcode_hash(source->path, hash, &st)) {
+		ast_log(LOG_WARNING, "Unable to read '%s' to transcode it: %s\n", source->path, strerror(errno));
+		goto done;
+	}
+	ao2_lock(source);
+	if (st.st_ino == source->ino && st.st_size == source->size && st.st_mtime == source->mtime) {
+		ast_copy_string(source->hash, hash, sizeof(source->hash));
+	}
+	ao2_unlock(source);
+
+	if (ast_asprintf(&variant, "%s/%s-%s", prompt_transcode_dir, hash, job->src_name) < 0 ||
+		ast_asprintf(&tmp, "%s/.%s-%s", prompt_transcode_dir, hash, job->src_name) < 0) {
+		goto done;
+	}
+	if (filehelper(variant, NULL, job->dst_ext, ACTION_EXISTS)) {
+		/* Transcoded before this source was last changed or by another name */
+		res = 0;
+		goto done;
+	}
+
+	if (!(rs = ast_readfile(job->name, job->src_ext, NULL, O_RDONLY, 0, 0)) ||
+		!(ws = ast_writefile(tmp, job->dst_ext, NULL, 0, 0, AST_FILE_MODE))) {
+		goto done;
+	}
+	while ((fr = ast_readframe(rs))) {
+		res = ast_writestream(ws, fr);
+		ast_frfree(fr);
+		if (res) {
+			break;
 		}
 	}
-	AST_RWLIST_UNLOCK(&formats);
+	ast_closestream(ws);
+	ws = NULL;
+
+	/* Only a complete variant may ever be found under its final name */
+	if (res || (res = ast_filerename(tmp, variant, job->dst_ext))) {
+		ast_filedelete(tmp, job->dst_ext);
+	} else {
+		ast_atomic_fetchadd_int(&transcode_stats.generated, 1);
+		ast_verb(3, "Transcoded '%s' to %s for playback\n", source->path, ast_getformatname(&job->dst));
+	}
+
+done:
+	if (res) {
+		ast_atomic_fetchadd_int(&transcode_stats.failed, 1);
+		ast_log(LOG_WARNING, "Unable to transcode '%s' to %s, it will be translated as it is played\n",
+			source->path, ast_getformatname(&job->dst));
+	}
+	if (rs) {
+		ast_closestream(rs);
+	}
+	ast_free(variant);
+	ast_free(tmp);
+	ao2_ref(source, -1);
+	ast_free(job);
+
+	return 0;
+}
+
+/*!
+ * \internal
+ * \brief Open the transcoded variant of a sound file for a channel
+ *
+ * When the file exists in no format the channel takes natively and no
+ * variant in the channel's format exists yet, a job is queued to make one.
+ *
+ * \param chan channel to play to
+ * \param filename sound file, as found by fileexists_core()
+ * \param file_cap formats the sound file exists in
+ *
+ * \retval 0 if the variant was opened on the channel
+ * \retval -1 if the file should be played as usual
+ */
+static int prompt_variant_open(struct ast_channel *chan, const char *filename, struct ast_format_cap *file_cap)
+{
+	char src_name[80], src_ext[80], dst_name[80], dst_ext[80];
+	struct transcode_source *key, *source;
+	struct ast_format_cap *dst_cap;
+	struct ast_format src, dst;
+	struct transcode_job *job;
+	char *path, *variant = NULL;
+	struct stat st;
+	int queue = 0, res;
+
+	if (AST_FORMAT_GET_TYPE(chan->rawwriteformat.id) != AST_FORMAT_TYPE_AUDIO ||
+		ast_format_cap_has_joint(file_cap, chan->nativeformats)) {
+		/* Played without translation anyway */
+		return -1;
+	}
+
+	if (!(dst_cap = ast_format_cap_alloc_nolock())) {
+		return -1;
+	}
+	ast_format_cap_add(dst_cap, &chan->rawwriteformat);
+	res = ast_translator_best_choice(dst_cap, file_cap, &dst, &src);
+	dst_cap = ast_format_cap_destroy(dst_cap);
+	if (res || transcode_format(&dst, NULL, dst_name, dst_ext) ||
+		transcode_format(&src, filename, src_name, src_ext)) {
+		return -1;
+	}
+
+	if (!(path = build_filename(filename, src_ext))) {
+		return -1;
+	}
+	if (prompt_stat(path, &st)) {
+		ast_free(path);
+		return -1;
+	}
+
+	key = ast_alloca(sizeof(*key) + strlen(path) + 1);
+	strcpy(key->path, path);
+	ao2_lock(transcode_sources);
+	if (!(source = ao2_find(transcode_sources, key, OBJ_POINTER | OBJ_NOLOCK)) &&
+		(source = ao2_alloc(sizeof(*source) + strlen(path) + 1, transcode_source_destructor))) {
+		strcpy(source->path, path);
+		if (!(source->queued = ast_format_cap_alloc_nolock())) {
+			ao2_ref(source, -1);
+			source = NULL;
+		} else {
+			ao2_link_nolock(transcode_sources, source);
+		}
+	}
+	ao2_unlock(transcode_sources);
+	if (!source) {
+		ast_free(path);
+		return -1;
+	}
+
+	ao2_lock(source);
+	if (st.st_ino != source->ino || st.st_size != source->size || st.st_mtime != source->mtime) {
+		/* New or changed since the hash was taken */
+		source->ino = st.st_ino;
+		source->size = st.st_size;
+		source->mtime = st.st_mtime;
+		source->hash[0] = '\0';
+		ast_format_cap_remove_all(source->queued);
+	}
+	if (!ast_strlen_zero(source->hash) &&
+		ast_asprintf(&variant, "%s/%s-%s", prompt_transcode_dir, source->hash, src_name) < 0) {
+		variant = NULL;
+	}
+	ao2_unlock(source);
+
+	res = -1;
+	if (variant && filehelper(variant, NULL, dst_ext, ACTION_EXISTS)) {
+		if (!ast_set_write_format(chan, &dst) && filehelper(variant, chan, NULL, ACTION_OPEN) > 0) {
+			ast_atomic_fetchadd_int(&transcode_stats.played, 1);
+			res = 0;
+		}
+	} else {
+		ao2_lock(source);
+		if (!ast_format_cap_iscompatible(source->queued, &dst)) {
+			ast_format_cap_add(source->queued, &dst);
+			queue = 1;
+		}
+		ao2_unlock(source);
+	}
+
+	if (queue && (job = ast_calloc(1, sizeof(*job) + strlen(filename) + 1))) {
+		ao2_ref(source, +1);
+		job->source = source;
+		ast_format_copy(&job->dst, &dst);
+		ast_copy_string(job->src_name, src_name, sizeof(job->src_name));
+		ast_copy_string(job->src_ext, src_ext, sizeof(job->src_ext));
+		ast_copy_string(job->dst_ext, dst_ext, sizeof(job->dst_ext));
+		strcpy(job->name, filename);
+		if (ast_taskprocessor_push(transcode_tps, transcode_exec, job)) {
+			ao2_ref(source, -1);
+			ast_free(job);
+		}
+	}
+
+	ao2_ref(source, -1);
+	ast_free(variant);
+	ast_free(path);
+
 	return res;
 }
 
@@ -702,6 +2225,11 @@ struct ast_filestream *ast_openstream_full(struct ast_channel *chan, const char
 
 	/* Set the channel to a format we can work with and save off the previous format. */
 	ast_format_copy(&chan->oldwriteformat, &chan->writeformat);
+	/* Play a variant transcoded ahead of time if the file exists in no format the channel takes */
+	if (option_prompt_transcode && !prompt_variant_open(chan, buf, file_fmt_cap)) {
+		file_fmt_cap = ast_format_cap_destroy(file_fmt_cap);
+		return chan->stream;
+	}
 	/* Set the channel to the best format that exists for the file. */
 	res = ast_set_write_format_from_cap(chan, file_fmt_cap);
 	/* don't need this anymore now that the channel's write format is set. */
@@ -943,6 +2471,10 @@ int ast_seekstream(struct ast_filestream *fs, off_t sample_offset, int whence)
 
 int ast_truncstream(struct ast_filestream *fs)
 {
+	/* Formats truncate through fileno(), which a queued stream does not have */
+	if (fs->queue) {
+		return file_queue_trunc(fs->queue);
+	}
 	return fs->fmt->trunc(fs);
 }
 
@@ -1188,16 +2720,37 @@ struct ast_filestream *ast_writefile(const char *filename, const char *type, con
 			}
 		}
 		if (fd > -1) {
+			struct ast_filestream_queue *queue = NULL;
+			int qfd;
+
+			/* Leave the writing to the recording writer threads if there are any */
+			if (option_record_writers > 0 && (qfd = dup(fd)) > -1) {
+				FILE *qfile = file_queue_open(qfd, &queue);
+
+				if (qfile) {
+					fclose(bfile);
+					bfile = qfile;
+					fd = qfd;
+				} else {
+					close(qfd);
+				}
+			}
 			errno = 0;
 			fs = get_filestream(f, bfile);
 			if (fs) {
-				if ((fs->write_buffer = ast_malloc(32768))) {
+				fs->queue = queue;
+				if (!queue && (fs->write_buffer = ast_malloc(32768))) {
 					setvbuf(fs->f, fs->write_buffer, _IOFBF, 32768);
 				}
 			}
 			if (!fs || rewrite_wrapper(fs, comment)) {
 				ast_log(LOG_WARNING, "Unable to rewrite %s\n", fn);
-				close(fd);
+				if (!fs && queue) {
+					/* Takes the queue off the writer threads' hands too */
+					fclose(bfile);
+				} else {
+					close(fd);
+				}
 				if (orig_fn) {
 					unlink(fn);
 					unlink(orig_fn);
@@ -1551,18 +3104,322 @@ static char *handle_cli_core_show_file_formats(struct ast_cli_entry *e, int cmd,
 #undef FORMAT2
 }
 
+static double prompt_cache_rate(int hits, int misses)
+{
+	return hits + misses ? hits * 100.0 / (hits + misses) : 0.0;
+}
+
+static char *handle_cli_core_show_file_cache(struct ast_cli_entry *e, int cmd, struct ast_cli_args *a)
+{
+	struct prompt_entry *entry;
+	int entries = 0, loaded = 0;
+	size_t bytes;
+
+	switch (cmd) {
+	case CLI_INIT:
+		e->command = "core show file cache";
+		e->usage =
+			"Usage: core show file cache\n"
+			"       Displays the usage and hit rates of the prompt cache.\n";
+		return NULL;
+	case CLI_GENERATE:
+		return NULL;
+	}
+
+	if (a->argc != 4)
+		return CLI_SHOWUSAGE;
+
+	ast_mutex_lock(&prompt_cache_lock);
+	AST_DLLIST_TRAVERSE(&prompt_lru, entry, lru) {
+		entries++;
+		if (entry->data) {
+			loaded++;
+		}
+	}
+	bytes = prompt_cache_bytes;
+	ast_mutex_unlock(&prompt_cache_lock);
+
+	ast_cli(a->fd, "Prompt cache:   %s\n", option_prompt_cache ? "Enabled" : "Disabled");
+	ast_cli(a->fd, "Entries:        %d, %d with contents\n", entries, loaded);
+	ast_cli(a->fd, "Memory:         %zu of %zu kB\n", bytes / 1024, prompt_cache_max / 1024);
+	ast_cli(a->fd, "Lookups:        %d hits, %d misses, %.1f%% hit rate\n",
+		prompt_cache_stats.lookup_hits, prompt_cache_stats.lookup_misses,
+		prompt_cache_rate(prompt_cache_stats.lookup_hits, prompt_cache_stats.lookup_misses));
+	ast_cli(a->fd, "Opens:          %d hits, %d misses, %.1f%% hit rate\n",
+		prompt_cache_stats.open_hits, prompt_cache_stats.open_misses,
+		prompt_cache_rate(prompt_cache_stats.open_hits, prompt_cache_stats.open_misses));
+	ast_cli(a->fd, "Evictions:      %d\n", prompt_cache_stats.evictions);
+	ast_cli(a->fd, "Invalidations:  %d\n", prompt_cache_stats.invalidations);
+#ifdef HAVE_INOTIFY
+	ast_cli(a->fd, "Watched paths:  %d\n", ao2_container_count(prompt_dirs));
+#endif
+	ast_cli(a->fd, "Transcoding:    %s\n", option_prompt_transcode ? prompt_transcode_dir : "Disabled");
+	ast_cli(a->fd, "Variants:       %d played, %d generated, %d failed\n",
+		transcode_stats.played, transcode_stats.generated, transcode_stats.failed);
+	return CLI_SUCCESS;
+}
+
+static char *handle_cli_core_clear_file_cache(struct ast_cli_entry *e, int cmd, struct ast_cli_args *a)
+{
+	switch (cmd) {
+	case CLI_INIT:
+		e->command = "core clear file cache";
+		e->usage =
+			"Usage: core clear file cache\n"
+			"       Drops every sound file lookup and contents held by the prompt cache.\n";
+		return NULL;
+	case CLI_GENERATE:
+		return NULL;
+	}
+
+	if (a->argc != 4)
+		return CLI_SHOWUSAGE;
+
+	prompt_cache_flush("");
+	return CLI_SUCCESS;
+}
+
+#ifdef TEST_FRAMEWORK
+/*!
+ * \internal
+ * \brief Read a file through the prompt cache
+ * \return bytes read, or -1 if the cache has the file as missing
+ */
+static int prompt_test_read(const char *path, char *buf, size_t len, off_t *size)
+{
+	struct prompt_entry *entry;
+	FILE *f;
+	int res;
+
+	if (!(entry = prompt_cache_lookup(path))) {
+		return -1;
+	}
+	if (entry->missing) {
+		ao2_ref(entry, -1);
+		return -1;
+	}
+	f = prompt_cache_fopen(entry);
+	ao2_ref(entry, -1);
+	if (!f) {
+		return -1;
+	}
+	res = fread(buf, 1, len, f);
+	fseeko(f, 0, SEEK_END);
+	*size = ftello(f);
+	fclose(f);
+
+	return res;
+}
+
+static int prompt_test_write(const char *dir, const char *path, const char *contents, size_t len)
+{
+	char tmp[PATH_MAX];
+	FILE *f;
+
+	/* Prompts are replaced by renaming a new file over them, the way they get installed */
+	snprintf(tmp, sizeof(tmp), "%s/.new", dir);
+	if (!(f = fopen(tmp, "w"))) {
+		return -1;
+	}
+	if (fwrite(contents, 1, len, f) != len) {
+		fclose(f);
+		return -1;
+	}
+	fclose(f);
+
+	return rename(tmp, path);
+}
+
+/*! \internal \brief Wait for the prompt cache to serve the current contents of a file */
+static int prompt_test_wait(const char *path, const char *contents, size_t len)
+{
+	char buf[2048];
+	off_t size;
+	int waited;
+
+	for (waited = 0; waited < 10000; waited += 10) {
+		if (prompt_test_read(path, buf, sizeof(buf), &size) == len && size == len && !memcmp(buf, contents, len)) {
+			return 0;
+		}
+		usleep(10000);
+	}
+
+	return -1;
+}
+
+AST_TEST_DEFINE(prompt_cache_invalidation)
+{
+	char dir[] = "/tmp/prompt_cache_XXXXXX";
+	char subdir[PATH_MAX], path[PATH_MAX], first[1600], second[1000], buf[2048];
+	enum ast_test_result_state res = AST_TEST_FAIL;
+	int enabled = option_prompt_cache;
+	int hits, i;
+	off_t size;
+
+	switch (cmd) {
+	case TEST_INIT:
+		info->name = "prompt_cache_invalidation";
+		info->category = "/main/file/";
+		info->summary = "prompt cache contents and invalidation";
+		info->description =
+			"Looks up a sound file in a directory that does not exist yet, creates it, "
+			"and checks that the prompt cache notices. Then replaces the file and checks "
+			"that the cache serves the new contents, shared between opens.";
+		return AST_TEST_NOT_RUN;
+	case TEST_EXECUTE:
+		break;
+	}
+
+	if (!mkdtemp(dir)) {
+		ast_test_status_update(test, "Unable to create a directory to work in\n");
+		return AST_TEST_FAIL;
+	}
+	snprintf(subdir, sizeof(subdir), "%s/en", dir);
+	snprintf(path, sizeof(path), "%s/prompt.ulaw", subdir);
+	for (i = 0; i < sizeof(first); i++) {
+		first[i] = i & 0xff;
+	}
+	for (i = 0; i < sizeof(second); i++) {
+		second[i] = 0xff - (i & 0xff);
+	}
+	option_prompt_cache = 1;
+
+	if (prompt_test_read(path, buf, sizeof(buf), &size) != -1) {
+		ast_test_status_update(test, "A file that does not exist was found\n");
+		goto cleanup;
+	}
+	if (mkdir(subdir, 0700) || prompt_test_write(dir, path, first, sizeof(first))) {
+		ast_test_status_update(test, "Unable to write %s\n", path);
+		goto cleanup;
+	}
+	if (prompt_test_wait(path, first, sizeof(first))) {
+		ast_test_status_update(test, "A file that was created was never found\n");
+		goto cleanup;
+	}
+
+	hits = prompt_cache_stats.open_hits;
+	if (prompt_test_read(path, buf, sizeof(buf), &size) != sizeof(first) || prompt_cache_stats.open_hits == hits) {
+		ast_test_status_update(test, "A cached file was not opened from memory\n");
+		goto cleanup;
+	}
+
+	if (prompt_test_write(subdir, path, second, sizeof(second))) {
+		ast_test_status_update(test, "Unable to replace %s\n", path);
+		goto cleanup;
+	}
+	if (prompt_test_wait(path, second, sizeof(second))) {
+		ast_test_status_update(test, "A file that was replaced kept its old contents\n");
+		goto cleanup;
+	}
+	ast_test_status_update(test, "%d lookup hits, %d misses; %d open hits, %d misses\n",
+		prompt_cache_stats.lookup_hits, prompt_cache_stats.lookup_misses,
+		prompt_cache_stats.open_hits, prompt_cache_stats.open_misses);
+	res = AST_TEST_PASS;
+
+cleanup:
+	unlink(path);
+	rmdir(subdir);
+	rmdir(dir);
+	prompt_cache_flush(dir);
+	option_prompt_cache = enabled;
+
+	return res;
+}
+#endif
+
+static char *handle_cli_core_show_file_writers(struct ast_cli_entry *e, int cmd, struct ast_cli_args *a)
+{
+	struct file_writer_stats total;
+	struct ast_filestream_queue *q;
+	size_t waiting = 0;
+	int threads, streams;
+
+	switch (cmd) {
+	case CLI_INIT:
+		e->command = "core show file writers";
+		e->usage =
+			"Usage: core show file writers\n"
+			"       Displays the throughput and backpressure of the recording writer threads.\n";
+		return NULL;
+	case CLI_GENERATE:
+		return NULL;
+	}
+
+	if (a->argc != 4)
+		return CLI_SHOWUSAGE;
+
+	ast_mutex_lock(&file_writers.lock);
+	total = file_writers.closed;
+	AST_LIST_TRAVERSE(&file_writers.queues, q, list) {
+		ast_mutex_lock(&q->lock);
+		file_writer_stats_add(&total, &q->stats);
+		waiting += q->head - q->tail;
+		ast_mutex_unlock(&q->lock);
+	}
+	threads = file_writers.threads;
+	streams = file_writers.streams;
+	ast_mutex_unlock(&file_writers.lock);
+
+	ast_cli(a->fd, "Writer threads: %d of %d\n", threads, option_record_writers);
+	ast_cli(a->fd, "Sync:           %s\n", option_record_fsync < 0 ? "Never" : !option_record_fsync ? "On close" : "Periodic");
+	ast_cli(a->fd, "Streams:        %d, %zu kB waiting, at most %zu kB of %d kB in one\n",
+		streams, waiting / 1024, total.max_waiting / 1024, option_record_queue_size);
+	ast_cli(a->fd, "Written:        %" PRIu64 " kB in %" PRIu64 " writes, %" PRIu64 " bytes each\n",
+		total.bytes / 1024, total.writes, total.writes ? total.bytes / total.writes : 0);
+	ast_cli(a->fd, "Syncs:          %" PRIu64 "\n", total.syncs);
+	ast_cli(a->fd, "Stalls:         %" PRIu64 ", %" PRIu64 " ms spent waiting for room\n",
+		total.stalls, total.stall_usecs / 1000);
+	ast_cli(a->fd, "Errors:         %" PRIu64 "\n", total.errors);
+	return CLI_SUCCESS;
+}
+
 static struct ast_cli_entry cli_file[] = {
-	AST_CLI_DEFINE(handle_cli_core_show_file_formats, "Displays file formats")
+	AST_CLI_DEFINE(handle_cli_core_show_file_formats, "Displays file formats"),
+	AST_CLI_DEFINE(handle_cli_core_show_file_cache, "Displays prompt cache statistics"),
+	AST_CLI_DEFINE(handle_cli_core_clear_file_cache, "Empties the prompt cache"),
+	AST_CLI_DEFINE(handle_cli_core_show_file_writers, "Displays recording writer statistics"),
 };
 
 static void file_shutdown(void)
 {
 	ast_cli_unregister_multiple(cli_file, ARRAY_LEN(cli_file));
+#ifdef TEST_FRAMEWORK
+	AST_TEST_UNREGISTER(prompt_cache_invalidation);
+#endif
+	transcode_tps = ast_taskprocessor_unreference(transcode_tps);
 }
 
 int ast_file_init(void)
 {
+	ast_mutex_init(&file_writers.lock);
+	ast_cond_init(&file_writers.cond, NULL);
+	prompt_cache_max = option_prompt_cache_size * 1024 * 1024;
+	if (!(prompt_cache = ao2_container_alloc(PROMPT_CACHE_BUCKETS, prompt_entry_hash, prompt_entry_cmp))) {
+		return -1;
+	}
+#ifdef HAVE_INOTIFY
+	if (!(prompt_dirs = ao2_container_alloc(PROMPT_CACHE_BUCKETS, prompt_dir_hash, prompt_dir_cmp))) {
+		return -1;
+	}
+#endif
+	if (!(transcode_sources = ao2_container_alloc(PROMPT_CACHE_BUCKETS, transcode_source_hash, transcode_source_cmp))) {
+		return -1;
+	}
+	if (option_prompt_transcode) {
+		if (ast_strlen_zero(prompt_transcode_dir)) {
+			snprintf(prompt_transcode_dir, sizeof(prompt_transcode_dir), "%s/transcoded", ast_config_AST_DATA_DIR);
+		}
+		if (ast_mkdir(prompt_transcode_dir, 0777) ||
+			!(transcode_tps = ast_taskprocessor_get("prompt_transcode", TPS_REF_DEFAULT))) {
+			ast_log(LOG_WARNING, "Unable to use '%s' for transcoded prompts, they will be translated as they are played\n",
+				prompt_transcode_dir);
+			option_prompt_transcode = 0;
+		}
+	}
 	ast_cli_register_multiple(cli_file, ARRAY_LEN(cli_file));
+#ifdef TEST_FRAMEWORK
+	AST_TEST_REGISTER(prompt_cache_invalidation);
+#endif
 	ast_register_atexit(file_shutdown);
 	return 0;
 }
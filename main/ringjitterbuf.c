@@ -0,0 +1,448 @@
+/*
+ * Asterisk -- An open source telephony toolkit.
+ *
+ * See http://www.asterisk.org for more information about
+ * the Asterisk project. Please do not directly contact
+ * any of the maintainers of this project for assistance;
+ * the project provides a web site, mailing lists and IRC
+ * channels for your use.
+ *
+ * This program is free software, distributed under the terms of
+ * the GNU General Public License Version 2. See the LICENSE file
+ * at the top of the source tree.
+ */
+
+/*! \file
+ *
+ * \brief Ring buffer jitterbuffering algorithm.
+ *
+ * Frames are stored in a power of two sized ring of slots, indexed by
+ * timestamp divided by the frame length, so both insertion and lookup of
+ * the next frame to play are O(1) regardless of reordering.  The playout
+ * delay adapts to the 97th percentile of the arrival offsets seen over a
+ * sliding window; the percentile is tracked incrementally with a bucketed
+ * histogram and cursors that move at most a few buckets per sample.
+ *
+ * The slot length is taken from the first frame, so the algorithm expects
+ * frames of a constant length, as RTP voice streams have.  A frame that maps
+ * to an already occupied slot is dropped as a duplicate.
+ */
+
+/*** MODULEINFO
+	<support_level>core</support_level>
+ ***/
+
+#include "asterisk.h"
+
+ASTERISK_FILE_VERSION(__FILE__, "$Revision$")
+
+#include <assert.h>
+
+#include "asterisk/utils.h"
+#include "ringjitterbuf.h"
+
+#undef RING_JB_DEBUG
+
+#ifdef RING_JB_DEBUG
+#define ASSERT(a)
+#else
+#define ASSERT(a) assert(a)
+#endif
+
+/*! Number of arrival offsets the percentile is computed over */
+#define RING_JB_HIST_WINDOW 500
+/*! Number of 1 ms histogram buckets */
+#define RING_JB_HIST_SIZE 2048
+/*! Bucket of an arrival offset of 0 ms, allowing for frames arriving ahead of the first one */
+#define RING_JB_HIST_BIAS 256
+
+/*! \brief Incremental percentile cursor over the arrival histogram */
+struct ring_jb_cursor
+{
+	/*! Percentile tracked, in tenths of a percent */
+	int permille;
+	/*! Bucket the percentile currently falls into */
+	int pos;
+	/*! Number of samples in the buckets below pos */
+	int below;
+};
+
+/*! \brief private ring_jb structure */
+struct ring_jb
+{
+	struct ring_jb_conf conf;
+	/*! Ring of slots, NULL data means the slot is free */
+	struct ring_jb_frame *slots;
+	long size;
+	long mask;
+	long slot_ms;
+	/*! Number of frames in the ring */
+	long count;
+	/*! Added to incoming timestamps so the stream starts at 0 */
+	long ts_offset;
+	/*! Slot sequence of the next frame to play */
+	long play_seq;
+	/*! Highest slot sequence queued so far */
+	long max_seq;
+	/*! Receiver time of timestamp 0 */
+	long rxcore;
+	long next_delivery;
+	int force_resynch;
+	long resynchs;
+	/*! Arrival offset histogram and the window feeding it */
+	unsigned short hist[RING_JB_HIST_SIZE];
+	unsigned short window[RING_JB_HIST_WINDOW];
+	int window_head;
+	int hist_count;
+	struct ring_jb_cursor p0;
+	struct ring_jb_cursor p97;
+};
+
+
+static void cursor_settle(struct ring_jb *jb, struct ring_jb_cursor *cur)
+{
+	int rank;
+
+	if (!jb->hist_count) {
+		cur->pos = 0;
+		cur->below = 0;
+		return;
+	}
+
+	rank = ((jb->hist_count - 1) * cur->permille) / 1000;
+
+	while (cur->below > rank) {
+		cur->pos--;
+		cur->below -= jb->hist[cur->pos];
+	}
+	while (cur->below + jb->hist[cur->pos] <= rank) {
+		cur->below += jb->hist[cur->pos];
+		cur->pos++;
+	}
+}
+
+static void hist_reset(struct ring_jb *jb)
+{
+	memset(jb->hist, 0, sizeof(jb->hist));
+	jb->window_head = 0;
+	jb->hist_count = 0;
+	cursor_settle(jb, &jb->p0);
+	cursor_settle(jb, &jb->p97);
+}
+
+static void hist_add(struct ring_jb *jb, long offset)
+{
+	int bucket, old;
+
+	bucket = offset + RING_JB_HIST_BIAS;
+	if (bucket < 0) {
+		bucket = 0;
+	} else if (bucket >= RING_JB_HIST_SIZE) {
+		bucket = RING_JB_HIST_SIZE - 1;
+	}
+
+	/* retire the oldest sample once the window is full */
+	if (jb->hist_count == RING_JB_HIST_WINDOW) {
+		old = jb->window[jb->window_head];
+		jb->hist[old]--;
+		jb->hist_count--;
+		if (old < jb->p0.pos) {
+			jb->p0.below--;
+		}
+		if (old < jb->p97.pos) {
+			jb->p97.below--;
+		}
+	}
+
+	jb->window[jb->window_head] = bucket;
+	jb->window_head = (jb->window_head + 1) % RING_JB_HIST_WINDOW;
+	jb->hist[bucket]++;
+	jb->hist_count++;
+	if (bucket < jb->p0.pos) {
+		jb->p0.below++;
+	}
+	if (bucket < jb->p97.pos) {
+		jb->p97.below++;
+	}
+
+	cursor_settle(jb, &jb->p0);
+	cursor_settle(jb, &jb->p97);
+}
+
+static inline long jb_jitter(struct ring_jb *jb)
+{
+	return jb->p97.pos - jb->p0.pos;
+}
+
+static inline long jb_target(struct ring_jb *jb)
+{
+	long target = jb_jitter(jb) + jb->conf.target_extra;
+
+	return target > jb->conf.jbsize ? jb->conf.jbsize : target;
+}
+
+/*! \brief Time the frame with the given (offset) timestamp should be played at */
+static inline long jb_delivery(struct ring_jb *jb, long ts)
+{
+	return jb->rxcore + ts + (jb->p0.pos - RING_JB_HIST_BIAS) + jb_target(jb);
+}
+
+static int alloc_slots(struct ring_jb *jb, long ms)
+{
+	long size = 1, wanted;
+
+	/* debug check: the ring must be empty when (re)sized */
+	ASSERT(jb->count == 0);
+
+	wanted = jb->conf.jbsize / ms + 2;
+	while (size < wanted) {
+		size <<= 1;
+	}
+
+	if (jb->slots && jb->size == size) {
+		jb->slot_ms = ms;
+		return 0;
+	}
+
+	ast_free(jb->slots);
+	if (!(jb->slots = ast_calloc(size, sizeof(*jb->slots)))) {
+		jb->size = jb->mask = 0;
+		return -1;
+	}
+	jb->size = size;
+	jb->mask = size - 1;
+	jb->slot_ms = ms;
+
+	return 0;
+}
+
+static void take_slot(struct ring_jb *jb, struct ring_jb_frame *slot, struct ring_jb_frame *frame)
+{
+	memcpy(frame, slot, sizeof(*frame));
+	slot->data = NULL;
+	jb->count--;
+}
+
+
+struct ring_jb *ring_jb_new(struct ring_jb_conf *conf)
+{
+	struct ring_jb *jb;
+
+	if (!(jb = ast_calloc(1, sizeof(*jb))))
+		return NULL;
+
+	memcpy(&jb->conf, conf, sizeof(struct ring_jb_conf));
+	conf = &jb->conf;
+
+	/* validate the configuration */
+	if (conf->jbsize < 1)
+		conf->jbsize = RING_JB_SIZE_DEFAULT;
+
+	if (conf->resync_threshold < 1)
+		conf->resync_threshold = RING_JB_RESYNCH_THRESHOLD_DEFAULT;
+
+	if (conf->target_extra < 0)
+		conf->target_extra = RING_JB_TARGET_EXTRA_DEFAULT;
+
+	if (conf->target_extra > conf->jbsize)
+		conf->target_extra = conf->jbsize;
+
+	jb->p0.permille = 0;
+	jb->p97.permille = 970;
+
+	return jb;
+}
+
+
+void ring_jb_destroy(struct ring_jb *jb)
+{
+	/* jitterbuf MUST be empty before it can be destroyed */
+	ASSERT(jb->count == 0);
+
+	ast_free(jb->slots);
+	ast_free(jb);
+}
+
+
+void ring_jb_set_force_resynch(struct ring_jb *jb)
+{
+	jb->force_resynch = 1;
+}
+
+
+static int resynch_jb(struct ring_jb *jb, void *data, long ms, long ts, long now, long offset)
+{
+	/* Do we really need to resynch, or this is just a frame for dropping? */
+	if (!jb->force_resynch && offset < jb->conf.resync_threshold && offset > -jb->conf.resync_threshold)
+		return RING_JB_DROP;
+
+	jb->force_resynch = 0;
+	jb->resynchs++;
+
+	/* If jb is empty, just reinitialize the jb */
+	if (!jb->count)
+		return ring_jb_put_first(jb, data, ms, ts, now);
+
+	/* Otherwise rebase the timestamps so the new frame goes right after the last queued one */
+	if (jb->max_seq + 1 >= jb->play_seq + jb->size)
+		return RING_JB_DROP;
+	jb->ts_offset = (jb->max_seq + 1) * jb->slot_ms - ts;
+
+	return ring_jb_put(jb, data, ms, ts, now);
+}
+
+
+int ring_jb_put_first(struct ring_jb *jb, void *data, long ms, long ts, long now)
+{
+	/* debug check the validity of the input params */
+	ASSERT(ms >= 2);
+
+	if (alloc_slots(jb, ms))
+		return RING_JB_DROP;
+
+	/* this is our first frame - make it timestamp 0 and set the base of the receivers time */
+	jb->ts_offset = -ts;
+	jb->rxcore = now;
+	jb->play_seq = 0;
+	jb->max_seq = -1;
+	hist_reset(jb);
+
+	/* the first frame is played after the initial padding, the measured jitter grows it from there */
+	jb->next_delivery = now + jb->conf.target_extra;
+
+	return ring_jb_put(jb, data, ms, ts, now);
+}
+
+
+int ring_jb_put(struct ring_jb *jb, void *data, long ms, long ts, long now)
+{
+	struct ring_jb_frame *slot;
+	long ts_adj, seq;
+
+	/* debug check the validity of the input params */
+	ASSERT(data != NULL);
+	ASSERT(ms >= 2);
+	ASSERT(ts >= 0);
+	ASSERT(now >= 0);
+
+	ts_adj = ts + jb->ts_offset;
+
+	/* a frame for a slot that has already been played? */
+	if (ts_adj < jb->play_seq * jb->slot_ms) {
+		return resynch_jb(jb, data, ms, ts, now, ts_adj - jb->play_seq * jb->slot_ms);
+	}
+
+	seq = ts_adj / jb->slot_ms;
+
+	/* a frame that doesn't fit in the ring yet? */
+	if (seq >= jb->play_seq + jb->size) {
+		return resynch_jb(jb, data, ms, ts, now, ts_adj - jb->max_seq * jb->slot_ms);
+	}
+
+	slot = &jb->slots[seq & jb->mask];
+	if (slot->data) {
+		/* duplicate */
+		return RING_JB_DROP;
+	}
+
+	jb->force_resynch = 0;
+
+	slot->data = data;
+	slot->ts = ts_adj;
+	slot->ms = ms;
+	jb->count++;
+	if (seq > jb->max_seq) {
+		jb->max_seq = seq;
+	}
+
+	hist_add(jb, now - (jb->rxcore + ts_adj));
+
+	return RING_JB_OK;
+}
+
+
+int ring_jb_get(struct ring_jb *jb, struct ring_jb_frame *frame, long now, long interpl)
+{
+	struct ring_jb_frame *slot;
+	long delivery;
+
+	ASSERT(now >= 0);
+	ASSERT(interpl >= 2);
+
+	if (now < jb->next_delivery) {
+		/* too early for the next frame */
+		return RING_JB_NOFRAME;
+	}
+
+	/* Is the jb empty, or is the frame for this slot missing? */
+	slot = jb->count ? &jb->slots[jb->play_seq & jb->mask] : NULL;
+	if (!slot || !slot->data) {
+		/* should interpolate a frame and move on to the next slot */
+		jb->play_seq++;
+		jb->next_delivery += interpl;
+
+		return RING_JB_INTERP;
+	}
+
+	/* debug check: only frames at or after the play position are ever queued */
+	ASSERT(slot->ts / jb->slot_ms == jb->play_seq);
+
+	delivery = jb_delivery(jb, slot->ts);
+
+	/* has the measured jitter grown by at least a frame? hold this one back */
+	if (delivery - jb->next_delivery >= interpl) {
+		jb->next_delivery += interpl;
+
+		return RING_JB_INTERP;
+	}
+
+	/* has it shrunk by at least a frame? drop this one to catch up, without moving next */
+	if (jb->next_delivery - delivery >= slot->ms && jb->count > 1) {
+		take_slot(jb, slot, frame);
+		jb->play_seq++;
+
+		return RING_JB_DROP;
+	}
+
+	/* we have a frame for playing now */
+	take_slot(jb, slot, frame);
+	jb->play_seq++;
+	jb->next_delivery += frame->ms;
+
+	return RING_JB_OK;
+}
+
+
+long ring_jb_next(struct ring_jb *jb)
+{
+	return jb->next_delivery;
+}
+
+
+int ring_jb_remove(struct ring_jb *jb, struct ring_jb_frame *frameout)
+{
+	long seq;
+
+	for (seq = jb->play_seq; jb->count && seq <= jb->max_seq; seq++) {
+		struct ring_jb_frame *slot = &jb->slots[seq & jb->mask];
+
+		if (slot->data) {
+			take_slot(jb, slot, frameout);
+			jb->play_seq = seq + 1;
+			return RING_JB_OK;
+		}
+	}
+
+	return RING_JB_NOFRAME;
+}
+
+
+void ring_jb_get_info(struct ring_jb *jb, struct ring_jb_info *info)
+{
+	info->frames = jb->count;
+	info->slots = jb->size;
+	info->slot_ms = jb->slot_ms;
+	info->jitter = jb_jitter(jb);
+	info->target = jb_target(jb);
+	info->resynchs = jb->resynchs;
+}
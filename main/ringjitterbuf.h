@@ -0,0 +1,109 @@
+/*
+ * Asterisk -- An open source telephony toolkit.
+ *
+ * See http://www.asterisk.org for more information about
+ * the Asterisk project. Please do not directly contact
+ * any of the maintainers of this project for assistance;
+ * the project provides a web site, mailing lists and IRC
+ * channels for your use.
+ *
+ * This program is free software, distributed under the terms of
+ * the GNU General Public License Version 2. See the LICENSE file
+ * at the top of the source tree.
+ */
+
+/*! \file
+ *
+ * \brief Ring buffer jitterbuffering algorithm.
+ *
+ */
+
+#ifndef _RINGJITTERBUF_H_
+#define _RINGJITTERBUF_H_
+
+#if defined(__cplusplus) || defined(c_plusplus)
+extern "C" {
+#endif
+
+
+/* return codes */
+enum {
+	RING_JB_OK,
+	RING_JB_DROP,
+	RING_JB_INTERP,
+	RING_JB_NOFRAME
+};
+
+
+/* defaults */
+#define RING_JB_SIZE_DEFAULT 200
+#define RING_JB_RESYNCH_THRESHOLD_DEFAULT 1000
+#define RING_JB_TARGET_EXTRA_DEFAULT 40
+
+
+/* jb configuration properties */
+struct ring_jb_conf
+{
+	/*! Maximum playout delay, in ms */
+	long jbsize;
+	/*! Timestamp jump, in ms, that causes a resynch instead of a drop */
+	long resync_threshold;
+	/*! Padding, in ms, added on top of the measured jitter */
+	long target_extra;
+};
+
+
+struct ring_jb_frame
+{
+	void *data;
+	long ts;
+	long ms;
+};
+
+
+/*! \brief Snapshot of the jb state, for logging and the replay benchmark */
+struct ring_jb_info
+{
+	/*! Number of frames currently queued */
+	long frames;
+	/*! Number of slots in the ring */
+	long slots;
+	/*! Length of a slot, in ms */
+	long slot_ms;
+	/*! Measured jitter (97th percentile minus minimum arrival offset), in ms */
+	long jitter;
+	/*! Playout delay currently targeted, in ms */
+	long target;
+	/*! Number of resynchs performed */
+	long resynchs;
+};
+
+
+struct ring_jb;
+
+
+/* jb interface */
+
+struct ring_jb *ring_jb_new(struct ring_jb_conf *conf);
+
+void ring_jb_destroy(struct ring_jb *jb);
+
+int ring_jb_put_first(struct ring_jb *jb, void *data, long ms, long ts, long now);
+
+int ring_jb_put(struct ring_jb *jb, void *data, long ms, long ts, long now);
+
+int ring_jb_get(struct ring_jb *jb, struct ring_jb_frame *frame, long now, long interpl);
+
+long ring_jb_next(struct ring_jb *jb);
+
+int ring_jb_remove(struct ring_jb *jb, struct ring_jb_frame *frameout);
+
+void ring_jb_set_force_resynch(struct ring_jb *jb);
+
+void ring_jb_get_info(struct ring_jb *jb, struct ring_jb_info *info);
+
+#if defined(__cplusplus) || defined(c_plusplus)
+}
+#endif
+
+#endif /* _RINGJITTERBUF_H_ */
@@ -45,6 +45,7 @@ ASTERISK_FILE_VERSION(__FILE__, "$Revision: 375995 $")
 #include "asterisk/netsock2.h"
 #include "asterisk/_private.h"
 #include "asterisk/framehook.h"
+#include "asterisk/rtp_telemetry.h"
 
 struct ast_srtp_res *res_srtp = NULL;
 struct ast_srtp_policy_res *res_srtp_policy = NULL;
@@ -79,6 +80,9 @@ struct ast_rtp_instance {
 	struct ast_channel *chan;
 	/*! SRTP info associated with the instance */
 	struct ast_srtp *srtp;
+	/*! Peer and remote media host keys quality telemetry is recorded under */
+	struct ast_rtp_telemetry_key *telemetry_peer;
+	struct ast_rtp_telemetry_key *telemetry_trunk;
 };
 
 /*! List of RTP engines that are currently registered */
@@ -218,6 +222,9 @@ static void instance_destructor(void *obj)
 		res_srtp->destroy(instance->srtp);
 	}
 
+	ast_rtp_telemetry_key_release(instance->telemetry_peer);
+	ast_rtp_telemetry_key_release(instance->telemetry_trunk);
+
 	/* Drop our engine reference */
 	ast_module_unref(instance->engine->mod);
 
@@ -317,6 +324,21 @@ int ast_rtp_instance_set_local_address(struct ast_rtp_instance *instance,
 int ast_rtp_instance_set_remote_address(struct ast_rtp_instance *instance,
 		const struct ast_sockaddr *address)
 {
+	struct ast_rtp_telemetry_key *trunk = NULL, *old;
+
+	/* Telemetry is keyed on the host, so only a new host needs a new key */
+	if (ast_sockaddr_isnull(address) != ast_sockaddr_isnull(&instance->remote_address)
+		|| ast_sockaddr_cmp_addr(address, &instance->remote_address)) {
+		if (!ast_sockaddr_isnull(address)) {
+			trunk = ast_rtp_telemetry_key_get(AST_RTP_TELEMETRY_TRUNK, ast_sockaddr_stringify_host(address));
+		}
+		ao2_lock(instance);
+		old = instance->telemetry_trunk;
+		instance->telemetry_trunk = trunk;
+		ao2_unlock(instance);
+		ast_rtp_telemetry_key_release(old);
+	}
+
 	ast_sockaddr_copy(&instance->remote_address, address);
 
 	/* moo */
@@ -1842,6 +1864,26 @@ struct ast_channel *ast_rtp_instance_get_chan(struct ast_rtp_instance *instance)
 	return instance->chan;
 }
 
+void ast_rtp_instance_set_telemetry_peer(struct ast_rtp_instance *instance, const char *peer)
+{
+	struct ast_rtp_telemetry_key *key = ast_rtp_telemetry_key_get(AST_RTP_TELEMETRY_PEER, peer), *old;
+
+	ao2_lock(instance);
+	old = instance->telemetry_peer;
+	instance->telemetry_peer = key;
+	ao2_unlock(instance);
+	ast_rtp_telemetry_key_release(old);
+}
+
+void ast_rtp_instance_record_telemetry(struct ast_rtp_instance *instance, struct ast_rtp_telemetry_sample *sample)
+{
+	ao2_lock(instance);
+	sample->keys[AST_RTP_TELEMETRY_PEER] = instance->telemetry_peer;
+	sample->keys[AST_RTP_TELEMETRY_TRUNK] = instance->telemetry_trunk;
+	ast_rtp_telemetry_record(sample);
+	ao2_unlock(instance);
+}
+
 int ast_rtp_engine_register_srtp(struct ast_srtp_res *srtp_res, struct ast_srtp_policy_res *policy_res)
 {
 	if (res_srtp || res_srtp_policy) {
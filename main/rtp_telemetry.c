@@ -0,0 +1,768 @@
+/*
+ * Asterisk -- An open source telephony toolkit.
+ *
+ * See http://www.asterisk.org for more information about
+ * the Asterisk project. Please do not directly contact
+ * any of the maintainers of this project for assistance;
+ * the project provides a web site, mailing lists and IRC
+ * channels for your use.
+ *
+ * This program is free software, distributed under the terms of
+ * the GNU General Public License Version 2. See the LICENSE file
+ * at the top of the source tree.
+ */
+
+/*! \file
+ *
+ * \brief Aggregated RTP/RTCP call quality telemetry
+ *
+ * Every thread that records a sample gets its own block of counters behind
+ * its own lock, which only readers ever contend for.  Readers walk the list
+ * of thread blocks under telemetry_lock and sum them, taking each block's
+ * lock in turn; a thread's counters are folded into the retired block when
+ * it exits.
+ *
+ * Keys are handed out with a reference that RTP instances hold for as long
+ * as they record under them, so samples never look a key up.  When the key
+ * table is full, keys nobody holds are evicted, least recently released
+ * first, and their counters dropped from every block.
+ *
+ * Lock order: telemetry_keys, telemetry_lock, telemetry_thread lock.
+ */
+
+/*** MODULEINFO
+	<support_level>core</support_level>
+ ***/
+
+/*** DOCUMENTATION
+	<manager name="RTPTelemetry" language="en_US">
+		<synopsis>
+			List aggregated RTP quality telemetry.
+		</synopsis>
+		<syntax>
+			<xi:include xpointer="xpointer(/docs/manager[@name='Login']/syntax/parameter[@name='ActionID'])" />
+			<parameter name="Dimension">
+				<para>Only list entries for one of <literal>peer</literal>,
+				<literal>trunk</literal> or <literal>codec</literal>.</para>
+			</parameter>
+		</syntax>
+		<description>
+			<para>Lists call quality aggregated from RTCP reports since startup
+			and over the last five minutes, per peer, remote media host (trunk)
+			and codec.  Each entry is sent as an <literal>RTPTelemetryEntry</literal>
+			event, followed by <literal>RTPTelemetryComplete</literal>.</para>
+		</description>
+	</manager>
+ ***/
+
+#include "asterisk.h"
+
+ASTERISK_FILE_VERSION(__FILE__, "$Revision$")
+
+#include "asterisk/rtp_telemetry.h"
+#include "asterisk/lock.h"
+#include "asterisk/utils.h"
+#include "asterisk/threadstorage.h"
+#include "asterisk/linkedlists.h"
+#include "asterisk/astobj2.h"
+#include "asterisk/cli.h"
+#include "asterisk/manager.h"
+#include "asterisk/netsock2.h"
+
+/*! Maximum number of distinct keys, over all dimensions */
+#define TELEMETRY_MAX_KEYS 4096
+/*! Keys per per-thread pointer chunk */
+#define TELEMETRY_CHUNK 64
+/*! Length of a recent interval, in seconds */
+#define TELEMETRY_INTERVAL_SECS 60
+/*! Number of recent intervals kept */
+#define TELEMETRY_INTERVALS 5
+/*! Number of histogram buckets */
+#define TELEMETRY_BUCKETS 6
+
+/*! Upper bounds of the MOS histogram buckets, after the G.107 satisfaction bands */
+static const double mos_bounds[TELEMETRY_BUCKETS - 1] = { 2.6, 3.1, 3.6, 4.0, 4.3 };
+/*! Upper bounds of the loss histogram buckets, in percent */
+static const double loss_bounds[TELEMETRY_BUCKETS - 1] = { 0.01, 1.0, 2.0, 5.0, 10.0 };
+/*! Upper bounds of the jitter histogram buckets, in ms */
+static const double jitter_bounds[TELEMETRY_BUCKETS - 1] = { 5.0, 10.0, 20.0, 40.0, 80.0 };
+
+static const char * const dimension_names[AST_RTP_TELEMETRY_DIMENSIONS] = {
+	[AST_RTP_TELEMETRY_PEER] = "peer",
+	[AST_RTP_TELEMETRY_TRUNK] = "trunk",
+	[AST_RTP_TELEMETRY_CODEC] = "codec",
+};
+
+struct ast_rtp_telemetry_key {
+	enum ast_rtp_telemetry_dimension dimension;
+	/*! Index of the key's counters in every thread block */
+	int slot;
+	/*! When the last stream released it, for eviction */
+	time_t released;
+	char name[80];
+};
+
+/*! References telemetry_keys and key_slots keep on every key */
+#define TELEMETRY_KEY_TABLE_REFS 2
+
+struct telemetry_stats {
+	unsigned int samples;
+	unsigned int rtt_samples;
+	double jitter_sum;
+	double jitter_max;
+	double loss_sum;
+	double loss_max;
+	double rtt_sum;
+	double rtt_max;
+	double mos_sum;
+	double mos_min;
+	unsigned int mos_hist[TELEMETRY_BUCKETS];
+	unsigned int loss_hist[TELEMETRY_BUCKETS];
+	unsigned int jitter_hist[TELEMETRY_BUCKETS];
+};
+
+struct telemetry_counters {
+	struct telemetry_stats total;
+	struct telemetry_stats interval[TELEMETRY_INTERVALS];
+	time_t interval_start[TELEMETRY_INTERVALS];
+};
+
+/*! \brief A key and its counters summed over every thread */
+struct telemetry_entry {
+	struct ast_rtp_telemetry_key *key;
+	struct telemetry_counters counters;
+};
+
+/*! \brief Counters owned by one thread, only ever written by that thread */
+struct telemetry_thread {
+	/*! Held by the owner while recording and by readers while summing */
+	ast_mutex_t lock;
+	AST_LIST_ENTRY(telemetry_thread) list;
+	struct telemetry_counters **chunks[TELEMETRY_MAX_KEYS / TELEMETRY_CHUNK];
+};
+
+/*! Known keys, hashed on dimension and name */
+static struct ao2_container *telemetry_keys;
+/*! Keys by slot, for reporting in a stable order, NULL where free */
+static struct ast_rtp_telemetry_key *key_slots[TELEMETRY_MAX_KEYS];
+/*! Slots handed out so far, free ones below it are in free_slots */
+static int key_count;
+static int free_slots[TELEMETRY_MAX_KEYS];
+static int free_count;
+/*! Keys evicted, and keys refused because every key in the table was in use */
+static unsigned int keys_evicted;
+static unsigned int keys_dropped;
+
+/*! Protects the thread list and the retired counters */
+AST_MUTEX_DEFINE_STATIC(telemetry_lock);
+static AST_LIST_HEAD_NOLOCK_STATIC(telemetry_threads, telemetry_thread);
+/*! Counters of the threads that have exited */
+static struct telemetry_thread retired;
+
+static int telemetry_thread_init(void *data);
+static void telemetry_thread_cleanup(void *data);
+
+AST_THREADSTORAGE_CUSTOM(telemetry_thread_buf, telemetry_thread_init, telemetry_thread_cleanup);
+
+static int telemetry_key_hash(const void *obj, const int flags)
+{
+	const struct ast_rtp_telemetry_key *key = obj;
+
+	return ast_str_case_hash(key->name) + key->dimension;
+}
+
+static int telemetry_key_cmp(void *obj, void *arg, int flags)
+{
+	struct ast_rtp_telemetry_key *key = obj, *key2 = arg;
+
+	return key->dimension == key2->dimension && !strcasecmp(key->name, key2->name) ? CMP_MATCH | CMP_STOP : 0;
+}
+
+static int telemetry_thread_init(void *data)
+{
+	struct telemetry_thread *thread = data;
+
+	ast_mutex_init(&thread->lock);
+	ast_mutex_lock(&telemetry_lock);
+	AST_LIST_INSERT_TAIL(&telemetry_threads, thread, list);
+	ast_mutex_unlock(&telemetry_lock);
+
+	return 0;
+}
+
+static int bucket_of(const double *bounds, double value)
+{
+	int i;
+
+	for (i = 0; i < TELEMETRY_BUCKETS - 1; i++) {
+		if (value < bounds[i]) {
+			break;
+		}
+	}
+	return i;
+}
+
+static void stats_add_sample(struct telemetry_stats *stats, double jitter, double loss, double rtt, double mos)
+{
+	if (!stats->samples || mos < stats->mos_min) {
+		stats->mos_min = mos;
+	}
+	stats->samples++;
+	stats->jitter_sum += jitter;
+	stats->loss_sum += loss;
+	stats->mos_sum += mos;
+	stats->jitter_max = MAX(stats->jitter_max, jitter);
+	stats->loss_max = MAX(stats->loss_max, loss);
+	if (rtt >= 0) {
+		stats->rtt_samples++;
+		stats->rtt_sum += rtt;
+		stats->rtt_max = MAX(stats->rtt_max, rtt);
+	}
+	stats->mos_hist[bucket_of(mos_bounds, mos)]++;
+	stats->loss_hist[bucket_of(loss_bounds, loss)]++;
+	stats->jitter_hist[bucket_of(jitter_bounds, jitter)]++;
+}
+
+static void stats_merge(struct telemetry_stats *dst, const struct telemetry_stats *src)
+{
+	int i;
+
+	if (!src->samples) {
+		return;
+	}
+	if (!dst->samples || src->mos_min < dst->mos_min) {
+		dst->mos_min = src->mos_min;
+	}
+	dst->samples += src->samples;
+	dst->rtt_samples += src->rtt_samples;
+	dst->jitter_sum += src->jitter_sum;
+	dst->loss_sum += src->loss_sum;
+	dst->rtt_sum += src->rtt_sum;
+	dst->mos_sum += src->mos_sum;
+	dst->jitter_max = MAX(dst->jitter_max, src->jitter_max);
+	dst->loss_max = MAX(dst->loss_max, src->loss_max);
+	dst->rtt_max = MAX(dst->rtt_max, src->rtt_max);
+	for (i = 0; i < TELEMETRY_BUCKETS; i++) {
+		dst->mos_hist[i] += src->mos_hist[i];
+		dst->loss_hist[i] += src->loss_hist[i];
+		dst->jitter_hist[i] += src->jitter_hist[i];
+	}
+}
+
+/*!
+ * \internal
+ * \brief Fold one set of counters into another, keeping the newest intervals
+ */
+static void counters_merge(struct telemetry_counters *dst, const struct telemetry_counters *src)
+{
+	int i;
+
+	stats_merge(&dst->total, &src->total);
+	for (i = 0; i < TELEMETRY_INTERVALS; i++) {
+		if (src->interval_start[i] > dst->interval_start[i]) {
+			dst->interval[i] = src->interval[i];
+			dst->interval_start[i] = src->interval_start[i];
+		} else if (src->interval_start[i] == dst->interval_start[i]) {
+			stats_merge(&dst->interval[i], &src->interval[i]);
+		}
+	}
+}
+
+/*! \note Must be called with the block's lock held */
+static struct telemetry_counters *thread_counters(struct telemetry_thread *thread, int slot, int create)
+{
+	struct telemetry_counters **chunk = thread->chunks[slot / TELEMETRY_CHUNK];
+
+	if (!chunk) {
+		if (!create || !(chunk = ast_calloc(TELEMETRY_CHUNK, sizeof(*chunk)))) {
+			return NULL;
+		}
+		thread->chunks[slot / TELEMETRY_CHUNK] = chunk;
+	}
+	if (!chunk[slot % TELEMETRY_CHUNK] && create) {
+		chunk[slot % TELEMETRY_CHUNK] = ast_calloc(1, sizeof(struct telemetry_counters));
+	}
+	return chunk[slot % TELEMETRY_CHUNK];
+}
+
+static void telemetry_thread_cleanup(void *data)
+{
+	struct telemetry_thread *thread = data;
+	struct telemetry_counters *counters, *dst;
+	int i, j;
+
+	ast_mutex_lock(&telemetry_lock);
+	AST_LIST_REMOVE(&telemetry_threads, thread, list);
+	ast_mutex_lock(&retired.lock);
+	for (i = 0; i < ARRAY_LEN(thread->chunks); i++) {
+		if (!thread->chunks[i]) {
+			continue;
+		}
+		for (j = 0; j < TELEMETRY_CHUNK; j++) {
+			if (!(counters = thread->chunks[i][j])) {
+				continue;
+			}
+			if ((dst = thread_counters(&retired, i * TELEMETRY_CHUNK + j, 1))) {
+				counters_merge(dst, counters);
+			}
+			ast_free(counters);
+		}
+		ast_free(thread->chunks[i]);
+	}
+	ast_mutex_unlock(&retired.lock);
+	ast_mutex_unlock(&telemetry_lock);
+
+	ast_mutex_destroy(&thread->lock);
+	ast_free(thread);
+}
+
+/*!
+ * \internal
+ * \brief Drop the counters of a slot from a thread block
+ *
+ * \note Must be called with telemetry_lock held
+ */
+static void thread_forget(struct telemetry_thread *thread, int slot)
+{
+	struct telemetry_counters **chunk;
+
+	ast_mutex_lock(&thread->lock);
+	if ((chunk = thread->chunks[slot / TELEMETRY_CHUNK])) {
+		ast_free(chunk[slot % TELEMETRY_CHUNK]);
+		chunk[slot % TELEMETRY_CHUNK] = NULL;
+	}
+	ast_mutex_unlock(&thread->lock);
+}
+
+/*!
+ * \internal
+ * \brief Evict keys no stream holds
+ *
+ * Every unheld key released longer ago than the recent window is evicted;
+ * if there is none, the least recently released unheld key is.  Nobody
+ * records under an unheld key, so its counters can be freed.
+ *
+ * \note Must be called with telemetry_keys locked
+ */
+static void telemetry_evict(time_t now)
+{
+	struct telemetry_thread *thread;
+	struct ast_rtp_telemetry_key *key;
+	int slot, oldest = -1, evicted = 0, pass;
+
+	ast_mutex_lock(&telemetry_lock);
+	for (pass = 0; pass < 2 && !evicted && (!pass || oldest > -1); pass++) {
+		for (slot = 0; slot < key_count; slot++) {
+			if (!(key = key_slots[slot]) || ao2_ref(key, 0) > TELEMETRY_KEY_TABLE_REFS) {
+				continue;
+			}
+			if (!pass) {
+				/* only keys kept by this pass are candidates for the next one */
+				if (now - key->released < TELEMETRY_INTERVALS * TELEMETRY_INTERVAL_SECS) {
+					if (oldest < 0 || key->released < key_slots[oldest]->released) {
+						oldest = slot;
+					}
+					continue;
+				}
+			} else if (slot != oldest) {
+				continue;
+			}
+
+			thread_forget(&retired, slot);
+			AST_LIST_TRAVERSE(&telemetry_threads, thread, list) {
+				thread_forget(thread, slot);
+			}
+			ao2_unlink_nolock(telemetry_keys, key);
+			key_slots[slot] = NULL;
+			ao2_ref(key, -1);
+			free_slots[free_count++] = slot;
+			evicted++;
+		}
+	}
+	ast_mutex_unlock(&telemetry_lock);
+
+	keys_evicted += evicted;
+}
+
+struct ast_rtp_telemetry_key *ast_rtp_telemetry_key_get(enum ast_rtp_telemetry_dimension dimension, const char *name)
+{
+	struct ast_rtp_telemetry_key search, *key;
+	time_t now = time(NULL);
+
+	if (!telemetry_keys || ast_strlen_zero(name)) {
+		return NULL;
+	}
+
+	search.dimension = dimension;
+	ast_copy_string(search.name, name, sizeof(search.name));
+
+	ao2_lock(telemetry_keys);
+	if ((key = ao2_find(telemetry_keys, &search, OBJ_POINTER | OBJ_NOLOCK))) {
+		ao2_unlock(telemetry_keys);
+		return key;
+	}
+
+	if (!free_count && key_count == TELEMETRY_MAX_KEYS) {
+		telemetry_evict(now);
+	}
+	if ((free_count || key_count < TELEMETRY_MAX_KEYS) && (key = ao2_alloc(sizeof(*key), NULL))) {
+		*key = search;
+		key->slot = free_count ? free_slots[--free_count] : key_count++;
+		key->released = now;
+		ao2_link_nolock(telemetry_keys, key);
+		/* the allocation reference is kept by key_slots, the caller gets its own */
+		key_slots[key->slot] = key;
+		ao2_ref(key, +1);
+	} else if (!keys_dropped++) {
+		ast_log(LOG_WARNING, "RTP telemetry key table is full, '%s' is not recorded\n", name);
+	}
+	ao2_unlock(telemetry_keys);
+
+	return key;
+}
+
+void ast_rtp_telemetry_key_release(struct ast_rtp_telemetry_key *key)
+{
+	if (key) {
+		key->released = time(NULL);
+		ao2_ref(key, -1);
+	}
+}
+
+double ast_rtp_telemetry_mos(double jitter, double loss, double rtt)
+{
+	double latency, r;
+
+	/* effective latency: one way delay plus the playout delay the jitter calls for */
+	latency = (rtt > 0 ? rtt / 2.0 : 0.0) + jitter * 2.0 + 10.0;
+	if (latency < 160.0) {
+		r = 93.2 - latency / 40.0;
+	} else {
+		r = 93.2 - (latency - 120.0) / 10.0;
+	}
+	r -= loss * 2.5;
+
+	if (r < 0.0) {
+		r = 0.0;
+	} else if (r > 100.0) {
+		r = 100.0;
+	}
+
+	return 1.0 + 0.035 * r + 0.000007 * r * (r - 60.0) * (100.0 - r);
+}
+
+void ast_rtp_telemetry_record(const struct ast_rtp_telemetry_sample *sample)
+{
+	struct telemetry_thread *thread;
+	struct telemetry_counters *counters;
+	struct telemetry_stats *interval;
+	time_t now = time(NULL), start;
+	double mos;
+	int dimension, idx;
+
+	if (!(thread = ast_threadstorage_get(&telemetry_thread_buf, sizeof(*thread)))) {
+		return;
+	}
+
+	mos = ast_rtp_telemetry_mos(sample->jitter, sample->loss, sample->rtt);
+	start = now - (now % TELEMETRY_INTERVAL_SECS);
+	idx = (now / TELEMETRY_INTERVAL_SECS) % TELEMETRY_INTERVALS;
+
+	ast_mutex_lock(&thread->lock);
+	for (dimension = 0; dimension < AST_RTP_TELEMETRY_DIMENSIONS; dimension++) {
+		if (!sample->keys[dimension]
+			|| !(counters = thread_counters(thread, sample->keys[dimension]->slot, 1))) {
+			continue;
+		}
+
+		interval = &counters->interval[idx];
+		if (counters->interval_start[idx] != start) {
+			memset(interval, 0, sizeof(*interval));
+			counters->interval_start[idx] = start;
+		}
+
+		stats_add_sample(&counters->total, sample->jitter, sample->loss, sample->rtt, mos);
+		stats_add_sample(interval, sample->jitter, sample->loss, sample->rtt, mos);
+	}
+	ast_mutex_unlock(&thread->lock);
+}
+
+/*! \note Must be called with telemetry_lock held */
+static void thread_collect(struct telemetry_thread *thread, struct telemetry_entry *sums, int count)
+{
+	struct telemetry_counters *counters;
+	int i, j;
+
+	ast_mutex_lock(&thread->lock);
+	for (i = 0; i < ARRAY_LEN(thread->chunks) && i * TELEMETRY_CHUNK < count; i++) {
+		if (!thread->chunks[i]) {
+			continue;
+		}
+		for (j = 0; j < TELEMETRY_CHUNK && i * TELEMETRY_CHUNK + j < count; j++) {
+			if ((counters = thread->chunks[i][j])) {
+				counters_merge(&sums[i * TELEMETRY_CHUNK + j].counters, counters);
+			}
+		}
+	}
+	ast_mutex_unlock(&thread->lock);
+}
+
+/*!
+ * \internal
+ * \brief Sum the counters of every thread
+ *
+ * \param[out] count Number of slots in the returned array
+ *
+ * \return array of entries indexed by slot, to be freed with telemetry_collect_free()
+ */
+static struct telemetry_entry *telemetry_collect(int *count)
+{
+	struct telemetry_entry *sums;
+	struct telemetry_thread *thread;
+	int slot;
+
+	/* hold the key table so no slot is evicted or reused while summing */
+	ao2_lock(telemetry_keys);
+	*count = key_count;
+	if (!(sums = ast_calloc(MAX(*count, 1), sizeof(*sums)))) {
+		ao2_unlock(telemetry_keys);
+		return NULL;
+	}
+	for (slot = 0; slot < *count; slot++) {
+		if ((sums[slot].key = key_slots[slot])) {
+			ao2_ref(sums[slot].key, +1);
+		}
+	}
+
+	ast_mutex_lock(&telemetry_lock);
+	thread_collect(&retired, sums, *count);
+	AST_LIST_TRAVERSE(&telemetry_threads, thread, list) {
+		thread_collect(thread, sums, *count);
+	}
+	ast_mutex_unlock(&telemetry_lock);
+	ao2_unlock(telemetry_keys);
+
+	return sums;
+}
+
+static void telemetry_collect_free(struct telemetry_entry *sums, int count)
+{
+	int slot;
+
+	for (slot = 0; slot < count; slot++) {
+		if (sums[slot].key) {
+			ao2_ref(sums[slot].key, -1);
+		}
+	}
+	ast_free(sums);
+}
+
+/*! \brief Sum the intervals of a set of counters that fall within the recent window */
+static void telemetry_recent(const struct telemetry_counters *counters, time_t now, struct telemetry_stats *recent)
+{
+	int i;
+
+	memset(recent, 0, sizeof(*recent));
+	for (i = 0; i < TELEMETRY_INTERVALS; i++) {
+		if (counters->interval_start[i] > now - TELEMETRY_INTERVALS * TELEMETRY_INTERVAL_SECS) {
+			stats_merge(recent, &counters->interval[i]);
+		}
+	}
+}
+
+static int dimension_parse(const char *name)
+{
+	int dimension;
+
+	for (dimension = 0; dimension < AST_RTP_TELEMETRY_DIMENSIONS; dimension++) {
+		if (!strcasecmp(name, dimension_names[dimension])) {
+			return dimension;
+		}
+	}
+	return -1;
+}
+
+static void format_hist(char *buf, size_t size, const unsigned int *hist)
+{
+	snprintf(buf, size, "%u/%u/%u/%u/%u/%u", hist[0], hist[1], hist[2], hist[3], hist[4], hist[5]);
+}
+
+#define STATS_AVG(stats, field) ((stats)->samples ? (stats)->field / (stats)->samples : 0.0)
+#define STATS_RTT_AVG(stats) ((stats)->rtt_samples ? (stats)->rtt_sum / (stats)->rtt_samples : 0.0)
+
+static char *handle_cli_rtp_show_telemetry(struct ast_cli_entry *e, int cmd, struct ast_cli_args *a)
+{
+#define FORMAT_HEAD "%-32.32s %8s %5s %5s %6s %7s %7s %8s %5s  %s\n"
+#define FORMAT_ROW  "%-32.32s %8u %5.2f %5.2f %6.2f %7.1f %7.1f %8u %5.2f  %s\n"
+	struct telemetry_entry *sums;
+	struct telemetry_stats recent;
+	char hist[64];
+	time_t now = time(NULL);
+	int only = -1, dimension, slot, count;
+
+	switch (cmd) {
+	case CLI_INIT:
+		e->command = "rtp show telemetry";
+		e->usage =
+			"Usage: rtp show telemetry [peer|trunk|codec]\n"
+			"       Shows call quality aggregated from RTCP reports, since startup and\n"
+			"       over the last five minutes, per peer, remote media host and codec.\n"
+			"       The MOS histogram counts samples below 2.6/3.1/3.6/4.0/4.3/above.\n";
+		return NULL;
+	case CLI_GENERATE:
+		return NULL;
+	}
+
+	if (a->argc > 4) {
+		return CLI_SHOWUSAGE;
+	}
+	if (a->argc == 4 && (only = dimension_parse(a->argv[3])) < 0) {
+		return CLI_SHOWUSAGE;
+	}
+
+	if (!(sums = telemetry_collect(&count))) {
+		return CLI_FAILURE;
+	}
+
+	for (dimension = 0; dimension < AST_RTP_TELEMETRY_DIMENSIONS; dimension++) {
+		if (only >= 0 && dimension != only) {
+			continue;
+		}
+		ast_cli(a->fd, "\n");
+		ast_cli(a->fd, FORMAT_HEAD, dimension_names[dimension], "Samples", "MOS", "MinMOS",
+			"Loss%", "Jitter", "RTT", "5mSample", "5mMOS", "MOS histogram");
+		for (slot = 0; slot < count; slot++) {
+			struct telemetry_counters *counters = &sums[slot].counters;
+
+			if (!sums[slot].key || sums[slot].key->dimension != dimension || !counters->total.samples) {
+				continue;
+			}
+			telemetry_recent(counters, now, &recent);
+			format_hist(hist, sizeof(hist), counters->total.mos_hist);
+			ast_cli(a->fd, FORMAT_ROW, sums[slot].key->name, counters->total.samples,
+				STATS_AVG(&counters->total, mos_sum), counters->total.mos_min,
+				STATS_AVG(&counters->total, loss_sum), STATS_AVG(&counters->total, jitter_sum),
+				STATS_RTT_AVG(&counters->total), recent.samples, STATS_AVG(&recent, mos_sum), hist);
+		}
+	}
+
+	ast_cli(a->fd, "\n%u keys evicted, %u refused while every key was in use\n",
+		keys_evicted, keys_dropped);
+
+	telemetry_collect_free(sums, count);
+
+	return CLI_SUCCESS;
+#undef FORMAT_HEAD
+#undef FORMAT_ROW
+}
+
+static int action_rtp_telemetry(struct mansession *s, const struct message *m)
+{
+	const char *actionid = astman_get_header(m, "ActionID");
+	const char *dimension_name = astman_get_header(m, "Dimension");
+	struct telemetry_entry *sums;
+	struct telemetry_stats recent;
+	char idtext[256] = "", mos_hist[64], loss_hist[64], jitter_hist[64];
+	time_t now = time(NULL);
+	int only = -1, slot, count, entries = 0;
+
+	if (!ast_strlen_zero(dimension_name) && (only = dimension_parse(dimension_name)) < 0) {
+		astman_send_error(s, m, "Dimension must be one of peer, trunk or codec");
+		return 0;
+	}
+	if (!ast_strlen_zero(actionid)) {
+		snprintf(idtext, sizeof(idtext), "ActionID: %s\r\n", actionid);
+	}
+
+	if (!(sums = telemetry_collect(&count))) {
+		astman_send_error(s, m, "Memory Allocation Failure");
+		return 0;
+	}
+
+	astman_send_listack(s, m, "Telemetry entries will follow", "start");
+
+	for (slot = 0; slot < count; slot++) {
+		struct telemetry_counters *counters = &sums[slot].counters;
+		struct telemetry_stats *total = &counters->total;
+
+		if (!sums[slot].key || (only >= 0 && sums[slot].key->dimension != only) || !total->samples) {
+			continue;
+		}
+		telemetry_recent(counters, now, &recent);
+		format_hist(mos_hist, sizeof(mos_hist), total->mos_hist);
+		format_hist(loss_hist, sizeof(loss_hist), total->loss_hist);
+		format_hist(jitter_hist, sizeof(jitter_hist), total->jitter_hist);
+
+		astman_append(s,
+			"Event: RTPTelemetryEntry\r\n"
+			"%s"
+			"Dimension: %s\r\n"
+			"Name: %s\r\n"
+			"Samples: %u\r\n"
+			"MOS: %.2f\r\n"
+			"MinMOS: %.2f\r\n"
+			"Loss: %.2f\r\n"
+			"MaxLoss: %.2f\r\n"
+			"Jitter: %.1f\r\n"
+			"MaxJitter: %.1f\r\n"
+			"RTT: %.1f\r\n"
+			"MaxRTT: %.1f\r\n"
+			"RecentSamples: %u\r\n"
+			"RecentMOS: %.2f\r\n"
+			"RecentLoss: %.2f\r\n"
+			"RecentJitter: %.1f\r\n"
+			"MOSHistogram: %s\r\n"
+			"LossHistogram: %s\r\n"
+			"JitterHistogram: %s\r\n"
+			"\r\n",
+			idtext, dimension_names[sums[slot].key->dimension], sums[slot].key->name,
+			total->samples, STATS_AVG(total, mos_sum), total->mos_min,
+			STATS_AVG(total, loss_sum), total->loss_max,
+			STATS_AVG(total, jitter_sum), total->jitter_max,
+			STATS_RTT_AVG(total), total->rtt_max,
+			recent.samples, STATS_AVG(&recent, mos_sum), STATS_AVG(&recent, loss_sum),
+			STATS_AVG(&recent, jitter_sum), mos_hist, loss_hist, jitter_hist);
+		entries++;
+	}
+
+	telemetry_collect_free(sums, count);
+
+	astman_append(s,
+		"Event: RTPTelemetryComplete\r\n"
+		"EventList: Complete\r\n"
+		"ListItems: %d\r\n"
+		"%s"
+		"\r\n", entries, idtext);
+
+	return 0;
+}
+
+static struct ast_cli_entry cli_rtp_telemetry[] = {
+	AST_CLI_DEFINE(handle_cli_rtp_show_telemetry, "Display aggregated RTP quality telemetry"),
+};
+
+/*!
+ * \internal
+ * \brief Clean up resources on Asterisk shutdown
+ */
+static void rtp_telemetry_shutdown(void)
+{
+	ast_cli_unregister_multiple(cli_rtp_telemetry, ARRAY_LEN(cli_rtp_telemetry));
+	ast_manager_unregister("RTPTelemetry");
+}
+
+int ast_rtp_telemetry_init(void)
+{
+	ast_mutex_init(&retired.lock);
+
+	if (!(telemetry_keys = ao2_container_alloc(127, telemetry_key_hash, telemetry_key_cmp))) {
+		return -1;
+	}
+
+	ast_cli_register_multiple(cli_rtp_telemetry, ARRAY_LEN(cli_rtp_telemetry));
+	ast_manager_register_xml("RTPTelemetry", EVENT_FLAG_REPORTING, action_rtp_telemetry);
+
+	ast_register_atexit(rtp_telemetry_shutdown);
+
+	return 0;
+}
@@ -411,6 +411,12 @@ static int tps_taskprocessor_depth(struct ast_taskprocessor *tps)
 	return (tps) ? tps->tps_queue_size : -1;
 }
 
+/* taskprocessor queue size accessor */
+long ast_taskprocessor_size(struct ast_taskprocessor *tps)
+{
+	return tps_taskprocessor_depth(tps);
+}
+
 /* taskprocessor name accessor */
 const char *ast_taskprocessor_name(struct ast_taskprocessor *tps)
 {
@@ -33,6 +33,7 @@ ASTERISK_FILE_VERSION(__FILE__, "$Revision: 369005 $")
 
 #include <sys/time.h>
 #include <sys/resource.h>
+#include <sys/stat.h>
 #include <math.h>
 
 #include "asterisk/lock.h"
@@ -43,6 +44,9 @@ ASTERISK_FILE_VERSION(__FILE__, "$Revision: 369005 $")
 #include "asterisk/sched.h"
 #include "asterisk/cli.h"
 #include "asterisk/term.h"
+#include "asterisk/astdb.h"
+#include "asterisk/paths.h"
+#include "asterisk/ast_version.h"
 
 /*! \todo
  * TODO: sample frames for each supported input format.
@@ -53,6 +57,12 @@ ASTERISK_FILE_VERSION(__FILE__, "$Revision: 369005 $")
 /*! max sample recalc */
 #define MAX_RECALC 1000
 
+/*! astdb family computational costs are kept in between restarts */
+#define COST_CACHE_FAMILY "TranslateCost"
+
+/*! CPU model computational costs were measured on, part of every cost cache entry */
+static char cpu_model[128] = "unknown";
+
 /*! \brief the list of translators */
 static AST_RWLIST_HEAD_STATIC(translators, ast_translator);
 
@@ -625,6 +635,104 @@ static void generate_computational_cost(struct ast_translator *t, int seconds)
 	}
 }
 
+/*!
+ * \internal
+ * \brief Describe what a translator's computational cost depends on.
+ *
+ * A cached cost is only valid for the same build of the module providing
+ * the translator, running on the same kind of CPU.
+ */
+static void cost_cache_key(struct ast_translator *t, char *buf, size_t len)
+{
+	const char *name = ast_module_name(t->module);
+	char path[PATH_MAX];
+	struct stat st;
+
+	snprintf(path, sizeof(path), "%s/%s.so", ast_config_AST_MODULE_DIR, S_OR(name, ""));
+	if (!name || stat(path, &st)) {
+		/* Built in, the Asterisk build is all there is to go by */
+		st.st_mtime = 0;
+		st.st_size = 0;
+	}
+	snprintf(buf, len, "%s %ld %ld %s %s", S_OR(name, "builtin"),
+		(long) st.st_mtime, (long) st.st_size, ast_get_version(), cpu_model);
+}
+
+/*!
+ * \internal
+ * \brief Reuse a translator's computational cost from a previous run.
+ *
+ * \retval 0 the cost was found and is still valid
+ * \retval -1 the cost needs to be computed
+ */
+static int cost_cache_load(struct ast_translator *t)
+{
+	char key[PATH_MAX + 256];
+	char value[sizeof(key) + 16];
+	int cost;
+	int pos = 0;
+
+	if (!t->sample || ast_db_get(COST_CACHE_FAMILY, t->name, value, sizeof(value))) {
+		return -1;
+	}
+
+	cost_cache_key(t, key, sizeof(key));
+	if (sscanf(value, "%30d %n", &cost, &pos) != 1 || !pos || cost <= 0 || strcmp(value + pos, key)) {
+		ast_debug(3, "Cached computational cost of translator '%s' is stale.\n", t->name);
+		return -1;
+	}
+
+	t->comp_cost = cost;
+	return 0;
+}
+
+/*!
+ * \internal
+ * \brief Remember a translator's computational cost for the next run.
+ *
+ * \note Translators which can not produce sample frames are not cached,
+ * their cost is known without running them.
+ */
+static void cost_cache_store(struct ast_translator *t)
+{
+	char key[PATH_MAX + 256];
+	char value[sizeof(key) + 16];
+
+	if (!t->sample) {
+		return;
+	}
+
+	cost_cache_key(t, key, sizeof(key));
+	snprintf(value, sizeof(value), "%d %s", t->comp_cost, key);
+	if (ast_db_put(COST_CACHE_FAMILY, t->name, value)) {
+		ast_debug(1, "Unable to cache computational cost of translator '%s'.\n", t->name);
+	}
+}
+
+/*!
+ * \internal
+ * \brief Find the CPU model computational costs are measured on.
+ */
+static void cost_cache_init(void)
+{
+	char line[256];
+	FILE *f;
+
+	if (!(f = fopen("/proc/cpuinfo", "r"))) {
+		return;
+	}
+	while (fgets(line, sizeof(line), f)) {
+		char *value;
+
+		if (strncmp(line, "model name", 10) || !(value = strchr(line, ':'))) {
+			continue;
+		}
+		ast_copy_string(cpu_model, ast_strip(value + 1), sizeof(cpu_model));
+		break;
+	}
+	fclose(f);
+}
+
 /*!
  * \internal
  *
@@ -720,6 +828,7 @@ static void matrix_rebuild(int samples)
 
 		if (samples) {
 			generate_computational_cost(t, samples);
+			cost_cache_store(t);
 		}
 
 		/* This new translator is the best choice if any of the below are true.
@@ -785,6 +894,163 @@ static void matrix_rebuild(int samples)
 	}
 }
 
+/*!
+ * \internal
+ * \brief Recompute every path to one destination format.
+ *
+ * \note This function expects the list of translators to be locked
+ */
+static void matrix_rebuild_column(int z)
+{
+	struct ast_translator *t;
+	int newtablecost;
+	int x;
+
+	for (x = 0; x < cur_max_index; x++) {
+		memset(matrix_get(x, z), '\0', sizeof(struct translator_path));
+	}
+
+	/* first, the direct costs, chosen the same way matrix_rebuild() does */
+	AST_RWLIST_TRAVERSE(&translators, t, list) {
+		if (!t->active || t->dst_fmt_index != z) {
+			continue;
+		}
+		x = t->src_fmt_index;
+		if (!matrix_get(x, z)->step ||
+			(t->table_cost < matrix_get(x, z)->step->table_cost) ||
+			(t->comp_cost < matrix_get(x, z)->step->comp_cost)) {
+
+			matrix_get(x, z)->step = t;
+			matrix_get(x, z)->table_cost = t->table_cost;
+		}
+	}
+
+	/* then extend paths backwards one translator at a time until stable */
+	for (;;) {
+		int changed = 0;
+
+		AST_RWLIST_TRAVERSE(&translators, t, list) {
+			int y = t->dst_fmt_index;
+
+			x = t->src_fmt_index;
+			if (!t->active || x == z || y == z || !matrix_get(y, z)->step) {
+				continue;
+			}
+
+			newtablecost = t->table_cost + matrix_get(y, z)->table_cost;
+			if (!matrix_get(x, z)->step || (newtablecost < matrix_get(x, z)->table_cost)) {
+				matrix_get(x, z)->step = t;
+				matrix_get(x, z)->table_cost = newtablecost;
+				matrix_get(x, z)->multistep = 1;
+				changed++;
+			}
+		}
+		if (!changed) {
+			break;
+		}
+	}
+}
+
+/*!
+ * \internal
+ * \brief Add the paths a newly active translator makes possible or cheaper.
+ *
+ * Any path improved by the new translator runs from its source to some format
+ * over the existing paths, then through the translator, then on over the
+ * existing paths, so this only has to try every pair of formats once instead
+ * of rebuilding the whole matrix.
+ *
+ * \note This function expects the list of translators to be locked
+ */
+static void matrix_add_translator(struct ast_translator *t)
+{
+	struct translator_path *direct;
+	struct ast_translator *replaced;
+	int newtablecost;
+	int x = t->src_fmt_index;
+	int z = t->dst_fmt_index;
+	int a;      /* source format index */
+	int b;      /* destination format index */
+
+	direct = matrix_get(x, z);
+
+	/* Same choice matrix_rebuild() makes between translators with identical
+	 * src and dst formats.  A multi step path only beats a direct one if it
+	 * is strictly cheaper. */
+	if (direct->step &&
+		(direct->multistep ? direct->table_cost < t->table_cost :
+		 !((t->table_cost < direct->step->table_cost) || (t->comp_cost < direct->step->comp_cost)))) {
+		return;
+	}
+
+	newtablecost = !direct->step || t->table_cost < direct->table_cost;
+	replaced = direct->multistep ? NULL : direct->step;
+	direct->step = t;
+	direct->table_cost = t->table_cost;
+	direct->multistep = 0;
+
+	if (!newtablecost) {
+		/* Only the tie breaker changed.  No path gets any cheaper, but the
+		 * paths which started with the replaced translator are rerouted
+		 * through the new one, as a full rebuild would. */
+		for (b = 0; replaced && b < cur_max_index; b++) {
+			if (b != z && matrix_get(x, b)->step == replaced) {
+				matrix_rebuild_column(b);
+			}
+		}
+		return;
+	}
+
+	for (a = 0; a < cur_max_index; a++) {
+		if (a != x && !matrix_get(a, x)->step) {  /* no path to the translator */
+			continue;
+		}
+		for (b = 0; b < cur_max_index; b++) {
+			if ((b == a) || (a == x && b == z) ||  /* skip null and direct conversions */
+				(b != z && !matrix_get(z, b)->step)) {  /* no path from the translator */
+				continue;
+			}
+
+			newtablecost = t->table_cost;
+			if (a != x) {
+				newtablecost += matrix_get(a, x)->table_cost;
+			}
+			if (b != z) {
+				newtablecost += matrix_get(z, b)->table_cost;
+			}
+
+			if (!matrix_get(a, b)->step || (newtablecost < matrix_get(a, b)->table_cost)) {
+				matrix_get(a, b)->step = (a == x) ? t : matrix_get(a, x)->step;
+				matrix_get(a, b)->table_cost = newtablecost;
+				matrix_get(a, b)->multistep = 1;
+			}
+		}
+	}
+}
+
+/*!
+ * \internal
+ * \brief Drop the paths going through a translator which is no longer active.
+ *
+ * Paths are followed one step at a time, so a path uses the translator only
+ * if the translator is the next step from its source format towards the
+ * destination.  Only the destinations reached that way are recomputed.
+ *
+ * \note This function expects the list of translators to be locked, and the
+ * translator to be already removed from it or inactive.
+ */
+static void matrix_remove_translator(struct ast_translator *t)
+{
+	int x = t->src_fmt_index;
+	int z;
+
+	for (z = 0; z < cur_max_index; z++) {
+		if (matrix_get(x, z)->step == t) {
+			matrix_rebuild_column(z);
+		}
+	}
+}
+
 const char *ast_translate_path_to_str(struct ast_trans_pvt *p, struct ast_str **str)
 {
 	struct ast_trans_pvt *pn = p;
@@ -1008,7 +1274,8 @@ static char *handle_cli_core_show_translation(struct ast_cli_entry *e, int cmd,
 			"          Displays known codec translators and the cost associated\n"
 			"          with each conversion.  If the argument 'recalc' is supplied along\n"
 			"          with optional number of seconds to test a new test will be performed\n"
-			"          as the chart is being displayed.\n"
+			"          as the chart is being displayed.  The new costs replace the ones\n"
+			"          remembered from earlier runs.\n"
 			"       2. 'core show translation paths [codec]'\n"
 			"           This will display all the translation paths associated with a codec\n";
 		return NULL;
@@ -1104,7 +1371,10 @@ int __ast_register_translator(struct ast_translator *t, struct ast_module *mod)
 		t->frameout = default_frameout;
 	}
 
-	generate_computational_cost(t, 1);
+	if (cost_cache_load(t)) {
+		generate_computational_cost(t, 1);
+		cost_cache_store(t);
+	}
 
 	ast_verb(2, "Registered translator '%s' from format %s to %s, table cost, %d, computational cost %d\n",
 			    term_color(tmp, t->name, COLOR_MAGENTA, COLOR_BLACK, sizeof(tmp)),
@@ -1119,7 +1389,6 @@ int __ast_register_translator(struct ast_translator *t, struct ast_module *mod)
 		    (u->dst_fmt_index == t->dst_fmt_index) &&
 		    (u->comp_cost > t->comp_cost)) {
 			AST_RWLIST_INSERT_BEFORE_CURRENT(t, list);
-			t = NULL;
 			break;
 		}
 	}
@@ -1127,11 +1396,11 @@ int __ast_register_translator(struct ast_translator *t, struct ast_module *mod)
 
 	/* if no existing translator was found for this format combination,
 	   add it to the beginning of the list */
-	if (t) {
+	if (!u) {
 		AST_RWLIST_INSERT_HEAD(&translators, t, list);
 	}
 
-	matrix_rebuild(0);
+	matrix_add_translator(t);
 
 	AST_RWLIST_UNLOCK(&translators);
 
@@ -1159,8 +1428,8 @@ int ast_unregister_translator(struct ast_translator *t)
 	}
 	AST_RWLIST_TRAVERSE_SAFE_END;
 
-	if (found) {
-		matrix_rebuild(0);
+	if (found && t->active) {
+		matrix_remove_translator(t);
 	}
 
 	AST_RWLIST_UNLOCK(&translators);
@@ -1171,16 +1440,20 @@ int ast_unregister_translator(struct ast_translator *t)
 void ast_translator_activate(struct ast_translator *t)
 {
 	AST_RWLIST_WRLOCK(&translators);
-	t->active = 1;
-	matrix_rebuild(0);
+	if (!t->active) {
+		t->active = 1;
+		matrix_add_translator(t);
+	}
 	AST_RWLIST_UNLOCK(&translators);
 }
 
 void ast_translator_deactivate(struct ast_translator *t)
 {
 	AST_RWLIST_WRLOCK(&translators);
-	t->active = 0;
-	matrix_rebuild(0);
+	if (t->active) {
+		t->active = 0;
+		matrix_remove_translator(t);
+	}
 	AST_RWLIST_UNLOCK(&translators);
 }
 
@@ -1390,6 +1663,7 @@ int ast_translate_init(void)
 {
 	int res = 0;
 	ast_rwlock_init(&tablelock);
+	cost_cache_init();
 	res = matrix_resize(1);
 	res |= ast_cli_register_multiple(cli_translate, ARRAY_LEN(cli_translate));
 	return res;
@@ -57,6 +57,7 @@
 ASTERISK_FILE_VERSION(__FILE__, "$Revision: 377848 $")
 
 #include <sys/time.h>
+#include <sys/uio.h>
 #include <signal.h>
 #include <fcntl.h>
 
@@ -103,12 +104,35 @@ static int use_even_ports;
 #define MAX_FEC_SPAN                5
 
 #define UDPTL_BUF_MASK              15
+/*! The transmit history must reach back over a full FEC window and one more IFP */
+#define UDPTL_TX_BUF_MASK           31
+
+/*! Most fragments a transmitted packet is made of: the header octets and primary
+ * IFP, plus a length and a payload for each redundant IFP or FEC entry */
+#define UDPTL_MAX_IOV               (2 * MAX_FEC_ENTRIES + 4)
 
 typedef struct {
 	int buf_len;
 	uint8_t buf[LOCAL_FAX_MAX_DATAGRAM];
 } udptl_fec_tx_buffer_t;
 
+/*! \brief A UDPTL packet being built for transmission
+ *
+ * Sequence numbers, lengths and other encoding octets are written to hdr,
+ * while IFPs and FEC entries are referenced where they already live in the
+ * transmit history, so the packet is sent without being assembled.
+ */
+struct udptl_sg {
+	struct iovec iov[UDPTL_MAX_IOV];
+	int iovcnt;
+	uint8_t hdr[UDPTL_MAX_IOV * 4];
+	unsigned int hdrlen;
+	/*! Total length of the packet */
+	unsigned int len;
+	/*! Largest datagram the far end accepts */
+	unsigned int limit;
+};
+
 typedef struct {
 	int buf_len;
 	uint8_t buf[LOCAL_FAX_MAX_DATAGRAM];
@@ -179,8 +203,19 @@ struct ast_udptl {
 	unsigned int tx_seq_no;
 	unsigned int rx_seq_no;
 
-	udptl_fec_tx_buffer_t tx[UDPTL_BUF_MASK + 1];
+	udptl_fec_tx_buffer_t tx[UDPTL_TX_BUF_MASK + 1];
 	udptl_fec_rx_buffer_t rx[UDPTL_BUF_MASK + 1];
+
+	/*! FEC entries for the windows ending at fec_base to fec_base + entries - 1,
+	 * the first in slot fec_slot. Bytes past fec_len are always zero so a
+	 * window can be slid along with two XORs when the next IFP is sent. */
+	uint8_t fec[MAX_FEC_ENTRIES][LOCAL_FAX_MAX_DATAGRAM];
+	int fec_len[MAX_FEC_ENTRIES];
+	int fec_slot;
+	unsigned int fec_base;
+	/*! Span and entries the FEC windows were computed for, 0 if they must be recomputed */
+	unsigned int fec_span;
+	unsigned int fec_entries;
 };
 
 static AST_RWLIST_HEAD_STATIC(protos, ast_udptl_protocol);
@@ -248,68 +283,6 @@ static int decode_open_type(uint8_t *buf, unsigned int limit, unsigned int *len,
 }
 /*- End of function --------------------------------------------------------*/
 
-static unsigned int encode_length(uint8_t *buf, unsigned int *len, unsigned int value)
-{
-	unsigned int multiplier;
-
-	if (value < 0x80) {
-		/* 1 octet */
-		buf[*len] = value;
-		(*len)++;
-		return value;
-	}
-	if (value < 0x4000) {
-		/* 2 octets */
-		/* Set the first bit of the first octet */
-		buf[*len] = ((0x8000 | value) >> 8) & 0xFF;
-		(*len)++;
-		buf[*len] = value & 0xFF;
-		(*len)++;
-		return value;
-	}
-	/* Fragmentation */
-	multiplier = (value < 0x10000) ? (value >> 14) : 4;
-	/* Set the first 2 bits of the octet */
-	buf[*len] = 0xC0 | multiplier;
-	(*len)++;
-	return multiplier << 14;
-}
-/*- End of function --------------------------------------------------------*/
-
-static int encode_open_type(const struct ast_udptl *udptl, uint8_t *buf, unsigned int buflen,
-			    unsigned int *len, const uint8_t *data, unsigned int num_octets)
-{
-	unsigned int enclen;
-	unsigned int octet_idx;
-	uint8_t zero_byte;
-
-	/* If open type is of zero length, add a single zero byte (10.1) */
-	if (num_octets == 0) {
-		zero_byte = 0;
-		data = &zero_byte;
-		num_octets = 1;
-	}
-	/* Encode the open type */
-	for (octet_idx = 0; ; num_octets -= enclen, octet_idx += enclen) {
-		if ((enclen = encode_length(buf, len, num_octets)) < 0)
-			return -1;
-		if (enclen + *len > buflen) {
-			ast_log(LOG_ERROR, "UDPTL (%s): Buffer overflow detected (%d + %d > %d)\n",
-				LOG_TAG(udptl), enclen, *len, buflen);
-			return -1;
-		}
-		if (enclen > 0) {
-			memcpy(&buf[*len], &data[octet_idx], enclen);
-			*len += enclen;
-		}
-		if (enclen >= num_octets)
-			break;
-	}
-
-	return 0;
-}
-/*- End of function --------------------------------------------------------*/
-
 static int udptl_rx_packet(struct ast_udptl *s, uint8_t *buf, unsigned int len)
 {
 	int stat1;
@@ -526,9 +499,134 @@ static int udptl_rx_packet(struct ast_udptl *s, uint8_t *buf, unsigned int len)
 }
 /*- End of function --------------------------------------------------------*/
 
-static int udptl_build_packet(struct ast_udptl *s, uint8_t *buf, unsigned int buflen, uint8_t *ifp, unsigned int ifp_len)
+/*! \brief Add an octet to a packet being built */
+static int udptl_sg_octet(const struct ast_udptl *s, struct udptl_sg *sg, uint8_t octet)
+{
+	struct iovec *last = sg->iovcnt ? &sg->iov[sg->iovcnt - 1] : NULL;
+
+	if (sg->len + 1 > sg->limit) {
+		ast_log(LOG_ERROR, "UDPTL (%s): Buffer overflow detected (%d + 1 > %d)\n",
+			LOG_TAG(s), sg->len, sg->limit);
+		return -1;
+	}
+	if (!last || (uint8_t *) last->iov_base + last->iov_len != &sg->hdr[sg->hdrlen]) {
+		if (sg->iovcnt == ARRAY_LEN(sg->iov)) {
+			return -1;
+		}
+		last = &sg->iov[sg->iovcnt++];
+		last->iov_base = &sg->hdr[sg->hdrlen];
+		last->iov_len = 0;
+	}
+	sg->hdr[sg->hdrlen++] = octet;
+	last->iov_len++;
+	sg->len++;
+
+	return 0;
+}
+
+/*! \brief Add an open type referencing data in place to a packet being built
+ *
+ * \note Only the unfragmented forms are produced, which cover every IFP our
+ * buffers can hold.
+ */
+static int udptl_sg_open_type(const struct ast_udptl *s, struct udptl_sg *sg, const uint8_t *data, unsigned int num_octets)
+{
+	/* If open type is of zero length, add a single zero byte (10.1) */
+	if (num_octets == 0) {
+		return udptl_sg_octet(s, sg, 1) || udptl_sg_octet(s, sg, 0) ? -1 : 0;
+	}
+	if (num_octets >= 0x4000) {
+		return -1;
+	}
+	if (num_octets >= 0x80) {
+		if (udptl_sg_octet(s, sg, ((0x8000 | num_octets) >> 8) & 0xFF)) {
+			return -1;
+		}
+	}
+	if (udptl_sg_octet(s, sg, num_octets & 0xFF)) {
+		return -1;
+	}
+	if (sg->len + num_octets > sg->limit) {
+		ast_log(LOG_ERROR, "UDPTL (%s): Buffer overflow detected (%d + %d > %d)\n",
+			LOG_TAG(s), num_octets, sg->len, sg->limit);
+		return -1;
+	}
+	if (sg->iovcnt == ARRAY_LEN(sg->iov)) {
+		return -1;
+	}
+	sg->iov[sg->iovcnt].iov_base = (void *) data;
+	sg->iov[sg->iovcnt].iov_len = num_octets;
+	sg->iovcnt++;
+	sg->len += num_octets;
+
+	return 0;
+}
+
+/*! \brief XOR an IFP from the transmit history into an FEC entry */
+static void udptl_fec_xor(struct ast_udptl *s, int slot, int entry)
+{
+	const udptl_fec_tx_buffer_t *tx = &s->tx[entry & UDPTL_TX_BUF_MASK];
+	uint8_t *fec = s->fec[slot];
+	int j;
+
+	for (j = 0; j < tx->buf_len; j++) {
+		fec[j] ^= tx->buf[j];
+	}
+}
+
+/*! \brief Compute the FEC entry for the window of IFPs ending before limit from scratch */
+static void udptl_fec_window(struct ast_udptl *s, int slot, int limit, int span, int entries)
+{
+	int i;
+
+	memset(s->fec[slot], 0, sizeof(s->fec[slot]));
+	s->fec_len[slot] = 0;
+	for (i = limit - span * entries; i != limit; i += entries) {
+		udptl_fec_xor(s, slot, i);
+		s->fec_len[slot] = MAX(s->fec_len[slot], s->tx[i & UDPTL_TX_BUF_MASK].buf_len);
+	}
+}
+
+/*! \brief Bring the FEC entries up to date for the packet with sequence number seq
+ *
+ * Consecutive packets share all but one of their FEC windows, so in the
+ * steady state only the window that falls out of use is slid forward, by
+ * adding the newest IFP it must cover and removing the oldest.
+ */
+static void udptl_fec_update(struct ast_udptl *s, int seq, int span, int entries)
+{
+	int slot, i, limit;
+
+	if (s->fec_span == span && s->fec_entries == entries && ((s->fec_base + 1) & 0xFFFF) == seq) {
+		slot = s->fec_slot;
+		limit = seq - 1 + entries;
+		udptl_fec_xor(s, slot, seq - 1);
+		udptl_fec_xor(s, slot, seq - 1 - span * entries);
+		s->fec_len[slot] = 0;
+		for (i = limit - span * entries; i != limit; i += entries) {
+			s->fec_len[slot] = MAX(s->fec_len[slot], s->tx[i & UDPTL_TX_BUF_MASK].buf_len);
+		}
+		s->fec_slot = (slot + 1) % entries;
+		s->fec_base = seq;
+		return;
+	}
+
+	for (i = 0; i < entries; i++) {
+		udptl_fec_window(s, i, seq + i, span, entries);
+	}
+	s->fec_slot = 0;
+	s->fec_base = seq;
+	/* While winding up the span and entries change from packet to packet */
+	if (span == s->error_correction_span && entries == s->error_correction_entries) {
+		s->fec_span = span;
+		s->fec_entries = entries;
+	} else {
+		s->fec_span = s->fec_entries = 0;
+	}
+}
+
+static int udptl_build_packet(struct ast_udptl *s, struct udptl_sg *sg, uint8_t *ifp, unsigned int ifp_len)
 {
-	uint8_t fec[LOCAL_FAX_MAX_DATAGRAM * 2] = { 0, };
 	int i;
 	int j;
 	int seq;
@@ -536,57 +634,52 @@ static int udptl_build_packet(struct ast_udptl *s, uint8_t *buf, unsigned int bu
 	int entries;
 	int span;
 	int m;
-	unsigned int len;
-	int limit;
-	int high_tide;
 
 	seq = s->tx_seq_no & 0xFFFF;
 
 	/* Map the sequence number to an entry in the circular buffer */
-	entry = seq & UDPTL_BUF_MASK;
+	entry = seq & UDPTL_TX_BUF_MASK;
 
 	/* We save the message in a circular buffer, for generating FEC or
-	   redundancy sets later on. */
+	   redundancy sets later on, and send it from there. */
+	if (ifp_len > sizeof(s->tx[entry].buf)) {
+		return -1;
+	}
 	s->tx[entry].buf_len = ifp_len;
 	memcpy(s->tx[entry].buf, ifp, ifp_len);
 	
 	/* Build the UDPTLPacket */
 
-	len = 0;
 	/* Encode the sequence number */
-	buf[len++] = (seq >> 8) & 0xFF;
-	buf[len++] = seq & 0xFF;
+	if (udptl_sg_octet(s, sg, (seq >> 8) & 0xFF) || udptl_sg_octet(s, sg, seq & 0xFF))
+		return -1;
 
 	/* Encode the primary IFP packet */
-	if (encode_open_type(s, buf, buflen, &len, ifp, ifp_len) < 0)
+	if (udptl_sg_open_type(s, sg, s->tx[entry].buf, ifp_len) < 0)
 		return -1;
 
 	/* Encode the appropriate type of error recovery information */
 	switch (s->error_correction_scheme)
 	{
 	case UDPTL_ERROR_CORRECTION_NONE:
-		/* Encode the error recovery type */
-		buf[len++] = 0x00;
-		/* The number of entries will always be zero, so it is pointless allowing
-		   for the fragmented case here. */
-		if (encode_length(buf, &len, 0) < 0)
+		/* Encode the error recovery type, and a number of entries of zero */
+		if (udptl_sg_octet(s, sg, 0x00) || udptl_sg_octet(s, sg, 0))
 			return -1;
 		break;
 	case UDPTL_ERROR_CORRECTION_REDUNDANCY:
 		/* Encode the error recovery type */
-		buf[len++] = 0x00;
 		if (s->tx_seq_no > s->error_correction_entries)
 			entries = s->error_correction_entries;
 		else
 			entries = s->tx_seq_no;
 		/* The number of entries will always be small, so it is pointless allowing
 		   for the fragmented case here. */
-		if (encode_length(buf, &len, entries) < 0)
+		if (udptl_sg_octet(s, sg, 0x00) || udptl_sg_octet(s, sg, entries))
 			return -1;
 		/* Encode the elements */
 		for (i = 0; i < entries; i++) {
-			j = (entry - i - 1) & UDPTL_BUF_MASK;
-			if (encode_open_type(s, buf, buflen, &len, s->tx[j].buf, s->tx[j].buf_len) < 0) {
+			j = (entry - i - 1) & UDPTL_TX_BUF_MASK;
+			if (udptl_sg_open_type(s, sg, s->tx[j].buf, s->tx[j].buf_len) < 0) {
 				ast_debug(1, "UDPTL (%s): Encoding failed at i=%d, j=%d\n",
 					  LOG_TAG(s), i, j);
 				return -1;
@@ -602,39 +695,26 @@ static int udptl_build_packet(struct ast_udptl *s, uint8_t *buf, unsigned int bu
 			if (seq < s->error_correction_span)
 				span = 0;
 		}
-		/* Encode the error recovery type */
-		buf[len++] = 0x80;
-		/* Span is defined as an inconstrained integer, which it dumb. It will only
+		/* Encode the error recovery type. Span is defined as an inconstrained
+		   integer, which it dumb. It will only ever be a small value. Treat it
+		   as such. The number of entries is defined as a length, but will only
 		   ever be a small value. Treat it as such. */
-		buf[len++] = 1;
-		buf[len++] = span;
-		/* The number of entries is defined as a length, but will only ever be a small
-		   value. Treat it as such. */
-		buf[len++] = entries;
+		if (udptl_sg_octet(s, sg, 0x80) || udptl_sg_octet(s, sg, 1) ||
+			udptl_sg_octet(s, sg, span) || udptl_sg_octet(s, sg, entries))
+			return -1;
+		if (entries) {
+			udptl_fec_update(s, seq, span, entries);
+		}
 		for (m = 0; m < entries; m++) {
-			/* Make an XOR'ed entry the maximum length */
-			limit = (entry + m) & UDPTL_BUF_MASK;
-			high_tide = 0;
-			for (i = (limit - span*entries) & UDPTL_BUF_MASK; i != limit; i = (i + entries) & UDPTL_BUF_MASK) {
-				if (high_tide < s->tx[i].buf_len) {
-					for (j = 0; j < high_tide; j++)
-						fec[j] ^= s->tx[i].buf[j];
-					for ( ; j < s->tx[i].buf_len; j++)
-						fec[j] = s->tx[i].buf[j];
-					high_tide = s->tx[i].buf_len;
-				} else {
-					for (j = 0; j < s->tx[i].buf_len; j++)
-						fec[j] ^= s->tx[i].buf[j];
-				}
-			}
-			if (encode_open_type(s, buf, buflen, &len, fec, high_tide) < 0)
+			i = (s->fec_slot + m) % entries;
+			if (udptl_sg_open_type(s, sg, s->fec[i], s->fec_len[i]) < 0)
 				return -1;
 		}
 		break;
 	}
 
 	s->tx_seq_no++;
-	return len;
+	return sg->len;
 }
 
 int ast_udptl_fd(const struct ast_udptl *udptl)
@@ -944,6 +1024,8 @@ struct ast_udptl *ast_udptl_new_with_bindaddr(struct ast_sched_context *sched, s
 
 	for (i = 0; i <= UDPTL_BUF_MASK; i++) {
 		udptl->rx[i].buf_len = -1;
+	}
+	for (i = 0; i <= UDPTL_TX_BUF_MASK; i++) {
 		udptl->tx[i].buf_len = -1;
 	}
 
@@ -1054,11 +1136,11 @@ int ast_udptl_write(struct ast_udptl *s, struct ast_frame *f)
 	unsigned int seq;
 	unsigned int len = f->datalen;
 	int res;
-	/* if no max datagram size is provided, use default value */
-	const int bufsize = (s->far_max_datagram > 0) ? s->far_max_datagram : DEFAULT_FAX_MAX_DATAGRAM;
-	uint8_t buf[bufsize];
-
-	memset(buf, 0, sizeof(buf));
+	struct udptl_sg sg = {
+		/* if no max datagram size is provided, use default value */
+		.limit = (s->far_max_datagram > 0) ? s->far_max_datagram : DEFAULT_FAX_MAX_DATAGRAM,
+	};
+	struct msghdr msg = { 0, };
 
 	/* If we have no peer, return immediately */
 	if (ast_sockaddr_isnull(&s->them)) {
@@ -1088,10 +1170,14 @@ int ast_udptl_write(struct ast_udptl *s, struct ast_frame *f)
 	seq = s->tx_seq_no & 0xFFFF;
 
 	/* Cook up the UDPTL packet, with the relevant EC info. */
-	len = udptl_build_packet(s, buf, sizeof(buf), f->data.ptr, len);
+	len = udptl_build_packet(s, &sg, f->data.ptr, len);
 
 	if ((signed int) len > 0 && !ast_sockaddr_isnull(&s->them)) {
-		if ((res = ast_sendto(s->fd, buf, len, 0, &s->them)) < 0)
+		msg.msg_name = &s->them.ss;
+		msg.msg_namelen = s->them.len;
+		msg.msg_iov = sg.iov;
+		msg.msg_iovlen = sg.iovcnt;
+		if ((res = sendmsg(s->fd, &msg, 0)) < 0)
 			ast_log(LOG_NOTICE, "UDPTL (%s): Transmission error to %s: %s\n",
 				LOG_TAG(s), ast_sockaddr_stringify(&s->them), strerror(errno));
 		if (udptl_debug_test_addr(&s->them))
@@ -173,6 +173,7 @@ struct moh_files_state {
 #define MOH_SORTALPHA		(1 << 4)
 
 #define MOH_CACHERTCLASSES      (1 << 5)        /*!< Should we use a separate instance of MOH for each user or not */
+#define MOH_BROADCAST		(1 << 6)	/*!< Files are decoded once and the audio shared by every listener */
 
 /* Custom astobj2 flag */
 #define MOH_NOTDELETED          (1 << 30)       /*!< Find only records that aren't deleted? */
@@ -191,6 +192,8 @@ struct mohclass {
 	int allowed_files;
 	/*! The current number of files loaded into the filearray */
 	int total_files;
+	/*! The extension each file in the filearray was found with */
+	char **extarray;
 	unsigned int flags;
 	/*! The format from the MOH source, not applicable to "files" mode */
 	struct ast_format format;
@@ -207,6 +210,8 @@ struct mohclass {
 	unsigned int delete:1;
 	AST_LIST_HEAD_NOLOCK(, mohdata) members;
 	AST_LIST_ENTRY(mohclass) list;
+	/*! Shared playback of a "files" class with broadcast set */
+	struct moh_broadcast *broadcast;
 };
 
 struct mohdata {
@@ -507,6 +512,499 @@ static struct ast_generator moh_file_stream =
 	.write_format_change = moh_files_write_format_change,
 };
 
+/*
+ * Broadcast "files" classes
+ *
+ * Instead of every channel on hold opening the class' files and translating
+ * them itself, one thread per class reads the playlist in real time and
+ * decodes it to signed linear once. Each tick it encodes that audio once
+ * for every codec someone is listening in, into a short ring of frames per
+ * codec. The channels' generators copy the newest frames of their codec from
+ * there, so a channel joins wherever the class is in the playlist and does
+ * no file I/O or translation of its own.
+ */
+
+/*! Audio broadcast per tick, in milliseconds */
+#define MOH_BROADCAST_MS	20
+/*! Signed linear samples broadcast per tick */
+#define MOH_BROADCAST_SAMPLES	(8 * MOH_BROADCAST_MS)
+/*! Frames of each codec kept for listeners to catch up on */
+#define MOH_BROADCAST_FRAMES	8
+/*! Seconds to wait before rescanning a playlist none of whose files could be played */
+#define MOH_BROADCAST_RETRY	5
+
+/*! \brief The frames of a broadcast in one codec */
+struct moh_broadcast_stream {
+	struct ast_format format;
+	/*! Encodes signed linear into the format, NULL for signed linear */
+	struct ast_trans_pvt *encoder;
+	struct ast_frame *frames[MOH_BROADCAST_FRAMES];
+	/*! Frames ever broadcast in this codec */
+	unsigned int head;
+	int listeners;
+	AST_LIST_ENTRY(moh_broadcast_stream) list;
+};
+
+/*!
+ * \brief Broadcast state of a class
+ * \note The streams are protected by the class lock. The rest belongs to the
+ * broadcast thread.
+ */
+struct moh_broadcast {
+	AST_LIST_HEAD_NOLOCK(, moh_broadcast_stream) streams;
+	struct ast_filestream *fs;
+	/*! Position of the file being played in the filearray */
+	int pos;
+	/*! Decodes the file being played to signed linear */
+	struct ast_trans_pvt *decoder;
+	struct ast_format decoder_format;
+	/*! Decoded audio not broadcast yet, grown to fit the largest frame a file gives */
+	int16_t *buf;
+	int buf_len;
+	int samples;
+	/*! Set while no file of the playlist plays, until the playlist is rescanned */
+	struct timeval retry;
+};
+
+/*! \brief A channel listening to a broadcast */
+struct moh_listener {
+	struct mohclass *class;
+	struct moh_broadcast_stream *stream;
+	/*! Frames of the stream played so far */
+	unsigned int pos;
+	struct ast_format origwfmt;
+};
+
+static void moh_broadcast_stream_destroy(struct moh_broadcast_stream *stream)
+{
+	int i;
+
+	for (i = 0; i < MOH_BROADCAST_FRAMES; i++) {
+		if (stream->frames[i]) {
+			ast_frfree(stream->frames[i]);
+		}
+	}
+	if (stream->encoder) {
+		ast_translator_free_path(stream->encoder);
+	}
+	ast_free(stream);
+}
+
+/*!
+ * \brief Find or create the stream of a broadcast in a codec
+ * \note The class must be locked.
+ */
+static struct moh_broadcast_stream *moh_broadcast_stream_get(struct moh_broadcast *bcast, struct ast_format *format)
+{
+	struct moh_broadcast_stream *stream;
+	struct ast_format slin;
+
+	AST_LIST_TRAVERSE(&bcast->streams, stream, list) {
+		if (ast_format_cmp(&stream->format, format) != AST_FORMAT_CMP_NOT_EQUAL) {
+			return stream;
+		}
+	}
+
+	if (!(stream = ast_calloc(1, sizeof(*stream)))) {
+		return NULL;
+	}
+	ast_format_copy(&stream->format, format);
+	ast_format_set(&slin, AST_FORMAT_SLINEAR, 0);
+	if (ast_format_cmp(format, &slin) == AST_FORMAT_CMP_NOT_EQUAL &&
+		!(stream->encoder = ast_translator_build_path(format, &slin))) {
+		ast_free(stream);
+		return NULL;
+	}
+	AST_LIST_INSERT_TAIL(&bcast->streams, stream, list);
+
+	return stream;
+}
+
+/*! \brief Open the next file of the playlist for broadcasting */
+static int moh_broadcast_open_next(struct mohclass *class, struct moh_broadcast *bcast, int quiet)
+{
+	char name[PATH_MAX], ext[32];
+	int tries;
+
+	if (bcast->fs) {
+		ast_closestream(bcast->fs);
+		bcast->fs = NULL;
+	}
+
+	for (tries = 0; ; tries++) {
+		ao2_lock(class);
+		if (tries >= class->total_files) {
+			ao2_unlock(class);
+			return -1;
+		}
+		if (ast_test_flag(class, MOH_RANDOMIZE)) {
+			bcast->pos = ast_random() % class->total_files;
+		} else {
+			bcast->pos = (bcast->pos + 1) % class->total_files;
+		}
+		ast_copy_string(name, class->filearray[bcast->pos], sizeof(name));
+		ast_copy_string(ext, class->extarray[bcast->pos], sizeof(ext));
+		ao2_unlock(class);
+
+		if ((bcast->fs = ast_readfile(name, ext, NULL, O_RDONLY, 0, 0))) {
+			ast_debug(1, "Broadcasting file %d '%s' of class '%s'\n", bcast->pos, name, class->name);
+			return 0;
+		}
+		if (quiet) {
+			ast_debug(1, "Unable to open file '%s.%s': %s\n", name, ext, strerror(errno));
+		} else {
+			ast_log(LOG_WARNING, "Unable to open file '%s.%s': %s\n", name, ext, strerror(errno));
+		}
+	}
+}
+
+/*! \brief Decode at least a tick of the playlist into the broadcast buffer */
+static int moh_broadcast_decode(struct mohclass *class, struct moh_broadcast *bcast)
+{
+	int opened = 0;
+	int failing = !ast_tvzero(bcast->retry);
+
+	if (failing && ast_tvdiff_ms(bcast->retry, ast_tvnow()) > 0) {
+		return -1;
+	}
+
+	while (bcast->samples < MOH_BROADCAST_SAMPLES) {
+		struct ast_frame *f, *out;
+		int samples;
+
+		if (!bcast->fs || !(f = ast_readframe(bcast->fs))) {
+			/* Back off if no file in the playlist gives any audio, warning only the first time */
+			if (opened++ > class->total_files || moh_broadcast_open_next(class, bcast, failing)) {
+				if (!failing) {
+					ast_log(LOG_WARNING, "No file of class '%s' can be played, retrying every %d seconds\n",
+						class->name, MOH_BROADCAST_RETRY);
+				}
+				bcast->retry = ast_tvadd(ast_tvnow(), ast_samp2tv(MOH_BROADCAST_RETRY, 1));
+				return -1;
+			}
+			continue;
+		}
+
+		if (f->frametype != AST_FRAME_VOICE) {
+			ast_frfree(f);
+			continue;
+		}
+		if (f->subclass.format.id == AST_FORMAT_SLINEAR) {
+			out = f;
+		} else {
+			if (ast_format_cmp(&f->subclass.format, &bcast->decoder_format) == AST_FORMAT_CMP_NOT_EQUAL) {
+				struct ast_format slin;
+
+				if (bcast->decoder) {
+					ast_translator_free_path(bcast->decoder);
+				}
+				ast_format_clear(&bcast->decoder_format);
+				if (!(bcast->decoder = ast_translator_build_path(ast_format_set(&slin, AST_FORMAT_SLINEAR, 0), &f->subclass.format))) {
+					ast_log(LOG_WARNING, "Unable to translate %s to signed linear for class '%s'\n",
+						ast_getformatname(&f->subclass.format), class->name);
+					ast_frfree(f);
+					ast_closestream(bcast->fs);
+					bcast->fs = NULL;
+					continue;
+				}
+				ast_format_copy(&bcast->decoder_format, &f->subclass.format);
+			}
+			out = ast_translate(bcast->decoder, f, 0);
+		}
+
+		if (out && (samples = out->datalen / (int) sizeof(int16_t)) > 0) {
+			if (bcast->samples + samples > bcast->buf_len) {
+				int16_t *buf;
+
+				/* Whatever does not fit in this tick is carried over to the next ones */
+				if (!(buf = ast_realloc(bcast->buf, (bcast->samples + samples) * sizeof(int16_t)))) {
+					ast_frfree(f);
+					return -1;
+				}
+				bcast->buf = buf;
+				bcast->buf_len = bcast->samples + samples;
+			}
+			memcpy(bcast->buf + bcast->samples, out->data.ptr, samples * sizeof(int16_t));
+			bcast->samples += samples;
+			if (failing) {
+				ast_log(LOG_NOTICE, "Class '%s' is playing again\n", class->name);
+				bcast->retry = ast_tv(0, 0);
+				failing = 0;
+			}
+		}
+		ast_frfree(f);
+	}
+
+	return 0;
+}
+
+/*!
+ * \brief Encode a tick of the broadcast buffer for every stream of the class
+ * \note The class must be locked.
+ */
+static void moh_broadcast_publish(struct moh_broadcast *bcast)
+{
+	struct moh_broadcast_stream *stream;
+	struct ast_frame slin = {
+		.frametype = AST_FRAME_VOICE,
+		.data.ptr = bcast->buf,
+		.datalen = MOH_BROADCAST_SAMPLES * sizeof(int16_t),
+		.samples = MOH_BROADCAST_SAMPLES,
+		.src = "MusicOnHold",
+	};
+
+	ast_format_set(&slin.subclass.format, AST_FORMAT_SLINEAR, 0);
+	AST_LIST_TRAVERSE(&bcast->streams, stream, list) {
+		struct ast_frame *f = stream->encoder ? ast_translate(stream->encoder, &slin, 0) : &slin;
+		struct ast_frame **slot = &stream->frames[stream->head % MOH_BROADCAST_FRAMES];
+
+		/* Codecs with longer frames than a tick have nothing some ticks */
+		if (!f) {
+			continue;
+		}
+		if (*slot) {
+			ast_frfree(*slot);
+		}
+		if ((*slot = ast_frdup(f))) {
+			stream->head++;
+		}
+	}
+
+	bcast->samples -= MOH_BROADCAST_SAMPLES;
+	memmove(bcast->buf, bcast->buf + MOH_BROADCAST_SAMPLES, bcast->samples * sizeof(int16_t));
+}
+
+static void *moh_broadcast_thread(void *data)
+{
+	struct mohclass *class = data;
+	struct moh_broadcast *bcast = class->broadcast;
+	struct timeval deadline = { 0, };
+	int listening;
+
+	/* The class destructor cancels us, which must only happen between ticks */
+	pthread_setcancelstate(PTHREAD_CANCEL_DISABLE, NULL);
+	for (;;) {
+		pthread_setcancelstate(PTHREAD_CANCEL_ENABLE, NULL);
+		pthread_testcancel();
+		pthread_setcancelstate(PTHREAD_CANCEL_DISABLE, NULL);
+
+		if (class->timer) {
+			struct pollfd pfd = { .fd = ast_timer_fd(class->timer), .events = POLLIN | POLLPRI, };
+
+			if (ast_poll(&pfd, 1, MOH_BROADCAST_MS * 2) > 0 && ast_timer_ack(class->timer, 1) < 0) {
+				ast_log(LOG_ERROR, "Failed to acknowledge timer for broadcasting class '%s'\n", class->name);
+				return NULL;
+			}
+		} else {
+			struct timeval now = ast_tvnow();
+			long delta;
+
+			/* Reliable sleep */
+			if (ast_tvzero(deadline)) {
+				deadline = now;
+			}
+			deadline = ast_tvadd(deadline, ast_samp2tv(MOH_BROADCAST_MS, 1000));
+			if ((delta = ast_tvdiff_ms(deadline, now)) > 0) {
+				usleep(1000 * delta);
+			} else if (delta < -MOH_BROADCAST_MS * 10) {
+				/* Too far behind to catch up, carry on from now */
+				deadline = now;
+			}
+		}
+
+		ao2_lock(class);
+		listening = !AST_LIST_EMPTY(&bcast->streams);
+		ao2_unlock(class);
+
+		/* The playlist stands still while nobody is listening */
+		if (!listening || moh_broadcast_decode(class, bcast)) {
+			continue;
+		}
+
+		ao2_lock(class);
+		moh_broadcast_publish(bcast);
+		ao2_unlock(class);
+	}
+
+	return NULL;
+}
+
+/*! \brief Start broadcasting a "files" class */
+static int moh_broadcast_start(struct mohclass *class)
+{
+	if (!(class->broadcast = ast_calloc(1, sizeof(*class->broadcast)))) {
+		return -1;
+	}
+	AST_LIST_HEAD_INIT_NOLOCK(&class->broadcast->streams);
+	class->broadcast->pos = -1;
+
+	if (!(class->timer = ast_timer_open())) {
+		ast_log(LOG_WARNING, "Unable to create timer: %s\n", strerror(errno));
+	}
+	if (class->timer && ast_timer_set_rate(class->timer, 1000 / MOH_BROADCAST_MS)) {
+		ast_log(LOG_WARNING, "Unable to set %dms frame rate: %s\n", MOH_BROADCAST_MS, strerror(errno));
+		ast_timer_close(class->timer);
+		class->timer = NULL;
+	}
+
+	if (ast_pthread_create_background(&class->thread, NULL, moh_broadcast_thread, class)) {
+		ast_log(LOG_WARNING, "Unable to create moh broadcast thread...\n");
+		if (class->timer) {
+			ast_timer_close(class->timer);
+			class->timer = NULL;
+		}
+		ast_free(class->broadcast);
+		class->broadcast = NULL;
+		return -1;
+	}
+
+	return 0;
+}
+
+/*! \brief Stop broadcasting a class, once its thread has exited */
+static void moh_broadcast_destroy(struct moh_broadcast *bcast)
+{
+	struct moh_broadcast_stream *stream;
+
+	while ((stream = AST_LIST_REMOVE_HEAD(&bcast->streams, list))) {
+		moh_broadcast_stream_destroy(stream);
+	}
+	if (bcast->fs) {
+		ast_closestream(bcast->fs);
+	}
+	if (bcast->decoder) {
+		ast_translator_free_path(bcast->decoder);
+	}
+	ast_free(bcast->buf);
+	ast_free(bcast);
+}
+
+static void moh_broadcast_release(struct ast_channel *chan, void *data)
+{
+	struct moh_listener *listener = data;
+	struct mohclass *class = listener->class;
+	struct ast_format oldwfmt;
+
+	ao2_lock(class);
+	if (listener->stream && !--listener->stream->listeners) {
+		AST_LIST_REMOVE(&class->broadcast->streams, listener->stream, list);
+		moh_broadcast_stream_destroy(listener->stream);
+	}
+	ao2_unlock(class);
+
+	ast_format_copy(&oldwfmt, &listener->origwfmt);
+	listener->class = mohclass_unref(class, "unreffing listener's class upon deactivation of generator");
+	ast_free(listener);
+
+	if (chan) {
+		struct moh_files_state *state = chan->music_state;
+
+		if (state && state->class) {
+			state->class = mohclass_unref(state->class, "Unreffing channel's music class upon deactivation of generator");
+		}
+		if (oldwfmt.id && ast_set_write_format(chan, &oldwfmt)) {
+			ast_log(LOG_WARNING, "Unable to restore channel '%s' to format %s\n",
+					chan->name, ast_getformatname(&oldwfmt));
+		}
+
+		ast_verb(3, "Stopped music on hold on %s\n", chan->name);
+	}
+}
+
+static void *moh_broadcast_alloc(struct ast_channel *chan, void *params)
+{
+	struct mohclass *class = params;
+	struct moh_files_state *state;
+	struct moh_listener *listener;
+	struct ast_format format;
+
+	/* Initiating music_state for current channel. Channel should know name of moh class */
+	if (!chan->music_state && (state = ast_calloc(1, sizeof(*state)))) {
+		chan->music_state = state;
+		ast_module_ref(ast_module_info->self);
+	} else {
+		state = chan->music_state;
+		if (!state) {
+			return NULL;
+		}
+		if (state->class) {
+			mohclass_unref(state->class, "Uh Oh. Restarting MOH with an active class");
+			ast_log(LOG_WARNING, "Uh Oh. Restarting MOH with an active class\n");
+		}
+		memset(state, 0, sizeof(*state));
+	}
+
+	if (!(listener = ast_calloc(1, sizeof(*listener)))) {
+		return NULL;
+	}
+	listener->class = mohclass_ref(class, "Reffing music class for broadcast listener");
+	ast_format_copy(&listener->origwfmt, &chan->writeformat);
+
+	/* Listen in the codec the channel sends, so nothing is translated for it alone */
+	ast_format_copy(&format, &chan->rawwriteformat);
+	ao2_lock(class);
+	if (!(listener->stream = moh_broadcast_stream_get(class->broadcast, &format))) {
+		ast_format_set(&format, AST_FORMAT_SLINEAR, 0);
+		listener->stream = moh_broadcast_stream_get(class->broadcast, &format);
+	}
+	if (listener->stream) {
+		listener->stream->listeners++;
+		listener->pos = listener->stream->head;
+	}
+	ao2_unlock(class);
+
+	if (!listener->stream || ast_set_write_format(chan, &format)) {
+		ast_log(LOG_WARNING, "Unable to set channel '%s' to format '%s'\n", chan->name, ast_getformatname(&format));
+		moh_broadcast_release(NULL, listener);
+		return NULL;
+	}
+	state->class = mohclass_ref(class, "Placing reference into state container");
+
+	ast_verb(3, "Started music on hold, class '%s', on channel '%s'\n", class->name, chan->name);
+
+	return listener;
+}
+
+static int moh_broadcast_generate(struct ast_channel *chan, void *data, int len, int samples)
+{
+	struct moh_listener *listener = data;
+	struct moh_broadcast_stream *stream = listener->stream;
+	struct ast_frame *frames[MOH_BROADCAST_FRAMES];
+	int count = 0, i, res = 0;
+
+	ao2_lock(listener->class);
+	if (stream->head - listener->pos > MOH_BROADCAST_FRAMES / 2) {
+		/* Fell behind, keep up with everyone else */
+		listener->pos = stream->head - 1;
+	}
+	/* The channel may change what it writes, so it gets copies */
+	while (listener->pos != stream->head) {
+		struct ast_frame *f = stream->frames[listener->pos++ % MOH_BROADCAST_FRAMES];
+
+		if (f && (frames[count] = ast_frdup(f))) {
+			count++;
+		}
+	}
+	ao2_unlock(listener->class);
+
+	for (i = 0; i < count; i++) {
+		if (!res && ast_write(chan, frames[i]) < 0) {
+			ast_log(LOG_WARNING, "Failed to write frame to '%s': %s\n", chan->name, strerror(errno));
+			res = -1;
+		}
+		ast_frfree(frames[i]);
+	}
+
+	return res;
+}
+
+static struct ast_generator moh_broadcast_gen = {
+	.alloc    = moh_broadcast_alloc,
+	.release  = moh_broadcast_release,
+	.generate = moh_broadcast_generate,
+	.digit    = moh_handle_digit,
+};
+
 static int spawn_mp3(struct mohclass *class)
 {
 	int fds[2];
@@ -1031,14 +1529,20 @@ static struct ast_generator mohgen = {
 	.digit    = moh_handle_digit,
 };
 
-static int moh_add_file(struct mohclass *class, const char *filepath)
+static int moh_add_file(struct mohclass *class, const char *filepath, const char *ext)
 {
 	if (!class->allowed_files) {
 		if (!(class->filearray = ast_calloc(1, INITIAL_NUM_FILES * sizeof(*class->filearray))))
 			return -1;
+		if (!(class->extarray = ast_calloc(1, INITIAL_NUM_FILES * sizeof(*class->extarray)))) {
+			ast_free(class->filearray);
+			class->filearray = NULL;
+			return -1;
+		}
 		class->allowed_files = INITIAL_NUM_FILES;
 	} else if (class->total_files == class->allowed_files) {
-		if (!(class->filearray = ast_realloc(class->filearray, class->allowed_files * sizeof(*class->filearray) * 2))) {
+		if (!(class->filearray = ast_realloc(class->filearray, class->allowed_files * sizeof(*class->filearray) * 2)) ||
+			!(class->extarray = ast_realloc(class->extarray, class->allowed_files * sizeof(*class->extarray) * 2))) {
 			class->allowed_files = 0;
 			class->total_files = 0;
 			return -1;
@@ -1046,8 +1550,12 @@ static int moh_add_file(struct mohclass *class, const char *filepath)
 		class->allowed_files *= 2;
 	}
 
-	if (!(class->filearray[class->total_files] = ast_strdup(filepath)))
+	if (!(class->extarray[class->total_files] = ast_strdup(ext)))
 		return -1;
+	if (!(class->filearray[class->total_files] = ast_strdup(filepath))) {
+		ast_free(class->extarray[class->total_files]);
+		return -1;
+	}
 
 	class->total_files++;
 
@@ -1089,8 +1597,10 @@ static int moh_scan_files(struct mohclass *class) {
 		return -1;
 	}
 
-	for (i = 0; i < class->total_files; i++)
+	for (i = 0; i < class->total_files; i++) {
 		ast_free(class->filearray[i]);
+		ast_free(class->extarray[i]);
+	}
 
 	class->total_files = 0;
 	if (!getcwd(path, sizeof(path))) {
@@ -1125,7 +1635,7 @@ static int moh_scan_files(struct mohclass *class) {
 			continue;
 
 		if ((ext = strrchr(filepath, '.')))
-			*ext = '\0';
+			*ext++ = '\0';
 
 		/* if the file is present in multiple formats, ensure we only put it into the list once */
 		for (i = 0; i < class->total_files; i++)
@@ -1133,7 +1643,7 @@ static int moh_scan_files(struct mohclass *class) {
 				break;
 
 		if (i == class->total_files) {
-			if (moh_add_file(class, filepath))
+			if (moh_add_file(class, filepath, ext))
 				break;
 		}
 	}
@@ -1173,6 +1683,10 @@ static int init_files_class(struct mohclass *class)
 	}
 #endif
 
+	if (ast_test_flag(class, MOH_BROADCAST) && moh_broadcast_start(class)) {
+		ast_log(LOG_WARNING, "Unable to broadcast class '%s', each channel will play its files\n", class->name);
+	}
+
 	return 0;
 }
 
@@ -1184,7 +1698,10 @@ static void moh_rescan_files(void) {
 
 	while ((c = ao2_iterator_next(&i))) {
 		if (!strcasecmp(c->mode, "files")) {
+			/* A broadcast thread may be picking the next file */
+			ao2_lock(c);
 			moh_scan_files(c);
+			ao2_unlock(c);
 		}
 		ao2_ref(c, -1);
 	}
@@ -1417,6 +1934,8 @@ static int local_ast_moh_start(struct ast_channel *chan, const char *mclass, con
 					ast_set_flag(mohclass, MOH_RANDOMIZE);
 				else if (!strcasecmp(tmp->name, "sort") && !strcasecmp(tmp->value, "alpha")) 
 					ast_set_flag(mohclass, MOH_SORTALPHA);
+				else if (!strcasecmp(tmp->name, "broadcast"))
+					ast_set2_flag(mohclass, ast_true(tmp->value), MOH_BROADCAST);
 				else if (!strcasecmp(tmp->name, "format")) {
 					ast_getformatbyname(tmp->value, &mohclass->format);
 					if (!mohclass->format.id) {
@@ -1557,7 +2076,7 @@ static int local_ast_moh_start(struct ast_channel *chan, const char *mclass, con
 	ast_set_flag(chan, AST_FLAG_MOH);
 
 	if (mohclass->total_files) {
-		res = ast_activate_generator(chan, &moh_file_stream, mohclass);
+		res = ast_activate_generator(chan, mohclass->broadcast ? &moh_broadcast_gen : &moh_file_stream, mohclass);
 	} else {
 		res = ast_activate_generator(chan, &mohgen, mohclass);
 	}
@@ -1656,13 +2175,27 @@ static void moh_class_destructor(void *obj)
 		class->srcfd = -1;
 	}
 
+	/* Finally, collect the exit status of the monitor thread */
+	if (tid > 0) {
+		pthread_join(tid, NULL);
+	}
+
+	/* The broadcast thread reads the files and the timer until it is gone */
+	if (class->broadcast) {
+		moh_broadcast_destroy(class->broadcast);
+		class->broadcast = NULL;
+	}
+
 	if (class->filearray) {
 		int i;
 		for (i = 0; i < class->total_files; i++) {
 			free(class->filearray[i]);
+			ast_free(class->extarray[i]);
 		}
 		free(class->filearray);
+		ast_free(class->extarray);
 		class->filearray = NULL;
+		class->extarray = NULL;
 	}
 
 	if (class->timer) {
@@ -1670,11 +2203,6 @@ static void moh_class_destructor(void *obj)
 		class->timer = NULL;
 	}
 
-	/* Finally, collect the exit status of the monitor thread */
-	if (tid > 0) {
-		pthread_join(tid, NULL);
-	}
-
 }
 
 static int moh_class_mark(void *obj, void *arg, int flags)
@@ -1760,6 +2288,8 @@ static int load_moh_classes(int reload)
 				ast_set_flag(class, MOH_RANDOMIZE);
 			else if (!strcasecmp(var->name, "sort") && !strcasecmp(var->value, "alpha")) 
 				ast_set_flag(class, MOH_SORTALPHA);
+			else if (!strcasecmp(var->name, "broadcast"))
+				ast_set2_flag(class, ast_true(var->value), MOH_BROADCAST);
 			else if (!strcasecmp(var->name, "format")) {
 				ast_getformatbyname(var->value, &class->format);
 				if (!class->format.id) {
@@ -1899,6 +2429,18 @@ static char *handle_cli_moh_show_classes(struct ast_cli_entry *e, int cmd, struc
 		if (strcasecmp(class->mode, "files")) {
 			ast_cli(a->fd, "\tFormat: %s\n", ast_getformatname(&class->format));
 		}
+		if (class->broadcast) {
+			struct moh_broadcast_stream *stream;
+			int listeners = 0, codecs = 0;
+
+			ao2_lock(class);
+			AST_LIST_TRAVERSE(&class->broadcast->streams, stream, list) {
+				listeners += stream->listeners;
+				codecs++;
+			}
+			ao2_unlock(class);
+			ast_cli(a->fd, "\tBroadcast: %d listeners in %d codecs\n", listeners, codecs);
+		}
 	}
 	ao2_iterator_destroy(&i);
 
@@ -39,6 +39,9 @@ ASTERISK_FILE_VERSION(__FILE__, "$Revision: 379887 $")
 #include <sys/time.h>
 #include <signal.h>
 #include <fcntl.h>
+#ifdef HAVE_EPOLL_CREATE1
+#include <sys/epoll.h>
+#endif
 
 #include "asterisk/stun.h"
 #include "asterisk/pbx.h"
@@ -48,11 +51,15 @@ ASTERISK_FILE_VERSION(__FILE__, "$Revision: 379887 $")
 #include "asterisk/config.h"
 #include "asterisk/lock.h"
 #include "asterisk/utils.h"
+#include "asterisk/threadstorage.h"
 #include "asterisk/cli.h"
 #include "asterisk/manager.h"
 #include "asterisk/unaligned.h"
 #include "asterisk/module.h"
 #include "asterisk/rtp_engine.h"
+#include "asterisk/rtp_telemetry.h"
+#include "asterisk/poll-compat.h"
+#include "asterisk/test.h"
 
 #define MAX_TIMESTAMP_SKEW	640
 
@@ -67,6 +74,14 @@ ASTERISK_FILE_VERSION(__FILE__, "$Revision: 379887 $")
 #define MINIMUM_RTP_PORT 1024 /*!< Minimum port number to accept */
 #define MAXIMUM_RTP_PORT 65535 /*!< Maximum port number to accept */
 
+#define RTP_PORT_QUARANTINE_MS 5000 /*!< How long a released RTP port is kept out of circulation */
+
+#define RTP_RELAY_MAX_THREADS 64	/*!< Most relay threads rtp.conf may ask for */
+#define RTP_RELAY_BATCH 32		/*!< Packets a relay thread moves per socket per wakeup */
+#define RTP_RELAY_PKTSIZE 2048		/*!< Largest packet a relay thread will forward */
+#define RTP_RELAY_MAX_PENDING 64	/*!< Packets queued for a channel thread before dropping */
+#define RTP_RELAY_MAX_SPARE 8		/*!< Handed up packet buffers a leg keeps for reuse */
+
 #define RTCP_PT_FUR     192
 #define RTCP_PT_SR      200
 #define RTCP_PT_RR      201
@@ -101,6 +116,29 @@ static int nochecksums;
 static int strictrtp;			/*< Only accept RTP frames from a defined source. If we receive an indication of a changing source, enter learning mode. */
 static int learning_min_sequential;	/*< Number of sequential RTP frames needed from a single source during learning mode to accept new source. */
 
+/*! \brief Pool of RTP/RTCP port pairs
+ *
+ * Each even port in the configured range is a slot.  Free slots sit in a
+ * FIFO, so a port handed back goes to the end of the line and is not reused
+ * until every other free port has been tried or its quarantine has passed.
+ * Allocation takes the head of the FIFO and normally costs a single bind().
+ */
+static struct {
+	int first;			/*!< Lowest even port in the pool */
+	unsigned int slots;		/*!< Number of port pairs in the pool */
+	unsigned int generation;	/*!< Bumped each time the pool is rebuilt */
+	unsigned short *fifo;		/*!< Free slots, oldest release first */
+	unsigned int head;		/*!< Index in fifo of the next slot to hand out */
+	unsigned int count;		/*!< Free slots in fifo */
+	struct timeval *released;	/*!< When each slot was last handed back */
+	unsigned char *inuse;		/*!< Bitmap of slots currently handed out */
+	unsigned int allocated;		/*!< Slots currently handed out */
+	unsigned int bind_failures;	/*!< bind() failures on pool ports, e.g. taken by another process */
+	unsigned int quarantine_overrides;	/*!< Allocations that had to take a quarantined port */
+	unsigned int exhausted;		/*!< Allocations that found no free port at all */
+} port_pool;
+AST_MUTEX_DEFINE_STATIC(port_pool_lock);
+
 enum strict_rtp_state {
 	STRICT_RTP_OPEN = 0, /*! No RTP packets should be dropped, all sources accepted */
 	STRICT_RTP_LEARN,    /*! Accept next packet as source */
@@ -141,6 +179,9 @@ struct ast_rtp {
 	double rxtransit;               /*!< Relative transit time for previous packet */
 	struct ast_format lasttxformat;
 	struct ast_format lastrxformat;
+	/*! Telemetry codec keys of the received and the sent stream, and the formats they are for */
+	struct ast_rtp_telemetry_key *telemetry_codec[2];
+	enum ast_format_id telemetry_codec_id[2];
 
 	int rtptimeout;			/*!< RTP timeout time (negative or zero means disabled, negative value means temporarily disabled) */
 	int rtpholdtimeout;		/*!< RTP timeout when on hold (negative or zero means disabled, negative value means temporarily disabled). */
@@ -188,6 +229,14 @@ struct ast_rtp {
 	int learning_probation;		/*!< Sequential packets untill source is valid */
 
 	struct rtp_red *red;
+
+	int port;			/*!< Port taken from the port pool, 0 if none */
+	unsigned int port_generation;	/*!< Port pool generation the port came from */
+
+	struct rtp_relay_leg *relay;	/*!< Set while a relay thread owns our socket */
+
+	unsigned int txhdr[2];		/*!< First and last RTP header words, in network order, for txhdr_codec; the timestamp is written per packet */
+	int txhdr_codec;		/*!< Payload type txhdr was built for, -1 if it must be rebuilt */
 };
 
 /*!
@@ -268,7 +317,134 @@ struct rtp_red {
 
 AST_LIST_HEAD_NOLOCK(frame_list, ast_frame);
 
+/*! \brief A packet the relay could not forward, waiting for the channel thread */
+struct rtp_relay_pkt {
+	AST_LIST_ENTRY(rtp_relay_pkt) next;
+	struct ast_sockaddr addr;
+	int len;
+	unsigned char data[0];
+};
+
+/*! \brief A p2p bridged RTP instance whose socket is serviced by a relay thread
+ *
+ * While relayed, the fd number the channel polls (rtp->s) is pointed at the
+ * read end of a pipe with dup2(), so the channel thread sleeps until the
+ * relay hands it a packet it cannot forward on its own: STUN, packets from an
+ * unexpected source, or a payload the other side did not negotiate.  The
+ * real socket lives on in sock for the relay and for anything the channel
+ * sends, sets options on or runs STUN over.
+ *
+ * The strict RTP state of the instance is read by the relay and written by
+ * the channel thread, both with the instance locked.  The pending marker bit
+ * moves from the instance's flags to need_marker for as long as the leg
+ * exists, so the relay thread never writes the instance's flags.
+ */
+struct rtp_relay_leg {
+	struct ast_rtp_instance *instance;	/*!< Instance the packets arrive on */
+	struct ast_rtp_instance *peer;		/*!< Instance the packets leave from (reffed) */
+	struct rtp_relay_thread *thread;	/*!< Thread servicing this leg */
+	int sock;				/*!< The instance's real RTP socket */
+	int wake[2];				/*!< Pipe standing in for the socket in the channel's poll set */
+	unsigned int need_marker:1;		/*!< FLAG_NEED_MARKER_BIT, protected by the instance lock */
+	ast_mutex_t lock;			/*!< Protects pending and npending */
+	AST_LIST_HEAD_NOLOCK(, rtp_relay_pkt) pending;
+	unsigned int npending;
+	AST_LIST_HEAD_NOLOCK(, rtp_relay_pkt) spare;	/*!< Buffers of RTP_RELAY_PKTSIZE kept for reuse */
+	unsigned int nspare;
+};
+
+/*! \brief A relay thread and the legs it services
+ *
+ * The leg list is changed only with relay_lock held for writing; the thread
+ * itself holds it for reading while it touches any leg.  Where epoll is
+ * available every leg's socket is registered with the thread's epoll set,
+ * carrying the leg, so a wakeup only visits the legs that are ready.
+ */
+struct rtp_relay_thread {
+	pthread_t id;
+	int wake[2];			/*!< Written to when the leg list changes */
+#ifdef HAVE_EPOLL_CREATE1
+	int epfd;			/*!< Legs' sockets and the wake pipe */
+#endif
+	struct rtp_relay_leg **legs;
+	unsigned int count;
+	unsigned int alloc;
+	unsigned int generation;	/*!< Bumped whenever legs changes */
+	unsigned int stop:1;
+	unsigned int relayed;		/*!< Packets forwarded */
+	unsigned int handed_up;		/*!< Packets passed to a channel thread */
+	unsigned int dropped;		/*!< Packets dropped */
+	unsigned char bufs[RTP_RELAY_BATCH][RTP_RELAY_PKTSIZE];
+};
+
+static struct rtp_relay_thread *relay_threads;
+static int relay_thread_count;
+static int relaythreads;		/*!< Relay threads requested in rtp.conf */
+AST_RWLOCK_DEFINE_STATIC(relay_lock);
+
+/*! \brief Per thread packet buffer for frames without room in front for the RTP header */
+struct rtp_txbuf {
+	unsigned char data[AST_FRIENDLY_OFFSET + 8192];
+};
+
+AST_THREADSTORAGE(rtp_txbuf);
+
+/*! \brief The socket RTP for this instance is actually sent and received on */
+static int rtp_socket(struct ast_rtp *rtp)
+{
+	return rtp->relay ? rtp->relay->sock : rtp->s;
+}
+
+/*! \brief Have the next packet sent or relayed for this instance carry the marker bit */
+static void rtp_need_marker_bit(struct ast_rtp_instance *instance)
+{
+	struct ast_rtp *rtp = ast_rtp_instance_get_data(instance);
+
+	ao2_lock(instance);
+	if (rtp->relay) {
+		rtp->relay->need_marker = 1;
+	} else {
+		ast_set_flag(rtp, FLAG_NEED_MARKER_BIT);
+	}
+	ao2_unlock(instance);
+}
+
+/*! \brief Read a packet the relay queued for the channel thread */
+static int rtp_relay_recv(struct rtp_relay_leg *leg, void *buf, size_t size, struct ast_sockaddr *sa)
+{
+	struct rtp_relay_pkt *pkt;
+	int len;
+	char c;
+
+	ast_mutex_lock(&leg->lock);
+	if (!(pkt = AST_LIST_REMOVE_HEAD(&leg->pending, next))) {
+		ast_mutex_unlock(&leg->lock);
+		errno = EAGAIN;
+		return -1;
+	}
+	leg->npending--;
+	/* One byte was written to the pipe per queued packet */
+	if (read(leg->wake[0], &c, 1) < 0) {
+		ast_debug(1, "Unable to drain RTP relay wakeup: %s\n", strerror(errno));
+	}
+
+	len = MIN(pkt->len, size);
+	memcpy(buf, pkt->data, len);
+	ast_sockaddr_copy(sa, &pkt->addr);
+
+	if (leg->nspare < RTP_RELAY_MAX_SPARE) {
+		AST_LIST_INSERT_HEAD(&leg->spare, pkt, next);
+		leg->nspare++;
+		pkt = NULL;
+	}
+	ast_mutex_unlock(&leg->lock);
+	ast_free(pkt);
+
+	return len;
+}
+
 /* Forward Declarations */
+static void rtp_relay_stop(struct ast_rtp_instance *instance);
 static int ast_rtp_new(struct ast_rtp_instance *instance, struct ast_sched_context *sched, struct ast_sockaddr *addr, void *data);
 static int ast_rtp_destroy(struct ast_rtp_instance *instance);
 static int ast_rtp_dtmf_begin(struct ast_rtp_instance *instance, char digit);
@@ -361,11 +537,17 @@ static int __rtp_recvfrom(struct ast_rtp_instance *instance, void *buf, size_t s
 	struct ast_rtp *rtp = ast_rtp_instance_get_data(instance);
 	struct ast_srtp *srtp = ast_rtp_instance_get_srtp(instance);
 
-	if ((len = ast_recvfrom(rtcp ? rtp->rtcp->s : rtp->s, buf, size, flags, sa)) < 0) {
+	if (!rtcp && rtp->relay) {
+		len = rtp_relay_recv(rtp->relay, buf, size, sa);
+	} else {
+		len = ast_recvfrom(rtcp ? rtp->rtcp->s : rtp->s, buf, size, flags, sa);
+	}
+	if (len < 0) {
 	   return len;
 	}
 
-	if (res_srtp && srtp && res_srtp->unprotect(srtp, buf, &len, rtcp) < 0) {
+	/* Packets queued by a relay thread were unprotected when it read them */
+	if (res_srtp && srtp && (rtcp || !rtp->relay) && res_srtp->unprotect(srtp, buf, &len, rtcp) < 0) {
 	   return -1;
 	}
 
@@ -393,7 +575,7 @@ static int __rtp_sendto(struct ast_rtp_instance *instance, void *buf, size_t siz
 	   return -1;
 	}
 
-	return ast_sendto(rtcp ? rtp->rtcp->s : rtp->s, temp, len, flags, sa);
+	return ast_sendto(rtcp ? rtp->rtcp->s : rtp_socket(rtp), temp, len, flags, sa);
 }
 
 static int rtcp_sendto(struct ast_rtp_instance *instance, void *buf, size_t size, int flags, struct ast_sockaddr *sa)
@@ -515,12 +697,127 @@ static int rtp_learning_rtp_seq_update(struct ast_rtp *rtp, uint16_t seq)
 	return probation;
 }
 
+/*! \brief Build the port pool for the range [start, end], dropping any old one
+ *
+ * Ports handed out from an older pool are simply forgotten when returned.
+ */
+static void rtp_port_pool_build(int start, int end)
+{
+	unsigned short *fifo;
+	struct timeval *released;
+	unsigned char *inuse;
+	int first = (start + 1) & ~1;
+	unsigned int slots = (end >= first) ? ((end - first) / 2 + 1) : 0;
+	unsigned int x;
+
+	fifo = ast_calloc(slots ? slots : 1, sizeof(*fifo));
+	released = ast_calloc(slots ? slots : 1, sizeof(*released));
+	inuse = ast_calloc(slots / 8 + 1, 1);
+	if (!fifo || !released || !inuse) {
+		ast_free(fifo);
+		ast_free(released);
+		ast_free(inuse);
+		return;
+	}
+
+	/* Shuffle so consecutive calls do not get predictable ports */
+	for (x = 0; x < slots; x++) {
+		unsigned int y = ast_random() % (x + 1);
+
+		fifo[x] = fifo[y];
+		fifo[y] = x;
+	}
+
+	ast_mutex_lock(&port_pool_lock);
+	ast_free(port_pool.fifo);
+	ast_free(port_pool.released);
+	ast_free(port_pool.inuse);
+	port_pool.first = first;
+	port_pool.slots = slots;
+	port_pool.generation++;
+	port_pool.fifo = fifo;
+	port_pool.head = 0;
+	port_pool.count = slots;
+	port_pool.released = released;
+	port_pool.inuse = inuse;
+	port_pool.allocated = 0;
+	ast_mutex_unlock(&port_pool_lock);
+}
+
+static void rtp_port_pool_destroy(void)
+{
+	ast_mutex_lock(&port_pool_lock);
+	ast_free(port_pool.fifo);
+	ast_free(port_pool.released);
+	ast_free(port_pool.inuse);
+	memset(&port_pool, 0, sizeof(port_pool));
+	ast_mutex_unlock(&port_pool_lock);
+}
+
+/*! \brief Take the next free port pair from the pool
+ *
+ * \param generation Set to the pool generation the port belongs to
+ *
+ * \return The even (RTP) port, or -1 if the pool is empty
+ */
+static int rtp_port_get(unsigned int *generation)
+{
+	unsigned int slot;
+	int port;
+
+	ast_mutex_lock(&port_pool_lock);
+	if (!port_pool.count) {
+		port_pool.exhausted++;
+		ast_mutex_unlock(&port_pool_lock);
+		return -1;
+	}
+	slot = port_pool.fifo[port_pool.head];
+	port_pool.head = (port_pool.head + 1) % port_pool.slots;
+	port_pool.count--;
+	if (!ast_tvzero(port_pool.released[slot])
+		&& ast_tvdiff_ms(ast_tvnow(), port_pool.released[slot]) < RTP_PORT_QUARANTINE_MS) {
+		/* Every free port was released recently; better to reuse one than fail the call */
+		port_pool.quarantine_overrides++;
+	}
+	port_pool.inuse[slot / 8] |= 1 << (slot % 8);
+	port_pool.allocated++;
+	*generation = port_pool.generation;
+	port = port_pool.first + slot * 2;
+	ast_mutex_unlock(&port_pool_lock);
+
+	return port;
+}
+
+/*! \brief Hand a port pair back to the pool, behind every other free port */
+static void rtp_port_put(int port, unsigned int generation)
+{
+	unsigned int slot;
+
+	ast_mutex_lock(&port_pool_lock);
+	if (generation != port_pool.generation || port < port_pool.first) {
+		ast_mutex_unlock(&port_pool_lock);
+		return;
+	}
+	slot = (port - port_pool.first) / 2;
+	if (slot >= port_pool.slots || !(port_pool.inuse[slot / 8] & (1 << (slot % 8)))) {
+		ast_mutex_unlock(&port_pool_lock);
+		return;
+	}
+	port_pool.inuse[slot / 8] &= ~(1 << (slot % 8));
+	port_pool.allocated--;
+	port_pool.released[slot] = ast_tvnow();
+	port_pool.fifo[(port_pool.head + port_pool.count) % port_pool.slots] = slot;
+	port_pool.count++;
+	ast_mutex_unlock(&port_pool_lock);
+}
+
 static int ast_rtp_new(struct ast_rtp_instance *instance,
 		       struct ast_sched_context *sched, struct ast_sockaddr *addr,
 		       void *data)
 {
 	struct ast_rtp *rtp = NULL;
-	int x, startplace;
+	unsigned int generation, tries;
+	int x;
 
 	/* Create a new RTP structure to hold all of our data */
 	if (!(rtp = ast_calloc(1, sizeof(*rtp)))) {
@@ -529,6 +826,7 @@ static int ast_rtp_new(struct ast_rtp_instance *instance,
 
 	/* Set default parameters on the newly created RTP structure */
 	rtp->ssrc = ast_random();
+	rtp->txhdr_codec = -1;
 	rtp->seqno = ast_random() & 0xffff;
 	rtp->strict_rtp_state = (strictrtp ? STRICT_RTP_LEARN : STRICT_RTP_OPEN);
 	if (strictrtp) {
@@ -546,26 +844,35 @@ static int ast_rtp_new(struct ast_rtp_instance *instance,
 	}
 
 	/* Now actually find a free RTP port to use */
-	x = (rtpend == rtpstart) ? rtpstart : (ast_random() % (rtpend - rtpstart)) + rtpstart;
-	x = x & ~1;
-	startplace = x;
+	for (tries = 0; ; tries++) {
+		int bind_errno;
+
+		if ((x = rtp_port_get(&generation)) < 0) {
+			ast_log(LOG_ERROR, "Oh dear... we couldn't allocate a port for RTP instance '%p'\n", instance);
+			close(rtp->s);
+			ast_free(rtp);
+			return -1;
+		}
 
-	for (;;) {
 		ast_sockaddr_set_port(addr, x);
 		/* Try to bind, this will tell us whether the port is available or not */
 		if (!ast_bind(rtp->s, addr)) {
 			ast_debug(1, "Allocated port %d for RTP instance '%p'\n", x, instance);
 			ast_rtp_instance_set_local_address(instance, addr);
+			rtp->port = x;
+			rtp->port_generation = generation;
 			break;
 		}
 
-		x += 2;
-		if (x > rtpend) {
-			x = (rtpstart + 1) & ~1;
-		}
+		/* Someone outside of the pool has this port; send it to the back of the line */
+		bind_errno = errno;
+		ast_mutex_lock(&port_pool_lock);
+		port_pool.bind_failures++;
+		ast_mutex_unlock(&port_pool_lock);
+		rtp_port_put(x, generation);
 
 		/* See if we ran out of ports or if the bind actually failed because of something other than the address being in use */
-		if (x == startplace || errno != EADDRINUSE) {
+		if (tries >= port_pool.slots || bind_errno != EADDRINUSE) {
 			ast_log(LOG_ERROR, "Oh dear... we couldn't allocate a port for RTP instance '%p'\n", instance);
 			close(rtp->s);
 			ast_free(rtp);
@@ -586,6 +893,9 @@ static int ast_rtp_destroy(struct ast_rtp_instance *instance)
 {
 	struct ast_rtp *rtp = ast_rtp_instance_get_data(instance);
 
+	/* Take our socket back if a relay thread still has it */
+	rtp_relay_stop(instance);
+
 	/* Destroy the smoother that was smoothing out audio if present */
 	if (rtp->smoother) {
 		ast_smoother_free(rtp->smoother);
@@ -595,6 +905,9 @@ static int ast_rtp_destroy(struct ast_rtp_instance *instance)
 	if (rtp->s > -1) {
 		close(rtp->s);
 	}
+	if (rtp->port) {
+		rtp_port_put(rtp->port, rtp->port_generation);
+	}
 
 	/* Destroy RTCP if it was being used */
 	if (rtp->rtcp) {
@@ -613,6 +926,9 @@ static int ast_rtp_destroy(struct ast_rtp_instance *instance)
 		ast_free(rtp->red);
 	}
 
+	ast_rtp_telemetry_key_release(rtp->telemetry_codec[0]);
+	ast_rtp_telemetry_key_release(rtp->telemetry_codec[1]);
+
 	/* Finally destroy ourselves */
 	ast_free(rtp);
 
@@ -824,10 +1140,8 @@ static int ast_rtp_dtmf_end(struct ast_rtp_instance *instance, char digit)
 
 static void ast_rtp_update_source(struct ast_rtp_instance *instance)
 {
-	struct ast_rtp *rtp = ast_rtp_instance_get_data(instance);
-
 	/* We simply set this bit so that the next packet sent will have the marker bit turned on */
-	ast_set_flag(rtp, FLAG_NEED_MARKER_BIT);
+	rtp_need_marker_bit(instance);
 	ast_debug(3, "Setting the marker bit due to a source update\n");
 
 	return;
@@ -845,7 +1159,7 @@ static void ast_rtp_change_source(struct ast_rtp_instance *instance)
 	}
 
 	/* We simply set this bit so that the next packet sent will have the marker bit turned on */
-	ast_set_flag(rtp, FLAG_NEED_MARKER_BIT);
+	rtp_need_marker_bit(instance);
 
 	ast_debug(3, "Changing ssrc from %u to %u due to a source change\n", rtp->ssrc, ssrc);
 
@@ -855,6 +1169,7 @@ static void ast_rtp_change_source(struct ast_rtp_instance *instance)
 	}
 
 	rtp->ssrc = ssrc;
+	rtp->txhdr_codec = -1;
 
 	return;
 }
@@ -878,6 +1193,35 @@ static unsigned int calc_txstamp(struct ast_rtp *rtp, struct timeval *delivery)
 	return (unsigned int) ms;
 }
 
+/*!
+ * \brief Record an RTCP quality sample with the core telemetry
+ *
+ * \param jitter Interarrival jitter, in ms
+ * \param fraction Fraction lost, as carried in a reception report
+ * \param tx Whether the report describes the stream we send rather than the one we receive
+ *
+ * The codec key is only looked up again when the stream's format changed.
+ */
+static void rtcp_record_telemetry(struct ast_rtp_instance *instance, struct ast_rtp *rtp, double jitter, int fraction, int tx)
+{
+	struct ast_format *format = tx ? &rtp->lasttxformat : &rtp->lastrxformat;
+	struct ast_rtp_telemetry_sample sample = {
+		.jitter = jitter,
+		.loss = (fraction & 0xff) * 100.0 / 256.0,
+		.rtt = rtp->rtcp->rtt_count ? rtp->rtcp->rtt * 1000.0 : -1.0,
+	};
+
+	if (rtp->telemetry_codec_id[tx] != format->id) {
+		ast_rtp_telemetry_key_release(rtp->telemetry_codec[tx]);
+		rtp->telemetry_codec[tx] = format->id ?
+			ast_rtp_telemetry_key_get(AST_RTP_TELEMETRY_CODEC, ast_getformatname(format)) : NULL;
+		rtp->telemetry_codec_id[tx] = format->id;
+	}
+	sample.keys[AST_RTP_TELEMETRY_CODEC] = rtp->telemetry_codec[tx];
+
+	ast_rtp_instance_record_telemetry(instance, &sample);
+}
+
 static void timeval2ntp(struct timeval tv, unsigned int *msw, unsigned int *lsw)
 {
 	unsigned int sec, usec, frac;
@@ -974,6 +1318,9 @@ static int ast_rtcp_write_rr(struct ast_rtp_instance *instance)
 	}
 
 	rtp->rtcp->rr_count++;
+	if (rtp->rxcount) {
+		rtcp_record_telemetry(instance, rtp, rtp->rxjitter * 1000.0, fraction, 0);
+	}
 	if (rtcp_debug_test_addr(&rtp->rtcp->them)) {
 		ast_verbose("\n* Sending RTCP RR to %s\n"
 			"  Our SSRC: %u\nTheir SSRC: %u\niFraction lost: %d\nCumulative loss: %u\n"
@@ -1075,6 +1422,9 @@ static int ast_rtcp_write_sr(struct ast_rtp_instance *instance)
 	/* FIXME Don't need to get a new one */
 	gettimeofday(&rtp->rtcp->txlsr, NULL);
 	rtp->rtcp->sr_count++;
+	if (rtp->rxcount) {
+		rtcp_record_telemetry(instance, rtp, rtp->rxjitter * 1000.0, fraction, 0);
+	}
 
 	rtp->rtcp->lastsrtxcount = rtp->txcount;
 
@@ -1233,9 +1583,15 @@ static int ast_rtp_raw_write(struct ast_rtp_instance *instance, struct ast_frame
 		int hdrlen = 12, res;
 		unsigned char *rtpheader = (unsigned char *)(frame->data.ptr - hdrlen);
 
-		put_unaligned_uint32(rtpheader, htonl((2 << 30) | (codec << 16) | (rtp->seqno) | (mark << 23)));
+		/* Only the sequence number, marker and timestamp change from packet to packet */
+		if (rtp->txhdr_codec != codec) {
+			rtp->txhdr[0] = htonl((2 << 30) | (codec << 16));
+			rtp->txhdr[1] = htonl(rtp->ssrc);
+			rtp->txhdr_codec = codec;
+		}
+		put_unaligned_uint32(rtpheader, rtp->txhdr[0] | htonl(rtp->seqno | (mark << 23)));
 		put_unaligned_uint32(rtpheader + 4, htonl(rtp->lastts));
-		put_unaligned_uint32(rtpheader + 8, htonl(rtp->ssrc));
+		put_unaligned_uint32(rtpheader + 8, rtp->txhdr[1]);
 
 		if ((res = rtp_sendto(instance, (void *)rtpheader, frame->datalen + hdrlen, 0, &remote_address)) < 0) {
 			if (!ast_rtp_instance_get_prop(instance, AST_RTP_PROPERTY_NAT) || (ast_rtp_instance_get_prop(instance, AST_RTP_PROPERTY_NAT) && (ast_test_flag(rtp, FLAG_NAT_ACTIVE) == FLAG_NAT_ACTIVE))) {
@@ -1413,16 +1769,27 @@ static int ast_rtp_write(struct ast_rtp_instance *instance, struct ast_frame *fr
 	} else {
 		int hdrlen = 12;
 		struct ast_frame *f = NULL;
+		struct ast_frame staged;
+		struct rtp_txbuf *txbuf;
 
-		if (frame->offset < hdrlen) {
-			f = ast_frdup(frame);
-		} else {
+		if (frame->offset >= hdrlen) {
 			f = frame;
+		} else if (frame->data.ptr && frame->datalen <= sizeof(txbuf->data) - AST_FRIENDLY_OFFSET &&
+			(txbuf = ast_threadstorage_get(&rtp_txbuf, sizeof(*txbuf)))) {
+			/* Stage the payload behind room for the header instead of duplicating the frame */
+			staged = *frame;
+			staged.mallocd = 0;
+			staged.offset = AST_FRIENDLY_OFFSET;
+			staged.data.ptr = txbuf->data + AST_FRIENDLY_OFFSET;
+			memcpy(staged.data.ptr, frame->data.ptr, frame->datalen);
+			f = &staged;
+		} else {
+			f = ast_frdup(frame);
 		}
-		if (f->data.ptr) {
+		if (f && f->data.ptr) {
 			ast_rtp_raw_write(instance, f, codec);
 		}
-		if (f != frame) {
+		if (f && f != frame && f != &staged) {
 			ast_frfree(f);
 		}
 
@@ -1947,6 +2314,13 @@ static struct ast_frame *ast_rtcp_read(struct ast_rtp_instance *instance)
 
 			rtp->rtcp->reported_jitter_count++;
 
+			/* the far end's view of our stream, in our stream's clock */
+			if (rtp->lasttxformat.id) {
+				rtcp_record_telemetry(instance, rtp,
+					reported_jitter * 1000.0 / rtp_get_rate(&rtp->lasttxformat),
+					ntohl(rtcpheader[i + 1]) >> 24, 1);
+			}
+
 			if (rtcp_debug_test_addr(&addr)) {
 				ast_verbose("  Fraction lost: %ld\n", (((long) ntohl(rtcpheader[i + 1]) & 0xff000000) >> 24));
 				ast_verbose("  Packets lost so far: %d\n", rtp->rtcp->reported_lost);
@@ -2119,6 +2493,572 @@ static int bridge_p2p_rtp_write(struct ast_rtp_instance *instance, unsigned int
 	return 0;
 }
 
+/*! \brief Decide what a relay thread does with a packet received on a leg
+ *
+ * Mirrors the checks ast_rtp_read() and bridge_p2p_rtp_write() apply, and
+ * rewrites the payload type and marker bit in place the same way.  Called
+ * with the leg's instance locked.
+ *
+ * \retval 1 forward the packet to dest
+ * \retval 0 drop the packet
+ * \retval -1 hand the packet to the channel thread
+ */
+static int rtp_relay_classify(struct rtp_relay_leg *leg, unsigned char *buf, int len, struct ast_sockaddr *addr, struct ast_sockaddr *dest)
+{
+	struct ast_rtp *rtp = ast_rtp_instance_get_data(leg->instance);
+	unsigned int *rtpheader = (unsigned int *) buf;
+	struct ast_rtp_payload_type payload_type;
+	struct ast_sockaddr remote_address;
+	int reconstruct, payload, bridged_payload, mark;
+
+	if (len < 12) {
+		return -1;
+	}
+	reconstruct = ntohl(rtpheader[0]);
+	if (((reconstruct & 0xC0000000) >> 30) != 2) {
+		return -1;
+	}
+
+	/* Anything strict RTP or symmetric RTP would act on goes the long way round */
+	if (rtp->strict_rtp_state == STRICT_RTP_LEARN ||
+		(rtp->strict_rtp_state == STRICT_RTP_CLOSED && ast_sockaddr_cmp(&rtp->strict_rtp_address, addr))) {
+		return -1;
+	}
+	if (ast_rtp_instance_get_prop(leg->instance, AST_RTP_PROPERTY_NAT)) {
+		ast_rtp_instance_get_remote_address(leg->instance, &remote_address);
+		if (ast_sockaddr_cmp(&remote_address, addr)) {
+			return -1;
+		}
+	}
+
+	payload = (reconstruct & 0x7f0000) >> 16;
+	mark = (((reconstruct & 0x800000) >> 23) != 0);
+	payload_type = ast_rtp_codecs_payload_lookup(ast_rtp_instance_get_codecs(leg->instance), payload);
+	bridged_payload = ast_rtp_codecs_payload_code(ast_rtp_instance_get_codecs(leg->peer), payload_type.asterisk_format, &payload_type.format, payload_type.rtp_code);
+	if (bridged_payload < 0 ||
+		(!(ast_rtp_instance_get_codecs(leg->peer)->payloads[bridged_payload].rtp_code) &&
+		!(ast_rtp_instance_get_codecs(leg->peer)->payloads[bridged_payload].asterisk_format))) {
+		return -1;
+	}
+
+	if (leg->need_marker) {
+		mark = 1;
+		leg->need_marker = 0;
+	}
+
+	reconstruct &= 0xFF80FFFF;
+	reconstruct |= (bridged_payload << 16);
+	reconstruct |= (mark << 23);
+	rtpheader[0] = htonl(reconstruct);
+
+	ast_rtp_instance_get_remote_address(leg->peer, dest);
+	if (ast_sockaddr_isnull(dest)) {
+		return 0;
+	}
+
+	if (rtp_debug_test_addr(dest)) {
+		ast_verbose("Sent RTP P2P packet to %s (type %-2.2d, len %-6.6u)\n",
+			ast_sockaddr_stringify(dest), bridged_payload, len - 12);
+	}
+
+	return 1;
+}
+
+/*! \brief Queue a packet for the channel thread and wake it up */
+static void rtp_relay_hand_up(struct rtp_relay_thread *thread, struct rtp_relay_leg *leg, unsigned char *buf, int len, struct ast_sockaddr *addr)
+{
+	struct rtp_relay_pkt *pkt;
+
+	ast_mutex_lock(&leg->lock);
+	if (leg->npending >= RTP_RELAY_MAX_PENDING) {
+		ast_mutex_unlock(&leg->lock);
+		thread->dropped++;
+		return;
+	}
+	if ((pkt = AST_LIST_REMOVE_HEAD(&leg->spare, next))) {
+		leg->nspare--;
+	} else if (!(pkt = ast_malloc(sizeof(*pkt) + RTP_RELAY_PKTSIZE))) {
+		ast_mutex_unlock(&leg->lock);
+		thread->dropped++;
+		return;
+	}
+	ast_sockaddr_copy(&pkt->addr, addr);
+	pkt->len = len;
+	memcpy(pkt->data, buf, len);
+	AST_LIST_INSERT_TAIL(&leg->pending, pkt, next);
+	leg->npending++;
+	if (write(leg->wake[1], "", 1) < 0) {
+		ast_debug(1, "Unable to wake RTP channel thread: %s\n", strerror(errno));
+	}
+	ast_mutex_unlock(&leg->lock);
+	thread->handed_up++;
+}
+
+/*! \brief Move everything waiting on a leg's socket. Called with relay_lock read locked. */
+static void rtp_relay_service(struct rtp_relay_thread *thread, struct rtp_relay_leg *leg)
+{
+	struct ast_rtp *peer_rtp = ast_rtp_instance_get_data(leg->peer);
+	struct ast_srtp *srtp = ast_rtp_instance_get_srtp(leg->instance);
+	struct ast_srtp *peer_srtp = ast_rtp_instance_get_srtp(leg->peer);
+	struct ast_srtp_packet pkts[RTP_RELAY_BATCH];
+	struct ast_sockaddr addrs[RTP_RELAY_BATCH];
+	struct ast_sockaddr dests[RTP_RELAY_BATCH];
+	int lens[RTP_RELAY_BATCH];
+	int count = 0, out = 0, sent = 0, x;
+#if defined(HAVE_RECVMMSG) || defined(HAVE_SENDMMSG)
+	struct mmsghdr msgs[RTP_RELAY_BATCH];
+	struct iovec iov[RTP_RELAY_BATCH];
+#endif
+
+#ifdef HAVE_RECVMMSG
+	memset(msgs, 0, sizeof(msgs));
+	for (x = 0; x < RTP_RELAY_BATCH; x++) {
+		iov[x].iov_base = thread->bufs[x];
+		iov[x].iov_len = RTP_RELAY_PKTSIZE;
+		msgs[x].msg_hdr.msg_name = &addrs[x].ss;
+		msgs[x].msg_hdr.msg_namelen = sizeof(addrs[x].ss);
+		msgs[x].msg_hdr.msg_iov = &iov[x];
+		msgs[x].msg_hdr.msg_iovlen = 1;
+	}
+	if ((count = recvmmsg(leg->sock, msgs, RTP_RELAY_BATCH, MSG_DONTWAIT, NULL)) < 0) {
+		return;
+	}
+	for (x = 0; x < count; x++) {
+		addrs[x].len = msgs[x].msg_hdr.msg_namelen;
+		lens[x] = msgs[x].msg_len;
+	}
+#else
+	for (count = 0; count < RTP_RELAY_BATCH; count++) {
+		if ((lens[count] = ast_recvfrom(leg->sock, thread->bufs[count], RTP_RELAY_PKTSIZE, MSG_DONTWAIT, &addrs[count])) < 0) {
+			break;
+		}
+	}
+#endif
+
+	if (srtp && count > 0) {
+		int idx[RTP_RELAY_BATCH], n = 0;
+
+		/* The whole batch is unprotected under a single lock of the session.
+		 * Anything that is not RTP, such as STUN, is handed up untouched. */
+		for (x = 0; x < count; x++) {
+			if (lens[x] < 12 || (thread->bufs[x][0] & 0xC0) != 0x80) {
+				continue;
+			}
+			pkts[n].buf = thread->bufs[x];
+			pkts[n].len = lens[x];
+			pkts[n].size = RTP_RELAY_PKTSIZE;
+			idx[n++] = x;
+		}
+		res_srtp->unprotect_batch(srtp, pkts, n, 0);
+		for (x = 0; x < n; x++) {
+			lens[idx[x]] = pkts[x].len;
+		}
+	}
+
+	/* Strict RTP and the marker bit are shared with the channel thread */
+	ao2_lock(leg->instance);
+	for (x = 0; x < count; x++) {
+		int res;
+
+		if (lens[x] < 0) {
+			thread->dropped++;
+			continue;
+		}
+
+		res = rtp_relay_classify(leg, thread->bufs[x], lens[x], &addrs[x], &dests[out]);
+		if (res < 0) {
+			rtp_relay_hand_up(thread, leg, thread->bufs[x], lens[x], &addrs[x]);
+		} else if (!res) {
+			thread->dropped++;
+		} else {
+			pkts[out].buf = thread->bufs[x];
+			pkts[out].len = lens[x];
+			pkts[out].size = RTP_RELAY_PKTSIZE;
+			out++;
+		}
+	}
+	ao2_unlock(leg->instance);
+
+	if (peer_srtp && out) {
+		res_srtp->protect_batch(peer_srtp, pkts, out, 0);
+	}
+
+	for (x = 0; x < out; x++) {
+		if (pkts[x].len < 0) {
+			thread->dropped++;
+			continue;
+		}
+#ifdef HAVE_SENDMMSG
+		iov[sent].iov_base = pkts[x].buf;
+		iov[sent].iov_len = pkts[x].len;
+		memset(&msgs[sent], 0, sizeof(msgs[sent]));
+		msgs[sent].msg_hdr.msg_name = &dests[x].ss;
+		msgs[sent].msg_hdr.msg_namelen = dests[x].len;
+		msgs[sent].msg_hdr.msg_iov = &iov[sent];
+		msgs[sent].msg_hdr.msg_iovlen = 1;
+#else
+		ast_sendto(rtp_socket(peer_rtp), pkts[x].buf, pkts[x].len, 0, &dests[x]);
+#endif
+		sent++;
+	}
+
+#ifdef HAVE_SENDMMSG
+	for (x = 0; x < sent; ) {
+		int res = sendmmsg(rtp_socket(peer_rtp), msgs + x, sent - x, 0);
+
+		if (res < 0) {
+			/* Skip the packet the kernel refused, the same as a failed sendto() */
+			thread->dropped++;
+			x++;
+			continue;
+		}
+		x += res;
+	}
+#endif
+	thread->relayed += sent;
+}
+
+#ifdef HAVE_EPOLL_CREATE1
+static void *rtp_relay_thread_main(void *data)
+{
+	struct rtp_relay_thread *thread = data;
+	struct epoll_event events[RTP_RELAY_BATCH];
+	unsigned int generation;
+	int res, x;
+
+	for (;;) {
+		ast_rwlock_rdlock(&relay_lock);
+		if (thread->stop) {
+			ast_rwlock_unlock(&relay_lock);
+			break;
+		}
+		generation = thread->generation;
+		ast_rwlock_unlock(&relay_lock);
+
+		if ((res = epoll_wait(thread->epfd, events, ARRAY_LEN(events), 1000)) <= 0) {
+			continue;
+		}
+
+		ast_rwlock_rdlock(&relay_lock);
+		for (x = 0; x < res; x++) {
+			if (!events[x].data.ptr) {
+				char buf[32];
+
+				while (read(thread->wake[0], buf, sizeof(buf)) > 0) {
+				}
+			} else if (generation == thread->generation) {
+				/* Otherwise the leg may be gone; the socket is level triggered and comes back */
+				rtp_relay_service(thread, events[x].data.ptr);
+			}
+		}
+		ast_rwlock_unlock(&relay_lock);
+	}
+
+	return NULL;
+}
+#else
+static void *rtp_relay_thread_main(void *data)
+{
+	struct rtp_relay_thread *thread = data;
+	struct pollfd *pfds = NULL;
+	struct rtp_relay_leg **legs = NULL;
+	unsigned int nfds = 0, alloc = 0, generation = 0, x;
+	int res;
+
+	for (;;) {
+		ast_rwlock_rdlock(&relay_lock);
+		if (thread->stop) {
+			ast_rwlock_unlock(&relay_lock);
+			break;
+		}
+		if (!nfds || generation != thread->generation) {
+			if (thread->count + 1 > alloc) {
+				alloc = thread->count + 16;
+				pfds = ast_realloc(pfds, alloc * sizeof(*pfds));
+				legs = ast_realloc(legs, alloc * sizeof(*legs));
+				if (!pfds || !legs) {
+					ast_rwlock_unlock(&relay_lock);
+					break;
+				}
+			}
+			pfds[0].fd = thread->wake[0];
+			pfds[0].events = POLLIN;
+			for (x = 0; x < thread->count; x++) {
+				legs[x] = thread->legs[x];
+				pfds[x + 1].fd = legs[x]->sock;
+				pfds[x + 1].events = POLLIN;
+			}
+			nfds = thread->count + 1;
+			generation = thread->generation;
+		}
+		ast_rwlock_unlock(&relay_lock);
+
+		if ((res = ast_poll(pfds, nfds, 1000)) <= 0) {
+			continue;
+		}
+
+		if (pfds[0].revents) {
+			char buf[32];
+
+			while (read(thread->wake[0], buf, sizeof(buf)) > 0) {
+			}
+		}
+
+		ast_rwlock_rdlock(&relay_lock);
+		/* If the leg list changed while we slept our snapshot may hold stale legs */
+		if (generation == thread->generation) {
+			for (x = 1; x < nfds; x++) {
+				if (pfds[x].revents & POLLIN) {
+					rtp_relay_service(thread, legs[x - 1]);
+				}
+			}
+		}
+		ast_rwlock_unlock(&relay_lock);
+	}
+
+	ast_free(pfds);
+	ast_free(legs);
+
+	return NULL;
+}
+#endif
+
+static void rtp_relay_thread_wake(struct rtp_relay_thread *thread)
+{
+	if (write(thread->wake[1], "", 1) < 0) {
+		ast_debug(1, "Unable to wake RTP relay thread: %s\n", strerror(errno));
+	}
+}
+
+/*! \brief Hand an instance's socket over to a relay thread
+ *
+ * Does nothing, leaving the channel thread on the existing p2p path, if no
+ * relay threads are running, or if either side is using SRTP and res_srtp
+ * cannot protect and unprotect packets in batches.
+ */
+static void rtp_relay_start(struct ast_rtp_instance *instance, struct ast_rtp_instance *peer)
+{
+	struct ast_rtp *rtp = ast_rtp_instance_get_data(instance);
+	struct rtp_relay_thread *thread = NULL;
+	struct rtp_relay_leg *leg;
+	int x;
+
+	if (!relay_thread_count || rtp->relay || rtp->s < 0) {
+		return;
+	}
+	if ((ast_rtp_instance_get_srtp(instance) || ast_rtp_instance_get_srtp(peer)) &&
+		(!res_srtp || !res_srtp->unprotect_batch || !res_srtp->protect_batch)) {
+		return;
+	}
+
+	if (!(leg = ast_calloc(1, sizeof(*leg)))) {
+		return;
+	}
+	leg->wake[0] = leg->wake[1] = -1;
+	if ((leg->sock = dup(rtp->s)) < 0 || pipe(leg->wake)) {
+		ast_log(LOG_WARNING, "Unable to set up RTP relay for instance '%p': %s\n", instance, strerror(errno));
+		if (leg->sock > -1) {
+			close(leg->sock);
+		}
+		ast_free(leg);
+		return;
+	}
+	fcntl(leg->wake[0], F_SETFL, fcntl(leg->wake[0], F_GETFL) | O_NONBLOCK);
+	fcntl(leg->wake[1], F_SETFL, fcntl(leg->wake[1], F_GETFL) | O_NONBLOCK);
+	ast_mutex_init(&leg->lock);
+	leg->instance = instance;
+	leg->peer = peer;
+	ao2_ref(peer, +1);
+
+	ast_rwlock_wrlock(&relay_lock);
+	for (x = 0; x < relay_thread_count; x++) {
+		if (!thread || relay_threads[x].count < thread->count) {
+			thread = &relay_threads[x];
+		}
+	}
+	if (thread->count == thread->alloc) {
+		struct rtp_relay_leg **legs = ast_realloc(thread->legs, (thread->alloc + 16) * sizeof(*legs));
+
+		if (!legs) {
+			ast_rwlock_unlock(&relay_lock);
+			ao2_ref(peer, -1);
+			ast_mutex_destroy(&leg->lock);
+			close(leg->sock);
+			close(leg->wake[0]);
+			close(leg->wake[1]);
+			ast_free(leg);
+			return;
+		}
+		thread->legs = legs;
+		thread->alloc += 16;
+	}
+#ifdef HAVE_EPOLL_CREATE1
+	{
+		struct epoll_event event = { .events = EPOLLIN, .data.ptr = leg, };
+
+		if (epoll_ctl(thread->epfd, EPOLL_CTL_ADD, leg->sock, &event)) {
+			ast_log(LOG_WARNING, "Unable to set up RTP relay for instance '%p': %s\n", instance, strerror(errno));
+			ast_rwlock_unlock(&relay_lock);
+			ao2_ref(peer, -1);
+			ast_mutex_destroy(&leg->lock);
+			close(leg->sock);
+			close(leg->wake[0]);
+			close(leg->wake[1]);
+			ast_free(leg);
+			return;
+		}
+	}
+#endif
+	leg->thread = thread;
+	thread->legs[thread->count++] = leg;
+	thread->generation++;
+	/* The relay owns the pending marker bit from here on */
+	ao2_lock(instance);
+	leg->need_marker = ast_test_flag(rtp, FLAG_NEED_MARKER_BIT) ? 1 : 0;
+	ast_clear_flag(rtp, FLAG_NEED_MARKER_BIT);
+	/* Sends switch to the real socket before the channel's fd stops being one */
+	rtp->relay = leg;
+	ao2_unlock(instance);
+	dup2(leg->wake[0], rtp->s);
+	ast_rwlock_unlock(&relay_lock);
+
+	rtp_relay_thread_wake(thread);
+	ast_debug(1, "RTP instance '%p' is now relayed to '%p'\n", instance, peer);
+}
+
+/*! \brief Give an instance's socket back to its channel thread */
+static void rtp_relay_stop(struct ast_rtp_instance *instance)
+{
+	struct ast_rtp *rtp = ast_rtp_instance_get_data(instance);
+	struct rtp_relay_leg *leg;
+	struct rtp_relay_thread *thread;
+	struct rtp_relay_pkt *pkt;
+	unsigned int x;
+
+	ast_rwlock_wrlock(&relay_lock);
+	if (!(leg = rtp->relay)) {
+		ast_rwlock_unlock(&relay_lock);
+		return;
+	}
+	thread = leg->thread;
+	for (x = 0; x < thread->count; x++) {
+		if (thread->legs[x] == leg) {
+			thread->legs[x] = thread->legs[--thread->count];
+			break;
+		}
+	}
+	thread->generation++;
+#ifdef HAVE_EPOLL_CREATE1
+	epoll_ctl(thread->epfd, EPOLL_CTL_DEL, leg->sock, NULL);
+#endif
+	dup2(leg->sock, rtp->s);
+	ao2_lock(instance);
+	if (leg->need_marker) {
+		ast_set_flag(rtp, FLAG_NEED_MARKER_BIT);
+	}
+	rtp->relay = NULL;
+	ao2_unlock(instance);
+	ast_rwlock_unlock(&relay_lock);
+
+	rtp_relay_thread_wake(thread);
+
+	while ((pkt = AST_LIST_REMOVE_HEAD(&leg->pending, next))) {
+		ast_free(pkt);
+	}
+	while ((pkt = AST_LIST_REMOVE_HEAD(&leg->spare, next))) {
+		ast_free(pkt);
+	}
+	close(leg->sock);
+	close(leg->wake[0]);
+	close(leg->wake[1]);
+	ast_mutex_destroy(&leg->lock);
+	ao2_ref(leg->peer, -1);
+	ast_free(leg);
+	ast_debug(1, "RTP instance '%p' is no longer relayed\n", instance);
+}
+
+static void rtp_relay_threads_stop(void)
+{
+	int x;
+
+	ast_rwlock_wrlock(&relay_lock);
+	for (x = 0; x < relay_thread_count; x++) {
+		relay_threads[x].stop = 1;
+		rtp_relay_thread_wake(&relay_threads[x]);
+	}
+	ast_rwlock_unlock(&relay_lock);
+
+	for (x = 0; x < relay_thread_count; x++) {
+		pthread_join(relay_threads[x].id, NULL);
+#ifdef HAVE_EPOLL_CREATE1
+		close(relay_threads[x].epfd);
+#endif
+		close(relay_threads[x].wake[0]);
+		close(relay_threads[x].wake[1]);
+		ast_free(relay_threads[x].legs);
+	}
+	ast_free(relay_threads);
+	relay_threads = NULL;
+	relay_thread_count = 0;
+}
+
+static int rtp_relay_threads_start(int count)
+{
+	int x;
+
+	if (!count) {
+		return 0;
+	}
+	if (!(relay_threads = ast_calloc(count, sizeof(*relay_threads)))) {
+		return -1;
+	}
+	for (x = 0; x < count; x++) {
+		struct rtp_relay_thread *thread = &relay_threads[x];
+
+		if (pipe(thread->wake)) {
+			break;
+		}
+		fcntl(thread->wake[0], F_SETFL, fcntl(thread->wake[0], F_GETFL) | O_NONBLOCK);
+		fcntl(thread->wake[1], F_SETFL, fcntl(thread->wake[1], F_GETFL) | O_NONBLOCK);
+#ifdef HAVE_EPOLL_CREATE1
+		{
+			struct epoll_event event = { .events = EPOLLIN, .data.ptr = NULL, };
+
+			if ((thread->epfd = epoll_create1(EPOLL_CLOEXEC)) < 0) {
+				close(thread->wake[0]);
+				close(thread->wake[1]);
+				break;
+			}
+			if (epoll_ctl(thread->epfd, EPOLL_CTL_ADD, thread->wake[0], &event)) {
+				close(thread->epfd);
+				close(thread->wake[0]);
+				close(thread->wake[1]);
+				break;
+			}
+		}
+#endif
+		if (ast_pthread_create_background(&thread->id, NULL, rtp_relay_thread_main, thread)) {
+#ifdef HAVE_EPOLL_CREATE1
+			close(thread->epfd);
+#endif
+			close(thread->wake[0]);
+			close(thread->wake[1]);
+			break;
+		}
+		relay_thread_count++;
+	}
+	if (relay_thread_count < count) {
+		ast_log(LOG_WARNING, "Only started %d of %d RTP relay threads\n", relay_thread_count, count);
+	}
+	if (!relay_thread_count) {
+		ast_free(relay_threads);
+		relay_threads = NULL;
+		return -1;
+	}
+	ast_verb(2, "%d RTP relay threads started\n", relay_thread_count);
+	return 0;
+}
+
 static struct ast_frame *ast_rtp_read(struct ast_rtp_instance *instance, int rtcp)
 {
 	struct ast_rtp *rtp = ast_rtp_instance_get_data(instance);
@@ -2179,7 +3119,7 @@ static struct ast_frame *ast_rtp_read(struct ast_rtp_instance *instance, int rtc
 				  ast_sockaddr_stringify(&addr));
 			return &ast_null_frame;
 		}
-		if ((ast_stun_handle_packet(rtp->s, &addr_tmp, rtp->rawdata + AST_FRIENDLY_OFFSET, res, NULL, NULL) == AST_STUN_ACCEPT) &&
+		if ((ast_stun_handle_packet(rtp_socket(rtp), &addr_tmp, rtp->rawdata + AST_FRIENDLY_OFFSET, res, NULL, NULL) == AST_STUN_ACCEPT) &&
 		    ast_sockaddr_isnull(&remote_address)) {
 			ast_sockaddr_from_sin(&addr, &addr_tmp);
 			ast_rtp_instance_set_remote_address(instance, &addr);
@@ -2187,7 +3127,9 @@ static struct ast_frame *ast_rtp_read(struct ast_rtp_instance *instance, int rtc
 		return &ast_null_frame;
 	}
 
-	/* If strict RTP protection is enabled see if we need to learn the remote address or if we need to drop the packet */
+	/* If strict RTP protection is enabled see if we need to learn the remote address or if we need to drop the packet.
+	 * A relay thread may be checking the same state. */
+	ao2_lock(instance);
 	if (rtp->strict_rtp_state == STRICT_RTP_LEARN) {
 		ast_debug(1, "%p -- start learning mode pass with addr = %s\n", rtp, ast_sockaddr_stringify(&addr));
 		/* For now, we always copy the address. */
@@ -2195,6 +3137,7 @@ static struct ast_frame *ast_rtp_read(struct ast_rtp_instance *instance, int rtc
 
 		/* Send the rtp and the seqno from header to rtp_learning_rtp_seq_update to see whether we can exit or not*/
 		if (rtp_learning_rtp_seq_update(rtp, ntohl(rtpheader[0]))) {
+			ao2_unlock(instance);
 			ast_debug(1, "%p -- Condition for learning hasn't exited, so reject the frame.\n", rtp);
 			return &ast_null_frame;
 		}
@@ -2212,6 +3155,7 @@ static struct ast_frame *ast_rtp_read(struct ast_rtp_instance *instance, int rtc
 				const char *real_addr = ast_strdupa(ast_sockaddr_stringify(&addr));
 				const char *expected_addr = ast_strdupa(ast_sockaddr_stringify(&rtp->strict_rtp_address));
 
+				ao2_unlock(instance);
 				ast_debug(1, "Received RTP packet from %s, dropping due to strict RTP protection. Expected it to be from %s\n",
 						real_addr, expected_addr);
 
@@ -2219,6 +3163,7 @@ static struct ast_frame *ast_rtp_read(struct ast_rtp_instance *instance, int rtc
 			}
 		}
 	}
+	ao2_unlock(instance);
 
 	/* If symmetric RTP is enabled see if the remote side is not what we expected and change where we are sending audio */
 	if (ast_rtp_instance_get_prop(instance, AST_RTP_PROPERTY_NAT)) {
@@ -2589,8 +3534,10 @@ static void ast_rtp_remote_address_set(struct ast_rtp_instance *instance, struct
 	rtp->rxseqno = 0;
 
 	if (strictrtp) {
+		ao2_lock(instance);
 		rtp->strict_rtp_state = STRICT_RTP_LEARN;
 		rtp_learning_seq_init(rtp, rtp->seqno);
+		ao2_unlock(instance);
 	}
 
 	return;
@@ -2672,9 +3619,13 @@ static int rtp_red_buffer(struct ast_rtp_instance *instance, struct ast_frame *f
 
 static int ast_rtp_local_bridge(struct ast_rtp_instance *instance0, struct ast_rtp_instance *instance1)
 {
-	struct ast_rtp *rtp = ast_rtp_instance_get_data(instance0);
+	rtp_need_marker_bit(instance0);
 
-	ast_set_flag(rtp, FLAG_NEED_MARKER_BIT);
+	if (instance1) {
+		rtp_relay_start(instance0, instance1);
+	} else {
+		rtp_relay_stop(instance0);
+	}
 
 	return 0;
 }
@@ -2746,11 +3697,24 @@ static int ast_rtp_dtmf_compatible(struct ast_channel *chan0, struct ast_rtp_ins
 static void ast_rtp_stun_request(struct ast_rtp_instance *instance, struct ast_sockaddr *suggestion, const char *username)
 {
 	struct ast_rtp *rtp = ast_rtp_instance_get_data(instance);
+	struct ast_rtp_instance *relay_peer = NULL;
 	struct sockaddr_in suggestion_tmp;
 
+	/* The request waits for its answer on the socket, which a relay thread would read first */
+	if (rtp->relay) {
+		relay_peer = rtp->relay->peer;
+		ao2_ref(relay_peer, +1);
+		rtp_relay_stop(instance);
+	}
+
 	ast_sockaddr_to_sin(suggestion, &suggestion_tmp);
 	ast_stun_request(rtp->s, &suggestion_tmp, username, NULL);
 	ast_sockaddr_from_sin(suggestion, &suggestion_tmp);
+
+	if (relay_peer) {
+		rtp_relay_start(instance, relay_peer);
+		ao2_ref(relay_peer, -1);
+	}
 }
 
 static void ast_rtp_stop(struct ast_rtp_instance *instance)
@@ -2777,14 +3741,15 @@ static void ast_rtp_stop(struct ast_rtp_instance *instance)
 		ast_sockaddr_setnull(&rtp->rtcp->them);
 	}
 
-	ast_set_flag(rtp, FLAG_NEED_MARKER_BIT);
+	rtp_need_marker_bit(instance);
 }
 
 static int ast_rtp_qos_set(struct ast_rtp_instance *instance, int tos, int cos, const char *desc)
 {
 	struct ast_rtp *rtp = ast_rtp_instance_get_data(instance);
 
-	return ast_set_qos(rtp->s, tos, cos, desc);
+	/* rtp->s is a pipe while a relay thread has the socket */
+	return ast_set_qos(rtp_socket(rtp), tos, cos, desc);
 }
 
 /*! \brief generate comfort noice (CNG) */
@@ -2957,20 +3922,218 @@ static char *handle_cli_rtcp_set_stats(struct ast_cli_entry *e, int cmd, struct
 	return CLI_SUCCESS;
 }
 
+static char *handle_cli_rtp_settings(struct ast_cli_entry *e, int cmd, struct ast_cli_args *a)
+{
+	struct timeval now = ast_tvnow();
+	unsigned int quarantined = 0;
+	unsigned int x;
+
+	switch (cmd) {
+	case CLI_INIT:
+		e->command = "rtp show settings";
+		e->usage =
+			"Usage: rtp show settings\n"
+			"       Display RTP configuration settings and port usage\n";
+		return NULL;
+	case CLI_GENERATE:
+		return NULL;
+	}
+
+	if (a->argc != 3) {
+		return CLI_SHOWUSAGE;
+	}
+
+	ast_cli(a->fd, "\n\nGeneral Settings:\n");
+	ast_cli(a->fd, "----------------\n");
+	ast_cli(a->fd, "  Port start:      %d\n", rtpstart);
+	ast_cli(a->fd, "  Port end:        %d\n", rtpend);
+#ifdef SO_NO_CHECK
+	ast_cli(a->fd, "  Checksums:       %s\n", AST_CLI_YESNO(nochecksums == 0));
+#endif
+	ast_cli(a->fd, "  DTMF Timeout:    %d\n", dtmftimeout);
+	ast_cli(a->fd, "  Strict RTP:      %s\n", AST_CLI_YESNO(strictrtp));
+	if (strictrtp) {
+		ast_cli(a->fd, "  Probation:       %d frames\n", learning_min_sequential);
+	}
+	ast_cli(a->fd, "  RTCP Interval:   %d ms\n", rtcpinterval);
+
+	ast_mutex_lock(&port_pool_lock);
+	/* Released slots are queued oldest first, so stop at the first one out of quarantine */
+	for (x = 0; x < port_pool.count; x++) {
+		unsigned int slot = port_pool.fifo[(port_pool.head + x) % port_pool.slots];
+
+		if (ast_tvzero(port_pool.released[slot])
+			|| ast_tvdiff_ms(now, port_pool.released[slot]) >= RTP_PORT_QUARANTINE_MS) {
+			break;
+		}
+		quarantined++;
+	}
+	ast_cli(a->fd, "\nPort Usage:\n");
+	ast_cli(a->fd, "----------------\n");
+	ast_cli(a->fd, "  Port pairs:      %u\n", port_pool.slots);
+	ast_cli(a->fd, "  In use:          %u (%u%%)\n", port_pool.allocated,
+		port_pool.slots ? port_pool.allocated * 100 / port_pool.slots : 0);
+	ast_cli(a->fd, "  Free:            %u\n", port_pool.count - quarantined);
+	ast_cli(a->fd, "  Quarantined:     %u (%d ms)\n", quarantined, RTP_PORT_QUARANTINE_MS);
+	ast_cli(a->fd, "  Bind failures:   %u\n", port_pool.bind_failures);
+	ast_cli(a->fd, "  Early reuse:     %u\n", port_pool.quarantine_overrides);
+	ast_cli(a->fd, "  Exhausted:       %u\n", port_pool.exhausted);
+	ast_mutex_unlock(&port_pool_lock);
+
+	ast_cli(a->fd, "\nP2P Relay:\n");
+	ast_cli(a->fd, "----------------\n");
+	ast_cli(a->fd, "  Relay threads:   %d\n", relay_thread_count);
+	ast_rwlock_rdlock(&relay_lock);
+	for (x = 0; x < relay_thread_count; x++) {
+		ast_cli(a->fd, "  Thread %u:        %u legs, %u relayed, %u to channel, %u dropped\n",
+			x + 1, relay_threads[x].count, relay_threads[x].relayed,
+			relay_threads[x].handed_up, relay_threads[x].dropped);
+	}
+	ast_rwlock_unlock(&relay_lock);
+
+	return CLI_SUCCESS;
+}
+
 static struct ast_cli_entry cli_rtp[] = {
+	AST_CLI_DEFINE(handle_cli_rtp_settings,   "Display RTP settings"),
 	AST_CLI_DEFINE(handle_cli_rtp_set_debug,  "Enable/Disable RTP debugging"),
 	AST_CLI_DEFINE(handle_cli_rtcp_set_debug, "Enable/Disable RTCP debugging"),
 	AST_CLI_DEFINE(handle_cli_rtcp_set_stats, "Enable/Disable RTCP stats"),
 };
 
+#ifdef TEST_FRAMEWORK
+AST_TEST_DEFINE(rtp_relay_benchmark)
+{
+	struct ast_sched_context *sched = NULL;
+	struct ast_rtp_instance *instance0 = NULL, *instance1 = NULL;
+	struct ast_sockaddr loopback, src_addr, sink_addr, relay_addr;
+	unsigned char packet[12 + 160] = { 0x80, 0x00, };
+	unsigned char drain[RTP_RELAY_PKTSIZE];
+	int src = -1, sink = -1, started_threads = 0;
+	int packets = 100000, sent = 0, received = 0, x;
+	struct timeval start, last_rx;
+	int64_t elapsed;
+	enum ast_test_result_state res = AST_TEST_FAIL;
+
+	switch (cmd) {
+	case TEST_INIT:
+		info->name = "rtp_relay_benchmark";
+		info->category = "/res/res_rtp_asterisk/";
+		info->summary = "P2P RTP relay throughput over loopback";
+		info->description =
+			"Relays a stream of G.711 sized RTP packets between two locally bridged "
+			"RTP instances over loopback and reports packets per second per relay thread.";
+		return AST_TEST_NOT_RUN;
+	case TEST_EXECUTE:
+		break;
+	}
+
+	if (!relay_thread_count) {
+		if (rtp_relay_threads_start(1)) {
+			ast_test_status_update(test, "Unable to start a relay thread\n");
+			return AST_TEST_FAIL;
+		}
+		started_threads = 1;
+	}
+
+	ast_sockaddr_parse(&loopback, "127.0.0.1", 0);
+	if (!(sched = ast_sched_context_create())
+		|| !(instance0 = ast_rtp_instance_new("asterisk", sched, &loopback, NULL))
+		|| !(instance1 = ast_rtp_instance_new("asterisk", sched, &loopback, NULL))) {
+		ast_test_status_update(test, "Unable to create RTP instances\n");
+		goto cleanup;
+	}
+
+	ast_sockaddr_copy(&src_addr, &loopback);
+	ast_sockaddr_copy(&sink_addr, &loopback);
+	if ((src = socket(AF_INET, SOCK_DGRAM, 0)) < 0 || (sink = socket(AF_INET, SOCK_DGRAM, 0)) < 0
+		|| ast_bind(src, &src_addr) || ast_bind(sink, &sink_addr)
+		|| ast_getsockname(src, &src_addr) || ast_getsockname(sink, &sink_addr)) {
+		ast_test_status_update(test, "Unable to set up loopback sockets: %s\n", strerror(errno));
+		goto cleanup;
+	}
+	fcntl(sink, F_SETFL, fcntl(sink, F_GETFL) | O_NONBLOCK);
+
+	for (x = 0; x < 2; x++) {
+		struct ast_rtp_instance *instance = x ? instance1 : instance0;
+		struct ast_rtp *rtp = ast_rtp_instance_get_data(instance);
+
+		ast_rtp_codecs_payloads_default(ast_rtp_instance_get_codecs(instance), instance);
+		rtp->strict_rtp_state = STRICT_RTP_OPEN;
+	}
+	ast_rtp_instance_set_remote_address(instance0, &src_addr);
+	ast_rtp_instance_set_remote_address(instance1, &sink_addr);
+	ast_rtp_instance_get_local_address(instance0, &relay_addr);
+
+	ast_rtp_local_bridge(instance0, instance1);
+	if (!((struct ast_rtp *) ast_rtp_instance_get_data(instance0))->relay) {
+		ast_test_status_update(test, "Relay did not take over the RTP socket\n");
+		goto cleanup;
+	}
+
+	start = last_rx = ast_tvnow();
+	while (received < packets && ast_tvdiff_ms(ast_tvnow(), last_rx) < 1000) {
+		for (x = 0; x < RTP_RELAY_BATCH && sent < packets; x++, sent++) {
+			put_unaligned_uint16(packet + 2, htons(sent));
+			ast_sendto(src, packet, sizeof(packet), 0, &relay_addr);
+		}
+		/* Keep no more than a few batches in flight so loopback does not drop */
+		while (received < sent) {
+			if (recv(sink, drain, sizeof(drain), 0) > 0) {
+				received++;
+				last_rx = ast_tvnow();
+			} else if (sent - received < RTP_RELAY_BATCH * 4) {
+				break;
+			} else if (ast_tvdiff_ms(ast_tvnow(), last_rx) >= 1000) {
+				break;
+			}
+		}
+	}
+	elapsed = ast_tvdiff_ms(last_rx, start);
+
+	ast_test_status_update(test, "Relayed %d of %d packets in %" PRId64 " ms: %" PRId64 " packets/s on %d relay thread%s\n",
+		received, packets, elapsed, elapsed ? (int64_t) received * 1000 / elapsed : 0,
+		relay_thread_count, ESS(relay_thread_count));
+	if (received) {
+		res = AST_TEST_PASS;
+	}
+
+cleanup:
+	if (instance0) {
+		ast_rtp_local_bridge(instance0, NULL);
+		ast_rtp_instance_destroy(instance0);
+	}
+	if (instance1) {
+		ast_rtp_instance_destroy(instance1);
+	}
+	if (sched) {
+		ast_sched_context_destroy(sched);
+	}
+	if (src > -1) {
+		close(src);
+	}
+	if (sink > -1) {
+		close(sink);
+	}
+	if (started_threads) {
+		rtp_relay_threads_stop();
+	}
+	return res;
+}
+#endif
+
 static int rtp_reload(int reload)
 {
 	struct ast_config *cfg;
 	const char *s;
 	struct ast_flags config_flags = { reload ? CONFIG_FLAG_FILEUNCHANGED : 0 };
+	int old_rtpstart = rtpstart, old_rtpend = rtpend;
 
 	cfg = ast_config_load2("rtp.conf", "rtp", config_flags);
 	if (cfg == CONFIG_STATUS_FILEMISSING || cfg == CONFIG_STATUS_FILEUNCHANGED || cfg == CONFIG_STATUS_FILEINVALID) {
+		if (!port_pool.fifo) {
+			rtp_port_pool_build(rtpstart, rtpend);
+		}
 		return 0;
 	}
 
@@ -2979,6 +4142,7 @@ static int rtp_reload(int reload)
 	dtmftimeout = DEFAULT_DTMF_TIMEOUT;
 	strictrtp = STRICT_RTP_CLOSED;
 	learning_min_sequential = DEFAULT_LEARNING_MIN_SEQUENTIAL;
+	relaythreads = 0;
 	if (cfg) {
 		if ((s = ast_variable_retrieve(cfg, "general", "rtpstart"))) {
 			rtpstart = atoi(s);
@@ -3022,6 +4186,13 @@ static int rtp_reload(int reload)
 		if ((s = ast_variable_retrieve(cfg, "general", "strictrtp"))) {
 			strictrtp = ast_true(s);
 		}
+		if ((s = ast_variable_retrieve(cfg, "general", "relaythreads"))) {
+			if (sscanf(s, "%30d", &relaythreads) != 1 || relaythreads < 0 || relaythreads > RTP_RELAY_MAX_THREADS) {
+				ast_log(LOG_WARNING, "Value for 'relaythreads' must be between 0 and %d, disabling the RTP relay\n",
+					RTP_RELAY_MAX_THREADS);
+				relaythreads = 0;
+			}
+		}
 		if ((s = ast_variable_retrieve(cfg, "general", "probation"))) {
 			if ((sscanf(s, "%d", &learning_min_sequential) <= 0) || learning_min_sequential <= 0) {
 				ast_log(LOG_WARNING, "Value for 'probation' could not be read, using default of '%d' instead\n",
@@ -3035,6 +4206,14 @@ static int rtp_reload(int reload)
 		rtpstart = DEFAULT_RTP_START;
 		rtpend = DEFAULT_RTP_END;
 	}
+	if (rtpstart != old_rtpstart || rtpend != old_rtpend || !port_pool.fifo) {
+		rtp_port_pool_build(rtpstart, rtpend);
+	}
+	if (!reload) {
+		rtp_relay_threads_start(relaythreads);
+	} else if (relaythreads != relay_thread_count) {
+		ast_log(LOG_NOTICE, "Ignoring any changes to relaythreads during reload\n");
+	}
 	ast_verb(2, "RTP Allocating from port range %d -> %d\n", rtpstart, rtpend);
 	return 0;
 }
@@ -3058,6 +4237,8 @@ static int load_module(void)
 
 	rtp_reload(0);
 
+	AST_TEST_REGISTER(rtp_relay_benchmark);
+
 	return AST_MODULE_LOAD_SUCCESS;
 }
 
@@ -3065,6 +4246,9 @@ static int unload_module(void)
 {
 	ast_rtp_engine_unregister(&asterisk_rtp_engine);
 	ast_cli_unregister_multiple(cli_rtp, ARRAY_LEN(cli_rtp));
+	AST_TEST_UNREGISTER(rtp_relay_benchmark);
+	rtp_relay_threads_stop();
+	rtp_port_pool_destroy();
 
 	return 0;
 }
@@ -47,11 +47,15 @@ ASTERISK_FILE_VERSION(__FILE__, "$Revision: 377261 $")
 #include "asterisk/options.h"
 #include "asterisk/rtp_engine.h"
 #include "asterisk/astobj2.h"
+#include "asterisk/utils.h"
+#include "asterisk/test.h"
 
 struct ast_srtp {
 	struct ast_rtp_instance *rtp;
 	struct ao2_container *policies;
 	srtp_t session;
+	/*! Serializes use of the session between the channel thread and an RTP relay thread */
+	ast_mutex_t lock;
 	const struct ast_srtp_cb *cb;
 	void *data;
 	int warned;
@@ -77,6 +81,8 @@ static int ast_srtp_unprotect(struct ast_srtp *srtp, void *buf, int *len, int rt
 static int ast_srtp_protect(struct ast_srtp *srtp, void **buf, int *len, int rtcp);
 static void ast_srtp_set_cb(struct ast_srtp *srtp, const struct ast_srtp_cb *cb, void *data);
 static int ast_srtp_get_random(unsigned char *key, size_t len);
+static int ast_srtp_unprotect_batch(struct ast_srtp *srtp, struct ast_srtp_packet *pkts, int count, int rtcp);
+static int ast_srtp_protect_batch(struct ast_srtp *srtp, struct ast_srtp_packet *pkts, int count, int rtcp);
 
 /* Policy functions */
 static struct ast_srtp_policy *ast_srtp_policy_alloc(void);
@@ -94,7 +100,9 @@ static struct ast_srtp_res srtp_res = {
 	.set_cb = ast_srtp_set_cb,
 	.unprotect = ast_srtp_unprotect,
 	.protect = ast_srtp_protect,
-	.get_random = ast_srtp_get_random
+	.get_random = ast_srtp_get_random,
+	.unprotect_batch = ast_srtp_unprotect_batch,
+	.protect_batch = ast_srtp_protect_batch,
 };
 
 static struct ast_srtp_policy_res policy_res = {
@@ -185,6 +193,7 @@ static struct ast_srtp *res_srtp_new(void)
 		return NULL;
 	}
 	
+	ast_mutex_init(&srtp->lock);
 	srtp->warned = 1;
 
 	return srtp;
@@ -317,13 +326,12 @@ static void ast_srtp_set_cb(struct ast_srtp *srtp, const struct ast_srtp_cb *cb,
 	srtp->data = data;
 }
 
-/* Vtable functions */
-static int ast_srtp_unprotect(struct ast_srtp *srtp, void *buf, int *len, int rtcp)
+/*! \note Must be called with the srtp locked */
+static int __ast_srtp_unprotect(struct ast_srtp *srtp, void *buf, int *len, int rtcp)
 {
 	int res = 0;
 	int i;
 	int retry = 0;
-	struct ast_rtp_instance_stats stats = {0,};
 
 tryagain:
 
@@ -334,6 +342,8 @@ tryagain:
 		}
 
 		if (srtp->cb && srtp->cb->no_ctx) {
+			struct ast_rtp_instance_stats stats = {0,};
+
 			if (ast_rtp_instance_get_stats(srtp->rtp, &stats, AST_RTP_INSTANCE_STAT_REMOTE_SSRC)) {
 				break;
 			}
@@ -406,6 +416,18 @@ tryagain:
 	return *len;
 }
 
+/* Vtable functions */
+static int ast_srtp_unprotect(struct ast_srtp *srtp, void *buf, int *len, int rtcp)
+{
+	int res;
+
+	ast_mutex_lock(&srtp->lock);
+	res = __ast_srtp_unprotect(srtp, buf, len, rtcp);
+	ast_mutex_unlock(&srtp->lock);
+
+	return res;
+}
+
 static int ast_srtp_protect(struct ast_srtp *srtp, void **buf, int *len, int rtcp)
 {
 	int res;
@@ -419,7 +441,11 @@ static int ast_srtp_protect(struct ast_srtp *srtp, void **buf, int *len, int rtc
 
 	memcpy(localbuf, *buf, *len);
 
-	if ((res = rtcp ? srtp_protect_rtcp(srtp->session, localbuf, len) : srtp_protect(srtp->session, localbuf, len)) != err_status_ok && res != err_status_replay_fail) {
+	ast_mutex_lock(&srtp->lock);
+	res = rtcp ? srtp_protect_rtcp(srtp->session, localbuf, len) : srtp_protect(srtp->session, localbuf, len);
+	ast_mutex_unlock(&srtp->lock);
+
+	if (res != err_status_ok && res != err_status_replay_fail) {
 		ast_log(LOG_WARNING, "SRTP protect: %s\n", srtp_errstr(res));
 		return -1;
 	}
@@ -428,6 +454,67 @@ static int ast_srtp_protect(struct ast_srtp *srtp, void **buf, int *len, int rtc
 	return *len;
 }
 
+/*!
+ * \brief Unprotect a batch of packets in place
+ *
+ * The session is locked once for the whole batch.  Only packets the fast
+ * path rejects go through the context recovery of the per packet path.
+ */
+static int ast_srtp_unprotect_batch(struct ast_srtp *srtp, struct ast_srtp_packet *pkts, int count, int rtcp)
+{
+	int i, res, done = 0;
+
+	ast_mutex_lock(&srtp->lock);
+	for (i = 0; i < count; i++) {
+		if (pkts[i].len < 0) {
+			continue;
+		}
+		res = rtcp ? srtp_unprotect_rtcp(srtp->session, pkts[i].buf, &pkts[i].len) : srtp_unprotect(srtp->session, pkts[i].buf, &pkts[i].len);
+		if (res == err_status_ok) {
+			done++;
+		} else if (__ast_srtp_unprotect(srtp, pkts[i].buf, &pkts[i].len, rtcp) < 0) {
+			pkts[i].len = -1;
+		} else {
+			done++;
+		}
+	}
+	ast_mutex_unlock(&srtp->lock);
+
+	return done;
+}
+
+/*!
+ * \brief Protect a batch of packets in place
+ *
+ * Unlike ast_srtp_protect() no copy is made, so each buffer must have room
+ * for the SRTP trailer after the packet.
+ */
+static int ast_srtp_protect_batch(struct ast_srtp *srtp, struct ast_srtp_packet *pkts, int count, int rtcp)
+{
+	int i, res, done = 0;
+
+	ast_mutex_lock(&srtp->lock);
+	for (i = 0; i < count; i++) {
+		if (pkts[i].len < 0) {
+			continue;
+		}
+		if (pkts[i].len + SRTP_MAX_TRAILER_LEN > pkts[i].size) {
+			pkts[i].len = -1;
+			continue;
+		}
+		res = rtcp ? srtp_protect_rtcp(srtp->session, pkts[i].buf, &pkts[i].len) : srtp_protect(srtp->session, pkts[i].buf, &pkts[i].len);
+		if (res != err_status_ok && res != err_status_replay_fail) {
+			ast_log(LOG_WARNING, "SRTP protect: %s\n", srtp_errstr(res));
+			pkts[i].len = -1;
+			continue;
+		}
+		done++;
+	}
+	ast_mutex_unlock(&srtp->lock);
+
+	return done;
+}
+
 static int ast_srtp_create(struct ast_srtp **srtp, struct ast_rtp_instance *rtp, struct ast_srtp_policy *policy)
 {
 	struct ast_srtp *temp;
@@ -470,11 +557,13 @@ static void ast_srtp_destroy(struct ast_srtp *srtp)
 	ao2_t_callback(srtp->policies, OBJ_UNLINK | OBJ_NODATA | OBJ_MULTIPLE, NULL, NULL, "Unallocate policy");
 	ao2_t_ref(srtp->policies, -1, "Destroying container");
 
+	ast_mutex_destroy(&srtp->lock);
 	ast_free(srtp);
 	ast_module_unref(ast_module_info->self);
 }
 
-static int ast_srtp_add_stream(struct ast_srtp *srtp, struct ast_srtp_policy *policy)
+/*! \note Must be called with the srtp locked */
+static int __ast_srtp_add_stream(struct ast_srtp *srtp, struct ast_srtp_policy *policy)
 {
 	struct ast_srtp_policy *match;
 
@@ -508,6 +597,17 @@ static int ast_srtp_add_stream(struct ast_srtp *srtp, struct ast_srtp_policy *po
 	return 0;
 }
 
+static int ast_srtp_add_stream(struct ast_srtp *srtp, struct ast_srtp_policy *policy)
+{
+	int res;
+
+	ast_mutex_lock(&srtp->lock);
+	res = __ast_srtp_add_stream(srtp, policy);
+	ast_mutex_unlock(&srtp->lock);
+
+	return res;
+}
+
 static int ast_srtp_change_source(struct ast_srtp *srtp, unsigned int from_ssrc, unsigned int to_ssrc)
 {
 	struct ast_srtp_policy *match;
@@ -520,19 +620,164 @@ static int ast_srtp_change_source(struct ast_srtp *srtp, unsigned int from_ssrc,
 	/* If we find a match, return and unlink it from the container so we
 	 * can change the SSRC (which is part of the hash) and then have
 	 * ast_srtp_add_stream link it back in if all is well */
+	ast_mutex_lock(&srtp->lock);
 	if ((match = find_policy(srtp, &sp, OBJ_POINTER | OBJ_UNLINK))) {
 		match->sp.ssrc.value = to_ssrc;
-		if (ast_srtp_add_stream(srtp, match)) {
+		if (__ast_srtp_add_stream(srtp, match)) {
 			ast_log(LOG_WARNING, "Couldn't add stream\n");
 		} else if ((status = srtp_remove_stream(srtp->session, from_ssrc))) {
 			ast_debug(3, "Couldn't remove stream (%d)\n", status);
 		}
 		ao2_t_ref(match, -1, "Unreffing found policy in change_source");
 	}
+	ast_mutex_unlock(&srtp->lock);
 
 	return 0;
 }
 
+#ifdef TEST_FRAMEWORK
+#define SRTP_BENCH_PACKETS 50000
+#define SRTP_BENCH_BATCH 32
+#define SRTP_BENCH_PAYLOAD 160
+#define SRTP_BENCH_PKTSIZE (12 + SRTP_BENCH_PAYLOAD + SRTP_MAX_TRAILER_LEN)
+
+static void srtp_bench_packet(unsigned char *buf, unsigned int seq)
+{
+	unsigned int *rtpheader = (unsigned int *) buf;
+
+	rtpheader[0] = htonl((2 << 30) | (seq & 0xffff));
+	rtpheader[1] = htonl(seq * SRTP_BENCH_PAYLOAD);
+	rtpheader[2] = htonl(0x5e11a7e5);
+	memset(buf + 12, seq & 0xff, SRTP_BENCH_PAYLOAD);
+}
+
+static int srtp_bench_check(const unsigned char *buf, int len, unsigned int seq)
+{
+	return len == 12 + SRTP_BENCH_PAYLOAD && buf[12] == (seq & 0xff) && buf[11 + SRTP_BENCH_PAYLOAD] == (seq & 0xff);
+}
+
+static struct ast_srtp *srtp_bench_session(const unsigned char *key, const unsigned char *salt, int inbound)
+{
+	struct ast_srtp_policy *policy;
+	struct ast_srtp *srtp = NULL;
+
+	if (!(policy = ast_srtp_policy_alloc())) {
+		return NULL;
+	}
+	if (ast_srtp_policy_set_suite(policy, AST_AES_CM_128_HMAC_SHA1_80) ||
+		ast_srtp_policy_set_master_key(policy, key, 16, salt, 14)) {
+		ast_srtp_policy_destroy(policy);
+		return NULL;
+	}
+	ast_srtp_policy_set_ssrc(policy, 0, inbound);
+	if (ast_srtp_create(&srtp, NULL, policy)) {
+		srtp = NULL;
+	}
+	ast_srtp_policy_destroy(policy);
+
+	return srtp;
+}
+
+AST_TEST_DEFINE(srtp_batch_benchmark)
+{
+	enum ast_test_result_state res = AST_TEST_PASS;
+	struct ast_srtp *tx = NULL, *rx = NULL;
+	struct ast_srtp_packet pkts[SRTP_BENCH_BATCH];
+	unsigned char (*bufs)[SRTP_BENCH_PKTSIZE] = NULL;
+	unsigned char key[16], salt[14];
+	unsigned int seq = 1, i, j, failed = 0;
+	struct timeval start;
+	int64_t single_us, batch_us;
+
+	switch (cmd) {
+	case TEST_INIT:
+		info->name = "srtp_batch_benchmark";
+		info->category = "/res/res_srtp/";
+		info->summary = "SRTP per packet versus batched throughput";
+		info->description =
+			"Protects and unprotects a stream of RTP packets one at a time, as the "
+			"RTP engine does, and then in batches, checking every packet survives "
+			"the round trip and reporting packets per second for both.";
+		return AST_TEST_NOT_RUN;
+	case TEST_EXECUTE:
+		break;
+	}
+
+	if (ast_srtp_get_random(key, sizeof(key)) || ast_srtp_get_random(salt, sizeof(salt))) {
+		ast_test_status_update(test, "Unable to generate a master key\n");
+		return AST_TEST_FAIL;
+	}
+	if (!(tx = srtp_bench_session(key, salt, 0)) || !(rx = srtp_bench_session(key, salt, 1)) ||
+		!(bufs = ast_calloc(SRTP_BENCH_BATCH, sizeof(*bufs)))) {
+		ast_test_status_update(test, "Unable to set up SRTP sessions\n");
+		res = AST_TEST_FAIL;
+		goto cleanup;
+	}
+
+	/* One packet at a time, through the same calls __rtp_sendto() and __rtp_recvfrom() make */
+	start = ast_tvnow();
+	for (i = 0; i < SRTP_BENCH_PACKETS; i++, seq++) {
+		void *out = bufs[0];
+		int len = 12 + SRTP_BENCH_PAYLOAD;
+
+		srtp_bench_packet(bufs[0], seq);
+		if (ast_srtp_protect(tx, &out, &len, 0) < 0) {
+			failed++;
+			continue;
+		}
+		memcpy(bufs[1], out, len);
+		if (ast_srtp_unprotect(rx, bufs[1], &len, 0) < 0 || !srtp_bench_check(bufs[1], len, seq)) {
+			failed++;
+		}
+	}
+	single_us = ast_tvdiff_us(ast_tvnow(), start);
+
+	/* The same number of packets in batches, in place */
+	start = ast_tvnow();
+	for (i = 0; i < SRTP_BENCH_PACKETS; i += SRTP_BENCH_BATCH) {
+		unsigned int count = MIN(SRTP_BENCH_BATCH, SRTP_BENCH_PACKETS - i);
+
+		for (j = 0; j < count; j++) {
+			srtp_bench_packet(bufs[j], seq + j);
+			pkts[j].buf = bufs[j];
+			pkts[j].len = 12 + SRTP_BENCH_PAYLOAD;
+			pkts[j].size = sizeof(bufs[j]);
+		}
+		ast_srtp_protect_batch(tx, pkts, count, 0);
+		ast_srtp_unprotect_batch(rx, pkts, count, 0);
+		for (j = 0; j < count; j++) {
+			if (pkts[j].len < 0 || !srtp_bench_check(bufs[j], pkts[j].len, seq + j)) {
+				failed++;
+			}
+		}
+		seq += count;
+	}
+	batch_us = ast_tvdiff_us(ast_tvnow(), start);
+
+	ast_test_status_update(test, "%d packets: per packet %.0f pps, batches of %d %.0f pps\n",
+		SRTP_BENCH_PACKETS,
+		single_us ? SRTP_BENCH_PACKETS * 1000000.0 / single_us : 0.0,
+		SRTP_BENCH_BATCH,
+		batch_us ? SRTP_BENCH_PACKETS * 1000000.0 / batch_us : 0.0);
+
+	if (failed) {
+		ast_test_status_update(test, "%u packets did not survive the round trip\n", failed);
+		res = AST_TEST_FAIL;
+	}
+
+cleanup:
+	if (tx) {
+		ast_srtp_destroy(tx);
+	}
+	if (rx) {
+		ast_srtp_destroy(rx);
+	}
+	ast_free(bufs);
+
+	return res;
+}
+#endif
+
 static void res_srtp_shutdown(void)
 {
 	srtp_install_event_handler(NULL);
@@ -569,11 +814,13 @@ static int res_srtp_init(void)
 
 static int load_module(void)
 {
+	AST_TEST_REGISTER(srtp_batch_benchmark);
 	return res_srtp_init();
 }
 
 static int unload_module(void)
 {
+	AST_TEST_UNREGISTER(srtp_batch_benchmark);
 	res_srtp_shutdown();
 	return 0;
 }
@@ -0,0 +1,217 @@
+/*
+ * Asterisk -- An open source telephony toolkit.
+ *
+ * See http://www.asterisk.org for more information about
+ * the Asterisk project. Please do not directly contact
+ * any of the maintainers of this project for assistance;
+ * the project provides a web site, mailing lists and IRC
+ * channels for your use.
+ *
+ * This program is free software, distributed under the terms of
+ * the GNU General Public License Version 2. See the LICENSE file
+ * at the top of the source tree.
+ */
+
+/*! \file
+ *
+ * \brief Audiohook tests
+ *
+ * Stacks several spies on one channel, passes audio through its audiohook
+ * list in both directions, and checks that every spy reads all of it from
+ * the shared tap.
+ */
+
+/*** MODULEINFO
+	<depend>TEST_FRAMEWORK</depend>
+	<support_level>core</support_level>
+ ***/
+
+#include "asterisk.h"
+
+ASTERISK_FILE_VERSION(__FILE__, "$Revision$")
+
+#include "asterisk/module.h"
+#include "asterisk/utils.h"
+#include "asterisk/channel.h"
+#include "asterisk/audiohook.h"
+#include "asterisk/frame.h"
+#include "asterisk/test.h"
+
+/*! Spies stacked on the channel */
+#define SPY_COUNT 3
+/*! Frames passed in each direction */
+#define SPY_FRAMES 20
+/*! Samples per frame, 20 ms of 8 kHz signed linear */
+#define SPY_SAMPLES 160
+
+static int16_t spy_sample(int direction, int frame, int sample)
+{
+	return (direction ? -1 : 1) * ((frame * SPY_SAMPLES + sample) % 4000);
+}
+
+/*! \brief Pass one frame of each direction through a channel's audiohooks */
+static void spy_feed(struct ast_channel *chan, int n)
+{
+	int16_t buf[SPY_SAMPLES];
+	struct ast_frame f = {
+		.frametype = AST_FRAME_VOICE,
+		.data.ptr = buf,
+		.datalen = sizeof(buf),
+		.samples = SPY_SAMPLES,
+		.src = "test_audiohook",
+	};
+	int d, i;
+
+	ast_format_set(&f.subclass.format, AST_FORMAT_SLINEAR, 0);
+	for (d = 0; d < 2; d++) {
+		for (i = 0; i < SPY_SAMPLES; i++) {
+			buf[i] = spy_sample(d, n, i);
+		}
+		ast_channel_lock(chan);
+		ast_audiohook_write_list(chan, chan->audiohooks,
+			d ? AST_AUDIOHOOK_DIRECTION_WRITE : AST_AUDIOHOOK_DIRECTION_READ, &f);
+		ast_channel_unlock(chan);
+	}
+}
+
+/*! \brief Read a frame of both directions from a spy and check it against what was fed */
+static int spy_check(struct ast_test *test, struct ast_audiohook *spy, int id, int n)
+{
+	struct ast_frame *mixed, *read_frame = NULL, *write_frame = NULL;
+	struct ast_format slin;
+	int16_t *data;
+	int i, res = 0;
+
+	ast_format_set(&slin, AST_FORMAT_SLINEAR, 0);
+	ast_audiohook_lock(spy);
+	mixed = ast_audiohook_read_frame_all(spy, SPY_SAMPLES, &slin, &read_frame, &write_frame);
+	ast_audiohook_unlock(spy);
+
+	if (!mixed || !read_frame || !write_frame) {
+		ast_test_status_update(test, "Spy %d got no audio for frame %d\n", id, n);
+		res = -1;
+		goto cleanup;
+	}
+	for (i = 0; i < SPY_SAMPLES; i++) {
+		int16_t r = spy_sample(0, n, i), w = spy_sample(1, n, i);
+
+		if (((int16_t *) read_frame->data.ptr)[i] != r || ((int16_t *) write_frame->data.ptr)[i] != w) {
+			ast_test_status_update(test, "Spy %d read the wrong audio at sample %d of frame %d\n", id, i, n);
+			res = -1;
+			break;
+		}
+		data = mixed->data.ptr;
+		ast_slinear_saturated_add(&r, &w);
+		if (data[i] != r) {
+			ast_test_status_update(test, "Spy %d mixed sample %d of frame %d to %d, expected %d\n",
+				id, i, n, data[i], r);
+			res = -1;
+			break;
+		}
+	}
+
+cleanup:
+	if (mixed) {
+		ast_frfree(mixed);
+	}
+	if (read_frame) {
+		ast_frfree(read_frame);
+	}
+	if (write_frame) {
+		ast_frfree(write_frame);
+	}
+
+	return res;
+}
+
+AST_TEST_DEFINE(audiohook_shared_tap)
+{
+	struct ast_audiohook spies[SPY_COUNT];
+	enum ast_test_result_state res = AST_TEST_PASS;
+	struct ast_channel *chan;
+	int i, n, attached = 0;
+
+	switch (cmd) {
+	case TEST_INIT:
+		info->name = "audiohook_shared_tap";
+		info->category = "/main/audiohook/";
+		info->summary = "stacked spies share one signed linear tap";
+		info->description =
+			"Attaches several spies to a channel, one of them only once audio "
+			"has started flowing, and passes frames through the channel's "
+			"audiohooks in both directions. Each spy must read exactly the "
+			"audio that passed while it was attached, mixed and unmixed.";
+		return AST_TEST_NOT_RUN;
+	case TEST_EXECUTE:
+		break;
+	}
+
+	if (!(chan = ast_dummy_channel_alloc())) {
+		return AST_TEST_FAIL;
+	}
+
+	for (i = 0; i < SPY_COUNT; i++) {
+		ast_audiohook_init(&spies[i], AST_AUDIOHOOK_TYPE_SPY, "test_audiohook", 0);
+	}
+
+	/* All but the last spy are there from the start */
+	for (; attached < SPY_COUNT - 1; attached++) {
+		if (ast_audiohook_attach(chan, &spies[attached])) {
+			ast_test_status_update(test, "Unable to attach spy %d\n", attached);
+			res = AST_TEST_FAIL;
+			goto cleanup;
+		}
+	}
+
+	for (n = 0; n < SPY_FRAMES; n++) {
+		if (n == SPY_FRAMES / 2) {
+			if (ast_audiohook_attach(chan, &spies[attached])) {
+				ast_test_status_update(test, "Unable to attach spy %d\n", attached);
+				res = AST_TEST_FAIL;
+				goto cleanup;
+			}
+			attached++;
+		}
+		spy_feed(chan, n);
+	}
+
+	for (i = 0; i < SPY_COUNT; i++) {
+		for (n = (i == SPY_COUNT - 1 ? SPY_FRAMES / 2 : 0); n < SPY_FRAMES; n++) {
+			if (spy_check(test, &spies[i], i, n)) {
+				res = AST_TEST_FAIL;
+				break;
+			}
+		}
+	}
+
+cleanup:
+	for (i = 0; i < attached; i++) {
+		ast_audiohook_remove(chan, &spies[i]);
+	}
+	for (i = 0; i < SPY_COUNT; i++) {
+		ast_audiohook_destroy(&spies[i]);
+	}
+	if (chan->audiohooks) {
+		ast_audiohook_detach_list(chan->audiohooks);
+		chan->audiohooks = NULL;
+	}
+	ast_channel_unref(chan);
+
+	return res;
+}
+
+static int unload_module(void)
+{
+	AST_TEST_UNREGISTER(audiohook_shared_tap);
+
+	return 0;
+}
+
+static int load_module(void)
+{
+	AST_TEST_REGISTER(audiohook_shared_tap);
+
+	return AST_MODULE_LOAD_SUCCESS;
+}
+
+AST_MODULE_INFO_STANDARD(ASTERISK_GPL_KEY, "Audiohook test module");
@@ -0,0 +1,798 @@
+/*
+ * Asterisk -- An open source telephony toolkit.
+ *
+ * See http://www.asterisk.org for more information about
+ * the Asterisk project. Please do not directly contact
+ * any of the maintainers of this project for assistance;
+ * the project provides a web site, mailing lists and IRC
+ * channels for your use.
+ *
+ * This program is free software, distributed under the terms of
+ * the GNU General Public License Version 2. See the LICENSE file
+ * at the top of the source tree.
+ */
+
+/*! \file
+ *
+ * \brief Bridge and channel media path benchmark
+ *
+ * Connects pairs of channels of a small pipe driven channel technology
+ * through each of the ways Asterisk can bridge two channels, sends frames
+ * both ways on every call at a steady rate, and reports the frames carried
+ * per second, the time each frame took to get through and the CPU used per
+ * call.  Nothing leaves the process, so no network or hardware is needed.
+ *
+ * The paths measured are:
+ * - generic: ast_channel_bridge(), which runs the generic bridge
+ * - features: ast_bridge_call(), the generic bridge with the features layer
+ * - multiplexed, simple, softmix: the bridging API with each technology
+ * - local: both channels bridged to either end of a Local channel
+ *
+ * A second test loads the multiplexed bridge with a few hundred calls and
+ * reports how many such calls one CPU core could carry.
+ */
+
+/*** MODULEINFO
+	<depend>TEST_FRAMEWORK</depend>
+	<support_level>core</support_level>
+ ***/
+
+#include "asterisk.h"
+
+ASTERISK_FILE_VERSION(__FILE__, "$Revision$")
+
+#include <fcntl.h>
+#include <sys/resource.h>
+
+#include "asterisk/module.h"
+#include "asterisk/utils.h"
+#include "asterisk/lock.h"
+#include "asterisk/cli.h"
+#include "asterisk/pbx.h"
+#include "asterisk/channel.h"
+#include "asterisk/features.h"
+#include "asterisk/bridging.h"
+#include "asterisk/bridging_technology.h"
+#include "asterisk/frame.h"
+#include "asterisk/test.h"
+
+/*! Samples per frame, 20 ms of 8 kHz signed linear */
+#define BRIDGE_BENCH_SAMPLES 160
+/*! First sample of every frame sent, so frames that carry a send time can be told apart */
+#define BRIDGE_BENCH_MARKER 0x0555
+/*! Amplitude of the square wave filling the rest of each frame, well above the DSP silence threshold */
+#define BRIDGE_BENCH_LEVEL 1000
+/*! Defaults used by the test and by the CLI when no value is given */
+#define BRIDGE_BENCH_CALLS 10
+#define BRIDGE_BENCH_RATE 50
+#define BRIDGE_BENCH_SECONDS 1
+/*! Calls and duration of the multiplexed calls per core test */
+#define BRIDGE_BENCH_MUX_CALLS 250
+#define BRIDGE_BENCH_MUX_SECONDS 3
+
+static const char bench_context[] = "test_bridge_bench";
+static const char bench_app[] = "BridgeBenchLeg";
+static const char registrar[] = "test_bridge_bench";
+
+enum bridge_bench_method {
+	BENCH_GENERIC,
+	BENCH_FEATURES,
+	BENCH_BRIDGING,
+	BENCH_LOCAL,
+};
+
+/*! \brief A way of connecting two channels */
+struct bridge_bench_path {
+	const char *name;
+	enum bridge_bench_method method;
+	/*! Capabilities asked of the bridging API */
+	uint32_t capabilities;
+	/*! Bridge technology the capabilities must select */
+	const char *technology;
+	/*! Mixes rather than forwards, so a frame may be replaced by the next before it is read */
+	unsigned int lossy:1;
+};
+
+static const struct bridge_bench_path bench_paths[] = {
+	{ "generic", BENCH_GENERIC, },
+	{ "features", BENCH_FEATURES, },
+	{ "multiplexed", BENCH_BRIDGING, AST_BRIDGE_CAPABILITY_1TO1MIX, "multiplexed_bridge", },
+	/* Only bridge_simple runs a thread per bridge for two channels */
+	{ "simple", BENCH_BRIDGING, AST_BRIDGE_CAPABILITY_THREAD, "simple_bridge", },
+	{ "softmix", BENCH_BRIDGING, AST_BRIDGE_CAPABILITY_MULTIMIX, "softmix", 1, },
+	{ "local", BENCH_LOCAL, },
+};
+
+/*! \brief One synthetic channel */
+struct bridge_bench_leg {
+	struct ast_channel *chan;
+	/*! Frames are sent by writing their send time here */
+	int pipe[2];
+	struct ast_frame frame;
+	int16_t buf[BRIDGE_BENCH_SAMPLES];
+};
+
+struct bridge_bench_call {
+	struct bridge_bench_leg legs[2];
+	/*! Bridge used by the bridging API paths */
+	struct ast_bridge *bridge;
+	/*! Thread bridging the first leg for the other paths */
+	pthread_t thread;
+	/*! Local channel the first leg is bridged to on the local path */
+	struct ast_channel *local;
+	/*! Set while the far end of the Local channel is bridged to the second leg */
+	int local_bridged;
+};
+
+/*! \brief One run of the benchmark over a path */
+struct bridge_bench_run {
+	const struct bridge_bench_path *path;
+	unsigned int calls;
+	unsigned int rate;
+	unsigned int seconds;
+	struct bridge_bench_call *call;
+	struct timeval start;
+	/*! Frames sent and delivered */
+	int sent;
+	int delivered;
+	/*! Time each delivered frame took to get through, in microseconds */
+	int *latency;
+	int max_latency;
+	int64_t cpu;
+	int64_t wall;
+};
+
+/*! Only one run at a time, the channels find it here */
+static struct bridge_bench_run *bench_run;
+AST_MUTEX_DEFINE_STATIC(bench_lock);
+
+static struct ast_frame *bench_read(struct ast_channel *chan)
+{
+	struct bridge_bench_leg *leg = chan->tech_pvt;
+	int64_t sent;
+
+	if (read(leg->pipe[0], &sent, sizeof(sent)) != sizeof(sent)) {
+		return &ast_null_frame;
+	}
+
+	/*
+	 * The send time travels in the audio itself, in small enough pieces
+	 * that softmix adding and removing the far end's audio leaves it intact.
+	 * The rest of the frame is loud enough for softmix not to take it for
+	 * silence, which would stop it removing each talker's own audio.
+	 */
+	leg->buf[0] = BRIDGE_BENCH_MARKER;
+	leg->buf[1] = (sent >> 24) & 0xFFF;
+	leg->buf[2] = (sent >> 12) & 0xFFF;
+	leg->buf[3] = sent & 0xFFF;
+	leg->frame.frametype = AST_FRAME_VOICE;
+	ast_format_set(&leg->frame.subclass.format, AST_FORMAT_SLINEAR, 0);
+	leg->frame.data.ptr = leg->buf;
+	leg->frame.datalen = sizeof(leg->buf);
+	leg->frame.samples = BRIDGE_BENCH_SAMPLES;
+	leg->frame.src = "test_bridge_bench";
+	leg->frame.mallocd = 0;
+
+	return &leg->frame;
+}
+
+static int bench_write(struct ast_channel *chan, struct ast_frame *frame)
+{
+	struct bridge_bench_run *run = bench_run;
+	int16_t *buf = frame->data.ptr;
+	int64_t sent;
+	int n;
+
+	if (!run || frame->frametype != AST_FRAME_VOICE || frame->datalen < 4 * sizeof(*buf) ||
+		buf[0] != BRIDGE_BENCH_MARKER) {
+		return 0;
+	}
+
+	/* Send times are one based so that a mix of silence is never taken for one */
+	sent = ((int64_t) buf[1] << 24) | (buf[2] << 12) | buf[3];
+	if (!sent) {
+		return 0;
+	}
+	n = ast_atomic_fetchadd_int(&run->delivered, 1);
+	if (n < run->max_latency) {
+		run->latency[n] = ast_tvdiff_us(ast_tvnow(), run->start) - (sent - 1);
+	}
+
+	return 0;
+}
+
+static int bench_hangup(struct ast_channel *chan)
+{
+	chan->tech_pvt = NULL;
+	return 0;
+}
+
+static struct ast_channel_tech bench_tech = {
+	.type = "BridgeBench",
+	.description = "Bridge benchmark channel",
+	.read = bench_read,
+	.write = bench_write,
+	.hangup = bench_hangup,
+};
+
+static int bench_leg_setup(struct bridge_bench_leg *leg, int call, int side)
+{
+	struct ast_format slin;
+	int i;
+
+	for (i = 4; i < BRIDGE_BENCH_SAMPLES; i++) {
+		leg->buf[i] = (i & 8) ? BRIDGE_BENCH_LEVEL : -BRIDGE_BENCH_LEVEL;
+	}
+
+	if (pipe(leg->pipe)) {
+		leg->pipe[0] = leg->pipe[1] = -1;
+		return -1;
+	}
+	for (i = 0; i < 2; i++) {
+		fcntl(leg->pipe[i], F_SETFL, fcntl(leg->pipe[i], F_GETFL) | O_NONBLOCK);
+	}
+
+	if (!(leg->chan = ast_channel_alloc(1, AST_STATE_UP, NULL, NULL, NULL, NULL, NULL, NULL, 0, "BridgeBench/%d-%c", call, side ? 'b' : 'a'))) {
+		return -1;
+	}
+	leg->chan->tech = &bench_tech;
+	leg->chan->tech_pvt = leg;
+	ast_format_set(&slin, AST_FORMAT_SLINEAR, 0);
+	ast_format_cap_add(leg->chan->nativeformats, &slin);
+	ast_format_copy(&leg->chan->readformat, &slin);
+	ast_format_copy(&leg->chan->rawreadformat, &slin);
+	ast_format_copy(&leg->chan->writeformat, &slin);
+	ast_format_copy(&leg->chan->rawwriteformat, &slin);
+	ast_channel_set_fd(leg->chan, 0, leg->pipe[0]);
+
+	return 0;
+}
+
+/*! \brief Run the generic bridge between two channels until either is hung up */
+static void bench_generic_bridge(struct ast_channel *c0, struct ast_channel *c1)
+{
+	while (!ast_check_hangup_locked(c0) && !ast_check_hangup_locked(c1)) {
+		struct ast_bridge_config config = { { 0, }, };
+		struct ast_frame *fo = NULL;
+		struct ast_channel *rc = NULL;
+
+		ast_channel_bridge(c0, c1, &config, &fo, &rc);
+		if (fo) {
+			ast_frfree(fo);
+		}
+	}
+}
+
+static void *bench_call_thread(void *data)
+{
+	struct bridge_bench_call *call = data;
+	struct ast_bridge_config config = { { 0, }, };
+
+	switch (bench_run->path->method) {
+	case BENCH_GENERIC:
+		bench_generic_bridge(call->legs[0].chan, call->legs[1].chan);
+		break;
+	case BENCH_FEATURES:
+		ast_bridge_call(call->legs[0].chan, call->legs[1].chan, &config);
+		break;
+	case BENCH_LOCAL:
+		bench_generic_bridge(call->legs[0].chan, call->local);
+		break;
+	case BENCH_BRIDGING:
+		break;
+	}
+
+	return NULL;
+}
+
+/*! \brief Dialplan application run by the far end of each Local channel */
+static int bench_local_exec(struct ast_channel *chan, const char *data)
+{
+	struct bridge_bench_run *run = bench_run;
+	struct bridge_bench_call *call;
+	unsigned int n;
+
+	if (!run || sscanf(data, "%30u", &n) != 1 || n >= run->calls) {
+		return -1;
+	}
+	call = &run->call[n];
+
+	call->local_bridged = 1;
+	bench_generic_bridge(chan, call->legs[1].chan);
+	call->local_bridged = 0;
+
+	return -1;
+}
+
+static int bench_call_setup(struct bridge_bench_run *run, int n)
+{
+	struct bridge_bench_call *call = &run->call[n];
+	struct ast_format_cap *cap;
+	struct ast_format slin;
+	char dest[64];
+	int cause, i;
+
+	for (i = 0; i < 2; i++) {
+		if (bench_leg_setup(&call->legs[i], n, i)) {
+			return -1;
+		}
+	}
+
+	switch (run->path->method) {
+	case BENCH_BRIDGING:
+		if (!(call->bridge = ast_bridge_new(run->path->capabilities, 0))) {
+			return -1;
+		}
+		for (i = 0; i < 2; i++) {
+			if (ast_bridge_impart(call->bridge, call->legs[i].chan, NULL, NULL, 0)) {
+				return -1;
+			}
+		}
+		return 0;
+	case BENCH_LOCAL:
+		if (!(cap = ast_format_cap_alloc_nolock())) {
+			return -1;
+		}
+		ast_format_cap_add(cap, ast_format_set(&slin, AST_FORMAT_SLINEAR, 0));
+		snprintf(dest, sizeof(dest), "%d@%s/n", n, bench_context);
+		call->local = ast_request("Local", cap, NULL, dest, &cause);
+		cap = ast_format_cap_destroy(cap);
+		if (!call->local || ast_call(call->local, dest, 0)) {
+			return -1;
+		}
+		break;
+	case BENCH_GENERIC:
+	case BENCH_FEATURES:
+		break;
+	}
+
+	if (ast_pthread_create(&call->thread, NULL, bench_call_thread, call)) {
+		call->thread = AST_PTHREADT_NULL;
+		return -1;
+	}
+
+	return 0;
+}
+
+static int bench_call_joined(struct bridge_bench_run *run, struct bridge_bench_call *call)
+{
+	switch (run->path->method) {
+	case BENCH_BRIDGING:
+		return call->bridge->num == 2;
+	case BENCH_LOCAL:
+		return call->legs[0].chan->_bridge && call->local_bridged;
+	case BENCH_GENERIC:
+	case BENCH_FEATURES:
+		break;
+	}
+
+	return call->legs[0].chan->_bridge != NULL;
+}
+
+static void bench_call_destroy(struct bridge_bench_call *call)
+{
+	int i, waited;
+
+	if (call->bridge) {
+		for (i = 0; i < 2; i++) {
+			if (call->legs[i].chan) {
+				ast_bridge_depart(call->bridge, call->legs[i].chan);
+			}
+		}
+		ast_bridge_destroy(call->bridge);
+	}
+
+	if (call->thread != AST_PTHREADT_NULL) {
+		ast_softhangup(call->legs[0].chan, AST_SOFTHANGUP_EXPLICIT);
+		pthread_join(call->thread, NULL);
+	}
+
+	if (call->local) {
+		/* Hang up the Local channel and wait for its far end to let go of the second leg */
+		ast_softhangup(call->legs[1].chan, AST_SOFTHANGUP_EXPLICIT);
+		ast_hangup(call->local);
+		for (waited = 0; call->local_bridged && waited < 5000; waited += 10) {
+			usleep(10000);
+		}
+		if (call->local_bridged) {
+			ast_log(LOG_WARNING, "%s is still bridged, leaking it\n", call->legs[1].chan->name);
+			call->legs[1].chan = NULL;
+		}
+	}
+
+	for (i = 0; i < 2; i++) {
+		if (call->legs[i].chan) {
+			ast_hangup(call->legs[i].chan);
+		}
+		if (call->legs[i].pipe[0] > -1) {
+			close(call->legs[i].pipe[0]);
+			close(call->legs[i].pipe[1]);
+		}
+	}
+}
+
+static int64_t rusage_usecs(void)
+{
+	struct rusage usage;
+
+	getrusage(RUSAGE_SELF, &usage);
+	return (int64_t) (usage.ru_utime.tv_sec + usage.ru_stime.tv_sec) * 1000000 +
+		usage.ru_utime.tv_usec + usage.ru_stime.tv_usec;
+}
+
+/*!
+ * \brief Check that a path can be measured with the modules loaded
+ *
+ * \retval NULL if it can
+ * \retval reason it cannot otherwise
+ */
+static const char *bench_path_unavailable(const struct bridge_bench_path *path)
+{
+	struct ast_bridge *bridge;
+	const char *reason = NULL;
+
+	switch (path->method) {
+	case BENCH_BRIDGING:
+		if (!(bridge = ast_bridge_new(path->capabilities, 0))) {
+			return "no bridge technology is available";
+		}
+		if (strcmp(bridge->technology->name, path->technology)) {
+			reason = "its bridge technology is not loaded";
+		}
+		ast_bridge_destroy(bridge);
+		break;
+	case BENCH_LOCAL:
+		if (!ast_get_channel_tech("Local")) {
+			reason = "chan_local is not loaded";
+		}
+		break;
+	case BENCH_GENERIC:
+	case BENCH_FEATURES:
+		break;
+	}
+
+	return reason;
+}
+
+static int int_cmp(const void *a, const void *b)
+{
+	return *(const int *) a - *(const int *) b;
+}
+
+/*!
+ * \brief Send frames through a path for a while
+ *
+ * \retval 0 if the calls were set up and frames sent
+ * \retval -1 otherwise
+ *
+ * \note Called with bench_lock held.
+ */
+static int bench_path_run(struct bridge_bench_run *run)
+{
+	struct timeval next, interval = ast_samp2tv(1, run->rate);
+	unsigned int i, j, joined;
+	int waited, res = 0;
+
+	if (!(run->call = ast_calloc(run->calls, sizeof(*run->call)))) {
+		return -1;
+	}
+	run->max_latency = run->calls * 2 * run->rate * (run->seconds + 1);
+	if (!(run->latency = ast_calloc(run->max_latency, sizeof(*run->latency)))) {
+		ast_free(run->call);
+		return -1;
+	}
+	for (i = 0; i < run->calls; i++) {
+		run->call[i].thread = AST_PTHREADT_NULL;
+		run->call[i].legs[0].pipe[0] = run->call[i].legs[1].pipe[0] = -1;
+	}
+	run->start = ast_tvnow();
+	bench_run = run;
+
+	for (i = 0; i < run->calls; i++) {
+		if (bench_call_setup(run, i)) {
+			res = -1;
+			goto cleanup;
+		}
+	}
+
+	/* Wait for every call to be connected before timing anything */
+	for (waited = 0; waited < 5000; waited += 10) {
+		for (i = 0, joined = 0; i < run->calls; i++) {
+			joined += bench_call_joined(run, &run->call[i]);
+		}
+		if (joined == run->calls) {
+			break;
+		}
+		usleep(10000);
+	}
+	if (joined != run->calls) {
+		res = -1;
+		goto cleanup;
+	}
+
+	run->delivered = 0;
+	run->start = next = ast_tvnow();
+	run->cpu = rusage_usecs();
+	while (ast_tvdiff_ms(ast_tvnow(), run->start) < run->seconds * 1000) {
+		int64_t sent = ast_tvdiff_us(ast_tvnow(), run->start) + 1;
+
+		for (i = 0; i < run->calls; i++) {
+			for (j = 0; j < 2; j++) {
+				if (write(run->call[i].legs[j].pipe[1], &sent, sizeof(sent)) == sizeof(sent)) {
+					run->sent++;
+				}
+			}
+		}
+		next = ast_tvadd(next, interval);
+		if (ast_tvcmp(next, ast_tvnow()) > 0) {
+			usleep(ast_tvdiff_us(next, ast_tvnow()));
+		}
+	}
+	/* Give the last frames time to get through */
+	usleep(100000);
+	run->cpu = rusage_usecs() - run->cpu;
+	run->wall = ast_tvdiff_us(ast_tvnow(), run->start);
+
+cleanup:
+	for (i = 0; i < run->calls; i++) {
+		bench_call_destroy(&run->call[i]);
+	}
+	bench_run = NULL;
+	ast_free(run->call);
+	run->call = NULL;
+
+	if (run->delivered > run->max_latency) {
+		run->delivered = run->max_latency;
+	}
+	qsort(run->latency, run->delivered, sizeof(*run->latency), int_cmp);
+
+	return res;
+}
+
+/*! \brief Describe the result of a run on one line */
+static void bench_path_report(struct bridge_bench_run *run, char *buf, size_t size)
+{
+	int *latency = run->latency;
+	int n = run->delivered;
+
+	if (!n || !run->wall) {
+		snprintf(buf, size, "%s: %u calls, no frames delivered\n", run->path->name, run->calls);
+		return;
+	}
+
+	snprintf(buf, size, "%s: %u calls at %u fps, %d of %d frames delivered, %.0f frames/s, "
+		"latency p50 %d us p90 %d us p99 %d us max %d us, %.3f%% of a core per call\n",
+		run->path->name, run->calls, run->rate, n, run->sent,
+		(double) n * 1000000.0 / run->wall,
+		latency[n / 2], latency[n * 9 / 10], latency[n * 99 / 100], latency[n - 1],
+		(double) run->cpu * 100.0 / run->wall / run->calls);
+}
+
+static void bench_run_free(struct bridge_bench_run *run)
+{
+	ast_free(run->latency);
+	run->latency = NULL;
+}
+
+static char *handle_cli_bridge_bench(struct ast_cli_entry *e, int cmd, struct ast_cli_args *a)
+{
+	struct bridge_bench_run run;
+	char report[256];
+	const char *reason;
+	unsigned int calls = BRIDGE_BENCH_CALLS, rate = BRIDGE_BENCH_RATE, seconds = BRIDGE_BENCH_SECONDS;
+	int i, found = 0;
+
+	switch (cmd) {
+	case CLI_INIT:
+		e->command = "bridge benchmark";
+		e->usage = ""
+			"Usage: bridge benchmark {generic|features|multiplexed|simple|softmix|local|all} [<calls> [<rate> [<seconds>]]]\n"
+			"       Bridges <calls> pairs of synthetic channels the given way and sends\n"
+			"       <rate> frames a second both ways on every call for <seconds>.\n"
+			"       Reports frames per second, latency percentiles and CPU per call.\n"
+			"       softmix mixes every 20 ms, so it only delivers every frame at 50.\n"
+			"";
+		return NULL;
+	case CLI_GENERATE:
+		return NULL;
+	}
+
+	if (a->argc < e->args + 1 || a->argc > e->args + 4) {
+		return CLI_SHOWUSAGE;
+	}
+	if ((a->argc > e->args + 1 && (sscanf(a->argv[e->args + 1], "%30u", &calls) != 1 || !calls)) ||
+		(a->argc > e->args + 2 && (sscanf(a->argv[e->args + 2], "%30u", &rate) != 1 || !rate || rate > 1000)) ||
+		(a->argc > e->args + 3 && (sscanf(a->argv[e->args + 3], "%30u", &seconds) != 1 || !seconds))) {
+		return CLI_SHOWUSAGE;
+	}
+
+	if (ast_mutex_trylock(&bench_lock)) {
+		ast_cli(a->fd, "A bridge benchmark is already running\n");
+		return CLI_FAILURE;
+	}
+	for (i = 0; i < ARRAY_LEN(bench_paths); i++) {
+		if (strcasecmp(a->argv[e->args], "all") && strcasecmp(a->argv[e->args], bench_paths[i].name)) {
+			continue;
+		}
+		found = 1;
+		if ((reason = bench_path_unavailable(&bench_paths[i]))) {
+			ast_cli(a->fd, "%s: skipped, %s\n", bench_paths[i].name, reason);
+			continue;
+		}
+		memset(&run, 0, sizeof(run));
+		run.path = &bench_paths[i];
+		run.calls = calls;
+		run.rate = rate;
+		run.seconds = seconds;
+		if (bench_path_run(&run)) {
+			ast_cli(a->fd, "%s: unable to set up the calls\n", run.path->name);
+		} else {
+			bench_path_report(&run, report, sizeof(report));
+			ast_cli(a->fd, "%s", report);
+		}
+		bench_run_free(&run);
+	}
+	ast_mutex_unlock(&bench_lock);
+
+	return found ? CLI_SUCCESS : CLI_SHOWUSAGE;
+}
+
+static struct ast_cli_entry cli_bridge_bench[] = {
+	AST_CLI_DEFINE(handle_cli_bridge_bench, "Benchmark the media path of each way of bridging two channels"),
+};
+
+AST_TEST_DEFINE(bridge_media_path)
+{
+	enum ast_test_result_state res = AST_TEST_PASS;
+	struct bridge_bench_run run;
+	char report[256];
+	const char *reason;
+	int i;
+
+	switch (cmd) {
+	case TEST_INIT:
+		info->name = "bridge_media_path";
+		info->category = "/main/bridging/";
+		info->summary = "bridge media path benchmark";
+		info->description =
+			"Connects synthetic channels with the generic bridge, ast_bridge_call, "
+			"each bridging API technology and a Local channel, and sends 20 ms frames "
+			"both ways on every call for a second. Every frame must get through, "
+			"except through softmix which may replace a mix before it is read. "
+			"Reports frames per second, latency percentiles and CPU per call. "
+			"Paths whose modules are not loaded are skipped.";
+		return AST_TEST_NOT_RUN;
+	case TEST_EXECUTE:
+		break;
+	}
+
+	ast_mutex_lock(&bench_lock);
+	for (i = 0; i < ARRAY_LEN(bench_paths); i++) {
+		if ((reason = bench_path_unavailable(&bench_paths[i]))) {
+			ast_test_status_update(test, "%s: skipped, %s\n", bench_paths[i].name, reason);
+			continue;
+		}
+		memset(&run, 0, sizeof(run));
+		run.path = &bench_paths[i];
+		run.calls = BRIDGE_BENCH_CALLS;
+		run.rate = BRIDGE_BENCH_RATE;
+		run.seconds = BRIDGE_BENCH_SECONDS;
+		if (bench_path_run(&run)) {
+			ast_test_status_update(test, "%s: unable to set up the calls\n", run.path->name);
+			res = AST_TEST_FAIL;
+		} else {
+			bench_path_report(&run, report, sizeof(report));
+			ast_test_status_update(test, "%s", report);
+			if (run.path->lossy ? !run.delivered : run.delivered != run.sent) {
+				res = AST_TEST_FAIL;
+			}
+		}
+		bench_run_free(&run);
+	}
+	ast_mutex_unlock(&bench_lock);
+
+	return res;
+}
+
+AST_TEST_DEFINE(multiplexed_calls_per_core)
+{
+	const struct bridge_bench_path *path = NULL;
+	enum ast_test_result_state res = AST_TEST_PASS;
+	struct bridge_bench_run run;
+	char report[256];
+	const char *reason;
+	int i;
+
+	switch (cmd) {
+	case TEST_INIT:
+		info->name = "multiplexed_calls_per_core";
+		info->category = "/bridges/bridge_multiplexed/";
+		info->summary = "multiplexed bridge calls per core benchmark";
+		info->description =
+			"Bridges a few hundred calls of synthetic channels with the multiplexed "
+			"bridge and sends 20 ms frames both ways on every call for a few seconds. "
+			"Every frame must be delivered. Reports the latency percentiles and "
+			"how many such calls one CPU core could carry.";
+		return AST_TEST_NOT_RUN;
+	case TEST_EXECUTE:
+		break;
+	}
+
+	for (i = 0; i < ARRAY_LEN(bench_paths); i++) {
+		if (!strcmp(bench_paths[i].name, "multiplexed")) {
+			path = &bench_paths[i];
+		}
+	}
+	if ((reason = bench_path_unavailable(path))) {
+		ast_test_status_update(test, "%s: %s\n", path->name, reason);
+		return AST_TEST_FAIL;
+	}
+
+	ast_mutex_lock(&bench_lock);
+	memset(&run, 0, sizeof(run));
+	run.path = path;
+	run.calls = BRIDGE_BENCH_MUX_CALLS;
+	run.rate = BRIDGE_BENCH_RATE;
+	run.seconds = BRIDGE_BENCH_MUX_SECONDS;
+	if (bench_path_run(&run)) {
+		ast_test_status_update(test, "%s: unable to set up the calls\n", path->name);
+		res = AST_TEST_FAIL;
+	} else {
+		bench_path_report(&run, report, sizeof(report));
+		ast_test_status_update(test, "%s", report);
+		ast_test_status_update(test, "%.0f calls per core\n",
+			run.cpu ? (double) run.calls * run.wall / run.cpu : 0.0);
+		if (run.delivered != run.sent) {
+			res = AST_TEST_FAIL;
+		}
+	}
+	bench_run_free(&run);
+	ast_mutex_unlock(&bench_lock);
+
+	return res;
+}
+
+static int unload_module(void)
+{
+	AST_TEST_UNREGISTER(multiplexed_calls_per_core);
+	AST_TEST_UNREGISTER(bridge_media_path);
+	ast_cli_unregister_multiple(cli_bridge_bench, ARRAY_LEN(cli_bridge_bench));
+	ast_context_destroy(NULL, registrar);
+	ast_unregister_application(bench_app);
+	ast_channel_unregister(&bench_tech);
+	bench_tech.capabilities = ast_format_cap_destroy(bench_tech.capabilities);
+
+	return 0;
+}
+
+static int load_module(void)
+{
+	struct ast_format slin;
+
+	if (!(bench_tech.capabilities = ast_format_cap_alloc())) {
+		return AST_MODULE_LOAD_DECLINE;
+	}
+	ast_format_cap_add(bench_tech.capabilities, ast_format_set(&slin, AST_FORMAT_SLINEAR, 0));
+	if (ast_channel_register(&bench_tech)) {
+		bench_tech.capabilities = ast_format_cap_destroy(bench_tech.capabilities);
+		return AST_MODULE_LOAD_DECLINE;
+	}
+
+	/* The far end of each Local channel runs this to reach its second leg */
+	ast_register_application(bench_app, bench_local_exec, "Bridge benchmark Local channel leg",
+		"Used by test_bridge_bench, not meant to be called from the dialplan.\n");
+	if (ast_context_find_or_create(NULL, NULL, bench_context, registrar)) {
+		ast_add_extension(bench_context, 1, "_X", 1, NULL, NULL, bench_app,
+			ast_strdup("${EXTEN}"), ast_free_ptr, registrar);
+		ast_add_extension(bench_context, 1, "_X.", 1, NULL, NULL, bench_app,
+			ast_strdup("${EXTEN}"), ast_free_ptr, registrar);
+	}
+
+	ast_cli_register_multiple(cli_bridge_bench, ARRAY_LEN(cli_bridge_bench));
+	AST_TEST_REGISTER(bridge_media_path);
+	AST_TEST_REGISTER(multiplexed_calls_per_core);
+
+	return AST_MODULE_LOAD_SUCCESS;
+}
+
+AST_MODULE_INFO_STANDARD(ASTERISK_GPL_KEY, "Bridge media path benchmark");
@@ -0,0 +1,208 @@
+/*
+ * Asterisk -- An open source telephony toolkit.
+ *
+ * See http://www.asterisk.org for more information about
+ * the Asterisk project. Please do not directly contact
+ * any of the maintainers of this project for assistance;
+ * the project provides a web site, mailing lists and IRC
+ * channels for your use.
+ *
+ * This program is free software, distributed under the terms of
+ * the GNU General Public License Version 2. See the LICENSE file
+ * at the top of the source tree.
+ */
+
+/*! \file
+ *
+ * \brief Recording writer benchmark
+ *
+ * Writes many signed linear recordings side by side the way MixMonitor does,
+ * one 20 ms frame to each recording in turn, first from the recording thread
+ * and then through the recording writer threads, and reports the throughput
+ * and the longest time a single frame write kept the recording thread waiting.
+ */
+
+/*** MODULEINFO
+	<depend>TEST_FRAMEWORK</depend>
+	<support_level>core</support_level>
+ ***/
+
+#include "asterisk.h"
+
+ASTERISK_FILE_VERSION(__FILE__, "$Revision$")
+
+#include <sys/stat.h>
+
+#include "asterisk/module.h"
+#include "asterisk/utils.h"
+#include "asterisk/file.h"
+#include "asterisk/frame.h"
+#include "asterisk/options.h"
+#include "asterisk/paths.h"
+#include "asterisk/test.h"
+
+/*! Recordings written at once */
+#define WRITER_BENCH_RECORDINGS 200
+/*! Recorded audio per recording, in seconds */
+#define WRITER_BENCH_SECONDS 30
+/*! Samples per frame, 20 ms of 8 kHz signed linear */
+#define WRITER_BENCH_SAMPLES 160
+/*! Writer threads used for the queued run */
+#define WRITER_BENCH_THREADS 2
+
+struct writer_bench_result {
+	int64_t usecs;
+	/*! Longest single ast_writestream() call */
+	int64_t longest;
+	int failed;
+};
+
+static void writer_bench_run(struct ast_test *test, const char *dir, struct writer_bench_result *result)
+{
+	struct ast_filestream **recs;
+	int16_t buf[WRITER_BENCH_SAMPLES];
+	struct ast_frame f = {
+		.frametype = AST_FRAME_VOICE,
+		.data.ptr = buf,
+		.datalen = sizeof(buf),
+		.samples = WRITER_BENCH_SAMPLES,
+		.src = "test_file_writer",
+	};
+	char name[PATH_MAX];
+	struct timeval start, t;
+	struct stat st;
+	int i, n, frames = WRITER_BENCH_SECONDS * 50;
+
+	memset(result, 0, sizeof(*result));
+	ast_format_set(&f.subclass.format, AST_FORMAT_SLINEAR, 0);
+	for (i = 0; i < WRITER_BENCH_SAMPLES; i++) {
+		buf[i] = (i * 409) & 0x7FFF;
+	}
+
+	if (!(recs = ast_calloc(WRITER_BENCH_RECORDINGS, sizeof(*recs)))) {
+		result->failed = 1;
+		return;
+	}
+
+	start = ast_tvnow();
+	for (i = 0; i < WRITER_BENCH_RECORDINGS; i++) {
+		snprintf(name, sizeof(name), "%s/rec-%d", dir, i);
+		if (!(recs[i] = ast_writefile(name, "sln", NULL, O_CREAT | O_TRUNC | O_WRONLY, 0, AST_FILE_MODE))) {
+			ast_test_status_update(test, "Unable to create recording %s, is format_sln loaded?\n", name);
+			result->failed = 1;
+			goto cleanup;
+		}
+	}
+
+	for (n = 0; n < frames; n++) {
+		for (i = 0; i < WRITER_BENCH_RECORDINGS; i++) {
+			int64_t took;
+
+			t = ast_tvnow();
+			if (ast_writestream(recs[i], &f)) {
+				ast_test_status_update(test, "Unable to write frame %d of recording %d\n", n, i);
+				result->failed = 1;
+				goto cleanup;
+			}
+			if ((took = ast_tvdiff_us(ast_tvnow(), t)) > result->longest) {
+				result->longest = took;
+			}
+		}
+	}
+
+cleanup:
+	for (i = 0; i < WRITER_BENCH_RECORDINGS; i++) {
+		if (recs[i]) {
+			ast_closestream(recs[i]);
+		}
+	}
+	result->usecs = ast_tvdiff_us(ast_tvnow(), start);
+	ast_free(recs);
+
+	/* Everything must be on disk once the recordings are closed */
+	for (i = 0; i < WRITER_BENCH_RECORDINGS; i++) {
+		snprintf(name, sizeof(name), "%s/rec-%d.sln", dir, i);
+		if (!result->failed && (stat(name, &st) || st.st_size != (off_t) frames * sizeof(buf))) {
+			ast_test_status_update(test, "Recording %d is %ld bytes, expected %ld\n",
+				i, (long) st.st_size, (long) (frames * sizeof(buf)));
+			result->failed = 1;
+		}
+		unlink(name);
+	}
+}
+
+AST_TEST_DEFINE(recording_writer_throughput)
+{
+	static const struct {
+		const char *name;
+		int writers;
+	} runs[] = {
+		{ "synchronous", 0 },
+		{ "writer threads", WRITER_BENCH_THREADS },
+	};
+	enum ast_test_result_state res = AST_TEST_PASS;
+	struct writer_bench_result result;
+	int saved_writers = option_record_writers;
+	char dir[PATH_MAX];
+	double mbytes = (double) WRITER_BENCH_RECORDINGS * WRITER_BENCH_SECONDS * 50 *
+		WRITER_BENCH_SAMPLES * 2 / (1024 * 1024);
+	int i;
+
+	switch (cmd) {
+	case TEST_INIT:
+		info->name = "recording_writer_throughput";
+		info->category = "/main/file/";
+		info->summary = "recording writer throughput benchmark";
+		info->description =
+			"Writes a couple of hundred signed linear recordings a frame at a time, "
+			"first synchronously and then through the recording writer threads. "
+			"Every recording must end up complete on disk. Reports the throughput "
+			"and the longest time a single frame write took. While it runs, record_writers "
+			"is changed for the whole system, so recordings started elsewhere in the "
+			"meantime use the same setting. It is restored afterwards, and writer threads "
+			"started only for the test stop once no recording needs them.";
+		return AST_TEST_NOT_RUN;
+	case TEST_EXECUTE:
+		break;
+	}
+
+	snprintf(dir, sizeof(dir), "%s/writer-bench-XXXXXX", ast_config_AST_SPOOL_DIR);
+	if (!mkdtemp(dir)) {
+		ast_test_status_update(test, "Unable to create a directory for the recordings: %s\n", strerror(errno));
+		return AST_TEST_FAIL;
+	}
+
+	/* record_writers is global: recordings started elsewhere during the runs follow it too */
+	for (i = 0; i < ARRAY_LEN(runs); i++) {
+		option_record_writers = runs[i].writers;
+		writer_bench_run(test, dir, &result);
+		ast_test_status_update(test, "%s: %d recordings, %.1f MB in %.2f s, %.1f MB/s, "
+			"longest frame write %.1f ms\n",
+			runs[i].name, WRITER_BENCH_RECORDINGS, mbytes, (double) result.usecs / 1000000,
+			result.usecs ? mbytes * 1000000 / result.usecs : 0.0,
+			(double) result.longest / 1000);
+		if (result.failed) {
+			res = AST_TEST_FAIL;
+		}
+	}
+	option_record_writers = saved_writers;
+	rmdir(dir);
+
+	return res;
+}
+
+static int unload_module(void)
+{
+	AST_TEST_UNREGISTER(recording_writer_throughput);
+
+	return 0;
+}
+
+static int load_module(void)
+{
+	AST_TEST_REGISTER(recording_writer_throughput);
+
+	return AST_MODULE_LOAD_SUCCESS;
+}
+
+AST_MODULE_INFO_STANDARD(ASTERISK_GPL_KEY, "Recording writer benchmark");
@@ -0,0 +1,282 @@
+/*
+ * Asterisk -- An open source telephony toolkit.
+ *
+ * See http://www.asterisk.org for more information about
+ * the Asterisk project. Please do not directly contact
+ * any of the maintainers of this project for assistance;
+ * the project provides a web site, mailing lists and IRC
+ * channels for your use.
+ *
+ * This program is free software, distributed under the terms of
+ * the GNU General Public License Version 2. See the LICENSE file
+ * at the top of the source tree.
+ */
+
+/*! \file
+ *
+ * \brief Jitterbuffer replay tests
+ *
+ * Replays arrival traces through each jitterbuffer implementation the way
+ * abstract_jb drives them, checking delivery order and reporting how long
+ * the replay took per frame.
+ */
+
+/*** MODULEINFO
+	<depend>TEST_FRAMEWORK</depend>
+	<support_level>core</support_level>
+ ***/
+
+#include "asterisk.h"
+
+ASTERISK_FILE_VERSION(__FILE__, "$Revision$")
+
+#include "asterisk/module.h"
+#include "asterisk/utils.h"
+#include "asterisk/frame.h"
+#include "asterisk/abstract_jb.h"
+#include "asterisk/test.h"
+
+/*! Frame length of the replayed streams, in ms */
+#define REPLAY_FRAME_MS 20
+/*! Frames replayed per trace and implementation */
+#define REPLAY_FRAMES 50000
+/*! Marks a frame that never arrived */
+#define LOST -1
+
+/*!
+ * \brief An arrival trace
+ *
+ * Each entry is how late, in ms, the frame with that index arrives relative
+ * to its ideal arrival time.  Traces are repeated to cover REPLAY_FRAMES.
+ */
+struct jb_trace {
+	const char *name;
+	const short *lateness;
+	int len;
+	/*! Minimum share of the frames that arrived the ring jb must deliver, in percent */
+	int ring_min_delivered;
+};
+
+/*! Low jitter LAN stream */
+static const short trace_lan[] = {
+	0, 1, 0, 2, 1, 0, 3, 1, 0, 0, 2, 1, 4, 0, 1, 0, 2, 3, 1, 0, 1, 0, 0, 2, 1,
+	3, 0, 1, 2, 0, 0, 1, 4, 2, 0, 1, 0, 3, 1, 0, 2, 0, 1, 0, 3, 1, 2, 0, 0, 1,
+};
+
+/*! Stream that regularly overtakes itself by one or two frames */
+static const short trace_reorder[] = {
+	0, 25, 5, 2, 30, 8, 1, 0, 24, 3, 6, 0, 28, 2, 4, 1, 0, 22, 5, 3,
+};
+
+/*! WAN stream with queueing bursts and some loss */
+static const short trace_wan[] = {
+	0, 3, 8, 2, 45, 31, 12, 6, 2, 9, LOST, 4, 14, 8, 3, 120, 98, 76, 52, 30,
+	11, 5, 2, 7, 18, 4, 2, LOST, LOST, 6, 3, 9, 22, 61, 40, 19, 4, 2, 8, 3,
+	5, 2, 14, 33, 12, 4, 80, 57, 36, 15,
+};
+
+static const struct jb_trace traces[] = {
+	{ "lan", trace_lan, ARRAY_LEN(trace_lan), 99 },
+	{ "reorder", trace_reorder, ARRAY_LEN(trace_reorder), 99 },
+	{ "wan", trace_wan, ARRAY_LEN(trace_wan), 95 },
+};
+
+struct replay_arrival {
+	long when;
+	int idx;
+};
+
+struct replay_stats {
+	long arrived;
+	long delivered;
+	long dropped;
+	long interpolated;
+	long rejected;
+	long out_of_order;
+	long noframe;
+	int64_t usecs;
+};
+
+static int arrival_cmp(const void *a, const void *b)
+{
+	const struct replay_arrival *x = a, *y = b;
+
+	if (x->when != y->when) {
+		return x->when < y->when ? -1 : 1;
+	}
+	return x->idx - y->idx;
+}
+
+/*!
+ * \brief Replay a trace through a jb implementation
+ *
+ * Time advances in 1 ms steps.  Frames are put as they arrive and taken out
+ * whenever now reaches the implementation's next delivery time, as
+ * jb_get_and_deliver() does.
+ */
+static int replay_trace(const struct ast_jb_impl *impl, const struct jb_trace *trace, struct replay_stats *stats)
+{
+	struct ast_jb_conf conf = {
+		.max_size = 200,
+		.resync_threshold = 1000,
+		.target_extra = 40,
+	};
+	struct ast_frame *frames, *f;
+	struct replay_arrival *arrivals;
+	struct timeval start;
+	void *jbobj;
+	long now, next = 0, last_ts = -1;
+	int i, k = 0, count = 0, res;
+
+	memset(stats, 0, sizeof(*stats));
+
+	frames = ast_calloc(REPLAY_FRAMES, sizeof(*frames));
+	arrivals = ast_calloc(REPLAY_FRAMES, sizeof(*arrivals));
+	if (!frames || !arrivals) {
+		ast_free(frames);
+		ast_free(arrivals);
+		return -1;
+	}
+
+	for (i = 0; i < REPLAY_FRAMES; i++) {
+		short lateness = trace->lateness[i % trace->len];
+
+		frames[i].frametype = AST_FRAME_VOICE;
+		frames[i].ts = i * REPLAY_FRAME_MS;
+		frames[i].len = REPLAY_FRAME_MS;
+		if (lateness == LOST) {
+			continue;
+		}
+		arrivals[count].when = frames[i].ts + lateness;
+		arrivals[count].idx = i;
+		count++;
+	}
+	qsort(arrivals, count, sizeof(*arrivals), arrival_cmp);
+	stats->arrived = count;
+
+	if (!(jbobj = impl->create(&conf, conf.resync_threshold))) {
+		ast_free(frames);
+		ast_free(arrivals);
+		return -1;
+	}
+
+	start = ast_tvnow();
+	for (now = arrivals[0].when; k < count || now < arrivals[count - 1].when + conf.max_size * 2; now++) {
+		for (; k < count && arrivals[k].when == now; k++) {
+			f = &frames[arrivals[k].idx];
+			res = k ? impl->put(jbobj, f, now) : impl->put_first(jbobj, f, now);
+			if (res != AST_JB_IMPL_OK) {
+				stats->rejected++;
+			}
+			next = impl->next(jbobj);
+		}
+
+		while (now >= next) {
+			res = impl->get(jbobj, &f, now, REPLAY_FRAME_MS);
+			if (res == AST_JB_IMPL_OK) {
+				stats->delivered++;
+				if (f->ts <= last_ts) {
+					stats->out_of_order++;
+				}
+				last_ts = f->ts;
+			} else if (res == AST_JB_IMPL_DROP) {
+				stats->dropped++;
+			} else if (res == AST_JB_IMPL_INTERP) {
+				stats->interpolated++;
+			} else {
+				stats->noframe++;
+				break;
+			}
+			next = impl->next(jbobj);
+		}
+	}
+	stats->usecs = ast_tvdiff_us(ast_tvnow(), start);
+
+	/* the frames belong to us, so drain without freeing them */
+	while (impl->remove(jbobj, &f) == AST_JB_IMPL_OK) {
+	}
+	impl->destroy(jbobj);
+
+	ast_free(frames);
+	ast_free(arrivals);
+
+	return 0;
+}
+
+AST_TEST_DEFINE(jitterbuf_replay)
+{
+	static const enum ast_jb_type types[] = { AST_JB_FIXED, AST_JB_ADAPTIVE, AST_JB_RING };
+	enum ast_test_result_state res = AST_TEST_PASS;
+	struct replay_stats stats;
+	int i, j;
+
+	switch (cmd) {
+	case TEST_INIT:
+		info->name = "jitterbuf_replay";
+		info->category = "/main/jitterbuf/";
+		info->summary = "replay arrival traces through the jitterbuffers";
+		info->description =
+			"Replays LAN, reordering and lossy WAN arrival traces through the fixed, "
+			"adaptive and ring jitterbuffers, reporting the time spent per frame. "
+			"The ring jitterbuffer must deliver frames in order, never report no frame "
+			"when one is due, and deliver most of the frames that arrived.";
+		return AST_TEST_NOT_RUN;
+	case TEST_EXECUTE:
+		break;
+	}
+
+	for (i = 0; i < ARRAY_LEN(traces); i++) {
+		for (j = 0; j < ARRAY_LEN(types); j++) {
+			const struct ast_jb_impl *impl = ast_jb_get_impl(types[j]);
+
+			if (!impl) {
+				ast_test_status_update(test, "No jitterbuffer implementation of type %d\n", types[j]);
+				res = AST_TEST_FAIL;
+				continue;
+			}
+			if (replay_trace(impl, &traces[i], &stats)) {
+				ast_test_status_update(test, "Failed to replay %s through %s\n", traces[i].name, impl->name);
+				res = AST_TEST_FAIL;
+				continue;
+			}
+
+			ast_test_status_update(test, "%s/%s: %ld of %ld delivered, %ld dropped, %ld interpolated, "
+				"%ld rejected, %ld out of order, %.1f ns/frame\n",
+				traces[i].name, impl->name, stats.delivered, stats.arrived, stats.dropped,
+				stats.interpolated, stats.rejected, stats.out_of_order,
+				(double) stats.usecs * 1000.0 / REPLAY_FRAMES);
+
+			if (types[j] != AST_JB_RING) {
+				continue;
+			}
+			if (stats.out_of_order || stats.noframe) {
+				ast_test_status_update(test, "ring jb misbehaved on %s: %ld out of order, %ld no frame\n",
+					traces[i].name, stats.out_of_order, stats.noframe);
+				res = AST_TEST_FAIL;
+			}
+			if (stats.delivered * 100 < stats.arrived * traces[i].ring_min_delivered) {
+				ast_test_status_update(test, "ring jb delivered only %ld of %ld frames on %s\n",
+					stats.delivered, stats.arrived, traces[i].name);
+				res = AST_TEST_FAIL;
+			}
+		}
+	}
+
+	return res;
+}
+
+static int unload_module(void)
+{
+	AST_TEST_UNREGISTER(jitterbuf_replay);
+
+	return 0;
+}
+
+static int load_module(void)
+{
+	AST_TEST_REGISTER(jitterbuf_replay);
+
+	return AST_MODULE_LOAD_SUCCESS;
+}
+
+AST_MODULE_INFO_STANDARD(ASTERISK_GPL_KEY, "Jitterbuffer test module");
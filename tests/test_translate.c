@@ -0,0 +1,169 @@
+/*
+ * Asterisk -- An open source telephony toolkit.
+ *
+ * See http://www.asterisk.org for more information about
+ * the Asterisk project. Please do not directly contact
+ * any of the maintainers of this project for assistance;
+ * the project provides a web site, mailing lists and IRC
+ * channels for your use.
+ *
+ * This program is free software, distributed under the terms of
+ * the GNU General Public License Version 2. See the LICENSE file
+ * at the top of the source tree.
+ */
+
+/*! \file
+ *
+ * \brief Translation matrix tests
+ *
+ * Registers, unregisters, activates and deactivates a few translators
+ * between video formats no codec module translates, and checks the
+ * translation paths the matrix is left with after each change.
+ */
+
+/*** MODULEINFO
+	<depend>TEST_FRAMEWORK</depend>
+	<support_level>core</support_level>
+ ***/
+
+#include "asterisk.h"
+
+ASTERISK_FILE_VERSION(__FILE__, "$Revision$")
+
+#include "asterisk/module.h"
+#include "asterisk/utils.h"
+#include "asterisk/translate.h"
+#include "asterisk/test.h"
+
+static struct ast_translator test_a_to_b = {
+	.name = "test_h261toh263",
+	.table_cost = 100,
+	.buf_size = 1,
+};
+
+static struct ast_translator test_b_to_c = {
+	.name = "test_h263toh263p",
+	.table_cost = 100,
+	.buf_size = 1,
+};
+
+static struct ast_translator test_a_to_c = {
+	.name = "test_h261toh263p",
+	.table_cost = 500,
+	.buf_size = 1,
+};
+
+/*! \brief Check the number of steps from H.261 to H.263+, -1 meaning no path */
+static int check_steps(struct ast_test *test, const char *what, int expected)
+{
+	struct ast_format src;
+	struct ast_format dst;
+	int steps;
+
+	ast_format_set(&src, AST_FORMAT_H261, 0);
+	ast_format_set(&dst, AST_FORMAT_H263_PLUS, 0);
+	steps = (int) ast_translate_path_steps(&dst, &src);
+	if (steps != expected) {
+		ast_test_status_update(test, "%s: %d steps from h261 to h263p, expected %d\n", what, steps, expected);
+		return -1;
+	}
+
+	return 0;
+}
+
+AST_TEST_DEFINE(translate_matrix_updates)
+{
+	enum ast_test_result_state res = AST_TEST_PASS;
+
+	switch (cmd) {
+	case TEST_INIT:
+		info->name = "translate_matrix_updates";
+		info->category = "/main/translate/";
+		info->summary = "translation paths follow translator changes";
+		info->description =
+			"Registers an H.261 to H.263 and an H.263 to H.263+ translator, plus a "
+			"more expensive direct H.261 to H.263+ one, then unregisters, "
+			"re-registers, deactivates and activates them one at a time. The "
+			"cheapest path from H.261 to H.263+ must be used after every change.";
+		return AST_TEST_NOT_RUN;
+	case TEST_EXECUTE:
+		break;
+	}
+
+	ast_format_set(&test_a_to_b.src_format, AST_FORMAT_H261, 0);
+	ast_format_set(&test_a_to_b.dst_format, AST_FORMAT_H263, 0);
+	ast_format_set(&test_b_to_c.src_format, AST_FORMAT_H263, 0);
+	ast_format_set(&test_b_to_c.dst_format, AST_FORMAT_H263_PLUS, 0);
+	ast_format_set(&test_a_to_c.src_format, AST_FORMAT_H261, 0);
+	ast_format_set(&test_a_to_c.dst_format, AST_FORMAT_H263_PLUS, 0);
+
+	if (ast_register_translator(&test_a_to_b) || ast_register_translator(&test_b_to_c)) {
+		ast_test_status_update(test, "Unable to register the test translators\n");
+		res = AST_TEST_FAIL;
+		goto cleanup;
+	}
+	if (check_steps(test, "two step path registered", 2)) {
+		res = AST_TEST_FAIL;
+	}
+
+	if (ast_register_translator(&test_a_to_c)) {
+		ast_test_status_update(test, "Unable to register the direct test translator\n");
+		res = AST_TEST_FAIL;
+		goto cleanup;
+	}
+	if (check_steps(test, "expensive direct path registered", 2)) {
+		res = AST_TEST_FAIL;
+	}
+
+	ast_unregister_translator(&test_b_to_c);
+	if (check_steps(test, "second step unregistered", 1)) {
+		res = AST_TEST_FAIL;
+	}
+
+	if (ast_register_translator(&test_b_to_c)) {
+		ast_test_status_update(test, "Unable to register the test translator again\n");
+		res = AST_TEST_FAIL;
+		goto cleanup;
+	}
+	if (check_steps(test, "second step registered again", 2)) {
+		res = AST_TEST_FAIL;
+	}
+
+	ast_translator_deactivate(&test_a_to_b);
+	if (check_steps(test, "first step deactivated", 1)) {
+		res = AST_TEST_FAIL;
+	}
+	ast_translator_activate(&test_a_to_b);
+	if (check_steps(test, "first step activated", 2)) {
+		res = AST_TEST_FAIL;
+	}
+
+	ast_unregister_translator(&test_a_to_c);
+	ast_unregister_translator(&test_a_to_b);
+	if (check_steps(test, "first step unregistered", -1)) {
+		res = AST_TEST_FAIL;
+	}
+
+cleanup:
+	ast_unregister_translator(&test_a_to_b);
+	ast_unregister_translator(&test_b_to_c);
+	ast_unregister_translator(&test_a_to_c);
+
+	return res;
+}
+
+static int unload_module(void)
+{
+	AST_TEST_UNREGISTER(translate_matrix_updates);
+
+	return 0;
+}
+
+static int load_module(void)
+{
+	AST_TEST_REGISTER(translate_matrix_updates);
+
+	return AST_MODULE_LOAD_SUCCESS;
+}
+
+AST_MODULE_INFO_STANDARD(ASTERISK_GPL_KEY, "Translation matrix tests");
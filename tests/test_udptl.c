@@ -0,0 +1,202 @@
+/*
+ * Asterisk -- An open source telephony toolkit.
+ *
+ * See http://www.asterisk.org for more information about
+ * the Asterisk project. Please do not directly contact
+ * any of the maintainers of this project for assistance;
+ * the project provides a web site, mailing lists and IRC
+ * channels for your use.
+ *
+ * This program is free software, distributed under the terms of
+ * the GNU General Public License Version 2. See the LICENSE file
+ * at the top of the source tree.
+ */
+
+/*! \file
+ *
+ * \brief UDPTL encode/decode tests
+ *
+ * Sends a stream of IFPs between two UDPTL sessions over the loopback
+ * interface with each error correction scheme, discarding some packets
+ * on the way, and checks that every IFP is delivered intact and in order.
+ */
+
+/*** MODULEINFO
+	<depend>TEST_FRAMEWORK</depend>
+	<support_level>core</support_level>
+ ***/
+
+#include "asterisk.h"
+
+ASTERISK_FILE_VERSION(__FILE__, "$Revision$")
+
+#include <sys/socket.h>
+
+#include "asterisk/module.h"
+#include "asterisk/utils.h"
+#include "asterisk/frame.h"
+#include "asterisk/netsock2.h"
+#include "asterisk/udptl.h"
+#include "asterisk/test.h"
+
+/*! IFPs sent per error correction scheme */
+#define UDPTL_BENCH_IFPS 20000
+/*! Every this many packets one is discarded before it is read */
+#define UDPTL_BENCH_LOSS 10
+/*! Far max datagram, the T38FaxMaxDatagram of a typical gateway */
+#define UDPTL_BENCH_DATAGRAM 400
+/*! Longest IFP sent, short enough for three FEC entries to fit in a datagram */
+#define UDPTL_BENCH_IFP 80
+
+static void bench_ifp(uint8_t *ifp, unsigned int len, unsigned int n)
+{
+	unsigned int k;
+
+	for (k = 0; k < len; k++) {
+		ifp[k] = (n * 7 + k) & 0xFF;
+	}
+}
+
+/*!
+ * \brief Stream IFPs from one session to another
+ *
+ * \retval number of IFPs delivered intact and in order
+ * \retval -1 on failure to set up the sessions
+ */
+static int bench_stream(struct ast_test *test, enum ast_t38_ec_modes ec, int lossy, int64_t *usecs)
+{
+	struct ast_sockaddr addr, us;
+	struct ast_udptl *tx = NULL, *rx = NULL;
+	uint8_t ifp[UDPTL_BENCH_IFP], check[UDPTL_BENCH_IFP], drain[UDPTL_BENCH_DATAGRAM * 2];
+	unsigned int max_ifp, n, len;
+	struct timeval start;
+	int expected = 0;
+
+	ast_sockaddr_parse(&addr, "127.0.0.1", 0);
+	if (!(tx = ast_udptl_new_with_bindaddr(NULL, NULL, 0, &addr)) ||
+		!(rx = ast_udptl_new_with_bindaddr(NULL, NULL, 0, &addr))) {
+		ast_test_status_update(test, "Unable to create UDPTL sessions\n");
+		expected = -1;
+		goto cleanup;
+	}
+	ast_udptl_get_us(rx, &us);
+	ast_udptl_set_peer(tx, &us);
+	ast_udptl_get_us(tx, &us);
+	ast_udptl_set_peer(rx, &us);
+	ast_udptl_set_error_correction_scheme(tx, ec);
+	ast_udptl_set_error_correction_scheme(rx, ec);
+	ast_udptl_set_far_max_datagram(tx, UDPTL_BENCH_DATAGRAM);
+	max_ifp = MIN(ast_udptl_get_far_max_ifp(tx), UDPTL_BENCH_IFP);
+
+	start = ast_tvnow();
+	for (n = 0; n < UDPTL_BENCH_IFPS; n++) {
+		struct ast_frame f = {
+			.frametype = AST_FRAME_MODEM,
+			.subclass.integer = AST_MODEM_T38,
+			.src = "test_udptl",
+		};
+		struct ast_frame *fr;
+
+		/* Vary the IFP lengths so FEC has to pad the shorter ones */
+		len = max_ifp - (n % 16);
+		bench_ifp(ifp, len, n);
+		f.data.ptr = ifp;
+		f.datalen = len;
+		ast_udptl_write(tx, &f);
+
+		if (lossy && (n % UDPTL_BENCH_LOSS) == UDPTL_BENCH_LOSS / 2) {
+			if (recv(ast_udptl_fd(rx), drain, sizeof(drain), 0) < 0) {
+				ast_test_status_update(test, "Unable to discard packet %u\n", n);
+			}
+			continue;
+		}
+
+		for (fr = ast_udptl_read(rx); fr && fr->frametype == AST_FRAME_MODEM; fr = AST_LIST_NEXT(fr, frame_list)) {
+			unsigned int flen = max_ifp - (fr->seqno % 16);
+
+			/* An IFP rebuilt from FEC comes back zero padded to the longest in its window */
+			memset(check, 0, sizeof(check));
+			bench_ifp(check, flen, fr->seqno);
+			if (fr->seqno != expected || fr->datalen < flen || fr->datalen > max_ifp ||
+				memcmp(fr->data.ptr, check, fr->datalen)) {
+				ast_test_status_update(test, "IFP %d: expected IFP %d of length %u, got %d bytes\n",
+					fr->seqno, expected, flen, fr->datalen);
+				goto cleanup;
+			}
+			expected++;
+		}
+	}
+	*usecs = ast_tvdiff_us(ast_tvnow(), start);
+
+cleanup:
+	if (tx) {
+		ast_udptl_destroy(tx);
+	}
+	if (rx) {
+		ast_udptl_destroy(rx);
+	}
+
+	return expected;
+}
+
+AST_TEST_DEFINE(udptl_encode_decode)
+{
+	static const struct {
+		enum ast_t38_ec_modes ec;
+		const char *name;
+		int lossy;
+	} schemes[] = {
+		{ UDPTL_ERROR_CORRECTION_NONE, "none", 0 },
+		{ UDPTL_ERROR_CORRECTION_REDUNDANCY, "redundancy", 1 },
+		{ UDPTL_ERROR_CORRECTION_FEC, "fec", 1 },
+	};
+	enum ast_test_result_state res = AST_TEST_PASS;
+	int64_t usecs = 0;
+	int i, delivered;
+
+	switch (cmd) {
+	case TEST_INIT:
+		info->name = "udptl_encode_decode";
+		info->category = "/main/udptl/";
+		info->summary = "T.38 UDPTL encode/decode benchmark";
+		info->description =
+			"Streams IFPs between two UDPTL sessions over loopback with no error "
+			"correction, redundancy and FEC, discarding one packet in ten for the "
+			"latter two. Every IFP must be delivered intact and in order. Reports "
+			"the time taken to encode and decode each packet.";
+		return AST_TEST_NOT_RUN;
+	case TEST_EXECUTE:
+		break;
+	}
+
+	for (i = 0; i < ARRAY_LEN(schemes); i++) {
+		if ((delivered = bench_stream(test, schemes[i].ec, schemes[i].lossy, &usecs)) < 0) {
+			res = AST_TEST_FAIL;
+			continue;
+		}
+		ast_test_status_update(test, "%s: %d of %d IFPs delivered, %.2f us/packet\n",
+			schemes[i].name, delivered, UDPTL_BENCH_IFPS,
+			(double) usecs / UDPTL_BENCH_IFPS);
+		if (delivered != UDPTL_BENCH_IFPS) {
+			res = AST_TEST_FAIL;
+		}
+	}
+
+	return res;
+}
+
+static int unload_module(void)
+{
+	AST_TEST_UNREGISTER(udptl_encode_decode);
+
+	return 0;
+}
+
+static int load_module(void)
+{
+	AST_TEST_REGISTER(udptl_encode_decode);
+
+	return AST_MODULE_LOAD_SUCCESS;
+}
+
+AST_MODULE_INFO_STANDARD(ASTERISK_GPL_KEY, "UDPTL test module");